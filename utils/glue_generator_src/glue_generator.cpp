@@ -3,6 +3,9 @@
 #include <string>
 #include <cstring>
 #include <cstdlib>
+#include <vector>
+#include <sstream>
+#include <algorithm>
 
 #define MAX_LINE_INPUT 1024
 #define MAX_LOCAL_BUFFER 100
@@ -67,16 +70,62 @@ IEC_LINT *lint_memory[BUFFER_SIZE];\r\n\
 //Special Functions\r\n\
 IEC_LINT *special_functions[BUFFER_SIZE];\r\n\
 \r\n\
+//Contiguous I/O image. The located variables are stored directly on these\r\n\
+//arrays so that the runtime can move whole blocks of the image at once\r\n\
+#define IMAGE_ALIGN		__attribute__((aligned(64)))\r\n\
 \r\n\
-#define __LOCATED_VAR(type, name, ...) type __##name;\r\n\
-#include \"LOCATED_VARIABLES.h\"\r\n\
-#undef __LOCATED_VAR\r\n\
-#define __LOCATED_VAR(type, name, ...) type* name = &__##name;\r\n\
-#include \"LOCATED_VARIABLES.h\"\r\n\
-#undef __LOCATED_VAR\r\n\
+IEC_BOOL bool_input_image[BUFFER_SIZE][8] IMAGE_ALIGN;\r\n\
+IEC_BOOL bool_output_image[BUFFER_SIZE][8] IMAGE_ALIGN;\r\n\
+IEC_BYTE byte_input_image[BUFFER_SIZE] IMAGE_ALIGN;\r\n\
+IEC_BYTE byte_output_image[BUFFER_SIZE] IMAGE_ALIGN;\r\n\
+IEC_UINT int_input_image[BUFFER_SIZE] IMAGE_ALIGN;\r\n\
+IEC_UINT int_output_image[BUFFER_SIZE] IMAGE_ALIGN;\r\n\
+IEC_LINT special_functions_image[BUFFER_SIZE] IMAGE_ALIGN;\r\n\
 \r\n\
-void glueVars()\r\n\
-{\r\n";
+//Memory image. It is kept on pages of its own, so that the persistent\r\n\
+//storage can map it to a file\r\n\
+struct retain_image\r\n\
+{\r\n\
+	IEC_UINT int_memory[BUFFER_SIZE];\r\n\
+	IEC_DINT dint_memory[BUFFER_SIZE];\r\n\
+	IEC_LINT lint_memory[BUFFER_SIZE];\r\n\
+} __attribute__((aligned(4096)));\r\n\
+\r\n\
+struct retain_image retain_image;\r\n\
+#define int_memory_image retain_image.int_memory\r\n\
+#define dint_memory_image retain_image.dint_memory\r\n\
+#define lint_memory_image retain_image.lint_memory\r\n\
+\r\n\
+//Private image of a task that runs on a thread of its own. See\r\n\
+//bindLocatedVars()\r\n\
+struct task_image\r\n\
+{\r\n\
+	IEC_BOOL bool_input[BUFFER_SIZE][8];\r\n\
+	IEC_BOOL bool_output[BUFFER_SIZE][8];\r\n\
+	IEC_BYTE byte_input[BUFFER_SIZE];\r\n\
+	IEC_BYTE byte_output[BUFFER_SIZE];\r\n\
+	IEC_UINT int_input[BUFFER_SIZE];\r\n\
+	IEC_UINT int_output[BUFFER_SIZE];\r\n\
+	IEC_UINT int_memory[BUFFER_SIZE];\r\n\
+	IEC_DINT dint_memory[BUFFER_SIZE];\r\n\
+	IEC_LINT lint_memory[BUFFER_SIZE];\r\n\
+	IEC_LINT special_functions[BUFFER_SIZE];\r\n\
+};\r\n\
+\r\n\
+//Symbol table used by the debugger. For located and external variables,\r\n\
+//value points to the variable's pointer and forced_value holds the value\r\n\
+//used while the variable is forced\r\n\
+struct debug_symbol\r\n\
+{\r\n\
+	const char *name;\r\n\
+	const char *type;\r\n\
+	unsigned int size;\r\n\
+	bool located;\r\n\
+	void *value;\r\n\
+	IEC_BYTE *flags;\r\n\
+	void *forced_value;\r\n\
+};\r\n\
+\r\n";
 }
 
 int parseIecVars(istream& locatedVars, char *varName, char *varType)
@@ -150,6 +199,68 @@ void findPositions(char *varName, int *pos1, int *pos2)
 	*pos2 = atoi(tempBuffer);
 }
 
+/// Returns the I/O image position that holds a located variable, or an
+/// empty string if the variable can't be stored on the image.
+string imagePosition(char *varName)
+{
+	int pos1, pos2;
+	findPositions(varName, &pos1, &pos2);
+
+	if (pos1 >= 1024 && !(varName[2] == 'M' && varName[3] == 'L' && pos1 < 2048)) return "";
+	if (pos2 >= 8) return "";
+
+	string index = "[" + to_string(pos1) + "]";
+	if (varName[2] == 'I')
+	{
+		switch (varName[3])
+		{
+			case 'X': return "bool_input_image" + index + "[" + to_string(pos2) + "]";
+			case 'B': return "byte_input_image" + index;
+			case 'W': return "int_input_image" + index;
+		}
+	}
+	else if (varName[2] == 'Q')
+	{
+		switch (varName[3])
+		{
+			case 'X': return "bool_output_image" + index + "[" + to_string(pos2) + "]";
+			case 'B': return "byte_output_image" + index;
+			case 'W': return "int_output_image" + index;
+		}
+	}
+	else if (varName[2] == 'M')
+	{
+		switch (varName[3])
+		{
+			case 'W': return "int_memory_image" + index;
+			case 'D': return "dint_memory_image" + index;
+			case 'L':
+				if (pos1 > 1023)
+					return "special_functions_image[" + to_string(pos1 - 1024) + "]";
+				return "lint_memory_image" + index;
+		}
+	}
+
+	return "";
+}
+
+/// Write the definition of a located variable. Variables that are mapped to
+/// the OpenPLC buffers point to their position on the I/O image. Everything
+/// else gets its own storage.
+void defineVar(ostream& glueVars, char *varName, char *varType)
+{
+	string position = imagePosition(varName);
+	if (position.empty())
+	{
+		glueVars << varType << " __" << varName << ";\r\n";
+		glueVars << varType << " *" << varName << " = &__" << varName << ";\r\n";
+	}
+	else
+	{
+		glueVars << varType << " *" << varName << " = (" << varType << " *)&" << position << ";\r\n";
+	}
+}
+
 void glueVar(ostream& glueVars, char *varName, char *varType)
 {
 	cout << "varName: " << varName << "\tvarType: " << varType << endl;
@@ -235,13 +346,209 @@ void generateBody(istream& locatedVars, ostream& glueVars) {
     // Start the generation process.
     char iecVar_name[100];
     char iecVar_type[100];
+    vector<string> names, types;
 
     while (parseIecVars(locatedVars, iecVar_name, iecVar_type))
     {
-        glueVar(glueVars, iecVar_name, iecVar_type);
+        names.push_back(iecVar_name);
+        types.push_back(iecVar_type);
+    }
+
+    // The variables must be defined before glueVars() can reference them
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        defineVar(glueVars, &names[i][0], &types[i][0]);
+    }
+
+    glueVars << "\r\nvoid glueVars()\r\n{\r\n";
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        glueVar(glueVars, &names[i][0], &types[i][0]);
     }
 }
 
+/// Writes bindLocatedVars(), which points the located variables to the
+/// private image of a task, or back to the shared image. Programs copy the
+/// pointers when they are initialized, so the runtime binds the image before
+/// initializing the programs of each task.
+void generateImageBinding(istream& locatedVars, ostream& glueVars)
+{
+	char iecVar_name[100];
+	char iecVar_type[100];
+	vector<string> shared, task;
+
+	while (parseIecVars(locatedVars, iecVar_name, iecVar_type))
+	{
+		// variables with storage of their own are never moved
+		string position = imagePosition(iecVar_name);
+		if (position.empty()) continue;
+
+		size_t area = position.find("_image");
+		string assignment = string("\t\t") + iecVar_name + " = (" + iecVar_type + " *)&";
+		shared.push_back(assignment + position + ";\r\n");
+		task.push_back(assignment + "image->" + position.substr(0, area) + position.substr(area + 6) + ";\r\n");
+	}
+
+	glueVars << "\r\n\r\nvoid bindLocatedVars(struct task_image *image)\r\n{\r\n";
+	glueVars << "\tif (image == NULL)\r\n\t{\r\n";
+	for (size_t i = 0; i < shared.size(); i++) glueVars << shared[i];
+	glueVars << "\t}\r\n\telse\r\n\t{\r\n";
+	for (size_t i = 0; i < task.size(); i++) glueVars << task[i];
+	glueVars << "\t}\r\n}";
+}
+
+/// Splits a line of VARIABLES.csv into its fields.
+vector<string> splitCsvLine(const string& line)
+{
+	vector<string> fields;
+	stringstream stream(line);
+	string field;
+	while (getline(stream, field, ';'))
+	{
+		if (!field.empty() && field[field.size() - 1] == '\r') field.erase(field.size() - 1);
+		fields.push_back(field);
+	}
+	return fields;
+}
+
+/// A program instance or global variable declared by MATIEC on Config0.c
+/// or Res0.c. Every variable on the symbol table is either one of these or
+/// a member of one.
+struct SymbolBase
+{
+	string path;
+	string cName;
+	string cType;
+};
+
+/// Converts the C path of a variable on VARIABLES.csv to the C expression
+/// that accesses it. Configuration globals are declared as CONFIG__NAME,
+/// resource globals and program instances as RESOURCE__NAME, and everything
+/// else is a member of one of those. Globals found on the way are added to
+/// bases unless lookupOnly is set. Returns an empty string for variables
+/// that can't be reached.
+string symbolExpression(const string& path, bool lookupOnly, vector<SymbolBase>& bases, const string& baseType)
+{
+	vector<string> parts;
+	stringstream stream(path);
+	string part;
+	while (getline(stream, part, '.')) parts.push_back(part);
+	if (parts.size() < 2) return "";
+
+	// Find the instance or global that contains this variable
+	size_t baseParts = 0;
+	string cName;
+	for (size_t i = 0; i < bases.size(); i++)
+	{
+		if (path.compare(0, bases[i].path.size() + 1, bases[i].path + ".") == 0)
+		{
+			baseParts = count(bases[i].path.begin(), bases[i].path.end(), '.') + 1;
+			cName = bases[i].cName;
+			break;
+		}
+	}
+
+	if (baseParts == 0)
+	{
+		// Not inside anything known. It must be a global itself
+		if (parts.size() == 2) cName = parts[0] + "__" + parts[1];
+		else if (parts.size() == 3) cName = parts[1] + "__" + parts[2];
+		else return "";
+
+		SymbolBase base = {path, cName, baseType};
+		if (!lookupOnly) bases.push_back(base);
+		return cName;
+	}
+
+	string expression = cName;
+	for (size_t i = baseParts; i < parts.size(); i++) expression += "." + parts[i];
+	return expression;
+}
+
+/// Reads VARIABLES.csv, generated by the MATIEC compiler, and writes the
+/// symbol table for the debugger. Arrays and structures are not listed by
+/// MATIEC, and function blocks are only used to find their members.
+void generateSymbolTable(istream& variables, ostream& glueVars)
+{
+	vector<SymbolBase> bases;
+	vector<string> entries;
+	bool programs = false;
+	string line;
+
+	while (getline(variables, line))
+	{
+		if (line.compare(0, 11, "// Programs") == 0) { programs = true; continue; }
+		if (line.compare(0, 12, "// Variables") == 0) { programs = false; continue; }
+
+		vector<string> fields = splitCsvLine(line);
+		if (programs)
+		{
+			// <number>;<instance path>;<program type>
+			if (fields.size() < 3) continue;
+			vector<SymbolBase> unused;
+			string cName = symbolExpression(fields[1], true, unused, "");
+			if (cName.empty()) continue;
+			SymbolBase base = {fields[1], cName, fields[2]};
+			bases.push_back(base);
+			continue;
+		}
+
+		// <number>;<class>;<IEC path>;<C path>;<type>
+		if (fields.size() < 5) continue;
+		const string& varClass = fields[1];
+		const string& cPath = fields[3];
+		const string& varType = fields[4];
+
+		// SFC steps, transitions and actions are not stored on IEC variables
+		if (cPath.find('[') != string::npos) continue;
+
+		bool located = (varClass == "IN" || varClass == "OUT" || varClass == "MEM" || varClass == "EXT");
+		if (varClass == "FB")
+		{
+			// function block instances declared as globals hold the members
+			// listed after them
+			symbolExpression(cPath, false, bases, varType);
+			continue;
+		}
+
+		string baseType = string("__IEC_") + varType + (located ? "_p" : "_t");
+		string expression = symbolExpression(cPath, false, bases, baseType);
+		if (expression.empty()) continue;
+
+		string entry = "\t{\"" + fields[2] + "\", \"" + varType + "\", ";
+		if (located)
+		{
+			entry += "sizeof(" + expression + ".fvalue), true, &(" + expression + ".value), &(" + expression +
+					 ".flags), &(" + expression + ".fvalue)},\r\n";
+		}
+		else
+		{
+			entry += "sizeof(" + expression + ".value), false, &(" + expression + ".value), &(" + expression +
+					 ".flags), NULL},\r\n";
+		}
+		entries.push_back(entry);
+	}
+
+	glueVars << "\r\n\r\n#include \"POUS.h\"\r\n\r\n";
+	for (size_t i = 0; i < bases.size(); i++)
+	{
+		glueVars << "extern " << bases[i].cType << " " << bases[i].cName << ";\r\n";
+	}
+
+	glueVars << "\r\nstruct debug_symbol debug_symbol_table[] =\r\n{\r\n";
+	for (size_t i = 0; i < entries.size(); i++) glueVars << entries[i];
+	glueVars << "\t{NULL, NULL, 0, false, NULL, NULL, NULL}\r\n};\r\n\r\n";
+	glueVars << "struct debug_symbol *debug_symbols = debug_symbol_table;\r\n";
+	glueVars << "int debug_symbol_count = " << entries.size() << ";\r\n";
+}
+
+/// Writes an empty symbol table, for programs compiled without VARIABLES.csv.
+void generateEmptySymbolTable(ostream& glueVars)
+{
+	glueVars << "\r\n\r\nstruct debug_symbol *debug_symbols = NULL;\r\n";
+	glueVars << "int debug_symbol_count = 0;\r\n";
+}
+
 /// This is our main function. We define it with a different name and then
 /// call it from the main function so that we can mock it for the purpose
 /// of testing.
@@ -250,12 +557,14 @@ int mainImpl(int argc, char *argv[])
 	// Parse the command line arguments - if they exist. Show the help if there are too many arguments
     // or if the first argument is for help.
     bool show_help = argc >= 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0);
-    if (show_help || (argc != 1 && argc != 3)) {
+    if (show_help || (argc != 1 && argc != 3 && argc != 4)) {
 		cout << "Usage " << endl << endl;
-		cout << "  glue_generator [options] <path-to-located-variables.h> <path-to-glue-vars.cpp>" << endl << endl;
+		cout << "  glue_generator [options] <path-to-located-variables.h> <path-to-glue-vars.cpp> [<path-to-variables.csv>]" << endl << endl;
 		cout << "Reads the LOCATED_VARIABLES.h file generated by the MATIEC compiler and produces" << endl;
-		cout << "glueVars.cpp for the OpenPLC runtime. If not specified, paths are relative to" << endl;
-		cout << "the current directory." << endl << endl;
+		cout << "glueVars.cpp for the OpenPLC runtime. If VARIABLES.csv is given, or found on the" << endl;
+		cout << "current directory when no paths are specified, the symbol table for the debugger" << endl;
+		cout << "is generated from it. If not specified, paths are relative to the current" << endl;
+		cout << "directory." << endl << endl;
 		cout << "Options" << endl;
 		cout << "  --help,-h   = Print usage information and exit." << endl;
 		return 0;
@@ -264,9 +573,11 @@ int mainImpl(int argc, char *argv[])
 	// If we have 3 arguments, then the user provided input and output paths
 	string input_file_name("LOCATED_VARIABLES.h");
 	string output_file_name("glueVars.cpp");
-	if (argc == 3) {
+	string variables_file_name("VARIABLES.csv");
+	if (argc >= 3) {
 		input_file_name = argv[1];
 		output_file_name = argv[2];
+		variables_file_name = (argc == 4) ? argv[3] : "";
 	}
 
 	// Try to open the files for reading and writing.
@@ -285,6 +596,23 @@ int mainImpl(int argc, char *argv[])
     generateBody(locatedVars, glueVars);
 	generateBottom(glueVars);
 
+	locatedVars.clear();
+	locatedVars.seekg(0);
+	generateImageBinding(locatedVars, glueVars);
+
+	ifstream variables;
+	if (!variables_file_name.empty()) variables.open(variables_file_name, ios::in);
+	if (variables.is_open()) {
+		generateSymbolTable(variables, glueVars);
+	}
+	else if (argc == 4) {
+		cout << "Error opening variables file at " << variables_file_name << endl;
+		return 3;
+	}
+	else {
+		generateEmptySymbolTable(glueVars);
+	}
+
 	return 0;
 }
 
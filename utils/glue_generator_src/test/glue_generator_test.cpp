@@ -31,85 +31,121 @@ SCENARIO("", "") {
         WHEN("Contains single BOOL at %IX0") {
             std::stringstream input_stream("__LOCATED_VAR(BOOL,__IX0,I,X,0)");
             generateBody(input_stream, output_stream);
-            REQUIRE(output_stream.str() == "\tbool_input[0][0] = __IX0;\r\n");
+            REQUIRE(output_stream.str() == "BOOL *__IX0 = (BOOL *)&bool_input_image[0][0];\r\n\r\nvoid glueVars()\r\n{\r\n\tbool_input[0][0] = __IX0;\r\n");
         }
 
         WHEN("Contains single BOOL at %QX0") {
             std::stringstream input_stream("__LOCATED_VAR(BOOL,__QX0,Q,X,0)");
             generateBody(input_stream, output_stream);
-            REQUIRE(output_stream.str() == "\tbool_output[0][0] = __QX0;\r\n");
+            REQUIRE(output_stream.str() == "BOOL *__QX0 = (BOOL *)&bool_output_image[0][0];\r\n\r\nvoid glueVars()\r\n{\r\n\tbool_output[0][0] = __QX0;\r\n");
         }
 
         WHEN("Contains single BYTE at %IB0") {
             std::stringstream input_stream("__LOCATED_VAR(BYTE,__IB0,I,B,0)");
             generateBody(input_stream, output_stream);
-            REQUIRE(output_stream.str() == "\tbyte_input[0] = __IB0;\r\n");
+            REQUIRE(output_stream.str() == "BYTE *__IB0 = (BYTE *)&byte_input_image[0];\r\n\r\nvoid glueVars()\r\n{\r\n\tbyte_input[0] = __IB0;\r\n");
         }
 
         WHEN("Contains single SINT at %IB1") {
             std::stringstream input_stream("__LOCATED_VAR(SINT,__IB1,I,B,1)");
             generateBody(input_stream, output_stream);
-            REQUIRE(output_stream.str() == "\tbyte_input[1] = __IB1;\r\n");
+            REQUIRE(output_stream.str() == "SINT *__IB1 = (SINT *)&byte_input_image[1];\r\n\r\nvoid glueVars()\r\n{\r\n\tbyte_input[1] = __IB1;\r\n");
         }
 
         WHEN("Contains single SINT at %QB1") {
             std::stringstream input_stream("__LOCATED_VAR(SINT,__QB1,Q,B,1)");
             generateBody(input_stream, output_stream);
-            REQUIRE(output_stream.str() == "\tbyte_output[1] = __QB1;\r\n");
+            REQUIRE(output_stream.str() == "SINT *__QB1 = (SINT *)&byte_output_image[1];\r\n\r\nvoid glueVars()\r\n{\r\n\tbyte_output[1] = __QB1;\r\n");
         }
 
         WHEN("Contains single USINT at %IB2") {
             std::stringstream input_stream("__LOCATED_VAR(USINT,__IB2,I,B,2)");
             generateBody(input_stream, output_stream);
-            REQUIRE(output_stream.str() == "\tbyte_input[2] = __IB2;\r\n");
+            REQUIRE(output_stream.str() == "USINT *__IB2 = (USINT *)&byte_input_image[2];\r\n\r\nvoid glueVars()\r\n{\r\n\tbyte_input[2] = __IB2;\r\n");
         }
 
         WHEN("Contains single WORD at %IW0") {
             std::stringstream input_stream("__LOCATED_VAR(WORD,__IW0,I,W,0)");
             generateBody(input_stream, output_stream);
-            REQUIRE(output_stream.str() == "\tint_input[0] = __IW0;\r\n");
+            REQUIRE(output_stream.str() == "WORD *__IW0 = (WORD *)&int_input_image[0];\r\n\r\nvoid glueVars()\r\n{\r\n\tint_input[0] = __IW0;\r\n");
         }
 
         WHEN("Contains single WORD at %QW0") {
             std::stringstream input_stream("__LOCATED_VAR(WORD,__QW0,Q,W,0)");
             generateBody(input_stream, output_stream);
-            REQUIRE(output_stream.str() == "\tint_output[0] = __QW0;\r\n");
+            REQUIRE(output_stream.str() == "WORD *__QW0 = (WORD *)&int_output_image[0];\r\n\r\nvoid glueVars()\r\n{\r\n\tint_output[0] = __QW0;\r\n");
         }
 
         WHEN("Contains single INT at %IW1") {
             std::stringstream input_stream("__LOCATED_VAR(INT,__IW1,I,W,1)");
             generateBody(input_stream, output_stream);
-            REQUIRE(output_stream.str() == "\tint_input[1] = __IW1;\r\n");
+            REQUIRE(output_stream.str() == "INT *__IW1 = (INT *)&int_input_image[1];\r\n\r\nvoid glueVars()\r\n{\r\n\tint_input[1] = __IW1;\r\n");
         }
 
         WHEN("Contains single UINT at %IW2") {
             std::stringstream input_stream("__LOCATED_VAR(UINT,__IW2,I,W,2)");
             generateBody(input_stream, output_stream);
-            REQUIRE(output_stream.str() == "\tint_input[2] = __IW2;\r\n");
+            REQUIRE(output_stream.str() == "UINT *__IW2 = (UINT *)&int_input_image[2];\r\n\r\nvoid glueVars()\r\n{\r\n\tint_input[2] = __IW2;\r\n");
         }
 
         WHEN("Contains single INT at %MW2") {
             std::stringstream input_stream("__LOCATED_VAR(INT,__MW2,M,W,2)");
             generateBody(input_stream, output_stream);
-            REQUIRE(output_stream.str() == "\tint_memory[2] = __MW2;\r\n");
+            REQUIRE(output_stream.str() == "INT *__MW2 = (INT *)&int_memory_image[2];\r\n\r\nvoid glueVars()\r\n{\r\n\tint_memory[2] = __MW2;\r\n");
         }
 
         WHEN("Contains single DWORD at %MD0") {
             std::stringstream input_stream("__LOCATED_VAR(DWORD,__MD2,M,D,2)");
             generateBody(input_stream, output_stream);
-            REQUIRE(output_stream.str() == "\tdint_memory[2] = (IEC_DINT *)__MD2;\r\n");
+            REQUIRE(output_stream.str() == "DWORD *__MD2 = (DWORD *)&dint_memory_image[2];\r\n\r\nvoid glueVars()\r\n{\r\n\tdint_memory[2] = (IEC_DINT *)__MD2;\r\n");
         }
 
         WHEN("Contains single LINT at %ML1") {
              std::stringstream input_stream("__LOCATED_VAR(LINT,__ML1,M,L,1)");
              generateBody(input_stream, output_stream);
-            REQUIRE(output_stream.str() == "\tlint_memory[1] = (IEC_LINT *)__ML1;\r\n");
+            REQUIRE(output_stream.str() == "LINT *__ML1 = (LINT *)&lint_memory_image[1];\r\n\r\nvoid glueVars()\r\n{\r\n\tlint_memory[1] = (IEC_LINT *)__ML1;\r\n");
         }
 
         WHEN("Contains single LINT at %ML1024") {
             std::stringstream input_stream("__LOCATED_VAR(LINT,__ML1024,M,L,1024)");
             generateBody(input_stream, output_stream);
-            REQUIRE(output_stream.str() == "\tspecial_functions[0] = (IEC_LINT *)__ML1024;\r\n");
+            REQUIRE(output_stream.str() == "LINT *__ML1024 = (LINT *)&special_functions_image[0];\r\n\r\nvoid glueVars()\r\n{\r\n\tspecial_functions[0] = (IEC_LINT *)__ML1024;\r\n");
+        }
+
+        WHEN("Contains single DINT at %ID0") {
+            std::stringstream input_stream("__LOCATED_VAR(DINT,__ID0,I,D,0)");
+            generateBody(input_stream, output_stream);
+            REQUIRE(output_stream.str() == "DINT ____ID0;\r\nDINT *__ID0 = &____ID0;\r\n\r\nvoid glueVars()\r\n{\r\n");
+        }
+    }
+}
+
+SCENARIO("Symbol table", "[debug]") {
+    GIVEN("VARIABLES.csv as a stream") {
+        std::stringstream output_stream;
+        WHEN("Contains a program with a local and a located variable") {
+            std::stringstream input_stream("// Programs\n0;CONFIG0.RES0.INSTANCE0;PROG0;\n\n// Variables\n"
+                                           "0;VAR;CONFIG0.RES0.INSTANCE0.COUNTER;CONFIG0.RES0.INSTANCE0.COUNTER;INT;\n"
+                                           "1;OUT;CONFIG0.RES0.INSTANCE0.LAMP;CONFIG0.RES0.INSTANCE0.LAMP;BOOL;\n");
+            generateSymbolTable(input_stream, output_stream);
+            std::string output = output_stream.str();
+            REQUIRE(output.find("extern PROG0 RES0__INSTANCE0;") != std::string::npos);
+            REQUIRE(output.find("{\"CONFIG0.RES0.INSTANCE0.COUNTER\", \"INT\", sizeof(RES0__INSTANCE0.COUNTER.value), false, &(RES0__INSTANCE0.COUNTER.value), &(RES0__INSTANCE0.COUNTER.flags), NULL},") != std::string::npos);
+            REQUIRE(output.find("{\"CONFIG0.RES0.INSTANCE0.LAMP\", \"BOOL\", sizeof(RES0__INSTANCE0.LAMP.fvalue), true, &(RES0__INSTANCE0.LAMP.value), &(RES0__INSTANCE0.LAMP.flags), &(RES0__INSTANCE0.LAMP.fvalue)},") != std::string::npos);
+            REQUIRE(output.find("int debug_symbol_count = 2;") != std::string::npos);
+        }
+    }
+}
+
+SCENARIO("Task image binding", "[tasks]") {
+    GIVEN("IO as streams") {
+        std::stringstream output_stream;
+        WHEN("Contains a BOOL at %QX0.1 and a DINT at %ID0") {
+            std::stringstream input_stream("__LOCATED_VAR(BOOL,__QX0_1,Q,X,0,1)\n__LOCATED_VAR(DINT,__ID0,I,D,0)");
+            generateImageBinding(input_stream, output_stream);
+            REQUIRE(output_stream.str() == "\r\n\r\nvoid bindLocatedVars(struct task_image *image)\r\n{\r\n\tif (image == NULL)\r\n\t{\r\n"
+                                           "\t\t__QX0_1 = (BOOL *)&bool_output_image[0][1];\r\n\t}\r\n\telse\r\n\t{\r\n"
+                                           "\t\t__QX0_1 = (BOOL *)&image->bool_output[0][1];\r\n\t}\r\n}");
         }
     }
 }
@@ -89,6 +89,17 @@
 /* Idem as body, but for run CONFIG and RESOURCE function */
 #define FB_RUN_SUFFIX "_run__"
 
+/* Table of the periodic tasks of a RESOURCE, generated with the 't' output option */
+#define TASKS_SUFFIX "_tasks__"
+
+/* Trigger function of a SINGLE task, generated with the 't' output option */
+#define TRIGGER_SUFFIX "_trigger__"
+
+/* Table of the program groups of a RESOURCE, and the function that updates the flags of its
+ * tasks before the groups run, generated with the 'g' output option */
+#define GROUPS_SUFFIX "_groups__"
+#define SCHEDULE_SUFFIX "_schedule__"
+
 /* The FB body function is passed as the only parameter a pointer to the FB data
  * structure instance. The name of this parameter is given by the following constant.
  * In order not to clash with any variable in the IL and ST source codem the
@@ -178,13 +189,16 @@
 
 static int generate_line_directives__ = 0;
 static int generate_pou_filepairs__   = 0;
+static int generate_task_functions__  = 0;
+static int generate_program_groups__  = 0;
+static int generate_direct_access__   = 0;
 
 #ifdef __unix__
 /* Parse command line options passed from main.c !! */
 #include <stdlib.h> // for getsybopt()
 int  stage4_parse_options(char *options) {
-  enum {                    LINE_OPT = 0            ,  SEPTFILE_OPT              /*, SOME_OTHER_OPT, YET_ANOTHER_OPT */};
-  char *const token[] = { /*[LINE_OPT]=*/(char *)"l",/*SEPTFILE_OPT*/(char *)"p" /*, SOME_OTHER_OPT, ...             */, NULL };
+  enum {                    LINE_OPT = 0            ,  SEPTFILE_OPT              ,  TASKS_OPT              ,  GROUPS_OPT              ,  DIRECT_OPT              /*, SOME_OTHER_OPT, YET_ANOTHER_OPT */};
+  char *const token[] = { /*[LINE_OPT]=*/(char *)"l",/*SEPTFILE_OPT*/(char *)"p",/*TASKS_OPT*/(char *)"t",/*GROUPS_OPT*/(char *)"g",/*DIRECT_OPT*/(char *)"d" /*, SOME_OTHER_OPT, ... */, NULL };
   /* unfortunately, the above commented out syntax for array initialization is valid in C, but not in C++ */
   
   char *subopts = options;
@@ -195,6 +209,9 @@ int  stage4_parse_options(char *options) {
     switch (getsubopt(&subopts, token, &value)) {
       case     LINE_OPT: generate_line_directives__  = 1; break;
       case SEPTFILE_OPT: generate_pou_filepairs__    = 1; break;
+      case    TASKS_OPT: generate_task_functions__   = 1; break;
+      case   GROUPS_OPT: generate_program_groups__   = 1; break;
+      case   DIRECT_OPT: generate_direct_access__    = 1; break;
       default          : fprintf(stderr, "Unrecognized option: -O %s\n", value); return -1; break;
      }
   }     
@@ -206,6 +223,13 @@ void stage4_print_options(void) {
   printf("          (options must be separated by commas. Example: 'l,w,x')\n"); 
   printf("      l : insert '#line' directives in generated C code.\n"); 
   printf("      p : place each POU in a separate pair of files (<pou_name>.c, <pou_name>.h).\n"); 
+  printf("      t : run each periodic and SINGLE task from functions of its own, listed on\n"); 
+  printf("          config_tasks__, so that the runtime can schedule tasks at their own rate and\n"); 
+  printf("          priority, and run SINGLE tasks as soon as their data source rises.\n"); 
+  printf("      g : run the programs of each resource from groups that share no variables, listed\n"); 
+  printf("          on config_groups__, so that the runtime can run the groups in parallel.\n"); 
+  printf("      d : access variables directly, without checking whether they are forced, and make\n"); 
+  printf("          functions static inline. Variables can then no longer be forced.\n"); 
 }
 #else /* not __unix__ */
 /* getsubopt isn't supported with mingw, 
@@ -226,6 +250,7 @@ int  stage4_parse_options(char *options) {}
 #include "generate_c_configbody.cc"
 #include "generate_location_list.cc"
 #include "generate_var_list.cc"
+#include "generate_c_groups.cc"
 
 /***********************************************************************/
 /***********************************************************************/
@@ -815,6 +840,9 @@ class generate_c_pous_c {
       /* (A) Function declaration... */
       /* (A.1) Function return type */
       s4o.print("// FUNCTION\n");
+      /* POUS.c is compiled within the resource, so functions may be inlined on their callers... */
+      if (generate_direct_access__)
+        s4o.print("static inline ");
       symbol->type_name->accept(print_base); /* return type */
       s4o.print(" ");
       /* (A.2) Function name */
@@ -1353,7 +1381,11 @@ class generate_c_config_c: public generate_c_base_and_typeid_c {
       initprotos_dt,
       initdeclare_dt,
       runprotos_dt,
-      rundeclare_dt
+      rundeclare_dt,
+      taskprotos_dt,
+      taskdeclare_dt,
+      groupprotos_dt,
+      groupdeclare_dt
     } declaretype_t;
 
     declaretype_t wanted_declaretype;
@@ -1407,6 +1439,13 @@ void *visit(configuration_declaration_c *symbol) {
     s4o.print("#endif\n");
   }
   
+  if (generate_direct_access__) {
+    // Use the accessor macros that do not check the force flags...
+    s4o.print("#ifndef DISABLE_FORCING\n");
+    s4o.print("#define DISABLE_FORCING\n");
+    s4o.print("#endif\n");
+  }
+  
   s4o.print("#include \"iec_std_lib.h\"\n\n");
   s4o.print("#include \"accessor.h\"\n\n"); 
   s4o.print("#include \"POUS.h\"\n\n");
@@ -1489,6 +1528,38 @@ void *visit(configuration_declaration_c *symbol) {
   s4o.indent_left();
   s4o.print(s4o.indent_spaces + "}\n");
 
+  /* (D) Periodic tasks of every resource, for runtimes that schedule them on their own */
+  if (generate_task_functions__) {
+    s4o.print("\n");
+    wanted_declaretype = taskprotos_dt;
+    symbol->resource_declarations->accept(*this);
+    s4o.print("\n");
+
+    s4o.print(s4o.indent_spaces + "__IEC_TASK_t *config_tasks__[] = {\n");
+    s4o.indent_right();
+    wanted_declaretype = taskdeclare_dt;
+    symbol->resource_declarations->accept(*this);
+    s4o.print(s4o.indent_spaces + "NULL\n");
+    s4o.indent_left();
+    s4o.print(s4o.indent_spaces + "};\n");
+  }
+
+  /* (E) Program groups of every resource, for runtimes that run them in parallel */
+  if (generate_program_groups__) {
+    s4o.print("\n");
+    wanted_declaretype = groupprotos_dt;
+    symbol->resource_declarations->accept(*this);
+    s4o.print("\n");
+
+    s4o.print(s4o.indent_spaces + "__IEC_RESOURCE_GROUPS_t config_groups__[] = {\n");
+    s4o.indent_right();
+    wanted_declaretype = groupdeclare_dt;
+    symbol->resource_declarations->accept(*this);
+    s4o.print(s4o.indent_spaces + "{NULL, NULL, NULL}\n");
+    s4o.indent_left();
+    s4o.print(s4o.indent_spaces + "};\n");
+  }
+
   return NULL;
 }
 
@@ -1517,6 +1588,39 @@ void *visit(resource_declaration_c *symbol) {
       s4o.print("(tick);\n");
     }
   }
+  if (wanted_declaretype == taskprotos_dt) {
+    s4o.print(s4o.indent_spaces + "extern __IEC_TASK_t ");
+    symbol->resource_name->accept(*this);
+    s4o.print(TASKS_SUFFIX);
+    s4o.print("[];\n");
+  }
+  if (wanted_declaretype == taskdeclare_dt) {
+    s4o.print(s4o.indent_spaces);
+    symbol->resource_name->accept(*this);
+    s4o.print(TASKS_SUFFIX);
+    s4o.print(",\n");
+  }
+  if (wanted_declaretype == groupprotos_dt) {
+    s4o.print(s4o.indent_spaces + "void ");
+    symbol->resource_name->accept(*this);
+    s4o.print(SCHEDULE_SUFFIX);
+    s4o.print("(unsigned long tick);\n");
+    s4o.print(s4o.indent_spaces + "extern __IEC_PROGRAM_GROUP_t ");
+    symbol->resource_name->accept(*this);
+    s4o.print(GROUPS_SUFFIX);
+    s4o.print("[];\n");
+  }
+  if (wanted_declaretype == groupdeclare_dt) {
+    s4o.print(s4o.indent_spaces + "{\"");
+    symbol->resource_name->accept(*this);
+    s4o.print("\", ");
+    symbol->resource_name->accept(*this);
+    s4o.print(SCHEDULE_SUFFIX);
+    s4o.print(", ");
+    symbol->resource_name->accept(*this);
+    s4o.print(GROUPS_SUFFIX);
+    s4o.print("},\n");
+  }
   return NULL;
 }
 
@@ -1543,6 +1647,31 @@ void *visit(single_resource_declaration_c *symbol) {
       s4o.print("(tick);\n");
     }
   }
+  if (wanted_declaretype == taskprotos_dt) {
+    s4o.print(s4o.indent_spaces + "extern __IEC_TASK_t RESOURCE");
+    s4o.print(TASKS_SUFFIX);
+    s4o.print("[];\n");
+  }
+  if (wanted_declaretype == taskdeclare_dt) {
+    s4o.print(s4o.indent_spaces + "RESOURCE");
+    s4o.print(TASKS_SUFFIX);
+    s4o.print(",\n");
+  }
+  if (wanted_declaretype == groupprotos_dt) {
+    s4o.print(s4o.indent_spaces + "void RESOURCE");
+    s4o.print(SCHEDULE_SUFFIX);
+    s4o.print("(unsigned long tick);\n");
+    s4o.print(s4o.indent_spaces + "extern __IEC_PROGRAM_GROUP_t RESOURCE");
+    s4o.print(GROUPS_SUFFIX);
+    s4o.print("[];\n");
+  }
+  if (wanted_declaretype == groupdeclare_dt) {
+    s4o.print(s4o.indent_spaces + "{\"RESOURCE\", RESOURCE");
+    s4o.print(SCHEDULE_SUFFIX);
+    s4o.print(", RESOURCE");
+    s4o.print(GROUPS_SUFFIX);
+    s4o.print("},\n");
+  }
   return NULL;
 }
 
@@ -1568,7 +1697,13 @@ class generate_c_resources_c: public generate_c_base_and_typeid_c {
     symbol_c *current_configuration;
     symbol_c *current_resource_name;
     symbol_c *current_task_name;
+    symbol_c *current_task_list;
     symbol_c *current_global_vars;
+    /* The periodic task whose functions are being generated, with the 't' output option... */
+    symbol_c *wanted_task_name;
+    /* The program groups, and the group whose function is being generated, with the 'g' output option... */
+    generate_c_groups_c *program_groups;
+    int wanted_group;
     bool configuration_name;
     stage4out_c *s4o_ptr;
 
@@ -1581,7 +1716,11 @@ class generate_c_resources_c: public generate_c_base_and_typeid_c {
       common_ticktime = time;
       current_resource_name = NULL;
       current_task_name = NULL;
+      current_task_list = NULL;
       current_global_vars = NULL;
+      wanted_task_name = NULL;
+      program_groups = NULL;
+      wanted_group = 0;
       configuration_name = false;
       generate_c_resources_c::s4o_ptr = s4o_ptr;
     };
@@ -1594,12 +1733,66 @@ class generate_c_resources_c: public generate_c_base_and_typeid_c {
     typedef enum {
       declare_dt,
       init_dt,
-      run_dt
+      run_dt,
+      task_init_dt,
+      task_run_dt,
+      group_run_dt
     } declaretype_t;
 
     declaretype_t wanted_declaretype;
 
     unsigned long long common_ticktime;
+
+    /* Returns the interval of a periodic task that gets functions of its own with the 't' output
+     * option, or 0 for any other task (SINGLE tasks, tasks without an interval, or when the
+     * option is not set)...
+     */
+    unsigned long long task_interval(symbol_c *task_name) {
+      if (!generate_task_functions__ || task_name == NULL || current_task_list == NULL)
+        return 0;
+      list_c *tasks = dynamic_cast<list_c *>(current_task_list);
+      for (int i = 0; i < tasks->n; i++) {
+        task_configuration_c *task = dynamic_cast<task_configuration_c *>(tasks->elements[i]);
+        if (task == NULL || compare_identifiers(task->task_name, task_name) != 0)
+          continue;
+        task_initialization_c *task_init = dynamic_cast<task_initialization_c *>(task->task_initialization);
+        if (task_init == NULL || task_init->single_data_source != NULL || task_init->interval_data_source == NULL)
+          return 0;
+        return calculate_time(task_init->interval_data_source);
+      }
+      return 0;
+    }
+
+    /* Tells if a task is a SINGLE task that gets functions of its own with the 't' output option.
+     * The runtime runs these when their data source rises, instead of sampling it on every tick...
+     */
+    bool is_event_task(symbol_c *task_name) {
+      if (!generate_task_functions__ || task_name == NULL || current_task_list == NULL)
+        return false;
+      list_c *tasks = dynamic_cast<list_c *>(current_task_list);
+      for (int i = 0; i < tasks->n; i++) {
+        task_configuration_c *task = dynamic_cast<task_configuration_c *>(tasks->elements[i]);
+        if (task == NULL || compare_identifiers(task->task_name, task_name) != 0)
+          continue;
+        task_initialization_c *task_init = dynamic_cast<task_initialization_c *>(task->task_initialization);
+        return (task_init != NULL) && (task_init->single_data_source != NULL);
+      }
+      return false;
+    }
+
+    bool task_has_functions(symbol_c *task_name) {
+      return task_interval(task_name) != 0 || is_event_task(task_name);
+    }
+
+    /* Tells if a program goes on the function being generated. The resource's functions
+     * leave out the programs of tasks that get functions of their own, and these only
+     * include the programs of their task...
+     */
+    bool is_wanted_program(symbol_c *task_name) {
+      if (wanted_declaretype == task_init_dt || wanted_declaretype == task_run_dt)
+        return (task_name != NULL) && (compare_identifiers(task_name, wanted_task_name) == 0);
+      return !task_has_functions(task_name);
+    }
     
     const char *current_program_name;
 
@@ -1705,6 +1898,7 @@ END_RESOURCE
       bool single_resource = current_resource_name == NULL;
       if (single_resource)
         current_resource_name = new identifier_c("RESOURCE");
+      current_task_list = symbol->task_configuration_list;
       generate_c_vardecl_c *vardecl;
       
       /* Insert the header... */
@@ -1721,6 +1915,13 @@ END_RESOURCE
         s4o.print("#endif\n");
       }
       
+      if (generate_direct_access__) {
+        // Use the accessor macros that do not check the force flags...
+        s4o.print("#ifndef DISABLE_FORCING\n");
+        s4o.print("#define DISABLE_FORCING\n");
+        s4o.print("#endif\n");
+      }
+      
       s4o.print("#include \"iec_std_lib.h\"\n\n");
       
       /* (A) resource declaration... */
@@ -1798,32 +1999,254 @@ END_RESOURCE
       s4o.indent_left();
       s4o.print("}\n\n");
       
-      /* (C) Resource run function... */
-      /* (C.1) Run function name... */
-      s4o.print("void ");
+      /* (C) Resource run function, split in program groups with the 'g' output option... */
+      if (generate_program_groups__) {
+        print_program_groups(symbol);
+      }
+      else {
+        /* (C.1) Run function name... */
+        s4o.print("void ");
+        current_resource_name->accept(*this);
+        s4o.print(FB_RUN_SUFFIX);
+        s4o.print("(unsigned long tick) {\n");
+        s4o.indent_right();
+        
+        wanted_declaretype = run_dt;
+        
+        /* (C.2) Task management... */
+        symbol->task_configuration_list->accept(*this);
+        
+        /* (C.3) Program run declaration... */
+        symbol->program_configuration_list->accept(*this);
+        
+        s4o.indent_left();
+        s4o.print("}\n\n");
+      }
+      
+      /* (D) Periodic tasks functions, with the 't' output option... */
+      if (generate_task_functions__)
+        print_task_functions(symbol);
+      
+      current_task_list = NULL;
+      if (single_resource) {
+        delete current_resource_name;
+        current_resource_name = NULL;
+      }
+      return NULL;
+    }
+    
+    /* Prints the name of the run function of a program group... */
+    void print_group_name(int group) {
       current_resource_name->accept(*this);
+      s4o.print("__group__");
+      s4o.print(group);
       s4o.print(FB_RUN_SUFFIX);
+    }
+
+    /* Splits the programs run by the resource's run function into groups that share no
+     * variables, and prints a run function for each group, the function that updates the task
+     * flags before the groups run, and the table of the groups. The resource's run function
+     * calls all of these in turn, so runtimes that don't run the groups in parallel keep
+     * working unchanged...
+     */
+    void print_program_groups(single_resource_declaration_c *symbol) {
+      list_c *program_list = dynamic_cast<list_c *>(symbol->program_configuration_list);
+      configuration_declaration_c *configuration = dynamic_cast<configuration_declaration_c *>(current_configuration);
+
+      program_groups = new generate_c_groups_c();
+      if (configuration != NULL)
+        program_groups->add_globals(configuration->global_var_declarations);
+      program_groups->add_globals(current_global_vars);
+      for (int i = 0; i < program_list->n; i++) {
+        program_configuration_c *program = dynamic_cast<program_configuration_c *>(program_list->elements[i]);
+        if (program != NULL && !task_has_functions(program->task_name))
+          program_groups->add_program(program);
+      }
+      program_groups->finish();
+
+      /* (C.1) Task management... */
+      s4o.print("void ");
+      current_resource_name->accept(*this);
+      s4o.print(SCHEDULE_SUFFIX);
       s4o.print("(unsigned long tick) {\n");
       s4o.indent_right();
-      
       wanted_declaretype = run_dt;
-      
-      /* (C.2) Task management... */
       symbol->task_configuration_list->accept(*this);
-      
-      /* (C.3) Program run declaration... */
-      symbol->program_configuration_list->accept(*this);
-      
       s4o.indent_left();
       s4o.print("}\n\n");
-      
-      if (single_resource) {
-        delete current_resource_name;
-        current_resource_name = NULL;
+
+      /* (C.2) Program groups run... */
+      for (wanted_group = 0; wanted_group < program_groups->count(); wanted_group++) {
+        s4o.print("void ");
+        print_group_name(wanted_group);
+        s4o.print("(unsigned long tick) {\n");
+        s4o.indent_right();
+        wanted_declaretype = group_run_dt;
+        symbol->program_configuration_list->accept(*this);
+        s4o.indent_left();
+        s4o.print("}\n\n");
       }
-      return NULL;
+
+      /* (C.3) Run function, running the groups one after the other... */
+      s4o.print("void ");
+      current_resource_name->accept(*this);
+      s4o.print(FB_RUN_SUFFIX);
+      s4o.print("(unsigned long tick) {\n");
+      s4o.indent_right();
+      s4o.print(s4o.indent_spaces);
+      current_resource_name->accept(*this);
+      s4o.print(SCHEDULE_SUFFIX);
+      s4o.print("(tick);\n");
+      for (int group = 0; group < program_groups->count(); group++) {
+        s4o.print(s4o.indent_spaces);
+        print_group_name(group);
+        s4o.print("(tick);\n");
+      }
+      s4o.indent_left();
+      s4o.print("}\n\n");
+
+      /* (C.4) Table of the groups, with the names of their programs, terminated by an empty entry... */
+      s4o.print("__IEC_PROGRAM_GROUP_t ");
+      current_resource_name->accept(*this);
+      s4o.print(GROUPS_SUFFIX);
+      s4o.print("[] = {\n");
+      s4o.indent_right();
+      for (int group = 0; group < program_groups->count(); group++) {
+        s4o.print(s4o.indent_spaces + "{\"");
+        bool first = true;
+        for (int i = 0; i < program_list->n; i++) {
+          if (program_groups->group(program_list->elements[i]) != group)
+            continue;
+          if (!first)
+            s4o.print(", ");
+          ((program_configuration_c *)program_list->elements[i])->program_name->accept(*this);
+          first = false;
+        }
+        s4o.print("\", ");
+        print_group_name(group);
+        s4o.print("},\n");
+      }
+      s4o.print(s4o.indent_spaces + "{NULL, NULL}\n");
+      s4o.indent_left();
+      s4o.print("};\n\n");
+
+      delete program_groups;
+      program_groups = NULL;
     }
-    
+
+    /* Prints an initialisation and a run function for each periodic and SINGLE task, and the
+     * table of these tasks that the runtime uses to schedule each of them at its own rate and
+     * priority. SINGLE tasks also get a trigger function, that samples their data source and
+     * tells if it rose, for the runtime to call whenever an event may have changed it. The
+     * resource's functions no longer run the programs of these tasks...
+     */
+    void print_task_functions(single_resource_declaration_c *symbol) {
+      list_c *tasks = dynamic_cast<list_c *>(symbol->task_configuration_list);
+
+      for (int i = 0; i < tasks->n; i++) {
+        task_configuration_c *task = dynamic_cast<task_configuration_c *>(tasks->elements[i]);
+        if (task == NULL || !task_has_functions(task->task_name))
+          continue;
+        wanted_task_name = task->task_name;
+
+        /* (D.1) Task programs initialisation... */
+        s4o.print("void ");
+        current_resource_name->accept(*this);
+        s4o.print("__");
+        task->task_name->accept(*this);
+        s4o.print(FB_INIT_SUFFIX);
+        s4o.print("(void) {\n");
+        s4o.indent_right();
+        s4o.print(s4o.indent_spaces);
+        s4o.print("BOOL retain;\n");
+        s4o.print(s4o.indent_spaces);
+        s4o.print("retain = 0;\n");
+        wanted_declaretype = task_init_dt;
+        symbol->program_configuration_list->accept(*this);
+        s4o.indent_left();
+        s4o.print("}\n\n");
+
+        /* (D.2) Task programs run... */
+        s4o.print("void ");
+        current_resource_name->accept(*this);
+        s4o.print("__");
+        task->task_name->accept(*this);
+        s4o.print(FB_RUN_SUFFIX);
+        s4o.print("(unsigned long tick) {\n");
+        s4o.indent_right();
+        wanted_declaretype = task_run_dt;
+        symbol->program_configuration_list->accept(*this);
+        s4o.indent_left();
+        s4o.print("}\n\n");
+
+        /* (D.3) Event trigger of SINGLE tasks... */
+        if (is_event_task(task->task_name)) {
+          s4o.print("BOOL ");
+          current_resource_name->accept(*this);
+          s4o.print("__");
+          task->task_name->accept(*this);
+          s4o.print(TRIGGER_SUFFIX);
+          s4o.print("(void) {\n");
+          s4o.indent_right();
+          wanted_declaretype = run_dt;
+          current_task_name = task->task_name;
+          task->task_initialization->accept(*this);
+          current_task_name = NULL;
+          s4o.print(s4o.indent_spaces + "return ");
+          task->task_name->accept(*this);
+          s4o.print(";\n");
+          s4o.indent_left();
+          s4o.print("}\n\n");
+        }
+      }
+      wanted_task_name = NULL;
+
+      /* (D.4) Table of the tasks, terminated by an empty entry... */
+      s4o.print("__IEC_TASK_t ");
+      current_resource_name->accept(*this);
+      s4o.print(TASKS_SUFFIX);
+      s4o.print("[] = {\n");
+      s4o.indent_right();
+      for (int i = 0; i < tasks->n; i++) {
+        task_configuration_c *task = dynamic_cast<task_configuration_c *>(tasks->elements[i]);
+        if (task == NULL || !task_has_functions(task->task_name))
+          continue;
+        task_initialization_c *task_init = dynamic_cast<task_initialization_c *>(task->task_initialization);
+        s4o.print(s4o.indent_spaces + "{\"");
+        task->task_name->accept(*this);
+        s4o.print("\", ");
+        s4o.print_long_long_integer(task_interval(task->task_name));
+        s4o.print(", ");
+        if (task_init->priority_data_source != NULL)
+          task_init->priority_data_source->accept(*this);
+        else
+          s4o.print("0");
+        s4o.print(", ");
+        current_resource_name->accept(*this);
+        s4o.print("__");
+        task->task_name->accept(*this);
+        s4o.print(FB_INIT_SUFFIX);
+        s4o.print(", ");
+        current_resource_name->accept(*this);
+        s4o.print("__");
+        task->task_name->accept(*this);
+        s4o.print(FB_RUN_SUFFIX);
+        s4o.print(", ");
+        if (is_event_task(task->task_name)) {
+          current_resource_name->accept(*this);
+          s4o.print("__");
+          task->task_name->accept(*this);
+          s4o.print(TRIGGER_SUFFIX);
+        }
+        else
+          s4o.print("NULL");
+        s4o.print("},\n");
+      }
+      s4o.print(s4o.indent_spaces + "{NULL, 0, 0, NULL, NULL, NULL}\n");
+      s4o.indent_left();
+      s4o.print("};\n\n");
+    }
+
 /*  PROGRAM [RETAIN | NON_RETAIN] program_name [WITH task_name] ':' program_type_name ['(' prog_conf_elements ')'] */
 //SYM_REF6(program_configuration_c, retain_option, program_name, task_name, program_type_name, prog_conf_elements, unused)
     void *visit(program_configuration_c *symbol) {
@@ -1844,6 +2267,9 @@ END_RESOURCE
           s4o.print("\n");
           break;
         case init_dt:
+        case task_init_dt:
+          if (!is_wanted_program(symbol->task_name))
+            break;
           if (symbol->retain_option != NULL)
             symbol->retain_option->accept(*this);
           s4o.print(s4o.indent_spaces);
@@ -1855,11 +2281,18 @@ END_RESOURCE
           s4o.print(");\n");
           break;
         case run_dt: 
+        case task_run_dt:
+        case group_run_dt:
+          if (!is_wanted_program(symbol->task_name))
+            break;
+          if (wanted_declaretype == group_run_dt && program_groups->group(symbol) != wanted_group)
+            break;
           { identifier_c *tmp_id = dynamic_cast<identifier_c*>(symbol->program_name);
             if (NULL == tmp_id) ERROR;
             current_program_name = tmp_id->value;
 	  }
-          if (symbol->task_name != NULL) {
+          /* the functions of a periodic task run its programs on every call */
+          if (symbol->task_name != NULL && wanted_declaretype != task_run_dt) {
             s4o.print(s4o.indent_spaces);
             s4o.print("if (");
             symbol->task_name->accept(*this);
@@ -1882,7 +2315,7 @@ END_RESOURCE
           if (symbol->prog_conf_elements != NULL)
             symbol->prog_conf_elements->accept(*this);
           
-          if (symbol->task_name != NULL) {
+          if (symbol->task_name != NULL && wanted_declaretype != task_run_dt) {
             s4o.indent_left();
             s4o.print(s4o.indent_spaces + "}\n");
           }
@@ -1911,7 +2344,8 @@ END_RESOURCE
           symbol->task_initialization->accept(*this);
           break;
         case run_dt:
-          symbol->task_initialization->accept(*this);
+          if (!task_has_functions(current_task_name))
+            symbol->task_initialization->accept(*this);
           break;
         default:
           break;
@@ -2164,6 +2598,13 @@ class generate_c_c: public iterator_visitor_c {
         pous_incl_s4o.print("#endif\n");
       }
       
+      if (generate_direct_access__) {
+        // Use the accessor macros that do not check the force flags...
+        pous_incl_s4o.print("#ifndef DISABLE_FORCING\n");
+        pous_incl_s4o.print("#define DISABLE_FORCING\n");
+        pous_incl_s4o.print("#endif\n");
+      }
+      
       pous_incl_s4o.print("#include \"accessor.h\"\n#include \"iec_std_lib.h\"\n\n");
 
       for(int i = 0; i < symbol->n; i++) {
@@ -2307,6 +2748,8 @@ class generate_c_c: public iterator_visitor_c {
         config_s4o.print("unsigned long greatest_tick_count__ = ");
         config_s4o.print_long_integer(calculate_common_ticktime.get_greatest_tick_count());
         config_s4o.print("; /*tick*/\n");
+        if (generate_direct_access__)
+          config_s4o.print("int config_forcing_disabled__ = 1;\n");
       }
 
       symbol->resource_declarations->accept(*this);
@@ -0,0 +1,235 @@
+/*
+ *  matiec - a compiler for the programming languages defined in IEC 61131-3
+ *
+ *  Copyright (C) 2003-2011  Mario de Sousa (msousa@fe.up.pt)
+ *  Copyright (C) 2007-2011  Laurent Bessard and Edouard Tisserant
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * This code is made available on the understanding that it will not be
+ * used in safety-critical situations without a full and competent review.
+ */
+
+/*
+ * Splits the programs run by a resource into groups that share no variables, so that
+ * with the 'g' output option the runtime may run the groups in parallel.
+ *
+ * Programs only reach variables outside their own instance through located variables,
+ * VAR_EXTERNAL declarations (their own or those of the function blocks they instantiate),
+ * the globals connected to them on the program configuration, and the direct variables
+ * (e.g. %QX0.0) used in their bodies or in those of the function blocks they instantiate.
+ * The analysis is conservative: a variable that is declared or read but never written
+ * still puts both programs on the same group.
+ * Located inputs (%I) are left out, as programs only read them, and the runtime refreshes
+ * them before any group starts.
+ *
+ * Within a group the programs run in the order they are configured.
+ */
+
+#include <set>
+#include <vector>
+
+class generate_c_groups_c: public iterator_visitor_c {
+
+  private:
+    /* Variables that the program being analysed can access... */
+    std::set<std::string> *current_access;
+    /* Function block types already visited for the program being analysed... */
+    std::set<std::string> visited_fb_types;
+    /* Location of the located global variables... */
+    std::map<std::string, std::string> global_locations;
+    bool collecting_globals;
+
+    /* First program found accessing each variable... */
+    std::map<std::string, int> owners;
+    std::map<symbol_c *, int> program_group;
+    std::vector<symbol_c *> programs;
+    /* Union-find forest of the programs, merged when they access the same variable... */
+    std::vector<int> parent;
+    int group_count;
+
+    static std::string upper(const char *value) {
+      std::string str(value);
+      for (unsigned int i = 0; i < str.size(); i++)
+        str[i] = toupper(str[i]);
+      return str;
+    }
+
+    static const char *token_value(symbol_c *symbol) {
+      token_c *token = dynamic_cast<token_c *>(symbol);
+      if (token == NULL) ERROR;
+      return token->value;
+    }
+
+    int find(int program) {
+      while (parent[program] != program)
+        program = parent[program] = parent[parent[program]];
+      return program;
+    }
+
+    void add_location(symbol_c *location) {
+      add_direct_variable(dynamic_cast<location_c *>(location)->direct_variable);
+    }
+
+    void add_direct_variable(symbol_c *direct_variable) {
+      std::string key = upper(token_value(direct_variable));
+      if (key[1] != 'I')
+        current_access->insert(key);
+    }
+
+    void add_global(symbol_c *global_var_name) {
+      std::string name = upper(token_value(global_var_name));
+      std::map<std::string, std::string>::iterator location = global_locations.find(name);
+      if (location == global_locations.end())
+        current_access->insert(name);
+      else if (location->second[1] != 'I')
+        current_access->insert(location->second);
+    }
+
+  public:
+    generate_c_groups_c(void) {
+      current_access = NULL;
+      collecting_globals = false;
+      group_count = 0;
+    }
+    virtual ~generate_c_groups_c(void) {}
+
+    /* Collects the located global variables of the configuration and of the resource, so
+     * that VAR_EXTERNAL declarations of these are matched by their location...
+     */
+    void add_globals(symbol_c *global_var_declarations) {
+      if (global_var_declarations == NULL)
+        return;
+      collecting_globals = true;
+      global_var_declarations->accept(*this);
+      collecting_globals = false;
+    }
+
+    /* Adds a program to the analysis, with the global variables connected to it... */
+    void add_program(program_configuration_c *program) {
+      program_type_symtable_t::iterator program_type = program_type_symtable.find(program->program_type_name);
+      if (program_type == program_type_symtable.end())
+        ERROR;
+
+      std::set<std::string> access;
+      current_access = &access;
+      visited_fb_types.clear();
+      program_type->second->var_declarations->accept(*this);
+      program_type->second->function_block_body->accept(*this);
+      if (program->prog_conf_elements != NULL) {
+        list_c *elements = dynamic_cast<list_c *>(program->prog_conf_elements);
+        for (int i = 0; i < elements->n; i++) {
+          prog_cnxn_assign_c *assign = dynamic_cast<prog_cnxn_assign_c *>(elements->elements[i]);
+          prog_cnxn_sendto_c *sendto = dynamic_cast<prog_cnxn_sendto_c *>(elements->elements[i]);
+          if (assign != NULL)
+            add_global(((global_var_reference_c *)(assign->prog_data_source))->global_var_name);
+          if (sendto != NULL)
+            add_global(((global_var_reference_c *)(sendto->data_sink))->global_var_name);
+        }
+      }
+      current_access = NULL;
+
+      /* merge the groups of all programs that access any of the same variables... */
+      int index = programs.size();
+      programs.push_back(program);
+      parent.push_back(index);
+      for (std::set<std::string>::iterator key = access.begin(); key != access.end(); key++) {
+        std::map<std::string, int>::iterator owner = owners.find(*key);
+        if (owner == owners.end())
+          owners[*key] = index;
+        else
+          parent[find(index)] = find(owner->second);
+      }
+    }
+
+    /* Numbers the groups once all programs were added, in the order of their first program... */
+    void finish(void) {
+      std::map<int, int> numbers;
+      for (unsigned int i = 0; i < programs.size(); i++) {
+        int root = find(i);
+        if (numbers.find(root) == numbers.end()) {
+          int number = numbers.size();
+          numbers[root] = number;
+        }
+        program_group[programs[i]] = numbers[root];
+      }
+      group_count = numbers.size();
+    }
+
+    int count(void) {return group_count;}
+
+    /* Returns the group of a program, or -1 if it was not added to the analysis... */
+    int group(symbol_c *program) {
+      std::map<symbol_c *, int>::iterator iter = program_group.find(program);
+      return (iter == program_group.end()) ? -1 : iter->second;
+    }
+
+
+/********************************************/
+/* B.1.4.3   Declaration and initilization  */
+/********************************************/
+
+/*  [variable_name] location ':' located_var_spec_init */
+//SYM_REF3(located_var_decl_c, variable_name, location, located_var_spec_init)
+    void *visit(located_var_decl_c *symbol) {
+      if (!collecting_globals)
+        add_location(symbol->location);
+      return symbol->located_var_spec_init->accept(*this);
+    }
+
+/*  global_var_name ':' (simple_specification|subrange_specification|enumerated_specification|array_specification|prev_declared_structure_type_name|function_block_type_name */
+//SYM_REF2(external_declaration_c, global_var_name, specification)
+    void *visit(external_declaration_c *symbol) {
+      add_global(symbol->global_var_name);
+      return symbol->specification->accept(*this);
+    }
+
+/*| global_var_name location */
+//SYM_REF2(global_var_spec_c, global_var_name, location)
+    void *visit(global_var_spec_c *symbol) {
+      if (collecting_globals && symbol->global_var_name != NULL && symbol->location != NULL)
+        global_locations[upper(token_value(symbol->global_var_name))] =
+          upper(token_value(dynamic_cast<location_c *>(symbol->location)->direct_variable));
+      return NULL;
+    }
+
+/*********************/
+/* B 1.4 - Variables */
+/*********************/
+    /* Direct variables used in the body of a program or function block... */
+    void *visit(direct_variable_c *symbol) {
+      if (!collecting_globals && current_access != NULL)
+        add_direct_variable(symbol);
+      return NULL;
+    }
+
+    /* Any function block type referenced by the declarations is visited too, as the
+     * VAR_EXTERNAL declarations and the direct variables of its instances are accessed
+     * by the program...
+     */
+    void *visit(identifier_c *symbol) {
+      if (collecting_globals)
+        return NULL;
+      function_block_type_symtable_t::iterator iter = function_block_type_symtable.find(symbol);
+      if (iter == function_block_type_symtable.end())
+        return NULL;
+      std::string type_name = upper(symbol->value);
+      if (visited_fb_types.find(type_name) != visited_fb_types.end())
+        return NULL;
+      visited_fb_types.insert(type_name);
+      iter->second->var_declarations->accept(*this);
+      return iter->second->fblock_body->accept(*this);
+    }
+};
@@ -0,0 +1,387 @@
+//-----------------------------------------------------------------------------
+// Copyright 2026 agent
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file implements the debugger. It gives access to every variable of
+// the program listed on the symbol table that the glue generator builds from
+// VARIABLES.csv, not only the located ones. Variables are addressed by their
+// index on the table and can be read or forced in batches.
+//
+// Requests are handed over to the main loop, which services them right
+// after the program runs, so that all values in a batch come from the same
+// cycle and forcing never races with the program. Forcing follows the
+// accessor model: the force flag makes __SET_VAR skip the variable, and
+// located variables return their forced value from __GET_LOCATED. The
+// forced value of located variables is also copied to their location on
+// every cycle, so that forced outputs reach the I/O. Programs compiled with
+// iec2c -O d never check the force flags, so forcing is refused for them.
+//
+// Programs of periodic and event tasks run on their own threads, outside of
+// the main loop. Their located variables are read from the shared image,
+// and they can't be forced, as a task reads the forced values while it
+// runs. Their other variables are read while the task may be running, so a
+// batch of these is not bound to a single cycle of the task.
+// agent, Oct 2026
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ladder.h"
+
+#define DEBUG_MAX_FORCED        256
+#define DEBUG_TIMEOUT           1000 //ms
+
+#define DEBUG_IDLE              0
+#define DEBUG_PENDING           1
+#define DEBUG_DONE              2
+
+#define DEBUG_READ              0
+#define DEBUG_FORCE             1
+#define DEBUG_UNFORCE           2
+
+//Defined on the configuration by iec2c -O d, which drops the force checks
+//from the accessors. NULL for programs compiled without that option
+extern int config_forcing_disabled__ __attribute__((weak));
+
+struct debug_request
+{
+    int operation;
+    int count;
+    int indexes[DEBUG_MAX_BATCH];
+    unsigned char values[DEBUG_MAX_VALUES]; //forced values, or values read
+    int size;
+    uint64_t cycle;
+    bool failed; //set by the main loop if a force couldn't be done
+};
+
+//Only one request is handed to the main loop at a time. debugLock keeps
+//the clients in line, and the state tells who owns the request
+struct debug_request debug_request;
+int debug_request_state = DEBUG_IDLE;
+pthread_mutex_t debugLock = PTHREAD_MUTEX_INITIALIZER;
+
+//Located variables that are forced. Only touched by the main loop
+int forced_located[DEBUG_MAX_FORCED];
+int forced_located_count = 0;
+
+//-----------------------------------------------------------------------------
+// Returns a pointer to the current value of a variable
+//-----------------------------------------------------------------------------
+void *debugValue(struct debug_symbol *symbol)
+{
+    if (symbol->located) return sharedImageLocation(*(void **)symbol->value);
+    return symbol->value;
+}
+
+//-----------------------------------------------------------------------------
+// Forces a variable to the value given, or releases it if value is NULL.
+// Returns false if the variable can't be forced because DEBUG_MAX_FORCED
+// located variables are already forced. Must be called by the main loop
+//-----------------------------------------------------------------------------
+bool forceSymbol(int index, unsigned char *value)
+{
+    struct debug_symbol *symbol = &debug_symbols[index];
+    if (value != NULL)
+    {
+        if (symbol->located && !(*symbol->flags & DEBUG_FORCE_FLAG))
+        {
+            if (forced_located_count == DEBUG_MAX_FORCED) return false;
+            forced_located[forced_located_count++] = index;
+        }
+        //located variables keep their forced value apart, as their location
+        //can still be written by the I/O
+        memcpy(symbol->located ? symbol->forced_value : symbol->value, value, symbol->size);
+        *symbol->flags |= DEBUG_FORCE_FLAG;
+    }
+    else
+    {
+        *symbol->flags &= ~DEBUG_FORCE_FLAG;
+        for (int i = 0; i < forced_located_count; i++)
+        {
+            if (forced_located[i] == index)
+            {
+                forced_located[i] = forced_located[--forced_located_count];
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Returns true if there is room to force all located variables of the
+// request that are not forced yet
+//-----------------------------------------------------------------------------
+bool roomToForce(struct debug_request *request)
+{
+    int needed = 0;
+    for (int i = 0; i < request->count; i++)
+    {
+        struct debug_symbol *symbol = &debug_symbols[request->indexes[i]];
+        if (!symbol->located || (*symbol->flags & DEBUG_FORCE_FLAG)) continue;
+
+        //the same variable may be listed more than once
+        bool listed = false;
+        for (int j = 0; j < i && !listed; j++) listed = (request->indexes[j] == request->indexes[i]);
+        if (!listed) needed++;
+    }
+
+    return forced_located_count + needed <= DEBUG_MAX_FORCED;
+}
+
+//-----------------------------------------------------------------------------
+// Services the pending debugger request and copies the forced values of
+// located variables to their locations. Called by the main loop right after
+// the program runs, while it holds bufferLock
+//-----------------------------------------------------------------------------
+void serviceDebugRequests(uint64_t cycle)
+{
+    if (__atomic_load_n(&debug_request_state, __ATOMIC_ACQUIRE) == DEBUG_PENDING)
+    {
+        struct debug_request *request = &debug_request;
+        int size = 0;
+
+        //a force is done for the whole batch or not at all
+        request->failed = (request->operation == DEBUG_FORCE && !roomToForce(request));
+        for (int i = 0; !request->failed && i < request->count; i++)
+        {
+            struct debug_symbol *symbol = &debug_symbols[request->indexes[i]];
+            if (request->operation == DEBUG_READ)
+            {
+                request->values[size] = (*symbol->flags & DEBUG_FORCE_FLAG) ? 1 : 0;
+                memcpy(&request->values[size + 1], debugValue(symbol), symbol->size);
+                size += symbol->size + 1;
+            }
+            else if (request->operation == DEBUG_FORCE)
+            {
+                if (!forceSymbol(request->indexes[i], &request->values[size])) request->failed = true;
+                size += symbol->size;
+            }
+            else
+            {
+                forceSymbol(request->indexes[i], NULL);
+            }
+        }
+        request->size = size;
+        request->cycle = cycle;
+        __atomic_store_n(&debug_request_state, DEBUG_DONE, __ATOMIC_RELEASE);
+    }
+
+    for (int i = 0; i < forced_located_count; i++)
+    {
+        struct debug_symbol *symbol = &debug_symbols[forced_located[i]];
+        memcpy(debugValue(symbol), symbol->forced_value, symbol->size);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Hands the request over to the main loop and waits until it is serviced.
+// Returns false if the main loop doesn't service it in time. Must be called
+// with debugLock held
+//-----------------------------------------------------------------------------
+bool runDebugRequest()
+{
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    __atomic_store_n(&debug_request_state, DEBUG_PENDING, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&debug_request_state, __ATOMIC_ACQUIRE) != DEBUG_DONE)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (timespec_diff_ns(&now, &start) / 1000000 >= DEBUG_TIMEOUT)
+        {
+            //take the request back, unless the main loop just finished it
+            int expected = DEBUG_PENDING;
+            if (__atomic_compare_exchange_n(&debug_request_state, &expected, DEBUG_IDLE, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return false;
+            break;
+        }
+
+        struct image_snapshot *snapshot = acquireImageSnapshot();
+        uint64_t cycle = snapshot->cycle;
+        releaseImageSnapshot(snapshot);
+        waitImageSnapshot(cycle, 100);
+    }
+
+    __atomic_store_n(&debug_request_state, DEBUG_IDLE, __ATOMIC_RELAXED);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Parses a comma separated list of symbol indexes, terminated by ')' or the
+// end of the string. With values set, each index must be followed by '=' and
+// the value to be forced, as hex digits of the value's bytes in memory
+// order. Returns false if the list is invalid
+//-----------------------------------------------------------------------------
+bool parseDebugList(char *list, bool values, struct debug_request *request)
+{
+    request->count = 0;
+    request->size = 0;
+
+    char *p = list;
+    while (*p != ')' && *p != '\0')
+    {
+        char *end;
+        long index = strtol(p, &end, 10);
+        if (end == p || index < 0 || index >= debug_symbol_count) return false;
+        if (request->count == DEBUG_MAX_BATCH) return false;
+        request->indexes[request->count++] = index;
+        p = end;
+
+        if (values)
+        {
+            int size = debug_symbols[index].size;
+            if (*p != '=' || request->size + size > DEBUG_MAX_VALUES) return false;
+            p++;
+            for (int i = 0; i < size; i++)
+            {
+                unsigned int byte;
+                if (!isxdigit(p[0]) || !isxdigit(p[1]) || sscanf(p, "%2x", &byte) != 1) return false;
+                request->values[request->size++] = byte;
+                p += 2;
+            }
+        }
+
+        while (*p == ' ') p++;
+        if (*p == ',') p++;
+        else if (*p != ')' && *p != '\0') return false;
+        while (*p == ' ') p++;
+    }
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Reads the variables listed on the command into buffer, which must be at
+// least DEBUG_RESPONSE_SIZE bytes long. The response has a 32-bit size of
+// the rest of the response, the 64-bit scan cycle and, for each variable,
+// one byte that is 1 if the variable is forced followed by its value, all in
+// host byte order. Returns the size of the response, or -1 if the list is
+// invalid or the request times out
+//-----------------------------------------------------------------------------
+int readDebugSymbols(char *list, unsigned char *buffer)
+{
+    int count = -1;
+
+    pthread_mutex_lock(&debugLock);
+    struct debug_request *request = &debug_request;
+    if (parseDebugList(list, false, request))
+    {
+        int size = 0;
+        for (int i = 0; i < request->count; i++) size += debug_symbols[request->indexes[i]].size + 1;
+
+        request->operation = DEBUG_READ;
+        if (size <= DEBUG_MAX_VALUES && runDebugRequest())
+        {
+            uint32_t response_size = request->size + sizeof(request->cycle);
+            memcpy(buffer, &response_size, sizeof(response_size));
+            memcpy(buffer + sizeof(response_size), &request->cycle, sizeof(request->cycle));
+            memcpy(buffer + sizeof(response_size) + sizeof(request->cycle), request->values, request->size);
+            count = sizeof(response_size) + response_size;
+        }
+    }
+    pthread_mutex_unlock(&debugLock);
+
+    return count;
+}
+
+//-----------------------------------------------------------------------------
+// Returns true if the request lists any located variable of a task program.
+// These are bound to the image of their task, which runs on its own thread
+//-----------------------------------------------------------------------------
+bool hasTaskLocatedSymbols(struct debug_request *request)
+{
+    for (int i = 0; i < request->count; i++)
+    {
+        struct debug_symbol *symbol = &debug_symbols[request->indexes[i]];
+        if (symbol->located && debugValue(symbol) != *(void **)symbol->value)
+        {
+            unsigned char log_msg[1000];
+            sprintf(log_msg, "Located variables of programs bound to a task can't be forced\n");
+            logMessage(LOG_WARNING, LOG_INTERACTIVE, log_msg);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+// Forces the variables listed on the command to the values given, or
+// releases them if force is false. Returns false if the list is invalid,
+// the request times out, the program cannot be forced or too many located
+// variables would be forced
+//-----------------------------------------------------------------------------
+bool forceDebugSymbols(char *list, bool force)
+{
+    bool done = false;
+
+    if (force && &config_forcing_disabled__ != NULL)
+    {
+        unsigned char log_msg[1000];
+        sprintf(log_msg, "Forcing is disabled for programs compiled with direct variable access\n");
+        logMessage(LOG_WARNING, LOG_INTERACTIVE, log_msg);
+        return false;
+    }
+
+    pthread_mutex_lock(&debugLock);
+    struct debug_request *request = &debug_request;
+    if (parseDebugList(list, force, request) && (!force || !hasTaskLocatedSymbols(request)))
+    {
+        request->operation = force ? DEBUG_FORCE : DEBUG_UNFORCE;
+        done = runDebugRequest();
+        if (done && request->failed)
+        {
+            unsigned char log_msg[1000];
+            sprintf(log_msg, "Can't force more than %d located variables. Nothing was forced\n", DEBUG_MAX_FORCED);
+            logMessage(LOG_WARNING, LOG_INTERACTIVE, log_msg);
+            done = false;
+        }
+    }
+    pthread_mutex_unlock(&debugLock);
+
+    return done;
+}
+
+//-----------------------------------------------------------------------------
+// Lists the symbol table, one variable per line as index;type;size;name,
+// starting from the variable at *index. Advances *index past the variables
+// written and returns the number of bytes written, which is 0 once the
+// whole table has been listed
+//-----------------------------------------------------------------------------
+int listDebugSymbols(int *index, char *buffer, int buffer_size)
+{
+    int count = 0;
+    while (*index < debug_symbol_count)
+    {
+        struct debug_symbol *symbol = &debug_symbols[*index];
+        int length = snprintf(buffer + count, buffer_size - count, "%d;%s;%u;%s\n", *index, symbol->type,
+                              symbol->size, symbol->name);
+        if (length >= buffer_size - count) break;
+        count += length;
+        (*index)++;
+    }
+
+    return count;
+}
@@ -42,6 +42,7 @@
 #define MAX_64B_RANGE			8191
 
 #define OPLC_CYCLE              50000000
+#define SCAN_WAIT_TIMEOUT       100 //ms. Points are updated at least this often if the scan stops
 
 // Initial offset parameters (yurgen1975)
 int offset_di = 0;
@@ -49,6 +50,9 @@ int offset_do = 0;
 int offset_ai = 0;
 int offset_ao = 0;
 
+// Publish the points at the end of every scan instead of on a fixed timer
+bool publish_on_scan = false;
+
 using namespace std;
 using namespace opendnp3;
 using namespace openpal;
@@ -61,6 +65,24 @@ IEC_BOOL dnp3_coils[MAX_COILS];
 IEC_UINT dnp3_input_regs[MAX_INP_REGS];
 IEC_UINT dnp3_holding_regs[MAX_HOLD_REGS];
 
+// Last values pushed to the outstation, indexed by DNP3 point. Only points
+// that changed since then are applied on each update
+struct dnp3_shadow
+{
+    bool valid;
+    bool binary[MAX_DISCRETE_INPUT];
+    bool binary_output[MAX_COILS];
+    int analog[MAX_INP_REGS];
+    int analog_output[MAX_HOLD_REGS];
+} dnp3_shadow;
+
+// Analog deadbands from dnp3.cfg. Points with a negative deadband use the
+// default one
+int analog_deadband_default = 0;
+int analog_output_deadband_default = 0;
+int analog_deadband[MAX_INP_REGS];
+int analog_output_deadband[MAX_HOLD_REGS];
+
 
 // trim string from left
 static inline std::string &ltrim(std::string &s) {
@@ -82,6 +104,24 @@ static inline std::string &trim(std::string &s) {
 }
 
 
+//-----------------------------------------------------------------------------
+// Queues a command from the master to be applied to the I/O image at the
+// start of the next cycle
+//-----------------------------------------------------------------------------
+CommandStatus queueCommand(uint8_t area, uint16_t index, uint64_t mask, uint64_t value)
+{
+    struct image_write write;
+    write.area = area;
+    write.index = index;
+    write.mask = mask;
+    write.value = value;
+
+    if (!queueImageWrites(&write, 1))
+        return CommandStatus::TOO_MANY_OPS;
+
+    return CommandStatus::SUCCESS;
+}
+
 //-----------------------------------------------------------------------------
 // Class to handle commands from the master
 //-----------------------------------------------------------------------------
@@ -100,15 +140,9 @@ public:
             
            
         if(code == ControlCode::LATCH_ON || code == ControlCode::LATCH_OFF) {
-            return_val = CommandStatus::SUCCESS;
-
             IEC_BOOL crob_val = (code == ControlCode::LATCH_ON);
-                           
-            pthread_mutex_lock(&bufferLock);
-            if(bool_output[index/8][index%8] != NULL) {
-                *bool_output[index/8][index%8] = crob_val;
-            }
-            pthread_mutex_unlock(&bufferLock);
+
+            return_val = queueCommand(IMAGE_BOOL_OUTPUT, index/8, 1 << (index%8), crob_val << (index%8));
         }
         else {
             return_val = CommandStatus::NOT_SUPPORTED;
@@ -124,19 +158,13 @@ public:
     virtual CommandStatus Operate(const AnalogOutputInt16& command, uint16_t index, OperateType opType) {
         index = index + offset_ao;
         auto ao_val = command.value;
-        pthread_mutex_lock(&bufferLock);
-        if(index < MIN_16B_RANGE && int_output[index] != NULL) {
-            *int_output[index] = ao_val;
+        if(index < MIN_16B_RANGE) {
+            return queueCommand(IMAGE_INT_OUTPUT, index, 0xffff, (uint16_t)ao_val);
         }
-        else if(index < MAX_16B_RANGE && 
-                int_memory[index - MIN_16B_RANGE] != NULL) {
-            *int_memory[index - MIN_16B_RANGE] = ao_val;
+        else if(index <= MAX_16B_RANGE) {
+            return queueCommand(IMAGE_INT_MEMORY, index - MIN_16B_RANGE, 0xffff, (uint16_t)ao_val);
         }
-        else if(index > MAX_16B_RANGE) {
-            return CommandStatus::OUT_OF_RANGE;
-        }
-        pthread_mutex_unlock(&bufferLock);
-        return CommandStatus::SUCCESS;
+        return CommandStatus::OUT_OF_RANGE;
     }
 
     //AnalogOut 32 (Int)
@@ -149,13 +177,7 @@ public:
         if(index < MIN_32B_RANGE || index >= MAX_32B_RANGE)
             return CommandStatus::OUT_OF_RANGE;
         
-        pthread_mutex_lock(&bufferLock);
-        if(dint_memory[index - MIN_32B_RANGE] != NULL) {
-            *dint_memory[index - MIN_32B_RANGE] = ao_val;
-        }
-        pthread_mutex_unlock(&bufferLock);
-
-        return CommandStatus::SUCCESS;
+        return queueCommand(IMAGE_DINT_MEMORY, index - MIN_32B_RANGE, 0xffffffff, (uint32_t)(IEC_DINT)ao_val);
     }
 
     //AnalogOut 32 (Float)
@@ -169,13 +191,7 @@ public:
         if(index < MIN_32B_RANGE || index >= MAX_32B_RANGE)
             return CommandStatus::OUT_OF_RANGE;
         
-        pthread_mutex_lock(&bufferLock);
-        if(dint_memory[index - MIN_32B_RANGE] != NULL) {
-            *dint_memory[index - MIN_32B_RANGE] = ao_val;
-        }
-        pthread_mutex_unlock(&bufferLock);
-
-        return CommandStatus::SUCCESS;
+        return queueCommand(IMAGE_DINT_MEMORY, index - MIN_32B_RANGE, 0xffffffff, (uint32_t)(IEC_DINT)ao_val);
     }
 
     //AnalogOut 64
@@ -188,13 +204,7 @@ public:
         if(index < MIN_64B_RANGE || index >= MAX_64B_RANGE)
             return CommandStatus::OUT_OF_RANGE;
         
-        pthread_mutex_lock(&bufferLock);
-        if(lint_memory[index - MIN_64B_RANGE] != NULL) {
-            *lint_memory[index - MIN_64B_RANGE] = ao_val;
-        }
-        pthread_mutex_unlock(&bufferLock);
-
-        return CommandStatus::SUCCESS;
+        return queueCommand(IMAGE_LINT_MEMORY, index - MIN_64B_RANGE, 0xffffffffffffffffULL, (uint64_t)(IEC_LINT)ao_val);
     }
 protected:
     void Start() final {}
@@ -202,58 +212,118 @@ protected:
 };
 
 //------------------------------------------------------------------
-// Function to update DNP3 values every time they may have changed
+// Checks if an analog point moved more than its deadband away from the
+// last value pushed to the outstation
+//------------------------------------------------------------------
+static inline bool analogChanged(int value, int last, int deadband, int default_deadband) {
+    if (deadband < 0) deadband = default_deadband;
+    return llabs((long long)value - last) > deadband;
+}
+
+//------------------------------------------------------------------
+// Function to update DNP3 values every time they may have changed.
+// Only points that changed since the last update are applied, except on
+// the first update after the outstation is started. Points carry the time
+// of the scan that produced them. Returns the cycle of the scan
 // Updated by Yurgen1975 to support slave devices: DI/DO address 800 and AI/AO address 100
 //------------------------------------------------------------------
-void update_vals(std::shared_ptr<IOutstation> outstation){
+uint64_t update_vals(std::shared_ptr<IOutstation> outstation){
     UpdateBuilder builder;
+    bool all = !dnp3_shadow.valid;
+    bool changed = false;
+    struct image_snapshot *snapshot = acquireImageSnapshot();
+    uint64_t cycle = snapshot->cycle;
+    DNPTime time(snapshot->time.tv_sec * 1000ULL + snapshot->time.tv_nsec / 1000000);
+    Flags online(0x01);
+
     // Update Discrete input (Binary input) - changed to support offsets (yurgen1975)
     for(int i = offset_di; i < MAX_DISCRETE_INPUT; i++) {
-        builder.Update(Binary((bool)(*bool_input[i/8][i%8])), i-offset_di);
+        int index = i - offset_di;
+        bool value = snapshot->bool_input[i/8][i%8];
+        if (all || value != dnp3_shadow.binary[index]) {
+            builder.Update(Binary(value, online, time), index);
+            dnp3_shadow.binary[index] = value;
+            changed = true;
+        }
     }
 
     // Update Coils (Binary Output) - changed to support offsets (yurgen1975)
     for(int i = offset_do; i < MAX_COILS; i++) {
-        builder.Update(BinaryOutputStatus((bool)(*bool_output[i/8][i%8])), i-offset_do);
+        int index = i - offset_do;
+        bool value = snapshot->bool_output[i/8][i%8];
+        if (all || value != dnp3_shadow.binary_output[index]) {
+            builder.Update(BinaryOutputStatus(value, online, time), index);
+            dnp3_shadow.binary_output[index] = value;
+            changed = true;
+        }
     }    
 
     // Update Input Registers (Analog Input) - changed to support offsets (yurgen1975)
     for (int i = offset_ai; i < MAX_INP_REGS; i++) {
-        builder.Update(Analog((int)(*int_input[i])), i-offset_ai);
+        int index = i - offset_ai;
+        int value = (int)snapshot->int_input[i];
+        if (all || analogChanged(value, dnp3_shadow.analog[index], analog_deadband[index], analog_deadband_default)) {
+            builder.Update(Analog(value, online, time), index);
+            dnp3_shadow.analog[index] = value;
+            changed = true;
+        }
     }
     
     // Update Holding Registers (Analog Output) - changed to support offsets (yurgen1975)
     for (int i = offset_ao; i < MIN_16B_RANGE; i++) {
-        builder.Update(AnalogOutputStatus((int)(*int_output[i])), i-offset_ao);
+        int index = i - offset_ao;
+        int value = (int)snapshot->int_output[i];
+        if (all || analogChanged(value, dnp3_shadow.analog_output[index], analog_output_deadband[index], analog_output_deadband_default)) {
+            builder.Update(AnalogOutputStatus(value, online, time), index);
+            dnp3_shadow.analog_output[index] = value;
+            changed = true;
+        }
     }
     // Update Holding registers for memory
     for (int i = MIN_16B_RANGE; i < MAX_16B_RANGE; i++) {
-        if(int_memory[i - MIN_16B_RANGE] != NULL)
-            builder.Update(
-                    AnalogOutputStatus((int)(*int_memory[i - MIN_16B_RANGE])),
-                    i
-            );
+        if(int_memory[i - MIN_16B_RANGE] != NULL) {
+            int value = (int)snapshot->int_memory[i - MIN_16B_RANGE];
+            if (all || analogChanged(value, dnp3_shadow.analog_output[i], analog_output_deadband[i], analog_output_deadband_default)) {
+                builder.Update(AnalogOutputStatus(value, online, time), i);
+                dnp3_shadow.analog_output[i] = value;
+                changed = true;
+            }
+        }
     } 
     // Update Holding registers for 32 b memory
-    for (int i = MIN_32B_RANGE; i < MAX_32B_RANGE; i++) {
-        if(dint_memory[i - MIN_32B_RANGE] != NULL)
-            builder.Update(
-                    AnalogOutputStatus((int)(*dint_memory[i - MIN_32B_RANGE])),
-                    i
-            );
+    for (int i = MIN_32B_RANGE; 
+         (i < MAX_32B_RANGE && i - MIN_32B_RANGE < BUFFER_SIZE); 
+         i++) {
+        if(dint_memory[i - MIN_32B_RANGE] != NULL) {
+            int value = (int)snapshot->dint_memory[i - MIN_32B_RANGE];
+            if (all || analogChanged(value, dnp3_shadow.analog_output[i], analog_output_deadband[i], analog_output_deadband_default)) {
+                builder.Update(AnalogOutputStatus(value, online, time), i);
+                dnp3_shadow.analog_output[i] = value;
+                changed = true;
+            }
+        }
     } 
     // Update Holding registers for 64 b memory
     for (int i = MIN_64B_RANGE; 
-         (i < MAX_64B_RANGE && 
-            i - MIN_64B_RANGE < sizeof(lint_memory) / sizeof(lint_memory[0])); 
+         (i < MAX_64B_RANGE && i - MIN_64B_RANGE < BUFFER_SIZE); 
          i++) {
-        if(lint_memory[i - MIN_64B_RANGE] != NULL)
-            builder.Update(
-                    AnalogOutputStatus((int)(*lint_memory[i - MIN_64B_RANGE])),
-                    i
-            );
+        if(lint_memory[i - MIN_64B_RANGE] != NULL) {
+            int value = (int)snapshot->lint_memory[i - MIN_64B_RANGE];
+            if (all || analogChanged(value, dnp3_shadow.analog_output[i], analog_output_deadband[i], analog_output_deadband_default)) {
+                builder.Update(AnalogOutputStatus(value, online, time), i);
+                dnp3_shadow.analog_output[i] = value;
+                changed = true;
+            }
+        }
     } 
-    outstation->Apply(builder.Build());
+
+    releaseImageSnapshot(snapshot);
+    dnp3_shadow.valid = true;
+
+    if (changed)
+        outstation->Apply(builder.Build());
+
+    return cycle;
 }
 
 //----------------------------------------------------------------------
@@ -297,6 +367,10 @@ OutstationStackConfig parseDNP3Config() {
     string line;
     ifstream cfgfile("dnp3.cfg");
     OutstationStackConfig config = create_config();
+
+    for (int i = 0; i < MAX_INP_REGS; i++) analog_deadband[i] = -1;
+    for (int i = 0; i < MAX_HOLD_REGS; i++) analog_output_deadband[i] = -1;
+
     if(cfgfile.is_open()) {
         while (getline(cfgfile, line)) {
             if (line[0] == '#')
@@ -328,6 +402,10 @@ OutstationStackConfig parseDNP3Config() {
                         config.outstation.params.allowUnsolicited = true;
                     else
                         config.outstation.params.allowUnsolicited = false;
+                } else if (token == "publish_on_scan") {
+                    getline(iss, token, '=');
+                    token = trim(token);
+                    publish_on_scan = (token == "True");
                 } else if (token == "select_timeout") {
                     getline(iss, token, '=');     
                     config.outstation.params.selectTimeout = 
@@ -367,6 +445,30 @@ OutstationStackConfig parseDNP3Config() {
                     offset_ao = atoi(token.c_str());
 // -------------------------------------------------------------------
 
+                } else if (token.compare(0, 22, "analog_output_deadband") == 0) {
+                    // analog_output_deadband sets the default, while
+                    // analog_output_deadband[index] sets a single point
+                    size_t bracket = token.find('[');
+                    getline(iss, token, '=');
+                    if (bracket == string::npos) {
+                        analog_output_deadband_default = atoi(token.c_str());
+                    } else {
+                        int index = atoi(line.c_str() + line.find('[') + 1);
+                        if (index >= 0 && index < MAX_HOLD_REGS)
+                            analog_output_deadband[index] = atoi(token.c_str());
+                    }
+                } else if (token.compare(0, 15, "analog_deadband") == 0) {
+                    // analog_deadband sets the default, while
+                    // analog_deadband[index] sets a single point
+                    size_t bracket = token.find('[');
+                    getline(iss, token, '=');
+                    if (bracket == string::npos) {
+                        analog_deadband_default = atoi(token.c_str());
+                    } else {
+                        int index = atoi(line.c_str() + line.find('[') + 1);
+                        if (index >= 0 && index < MAX_INP_REGS)
+                            analog_deadband[index] = atoi(token.c_str());
+                    }
                 } else if (token == "sol_confirm_timeout") {
                     getline(iss, token, '=');     
                     config.outstation.params.solConfirmTimeout =
@@ -447,16 +549,29 @@ void dnp3StartServer(int port) {
 
     mapUnusedIO();
 
+    // The new outstation starts with an empty database, so the first update
+    // must push every point
+    dnp3_shadow.valid = false;
+
     // Continuously update
     struct timespec timer_start;
     clock_gettime(CLOCK_MONOTONIC, &timer_start);
+    uint64_t last_cycle = 0;
     
     while(run_dnp3) 
     {
-        pthread_mutex_lock(&bufferLock);
-        update_vals(outstation);
-        pthread_mutex_unlock(&bufferLock);
-        sleep_until(&timer_start, OPLC_CYCLE);
+        if (publish_on_scan)
+        {
+            // Wake up at the end of each scan. The timeout keeps the points
+            // fresh if the scan stops, and lets the thread see run_dnp3
+            waitImageSnapshot(last_cycle, SCAN_WAIT_TIMEOUT);
+            last_cycle = update_vals(outstation);
+        }
+        else
+        {
+            last_cycle = update_vals(outstation);
+            sleep_until(&timer_start, OPLC_CYCLE);
+        }
     }
     
     printf("Shutting down DNP3 server\n");
@@ -48,13 +48,65 @@ IEC_UINT *int_memory[BUFFER_SIZE];
 IEC_DINT *dint_memory[BUFFER_SIZE];
 IEC_LINT *lint_memory[BUFFER_SIZE];
 
+//Special Functions
+IEC_LINT *special_functions[BUFFER_SIZE];
+
+//Contiguous I/O image. The located variables are stored directly on these
+//arrays so that the runtime can move whole blocks of the image at once
+#define IMAGE_ALIGN		__attribute__((aligned(64)))
+
+IEC_BOOL bool_input_image[BUFFER_SIZE][8] IMAGE_ALIGN;
+IEC_BOOL bool_output_image[BUFFER_SIZE][8] IMAGE_ALIGN;
+IEC_BYTE byte_input_image[BUFFER_SIZE] IMAGE_ALIGN;
+IEC_BYTE byte_output_image[BUFFER_SIZE] IMAGE_ALIGN;
+IEC_UINT int_input_image[BUFFER_SIZE] IMAGE_ALIGN;
+IEC_UINT int_output_image[BUFFER_SIZE] IMAGE_ALIGN;
+IEC_LINT special_functions_image[BUFFER_SIZE] IMAGE_ALIGN;
+
+//Memory image. It is kept on pages of its own, so that the persistent
+//storage can map it to a file
+struct retain_image
+{
+	IEC_UINT int_memory[BUFFER_SIZE];
+	IEC_DINT dint_memory[BUFFER_SIZE];
+	IEC_LINT lint_memory[BUFFER_SIZE];
+} __attribute__((aligned(4096)));
+
+struct retain_image retain_image;
+#define int_memory_image retain_image.int_memory
+#define dint_memory_image retain_image.dint_memory
+#define lint_memory_image retain_image.lint_memory
+
+//Private image of a task that runs on a thread of its own. See
+//bindLocatedVars()
+struct task_image
+{
+	IEC_BOOL bool_input[BUFFER_SIZE][8];
+	IEC_BOOL bool_output[BUFFER_SIZE][8];
+	IEC_BYTE byte_input[BUFFER_SIZE];
+	IEC_BYTE byte_output[BUFFER_SIZE];
+	IEC_UINT int_input[BUFFER_SIZE];
+	IEC_UINT int_output[BUFFER_SIZE];
+	IEC_UINT int_memory[BUFFER_SIZE];
+	IEC_DINT dint_memory[BUFFER_SIZE];
+	IEC_LINT lint_memory[BUFFER_SIZE];
+	IEC_LINT special_functions[BUFFER_SIZE];
+};
+
+//Symbol table used by the debugger. For located and external variables,
+//value points to the variable's pointer and forced_value holds the value
+//used while the variable is forced
+struct debug_symbol
+{
+	const char *name;
+	const char *type;
+	unsigned int size;
+	bool located;
+	void *value;
+	IEC_BYTE *flags;
+	void *forced_value;
+};
 
-#define __LOCATED_VAR(type, name, ...) type __##name;
-#include "LOCATED_VARIABLES.h"
-#undef __LOCATED_VAR
-#define __LOCATED_VAR(type, name, ...) type* name = &__##name;
-#include "LOCATED_VARIABLES.h"
-#undef __LOCATED_VAR
 
 void glueVars()
 {
@@ -69,4 +121,17 @@ void updateTime()
 		__CURRENT_TIME.tv_nsec -= 1000000000;
 		__CURRENT_TIME.tv_sec += 1;
 	}
-}
\ No newline at end of file
+}
+
+void bindLocatedVars(struct task_image *image)
+{
+	if (image == NULL)
+	{
+	}
+	else
+	{
+	}
+}
+
+struct debug_symbol *debug_symbols = NULL;
+int debug_symbol_count = 0;
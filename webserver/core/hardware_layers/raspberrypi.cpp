@@ -43,6 +43,8 @@
 #define MAX_OUTPUT 		11
 #define MAX_ANALOG_OUT	1
 
+#define INPUT_POLL_PERIOD	1 //ms. Used for event tasks when pin interrupts are not available
+
 /********************I/O PINS CONFIGURATION*********************
  * A good source for RaspberryPi I/O pins information is:
  * http://pinout.xyz
@@ -62,13 +64,66 @@ int outBufferPinMask[MAX_OUTPUT] =	{ 15, 16, 4, 5, 6, 10, 11, 26, 27, 28, 29 };
 //output of the RaspberryPi
 int analogOutBufferPinMask[MAX_ANALOG_OUT] = { 1 };
 
+//-----------------------------------------------------------------------------
+// Called by wiringPi when an input pin changes. Makes the main loop read the
+// inputs right away, so that event tasks react to the edge
+//-----------------------------------------------------------------------------
+void inputChanged()
+{
+	requestScan();
+}
+
+//-----------------------------------------------------------------------------
+// Thread that watches the input pins when their interrupts could not be set
+// up. Makes the main loop read the inputs as soon as one of them changes
+//-----------------------------------------------------------------------------
+bool poll_inputs = false;
+pthread_t input_poll_thread;
+
+void *pollInputs(void *arg)
+{
+	int last_value[MAX_INPUT];
+	for (int i = 0; i < MAX_INPUT; i++)
+	{
+	    last_value[i] = digitalRead(inBufferPinMask[i]);
+	}
+
+	while (run_openplc)
+	{
+		bool changed = false;
+		for (int i = 0; i < MAX_INPUT; i++)
+		{
+		    if (pinNotPresent(ignored_bool_inputs, ARRAY_SIZE(ignored_bool_inputs), i))
+		    {
+			    int value = digitalRead(inBufferPinMask[i]);
+			    if (value != last_value[i]) changed = true;
+			    last_value[i] = value;
+		    }
+		}
+		if (changed) requestScan();
+		sleepms(INPUT_POLL_PERIOD);
+	}
+
+	return NULL;
+}
+
 //-----------------------------------------------------------------------------
 // This function is called by the main OpenPLC routine when it is initializing.
 // Hardware initialization procedures should be here.
 //-----------------------------------------------------------------------------
 void initializeHardware()
 {
-	wiringPiSetup();
+	unsigned char log_msg[1000];
+
+	//make wiringPi return its errors instead of exiting, so that a pin
+	//interrupt that can't be set up falls back to polling
+	setenv("WIRINGPI_CODES", "1", 1);
+	if (wiringPiSetup() < 0)
+	{
+		sprintf(log_msg, "Failed to initialize wiringPi\n");
+		log(log_msg);
+		exit(1);
+	}
 	//piHiPri(99);
 
 	//set pins as input
@@ -81,9 +136,18 @@ void initializeHardware()
 		    {
 			    pullUpDnControl(inBufferPinMask[i], PUD_DOWN); //pull down enabled
 		    }
+		    if (event_task_count > 0 && !poll_inputs && wiringPiISR(inBufferPinMask[i], INT_EDGE_BOTH, &inputChanged) < 0)
+		    {
+			    sprintf(log_msg, "Interrupts are not available on input pin %d. Polling the inputs every %d ms\n",
+			            inBufferPinMask[i], INPUT_POLL_PERIOD);
+			    log(log_msg);
+			    poll_inputs = true;
+		    }
 	    }
 	}
 
+	if (poll_inputs) pthread_create(&input_poll_thread, NULL, pollInputs, NULL);
+
 	//set pins as output
 	for (int i = 0; i < MAX_OUTPUT; i++)
 	{
@@ -105,6 +169,7 @@ void initializeHardware()
 //-----------------------------------------------------------------------------
 void finalizeHardware()
 {
+	if (poll_inputs) pthread_join(input_poll_thread, NULL);
 }
 
 //-----------------------------------------------------------------------------
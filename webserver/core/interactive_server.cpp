@@ -46,8 +46,6 @@ bool run_enip = 0;
 uint16_t enip_port = 44818;
 bool run_pstorage = 0;
 uint16_t pstorage_polling = 10;
-unsigned char server_command[1024];
-int command_index = 0;
 bool processing_command = 0;
 time_t start_time;
 time_t end_time;
@@ -88,6 +86,7 @@ void *enipThread(void *arg)
 void *pstorageThread(void *arg)
 {
     startPstorage();
+    return NULL;
 }
 
 //-----------------------------------------------------------------------------
@@ -199,19 +198,34 @@ int listenToClient_interactive(int client_fd, unsigned char *buffer)
 }
 
 //-----------------------------------------------------------------------------
-// Process client's commands for the interactive server
+// Process client's commands for the interactive server. monitor is the
+// monitor list of the connection, created by its first monitor command
 //-----------------------------------------------------------------------------
-void processCommand(unsigned char *buffer, int client_fd)
+void processCommand(unsigned char *buffer, int client_fd, struct monitor_list **monitor)
 {
     unsigned char log_msg[1000];
     int count_char = 0;
     
-    if (processing_command)
+    //the monitor and debugger commands have locks of their own, so they are
+    //not held back by the other commands
+    bool own_lock = (strncmp(buffer, "monitor_", 8) == 0 || strncmp(buffer, "debug_", 6) == 0);
+    if (processing_command && !own_lock)
     {
         count_char = sprintf(buffer, "Processing command...\n");
         write(client_fd, buffer, count_char);
         return;
     }
+
+    if (strncmp(buffer, "monitor_", 8) == 0 && *monitor == NULL)
+    {
+        *monitor = createMonitorList();
+        if (*monitor == NULL)
+        {
+            count_char = sprintf(buffer, "Error: out of memory\n");
+            write(client_fd, buffer, count_char);
+            return;
+        }
+    }
     
     if (strncmp(buffer, "quit()", 6) == 0)
     {
@@ -351,9 +365,31 @@ void processCommand(unsigned char *buffer, int client_fd)
             sprintf(log_msg, "Persistent Storage server already active. Changing polling rate to: %d\n", pstorage_polling);
             log(log_msg);
         }
-        //Start Enip server
-        run_pstorage = 1;
-        pthread_create(&pstorage_thread, NULL, pstorageThread, NULL);
+        pstorage_use_map = false;
+        if (!run_pstorage)
+        {
+            run_pstorage = 1;
+            pthread_create(&pstorage_thread, NULL, pstorageThread, NULL);
+        }
+        processing_command = false;
+    }
+    else if (strncmp(buffer, "start_pstorage_mapped(", 22) == 0)
+    {
+        processing_command = true;
+        pstorage_polling = readCommandArgument(buffer);
+        sprintf(log_msg, "Issued start_pstorage_mapped() command with checkpoints every %d seconds\n", pstorage_polling);
+        log(log_msg);
+        pstorage_use_map = true;
+        if (run_pstorage)
+        {
+            sprintf(log_msg, "Persistent Storage server already active. Switching to the memory map with polling rate of: %d\n", pstorage_polling);
+            log(log_msg);
+        }
+        else
+        {
+            run_pstorage = 1;
+            pthread_create(&pstorage_thread, NULL, pstorageThread, NULL);
+        }
         processing_command = false;
     }
     else if (strncmp(buffer, "stop_pstorage()", 15) == 0)
@@ -364,6 +400,7 @@ void processCommand(unsigned char *buffer, int client_fd)
         if (run_pstorage)
         {
             run_pstorage = 0;
+            pthread_join(pstorage_thread, NULL);
             sprintf(log_msg, "Persistent Storage thread was stopped\n");
             log(log_msg);
         }
@@ -373,10 +410,118 @@ void processCommand(unsigned char *buffer, int client_fd)
     {
         processing_command = true;
         printf("Issued runtime_logs() command\n");
-        write(client_fd, log_buffer, log_index);
+        char logs[16384];
+        uint64_t cursor = 0;
+        while ((count_char = readLogHistory(&cursor, false, logs, sizeof(logs))) > 0)
+        {
+            write(client_fd, logs, count_char);
+        }
+        //the logs can take many writes. Closing our side of the connection
+        //tells the client where they end
+        shutdown(client_fd, SHUT_WR);
         processing_command = false;
         return;
     }
+    else if (strncmp(buffer, "runtime_logs(", 13) == 0)
+    {
+        //incremental read. Sends every message from the cursor on, one per
+        //line, followed by the cursor to be used on the next call
+        processing_command = true;
+        char logs[16384];
+        uint64_t cursor = strtoull((char *)buffer + 13, NULL, 10);
+        while ((count_char = readLogHistory(&cursor, true, logs, sizeof(logs))) > 0)
+        {
+            write(client_fd, logs, count_char);
+        }
+        count_char = sprintf(logs, "cursor %llu dropped %llu\n", (unsigned long long)cursor,
+                             (unsigned long long)droppedLogMessages());
+        write(client_fd, logs, count_char);
+        processing_command = false;
+        return;
+    }
+    else if (strncmp(buffer, "monitor_add(", 12) == 0)
+    {
+        //monitor commands only touch the monitor list of the connection, so
+        //they don't hold other commands back
+        if (!addMonitorPoints(*monitor, (char *)buffer + 12))
+        {
+            count_char = sprintf(buffer, "Error: invalid location or too many locations\n");
+            write(client_fd, buffer, count_char);
+            return;
+        }
+    }
+    else if (strncmp(buffer, "monitor_clear()", 15) == 0)
+    {
+        clearMonitorPoints(*monitor);
+    }
+    else if (strncmp(buffer, "monitor_read(", 13) == 0)
+    {
+        unsigned char response[MONITOR_RESPONSE_SIZE];
+        uint64_t last_cycle = strtoull((char *)buffer + 13, NULL, 10);
+        count_char = readMonitorPoints(*monitor, last_cycle, response);
+        write(client_fd, response, count_char);
+        return;
+    }
+    else if (strncmp(buffer, "debug_symbols()", 15) == 0)
+    {
+        char symbols[16384];
+        int index = 0;
+        while ((count_char = listDebugSymbols(&index, symbols, sizeof(symbols))) > 0)
+        {
+            write(client_fd, symbols, count_char);
+        }
+        count_char = sprintf(symbols, "END\n");
+        write(client_fd, symbols, count_char);
+        return;
+    }
+    else if (strncmp(buffer, "debug_read(", 11) == 0)
+    {
+        unsigned char response[DEBUG_RESPONSE_SIZE];
+        count_char = readDebugSymbols((char *)buffer + 11, response);
+        if (count_char < 0)
+        {
+            count_char = sprintf(buffer, "Error: invalid symbol or runtime not responding\n");
+            write(client_fd, buffer, count_char);
+            return;
+        }
+        write(client_fd, response, count_char);
+        return;
+    }
+    else if (strncmp(buffer, "debug_force(", 12) == 0 || strncmp(buffer, "debug_unforce(", 14) == 0)
+    {
+        bool force = (buffer[6] == 'f');
+        snprintf((char *)log_msg, sizeof(log_msg), "Issued %s\n", buffer);
+        if (!forceDebugSymbols((char *)buffer + (force ? 12 : 14), force))
+        {
+            count_char = sprintf(buffer, "Error: invalid symbol, too many forced variables or runtime not responding\n");
+            write(client_fd, buffer, count_char);
+            return;
+        }
+        log(log_msg);
+    }
+    else if (strncmp(buffer, "start_log_file(", 15) == 0)
+    {
+        processing_command = true;
+        int max_size = readCommandArgument(buffer);
+        if (max_size <= 0 || !startLogFile((long)max_size * 1024))
+        {
+            count_char = sprintf(buffer, "Error: could not open the log file\n");
+            write(client_fd, buffer, count_char);
+            processing_command = false;
+            return;
+        }
+        sprintf(log_msg, "Issued start_log_file() command. Log file rotated at %d KB\n", max_size);
+        log(log_msg);
+        processing_command = false;
+    }
+    else if (strncmp(buffer, "stop_log_file()", 15) == 0)
+    {
+        processing_command = true;
+        sprintf(log_msg, "Issued stop_log_file() command\n");
+        log(log_msg);
+        stopLogFile();
+        processing_command = false;
+    }
     else if (strncmp(buffer, "exec_time()", 11) == 0)
     {
         processing_command = true;
@@ -386,6 +531,105 @@ void processCommand(unsigned char *buffer, int client_fd)
         processing_command = false;
         return;
     }
+    else if (strncmp(buffer, "overrun_policy(", 15) == 0)
+    {
+        processing_command = true;
+        int policy = readCommandArgument(buffer);
+        if (policy < OVERRUN_CATCHUP || policy > OVERRUN_WATCHDOG)
+        {
+            count_char = sprintf(buffer, "Error: invalid overrun policy\n");
+            write(client_fd, buffer, count_char);
+            processing_command = false;
+            return;
+        }
+        overrun_policy = policy;
+        sprintf(log_msg, "Issued overrun_policy() command. Scan overrun policy set to: %d\n", overrun_policy);
+        log(log_msg);
+        processing_command = false;
+    }
+    else if (strncmp(buffer, "overrun_limit(", 14) == 0)
+    {
+        processing_command = true;
+        int limit = readCommandArgument(buffer);
+        if (limit <= 0)
+        {
+            count_char = sprintf(buffer, "Error: invalid overrun limit\n");
+            write(client_fd, buffer, count_char);
+            processing_command = false;
+            return;
+        }
+        overrun_limit = limit;
+        sprintf(log_msg, "Issued overrun_limit() command. Scan overrun limit set to: %d cycles\n", overrun_limit);
+        log(log_msg);
+        processing_command = false;
+    }
+    else if (strncmp(buffer, "reset_watchdog()", 16) == 0)
+    {
+        processing_command = true;
+        sprintf(log_msg, "Issued reset_watchdog() command\n");
+        log(log_msg);
+        watchdog_fault = false;
+        processing_command = false;
+    }
+    else if (strncmp(buffer, "server_workers(", 15) == 0)
+    {
+        processing_command = true;
+        int workers = readCommandArgument(buffer);
+        if (workers < 1 || workers > MAX_SERVER_WORKERS)
+        {
+            count_char = sprintf(buffer, "Error: invalid number of workers. Must be between 1 and %d\n", MAX_SERVER_WORKERS);
+            write(client_fd, buffer, count_char);
+            processing_command = false;
+            return;
+        }
+        server_workers = workers;
+        sprintf(log_msg, "Issued server_workers() command. Server workers set to: %d\n", server_workers);
+        log(log_msg);
+        processing_command = false;
+    }
+    else if (strncmp(buffer, "server_max_connections(", 23) == 0)
+    {
+        processing_command = true;
+        int connections = readCommandArgument(buffer);
+        if (connections < 1 || connections > MAX_SERVER_CONNECTIONS)
+        {
+            count_char = sprintf(buffer, "Error: invalid connection limit. Must be between 1 and %d\n", MAX_SERVER_CONNECTIONS);
+            write(client_fd, buffer, count_char);
+            processing_command = false;
+            return;
+        }
+        server_max_connections = connections;
+        sprintf(log_msg, "Issued server_max_connections() command. Connection limit set to: %d\n", server_max_connections);
+        log(log_msg);
+        processing_command = false;
+    }
+    else if (strncmp(buffer, "server_stats()", 14) == 0)
+    {
+        processing_command = true;
+        char stats[16384];
+        count_char = getServerStats(stats, sizeof(stats));
+        write(client_fd, stats, count_char);
+        processing_command = false;
+        return;
+    }
+    else if (strncmp(buffer, "scan_stats()", 12) == 0)
+    {
+        processing_command = true;
+        char stats[2048];
+        count_char = getScanStats(stats, sizeof(stats));
+        write(client_fd, stats, count_char);
+        processing_command = false;
+        return;
+    }
+    else if (strncmp(buffer, "task_stats()", 12) == 0)
+    {
+        processing_command = true;
+        char stats[4096];
+        count_char = getTaskStats(stats, sizeof(stats));
+        write(client_fd, stats, count_char);
+        processing_command = false;
+        return;
+    }
     else
     {
         processing_command = true;
@@ -400,21 +644,25 @@ void processCommand(unsigned char *buffer, int client_fd)
 }
 
 //-----------------------------------------------------------------------------
-// Process client's request
+// Process client's request. Each connection has its own command buffer, as
+// the monitor and debugger commands run while other clients send theirs, and
+// its own monitor list
 //-----------------------------------------------------------------------------
-void processMessage_interactive(unsigned char *buffer, int bufferSize, int client_fd)
+void processMessage_interactive(unsigned char *buffer, int bufferSize, int client_fd,
+                                unsigned char *command, int *command_index, struct monitor_list **monitor)
 {
     for (int i = 0; i < bufferSize; i++)
     {
-        if (buffer[i] == '\r' || buffer[i] == '\n' || command_index >= 1024)
+        if (buffer[i] == '\r' || buffer[i] == '\n' || *command_index >= 1024)
         {
-            processCommand(server_command, client_fd);
-            command_index = 0;
+            processCommand(command, client_fd, monitor);
+            *command_index = 0;
+            command[0] = '\0';
             break;
         }
-        server_command[command_index] = buffer[i];
-        command_index++;
-        server_command[command_index] = '\0';
+        command[*command_index] = buffer[i];
+        (*command_index)++;
+        command[*command_index] = '\0';
     }
 }
 
@@ -423,8 +671,11 @@ void processMessage_interactive(unsigned char *buffer, int bufferSize, int clien
 //-----------------------------------------------------------------------------
 void *handleConnections_interactive(void *arguments)
 {
-    int client_fd = *(int *)arguments;
+    int client_fd = (int)(intptr_t)arguments;
     unsigned char buffer[1024];
+    unsigned char command[1025];
+    int command_index = 0;
+    struct monitor_list *monitor = NULL;
     int messageSize;
 
     printf("Interactive Server: Thread created for client ID: %d\n", client_fd);
@@ -449,8 +700,9 @@ void *handleConnections_interactive(void *arguments)
             break;
         }
 
-        processMessage_interactive(buffer, messageSize, client_fd);
+        processMessage_interactive(buffer, messageSize, client_fd, command, &command_index, &monitor);
     }
+    deleteMonitorList(monitor);
     //printf("Debug: Closing client socket and calling pthread_exit in interactive_server.cpp\n");
     closeSocket(client_fd);
     printf("Terminating interactive server connections\r\n");
@@ -479,13 +731,13 @@ void startInteractiveServer(int port)
 
         else
         {
-            int arguments[1];
             pthread_t thread;
             int ret = -1;
 
+            //the descriptor is passed by value, as the next client may be
+            //accepted before the thread starts
             printf("Interactive Server: Client accepted! Creating thread for the new client ID: %d...\n", client_fd);
-            arguments[0] = client_fd;
-            ret = pthread_create(&thread, NULL, handleConnections_interactive, arguments);
+            ret = pthread_create(&thread, NULL, handleConnections_interactive, (void *)(intptr_t)client_fd);
             if (ret==0) 
             {
                 pthread_detach(thread);
@@ -77,11 +77,160 @@ extern IEC_LINT *lint_memory[BUFFER_SIZE];
 //Special Functions
 extern IEC_LINT *special_functions[BUFFER_SIZE];
 
-//lock for the buffer
+//Contiguous I/O image. Every non NULL pointer above points to the same
+//position on these arrays, so whole blocks of the image can be copied at once
+extern IEC_BOOL bool_input_image[BUFFER_SIZE][8];
+extern IEC_BOOL bool_output_image[BUFFER_SIZE][8];
+extern IEC_BYTE byte_input_image[BUFFER_SIZE];
+extern IEC_BYTE byte_output_image[BUFFER_SIZE];
+extern IEC_UINT int_input_image[BUFFER_SIZE];
+extern IEC_UINT int_output_image[BUFFER_SIZE];
+extern IEC_LINT special_functions_image[BUFFER_SIZE];
+
+//Memory image. It is kept on pages of its own, so that the persistent
+//storage can map it to a file
+struct retain_image
+{
+    IEC_UINT int_memory[BUFFER_SIZE];
+    IEC_DINT dint_memory[BUFFER_SIZE];
+    IEC_LINT lint_memory[BUFFER_SIZE];
+} __attribute__((aligned(4096)));
+
+extern struct retain_image retain_image;
+#define int_memory_image retain_image.int_memory
+#define dint_memory_image retain_image.dint_memory
+#define lint_memory_image retain_image.lint_memory
+
+//Private image of a periodic task that runs on a thread of its own. It has
+//the same layout as the one on the auto-generated glueVars.cpp file
+struct task_image
+{
+    IEC_BOOL bool_input[BUFFER_SIZE][8];
+    IEC_BOOL bool_output[BUFFER_SIZE][8];
+    IEC_BYTE byte_input[BUFFER_SIZE];
+    IEC_BYTE byte_output[BUFFER_SIZE];
+    IEC_UINT int_input[BUFFER_SIZE];
+    IEC_UINT int_output[BUFFER_SIZE];
+    IEC_UINT int_memory[BUFFER_SIZE];
+    IEC_DINT dint_memory[BUFFER_SIZE];
+    IEC_LINT lint_memory[BUFFER_SIZE];
+    IEC_LINT special_functions[BUFFER_SIZE];
+};
+
+//lock for the buffer. Only the main loop and the hardware layers should
+//take it. Protocol servers must use the process image snapshots instead
 extern pthread_mutex_t bufferLock;
 
+//Snapshot of the I/O image published at the end of each scan cycle
+struct image_snapshot
+{
+    IEC_BOOL bool_input[BUFFER_SIZE][8];
+    IEC_BOOL bool_output[BUFFER_SIZE][8];
+    IEC_BYTE byte_input[BUFFER_SIZE];
+    IEC_BYTE byte_output[BUFFER_SIZE];
+    IEC_UINT int_input[BUFFER_SIZE];
+    IEC_UINT int_output[BUFFER_SIZE];
+    IEC_UINT int_memory[BUFFER_SIZE];
+    IEC_DINT dint_memory[BUFFER_SIZE];
+    IEC_LINT lint_memory[BUFFER_SIZE];
+    uint64_t cycle;
+    struct timespec time; //wall clock time of the input scan that produced the snapshot
+};
+
+//Areas of the I/O image that can be written by the protocol servers
+#define IMAGE_BOOL_OUTPUT       0
+#define IMAGE_INT_OUTPUT        1
+#define IMAGE_INT_MEMORY        2
+#define IMAGE_DINT_MEMORY       3
+#define IMAGE_LINT_MEMORY       4
+
+//Write request to the I/O image. Only the bits set on mask are changed. For
+//IMAGE_BOOL_OUTPUT the index addresses a group of 8 booleans and each bit of
+//the mask selects one of them
+struct image_write
+{
+    uint8_t area;
+    bool end_of_batch;
+    uint16_t index;
+    uint64_t mask;
+    uint64_t value;
+};
+
 //Common task timer
 extern unsigned long long common_ticktime__;
+//Scan cycle phases measured by the main loop
+#define SCAN_PHASE_INPUT        0
+#define SCAN_PHASE_MB_INPUT     1
+#define SCAN_PHASE_PROGRAM      2
+#define SCAN_PHASE_OUTPUT       3
+#define SCAN_PHASE_SLACK        4
+#define SCAN_NUM_PHASES         5
+
+//Policies for scan cycles that miss their deadline
+#define OVERRUN_CATCHUP         0 //run missed cycles back to back, up to overrun_limit
+#define OVERRUN_SKIP            1 //drop missed cycles and re-phase on the next deadline
+#define OVERRUN_WATCHDOG        2 //raise a fault and disable outputs after overrun_limit missed deadlines in a row
+
+struct scan_record
+{
+    uint32_t phase_ns[SCAN_NUM_PHASES];
+    uint32_t wake_jitter_ns;
+    bool overrun;
+};
+
+//Log severities and subsystems
+#define LOG_ERROR               0
+#define LOG_WARNING             1
+#define LOG_INFO                2
+#define LOG_DEBUG               3
+
+#define LOG_RUNTIME             0
+#define LOG_SCAN                1
+#define LOG_INTERACTIVE         2
+#define LOG_MODBUS              3
+#define LOG_DNP3                4
+#define LOG_ENIP                5
+#define LOG_PSTORAGE            6
+#define LOG_HARDWARE            7
+
+#define LOG_MESSAGE_SIZE        240
+
+struct log_record
+{
+    uint64_t sequence;
+    struct timespec time;
+    uint8_t severity;
+    uint8_t subsystem;
+    uint16_t length;
+    char message[LOG_MESSAGE_SIZE]; //not null terminated
+};
+
+//Variable monitor. Responses hold a 12 byte header and up to 8 bytes for
+//each variable
+#define MONITOR_MAX_POINTS      1024
+#define MONITOR_RESPONSE_SIZE   (12 + MONITOR_MAX_POINTS * 8)
+
+//Debugger symbol table. It is defined on the auto-generated glueVars.cpp
+//file. For located and external variables, value points to the variable's
+//pointer and forced_value holds the value used while the variable is forced
+struct debug_symbol
+{
+    const char *name;
+    const char *type;
+    unsigned int size;
+    bool located;
+    void *value;
+    IEC_BYTE *flags;
+    void *forced_value;
+};
+
+extern struct debug_symbol *debug_symbols;
+extern int debug_symbol_count;
+
+#define DEBUG_FORCE_FLAG        0x02 //same as __IEC_FORCE_FLAG on iec_types_all.h
+#define DEBUG_MAX_BATCH         256
+#define DEBUG_MAX_VALUES        16384
+#define DEBUG_RESPONSE_SIZE     (12 + DEBUG_MAX_VALUES)
 
 //----------------------------------------------------------------------
 //FUNCTION PROTOTYPES
@@ -94,6 +243,7 @@ void config_init__(void);
 //glueVars.cpp
 void glueVars();
 void updateTime();
+void bindLocatedVars(struct task_image *image);
 
 //hardware_layer.cpp
 void initializeHardware();
@@ -112,16 +262,26 @@ extern int ignored_int_outputs[];
 
 //main.cpp
 void sleep_until(struct timespec *ts, int delay);
+unsigned long sleep_until_next_scan(struct timespec *ts, unsigned long long delay);
 void sleepms(int milliseconds);
-void log(unsigned char *logmsg);
+int64_t timespec_diff_ns(struct timespec *end, struct timespec *start);
 bool pinNotPresent(int *ignored_vector, int vector_size, int pinNumber);
 extern uint8_t run_openplc;
-extern unsigned char log_buffer[1000000];
-extern int log_index;
 void handleSpecialFunctions();
+int getScanStats(char *buffer, int buffer_size);
+extern uint64_t scan_overruns;
+extern uint8_t overrun_policy;
+extern uint16_t overrun_limit;
+extern bool watchdog_fault;
+void disableOutputs();
 
 //server.cpp
+#define MAX_SERVER_CONNECTIONS  1024
+#define MAX_SERVER_WORKERS      16
 void startServer(uint16_t port, int protocol_type);
+int getServerStats(char *buffer, int buffer_size);
+extern int server_workers;
+extern int server_max_connections;
 int getSO_ERROR(int fd);
 void closeSocket(int fd);
 bool SetSocketBlockingEnabled(int fd, bool blocking);
@@ -136,6 +296,60 @@ extern uint16_t pstorage_polling;
 extern time_t start_time;
 extern time_t end_time;
 
+//process_image.cpp
+void initializeProcessImage();
+void publishImageSnapshot(uint64_t cycle, struct timespec scan_time);
+struct image_snapshot *acquireImageSnapshot();
+void releaseImageSnapshot(struct image_snapshot *snapshot);
+bool waitImageSnapshot(uint64_t cycle, int timeout_ms);
+bool queueImageWrites(struct image_write *writes, int count);
+void applyImageWrites();
+int discardImageWrites();
+
+//logging.cpp
+void initializeLogging();
+void finalizeLogging();
+void log(unsigned char *logmsg);
+void logMessage(uint8_t severity, uint8_t subsystem, unsigned char *logmsg);
+bool startLogFile(long max_size);
+void stopLogFile();
+int readLogHistory(uint64_t *cursor, bool details, char *buffer, int buffer_size);
+uint64_t droppedLogMessages();
+
+//monitor.cpp
+struct monitor_list;
+struct monitor_list *createMonitorList();
+void deleteMonitorList(struct monitor_list *monitor);
+bool addMonitorPoints(struct monitor_list *monitor, char *list);
+void clearMonitorPoints(struct monitor_list *monitor);
+int readMonitorPoints(struct monitor_list *monitor, uint64_t last_cycle, unsigned char *buffer);
+
+//debug.cpp
+void serviceDebugRequests(uint64_t cycle);
+int readDebugSymbols(char *list, unsigned char *buffer);
+bool forceDebugSymbols(char *list, bool force);
+int listDebugSymbols(int *index, char *buffer, int buffer_size);
+
+//tasks.cpp
+void initializeTasks();
+void startTasks();
+void stopTasks();
+bool releaseDueTasks(unsigned long *dropped);
+void holdTaskDeadlines();
+void *sharedImageLocation(void *location);
+void notifyEventTasks();
+void requestScan();
+void waitNextTaskEvent(struct timespec *wake);
+int getTaskStats(char *buffer, int buffer_size);
+extern int task_count;
+extern int event_task_count;
+
+//program_groups.cpp
+void startProgramGroups();
+void stopProgramGroups();
+void runProgramGroups(unsigned long tick);
+extern int group_workers;
+
 //modbus.cpp
 int processModbusMessage(unsigned char *buffer, int bufferSize);
 void mapUnusedIO();
@@ -151,6 +365,7 @@ void initializeMB();
 void *querySlaveDevices(void *arg);
 void updateBuffersIn_MB();
 void updateBuffersOut_MB();
+void disableOutputs_MB();
 
 //dnp3.cpp
 void dnp3StartServer(int port);
@@ -158,3 +373,6 @@ void dnp3StartServer(int port);
 //persistent_storage.cpp
 void startPstorage();
 int readPersistentStorage();
+void registerRetainVariable(void *address, unsigned int size);
+void checkpointPersistentStorage();
+extern bool pstorage_use_map;
@@ -52,14 +52,21 @@
 // variable initialization macros
 #define __INIT_RETAIN(name, retained)\
     name.flags |= retained?__IEC_RETAIN_FLAG:0;
+// retained variables that have their own storage are added to the
+// persistent storage. Located ones live on the I/O image instead
+extern void registerRetainVariable(void *address, unsigned int size);
+#define __REGISTER_RETAIN(name, retained)\
+    {if (retained) registerRetainVariable(&(name.value), sizeof(name.value));}
 #define __INIT_VAR(name, initial, retained)\
 	name.value = initial;\
-	__INIT_RETAIN(name, retained)
+	__INIT_RETAIN(name, retained)\
+	__REGISTER_RETAIN(name, retained)
 #define __INIT_GLOBAL(type, name, initial, retained)\
     {\
 	    static const type temp = initial;\
 	    __INIT_GLOBAL_##name(temp);\
 	    __INIT_RETAIN((*GLOBAL__##name), retained)\
+	    __REGISTER_RETAIN((*GLOBAL__##name), retained)\
     }
 #define __INIT_GLOBAL_FB(type, name, retained)\
 	type##_init__(&(*GLOBAL__##name), retained);
@@ -86,10 +93,28 @@
 // variable getting macros
 #define __GET_VAR(name, ...)\
 	name.value __VA_ARGS__
-#define __GET_EXTERNAL(name, ...)\
-	((name.flags & __IEC_FORCE_FLAG) ? name.fvalue __VA_ARGS__ : (*(name.value)) __VA_ARGS__)
 #define __GET_EXTERNAL_FB(name, ...)\
 	__GET_VAR(((*name) __VA_ARGS__))
+#define __GET_EXTERNAL_FB_BY_REF(name, ...)\
+	__GET_EXTERNAL_BY_REF(((*name) __VA_ARGS__))
+
+// with DISABLE_FORCING (iec2c 'd' output option) the force flags are never
+// set, so variables are read straight from their value
+#ifdef DISABLE_FORCING
+#define __GET_EXTERNAL(name, ...)\
+	((*(name.value)) __VA_ARGS__)
+#define __GET_LOCATED(name, ...)\
+	((*(name.value)) __VA_ARGS__)
+
+#define __GET_VAR_BY_REF(name, ...)\
+	(&(name.value __VA_ARGS__))
+#define __GET_EXTERNAL_BY_REF(name, ...)\
+	(&((*(name.value)) __VA_ARGS__))
+#define __GET_LOCATED_BY_REF(name, ...)\
+	(&((*(name.value)) __VA_ARGS__))
+#else
+#define __GET_EXTERNAL(name, ...)\
+	((name.flags & __IEC_FORCE_FLAG) ? name.fvalue __VA_ARGS__ : (*(name.value)) __VA_ARGS__)
 #define __GET_LOCATED(name, ...)\
 	((name.flags & __IEC_FORCE_FLAG) ? name.fvalue __VA_ARGS__ : (*(name.value)) __VA_ARGS__)
 
@@ -97,10 +122,9 @@
 	((name.flags & __IEC_FORCE_FLAG) ? &(name.fvalue __VA_ARGS__) : &(name.value __VA_ARGS__))
 #define __GET_EXTERNAL_BY_REF(name, ...)\
 	((name.flags & __IEC_FORCE_FLAG) ? &(name.fvalue __VA_ARGS__) : &((*(name.value)) __VA_ARGS__))
-#define __GET_EXTERNAL_FB_BY_REF(name, ...)\
-	__GET_EXTERNAL_BY_REF(((*name) __VA_ARGS__))
 #define __GET_LOCATED_BY_REF(name, ...)\
 	((name.flags & __IEC_FORCE_FLAG) ? &(name.fvalue __VA_ARGS__) : &((*(name.value)) __VA_ARGS__))
+#endif
 
 #define __GET_VAR_REF(name, ...)\
 	(&(name.value __VA_ARGS__))
@@ -122,15 +146,53 @@
 
 
 // variable setting macros
+#define __SET_EXTERNAL_FB(prefix, name, suffix, new_value)\
+	__SET_VAR((*(prefix name)), suffix, new_value)
+
+#ifdef DISABLE_FORCING
+#define __SET_VAR(prefix, name, suffix, new_value)\
+	prefix name.value suffix = new_value
+#define __SET_EXTERNAL(prefix, name, suffix, new_value)\
+	(*(prefix name.value)) suffix = new_value
+#define __SET_LOCATED(prefix, name, suffix, new_value)\
+	*(prefix name.value) suffix = new_value
+#else
 #define __SET_VAR(prefix, name, suffix, new_value)\
 	if (!(prefix name.flags & __IEC_FORCE_FLAG)) prefix name.value suffix = new_value
 #define __SET_EXTERNAL(prefix, name, suffix, new_value)\
 	{extern IEC_BYTE __IS_GLOBAL_##name##_FORCED();\
     if (!(prefix name.flags & __IEC_FORCE_FLAG || __IS_GLOBAL_##name##_FORCED()))\
 		(*(prefix name.value)) suffix = new_value;}
-#define __SET_EXTERNAL_FB(prefix, name, suffix, new_value)\
-	__SET_VAR((*(prefix name)), suffix, new_value)
 #define __SET_LOCATED(prefix, name, suffix, new_value)\
 	if (!(prefix name.flags & __IEC_FORCE_FLAG)) *(prefix name.value) suffix = new_value
+#endif
+
+
+// periodic and SINGLE tasks generated by iec2c with the 't' output option.
+// The runtime runs each of them on a thread of its own, at its own interval
+// and priority. SINGLE tasks have no interval, and run when trigger() sees
+// their data source rise
+typedef struct {
+	const char *name;
+	unsigned long long interval; //ns
+	int priority;
+	void (*init)(void);
+	void (*run)(unsigned long tick);
+	IEC_BOOL (*trigger)(void);
+} __IEC_TASK_t;
+
+// programs of a resource that share no variables, generated by iec2c with the
+// 'g' output option. After schedule() updates the task flags, the runtime may
+// run the groups of the resource in parallel
+typedef struct {
+	const char *programs;
+	void (*run)(unsigned long tick);
+} __IEC_PROGRAM_GROUP_t;
+
+typedef struct {
+	const char *name;
+	void (*schedule)(unsigned long tick);
+	__IEC_PROGRAM_GROUP_t *groups;
+} __IEC_RESOURCE_GROUPS_t;
 
 #endif //__ACCESSOR_H
@@ -0,0 +1,327 @@
+//-----------------------------------------------------------------------------
+// Copyright 2026 agent
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file implements the runtime log. Any thread can log a message without
+// taking a lock or allocating memory: messages are stored as records on a
+// fixed ring, and a background thread drains them to the console, to an
+// optional rotating log file and to the history that is returned by the
+// runtime_logs() command. If the ring is full the message is dropped and
+// counted, so that the scan cycle is never stalled by logging.
+// agent, Oct 2026
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ladder.h"
+
+#define LOG_RING_SIZE           1024 //must be a power of two
+#define LOG_HISTORY_SIZE        1024 //must be a power of two
+#define LOG_DRAIN_PERIOD        20 //ms
+#define LOG_FILE_NAME           "openplc.log"
+#define LOG_FILE_BACKUP         "openplc.log.1"
+
+struct log_slot
+{
+    uint64_t sequence;
+    struct log_record record;
+};
+
+//Ring where the messages are queued by the producers
+struct log_slot log_ring[LOG_RING_SIZE];
+uint64_t log_ring_head = 0; //only touched by the drain thread
+uint64_t log_ring_tail = 0;
+uint64_t log_dropped = 0;
+
+//Messages already drained. Shared only between the drain thread and the
+//readers of the history, never with the producers
+struct log_record log_history[LOG_HISTORY_SIZE];
+uint64_t log_history_end = 0; //sequence of the next message to be drained
+pthread_mutex_t historyLock = PTHREAD_MUTEX_INITIALIZER;
+
+//Optional rotating log file, written by the drain thread
+pthread_mutex_t logFileLock = PTHREAD_MUTEX_INITIALIZER;
+FILE *log_file = NULL;
+long log_file_size = 0;
+long log_file_limit = 0;
+
+pthread_t log_thread;
+bool run_logging = false;
+
+const char *severity_names[] = {"ERROR", "WARNING", "INFO", "DEBUG"};
+const char *subsystem_names[] = {"runtime", "scan", "interactive", "modbus", "dnp3", "enip", "pstorage", "hardware"};
+
+//-----------------------------------------------------------------------------
+// Queues a message on the log ring. Safe to call from any thread, including
+// the main loop, as it never blocks. Messages longer than LOG_MESSAGE_SIZE
+// are truncated
+//-----------------------------------------------------------------------------
+void logMessage(uint8_t severity, uint8_t subsystem, unsigned char *logmsg)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    uint64_t position = __atomic_load_n(&log_ring_tail, __ATOMIC_RELAXED);
+    struct log_slot *slot;
+    while (true)
+    {
+        slot = &log_ring[position & (LOG_RING_SIZE - 1)];
+        uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (sequence < position)
+        {
+            //ring is full. The drain thread is behind
+            __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+
+        if (sequence == position && __atomic_compare_exchange_n(&log_ring_tail, &position, position + 1, false,
+                                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+
+        if (sequence > position) position = __atomic_load_n(&log_ring_tail, __ATOMIC_RELAXED);
+    }
+
+    struct log_record *record = &slot->record;
+    int length = 0;
+    while (length < LOG_MESSAGE_SIZE && logmsg[length] != '\0')
+    {
+        record->message[length] = logmsg[length];
+        length++;
+    }
+    record->sequence = position;
+    record->time = now;
+    record->severity = severity;
+    record->subsystem = subsystem;
+    record->length = length;
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+//-----------------------------------------------------------------------------
+// Logs a general runtime message
+//-----------------------------------------------------------------------------
+void log(unsigned char *logmsg)
+{
+    logMessage(LOG_INFO, LOG_RUNTIME, logmsg);
+}
+
+//-----------------------------------------------------------------------------
+// Formats a record as a line with its time, severity and subsystem. Returns
+// the number of bytes written, or 0 if the record doesn't fit on the buffer
+//-----------------------------------------------------------------------------
+int formatLogRecord(struct log_record *record, char *buffer, int buffer_size)
+{
+    struct tm local;
+    localtime_r(&record->time.tv_sec, &local);
+
+    int length = record->length;
+    if (length > 0 && record->message[length - 1] == '\n') length--;
+
+    int count = snprintf(buffer, buffer_size, "%llu %04d-%02d-%02d %02d:%02d:%02d.%03ld %s %s: %.*s\n",
+                         (unsigned long long)record->sequence, local.tm_year + 1900, local.tm_mon + 1,
+                         local.tm_mday, local.tm_hour, local.tm_min, local.tm_sec, record->time.tv_nsec / 1000000,
+                         severity_names[record->severity], subsystem_names[record->subsystem], length,
+                         record->message);
+    if (count < 0 || count >= buffer_size) return 0;
+
+    return count;
+}
+
+//-----------------------------------------------------------------------------
+// Appends a record to the log file, moving the file to LOG_FILE_BACKUP once
+// it grows past the size limit. Must be called with logFileLock held
+//-----------------------------------------------------------------------------
+void writeLogFile(struct log_record *record)
+{
+    char line[LOG_MESSAGE_SIZE + 128];
+    int count = formatLogRecord(record, line, sizeof(line));
+    if (count == 0) return;
+
+    if (log_file_size + count > log_file_limit)
+    {
+        fclose(log_file);
+        rename(LOG_FILE_NAME, LOG_FILE_BACKUP);
+        log_file = fopen(LOG_FILE_NAME, "w");
+        log_file_size = 0;
+        if (log_file == NULL) return;
+    }
+
+    fwrite(line, 1, count, log_file);
+    log_file_size += count;
+}
+
+//-----------------------------------------------------------------------------
+// Moves all complete records from the ring to the console, the log file and
+// the history. Returns the number of records drained
+//-----------------------------------------------------------------------------
+int drainLogRing()
+{
+    int drained = 0;
+
+    pthread_mutex_lock(&logFileLock);
+    while (true)
+    {
+        struct log_slot *slot = &log_ring[log_ring_head & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != log_ring_head + 1) break;
+
+        struct log_record *record = &slot->record;
+        printf("%.*s", record->length, record->message);
+        if (log_file != NULL) writeLogFile(record);
+
+        pthread_mutex_lock(&historyLock);
+        log_history[record->sequence & (LOG_HISTORY_SIZE - 1)] = *record;
+        log_history_end = record->sequence + 1;
+        pthread_mutex_unlock(&historyLock);
+
+        __atomic_store_n(&slot->sequence, log_ring_head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        log_ring_head++;
+        drained++;
+    }
+
+    if (drained > 0)
+    {
+        fflush(stdout);
+        if (log_file != NULL) fflush(log_file);
+    }
+    pthread_mutex_unlock(&logFileLock);
+
+    return drained;
+}
+
+//-----------------------------------------------------------------------------
+// Thread that drains the log ring periodically
+//-----------------------------------------------------------------------------
+void *logThread(void *arg)
+{
+    while (__atomic_load_n(&run_logging, __ATOMIC_RELAXED))
+    {
+        if (drainLogRing() == 0) sleepms(LOG_DRAIN_PERIOD);
+    }
+
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Prepares the log ring and starts the drain thread. Must be called before
+// anything is logged
+//-----------------------------------------------------------------------------
+void initializeLogging()
+{
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++)
+    {
+        log_ring[i].sequence = i;
+    }
+
+    run_logging = true;
+    pthread_create(&log_thread, NULL, logThread, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// Stops the drain thread and flushes whatever is left on the ring
+//-----------------------------------------------------------------------------
+void finalizeLogging()
+{
+    __atomic_store_n(&run_logging, false, __ATOMIC_RELAXED);
+    pthread_join(log_thread, NULL);
+    drainLogRing();
+    stopLogFile();
+}
+
+//-----------------------------------------------------------------------------
+// Starts writing the log to LOG_FILE_NAME. The file is rotated to
+// LOG_FILE_BACKUP when it grows beyond max_size bytes
+//-----------------------------------------------------------------------------
+bool startLogFile(long max_size)
+{
+    pthread_mutex_lock(&logFileLock);
+    if (log_file != NULL) fclose(log_file);
+    log_file = fopen(LOG_FILE_NAME, "a");
+    log_file_size = 0;
+    if (log_file != NULL)
+    {
+        fseek(log_file, 0, SEEK_END);
+        log_file_size = ftell(log_file);
+    }
+    log_file_limit = max_size;
+    pthread_mutex_unlock(&logFileLock);
+
+    return (log_file != NULL);
+}
+
+//-----------------------------------------------------------------------------
+// Stops writing the log to the log file
+//-----------------------------------------------------------------------------
+void stopLogFile()
+{
+    pthread_mutex_lock(&logFileLock);
+    if (log_file != NULL)
+    {
+        fclose(log_file);
+        log_file = NULL;
+    }
+    pthread_mutex_unlock(&logFileLock);
+}
+
+//-----------------------------------------------------------------------------
+// Copies messages from the log history into buffer, starting from the one
+// with sequence number *cursor, and advances the cursor past the messages
+// copied. If the cursor points to messages that are no longer on the history
+// it is moved to the oldest one available. With details set, each message is
+// written as a line with its sequence number, time, severity and subsystem;
+// otherwise only the message text is written. Returns the number of bytes
+// written, which is 0 once there are no more messages
+//-----------------------------------------------------------------------------
+int readLogHistory(uint64_t *cursor, bool details, char *buffer, int buffer_size)
+{
+    int count = 0;
+
+    pthread_mutex_lock(&historyLock);
+    uint64_t oldest = (log_history_end > LOG_HISTORY_SIZE) ? log_history_end - LOG_HISTORY_SIZE : 0;
+    if (*cursor < oldest) *cursor = oldest;
+
+    while (*cursor < log_history_end)
+    {
+        struct log_record *record = &log_history[*cursor & (LOG_HISTORY_SIZE - 1)];
+        int length;
+        if (details)
+        {
+            length = formatLogRecord(record, buffer + count, buffer_size - count);
+            if (length == 0) break;
+        }
+        else
+        {
+            length = record->length;
+            if (length > buffer_size - count) break;
+            memcpy(buffer + count, record->message, length);
+        }
+        count += length;
+        (*cursor)++;
+    }
+    pthread_mutex_unlock(&historyLock);
+
+    return count;
+}
+
+//-----------------------------------------------------------------------------
+// Returns the number of messages dropped because the log ring was full
+//-----------------------------------------------------------------------------
+uint64_t droppedLogMessages()
+{
+    return __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+}
@@ -34,6 +34,7 @@
 #include "ladder.h"
 
 #define OPLC_CYCLE          50000000
+#define SCAN_HISTORY_SIZE   1024 //must be a power of two
 
 extern int opterr;
 //extern int common_ticktime__;
@@ -41,13 +42,48 @@ IEC_BOOL __DEBUG;
 
 IEC_LINT cycle_counter = 0;
 
+extern IEC_TIME __CURRENT_TIME;
+
 unsigned long __tick = 0;
 pthread_mutex_t bufferLock; //mutex for the internal buffers
-pthread_mutex_t logLock; //mutex for the internal log
 uint8_t run_openplc = 1; //Variable to control OpenPLC Runtime execution
-unsigned char log_buffer[1000000]; //A very large buffer to store all logs
-int log_index = 0;
-int log_counter = 0;
+
+//Scan cycle instrumentation. The main loop is the only writer of the history
+//ring, so readers just need to load the index before copying the records
+struct scan_record scan_history[SCAN_HISTORY_SIZE];
+uint64_t scan_history_index = 0;
+uint64_t scan_overruns = 0;
+uint32_t scan_last_ns = 0;
+uint32_t scan_max_ns = 0;
+uint64_t scan_dropped = 0;
+
+//Overrun handling for the main loop
+uint8_t overrun_policy = OVERRUN_CATCHUP;
+uint16_t overrun_limit = 10; //max catch-up cycles, or late cycles in a row that raise a watchdog fault
+bool watchdog_fault = false;
+unsigned long late_cycles = 0; //deadlines missed in a row by the main loop
+
+//-----------------------------------------------------------------------------
+// Helper function - Returns the difference between two timestamps in
+// nanoseconds
+//-----------------------------------------------------------------------------
+int64_t timespec_diff_ns(struct timespec *end, struct timespec *start)
+{
+    return (int64_t)(end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
+
+//-----------------------------------------------------------------------------
+// Helper function - Sets the PLC clock to the time elapsed since start. Used
+// instead of updateTime() when the scans don't happen on a fixed tick
+//-----------------------------------------------------------------------------
+void syncPlcTime(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t elapsed = timespec_diff_ns(&now, start);
+    __CURRENT_TIME.tv_sec = elapsed / (1000*1000*1000);
+    __CURRENT_TIME.tv_nsec = elapsed % (1000*1000*1000);
+}
 
 //-----------------------------------------------------------------------------
 // Helper function - Makes the running thread sleep for the ammount of time
@@ -64,6 +100,73 @@ void sleep_until(struct timespec *ts, int delay)
     clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, ts,  NULL);
 }
 
+//-----------------------------------------------------------------------------
+// Helper function - Makes the main loop sleep until its next deadline,
+// applying the configured overrun policy when the deadline has already
+// passed. Returns the number of cycles that were dropped so the caller can
+// keep the PLC clock in step
+//-----------------------------------------------------------------------------
+unsigned long sleep_until_next_scan(struct timespec *ts, unsigned long long delay)
+{
+    unsigned long dropped = 0;
+    struct timespec now;
+
+    ts->tv_nsec += delay;
+    while (ts->tv_nsec >= 1000*1000*1000)
+    {
+        ts->tv_nsec -= 1000*1000*1000;
+        ts->tv_sec++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t lag = timespec_diff_ns(&now, ts);
+    if (lag > 0)
+    {
+        //number of whole periods we are behind, besides the current one
+        unsigned long late = lag / delay;
+
+        if (overrun_policy == OVERRUN_CATCHUP)
+        {
+            if (late > overrun_limit) dropped = late - overrun_limit;
+        }
+        else
+        {
+            if (overrun_policy == OVERRUN_WATCHDOG)
+            {
+                late_cycles += late + 1;
+                if (late_cycles >= overrun_limit && !watchdog_fault)
+                {
+                    unsigned char log_msg[1000];
+                    sprintf(log_msg, "Watchdog: scan missed %lu deadlines in a row. Disabling outputs!\n", late_cycles);
+                    logMessage(LOG_ERROR, LOG_SCAN, log_msg);
+                    watchdog_fault = true;
+                    late_cycles = 0;
+                }
+            }
+
+            //re-phase on the next deadline that is still in the future
+            dropped = late + 1;
+        }
+
+        uint64_t advance = (uint64_t)dropped * delay;
+        ts->tv_sec += advance / (1000*1000*1000);
+        ts->tv_nsec += advance % (1000*1000*1000);
+        if (ts->tv_nsec >= 1000*1000*1000)
+        {
+            ts->tv_nsec -= 1000*1000*1000;
+            ts->tv_sec++;
+        }
+        scan_dropped += dropped;
+    }
+    else
+    {
+        late_cycles = 0;
+    }
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, ts, NULL);
+    return dropped;
+}
+
 //-----------------------------------------------------------------------------
 // Helper function - Makes the running thread sleep for the ammount of time
 // in milliseconds
@@ -77,27 +180,71 @@ void sleepms(int milliseconds)
 }
 
 //-----------------------------------------------------------------------------
-// Helper function - Logs messages and print them on the console
+// Stores the timings of the last scan cycle on the history ring and updates
+// the overrun counters
 //-----------------------------------------------------------------------------
-void log(unsigned char *logmsg)
+void recordScanCycle(struct scan_record *record)
 {
-    pthread_mutex_lock(&logLock); //lock mutex
-    printf("%s", logmsg);
-    for (int i = 0; logmsg[i] != '\0'; i++)
+    uint32_t scan_time = 0;
+    for (int i = 0; i < SCAN_PHASE_SLACK; i++)
     {
-        log_buffer[log_index] = logmsg[i];
-        log_index++;
-        log_buffer[log_index] = '\0';
+        scan_time += record->phase_ns[i];
     }
-    
-    log_counter++;
-    if (log_counter >= 1000)
+    scan_last_ns = scan_time;
+    if (scan_time > scan_max_ns) scan_max_ns = scan_time;
+    if (record->overrun) scan_overruns++;
+
+    uint64_t index = __atomic_load_n(&scan_history_index, __ATOMIC_RELAXED);
+    scan_history[index & (SCAN_HISTORY_SIZE - 1)] = *record;
+    __atomic_store_n(&scan_history_index, index + 1, __ATOMIC_RELEASE);
+}
+
+int compareUint32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+//-----------------------------------------------------------------------------
+// Formats min/max/mean/p99 statistics for each scan phase over the cycles
+// currently kept on the history ring. Returns the number of characters
+// written to the buffer
+//-----------------------------------------------------------------------------
+int getScanStats(char *buffer, int buffer_size)
+{
+    const char *phase_names[SCAN_NUM_PHASES + 1] = {"input", "mb_input", "program", "output", "slack", "wake_jitter"};
+    static uint32_t samples[SCAN_HISTORY_SIZE];
+
+    //Leave a few records out of the window so that the ones being
+    //overwritten by the scan thread while we copy are not used
+    uint64_t index = __atomic_load_n(&scan_history_index, __ATOMIC_ACQUIRE);
+    uint64_t count = index < (SCAN_HISTORY_SIZE - 16) ? index : (SCAN_HISTORY_SIZE - 16);
+
+    int len = snprintf(buffer, buffer_size, "cycles: %llu\noverruns: %llu\ndropped: %llu\noverrun_policy: %d\noverrun_limit: %d\n"
+                       "watchdog_fault: %d\nlast_scan_us: %u\nmax_scan_us: %u\nwindow: %llu\n",
+                       (unsigned long long)index, (unsigned long long)scan_overruns, (unsigned long long)scan_dropped,
+                       overrun_policy, overrun_limit, watchdog_fault, scan_last_ns / 1000, scan_max_ns / 1000,
+                       (unsigned long long)count);
+    if (count == 0) return len;
+
+    for (int phase = 0; phase <= SCAN_NUM_PHASES && len < buffer_size; phase++)
     {
-        /*Store current log on a file*/
-        log_counter = 0;
-        log_index = 0;
+        uint64_t total = 0;
+        for (uint64_t i = 0; i < count; i++)
+        {
+            struct scan_record *record = &scan_history[(index - count + i) & (SCAN_HISTORY_SIZE - 1)];
+            samples[i] = (phase == SCAN_NUM_PHASES) ? record->wake_jitter_ns : record->phase_ns[phase];
+            total += samples[i];
+        }
+        qsort(samples, count, sizeof(uint32_t), compareUint32);
+
+        len += snprintf(buffer + len, buffer_size - len, "%s_us: min=%.1f max=%.1f mean=%.1f p99=%.1f\n", phase_names[phase],
+                        samples[0] / 1000.0, samples[count - 1] / 1000.0, (total / count) / 1000.0,
+                        samples[(count * 99) / 100] / 1000.0);
     }
-    pthread_mutex_unlock(&logLock); //unlock mutex
+
+    return len < buffer_size ? len : buffer_size - 1;
 }
 
 //-----------------------------------------------------------------------------
@@ -177,11 +324,21 @@ void handleSpecialFunctions()
     //comm error counter [%ML1026]
     /* Implemented in modbus_master.cpp */
 
+    //last scan time in microseconds [%ML1028]
+    if (special_functions[4] != NULL) *special_functions[4] = scan_last_ns / 1000;
+
+    //max scan time in microseconds [%ML1029]
+    if (special_functions[5] != NULL) *special_functions[5] = scan_max_ns / 1000;
+
+    //scan overrun counter [%ML1030]
+    if (special_functions[6] != NULL) *special_functions[6] = scan_overruns;
+
     //insert other special functions below
 }
 
 int main(int argc,char **argv)
 {
+    initializeLogging();
     unsigned char log_msg[1000];
     sprintf(log_msg, "OpenPLC Runtime starting...\n");
     log(log_msg);
@@ -191,15 +348,22 @@ int main(int argc,char **argv)
     //======================================================
     tzset();
     time(&start_time);
+    initializeProcessImage();
     pthread_t interactive_thread;
     pthread_create(&interactive_thread, NULL, interactiveServerThread, NULL);
     config_init__();
     glueVars();
+    initializeTasks();
 
     //======================================================
     //               MUTEX INITIALIZATION
     //======================================================
-    if (pthread_mutex_init(&bufferLock, NULL) != 0)
+    //periodic tasks of lower priority also take the buffer lock, so it must
+    //not leave the main loop waiting behind them
+    pthread_mutexattr_t bufferLockAttr;
+    pthread_mutexattr_init(&bufferLockAttr);
+    pthread_mutexattr_setprotocol(&bufferLockAttr, PTHREAD_PRIO_INHERIT);
+    if (pthread_mutex_init(&bufferLock, &bufferLockAttr) != 0)
     {
         printf("Mutex init failed\n");
         exit(1);
@@ -222,6 +386,13 @@ int main(int argc,char **argv)
     glueVars();
     mapUnusedIO();
     readPersistentStorage();
+    //snapshots are stamped with the wall clock time of the input scan, so
+    //every point of a scan carries the same time
+    struct timespec input_time;
+    clock_gettime(CLOCK_REALTIME, &input_time);
+    pthread_mutex_lock(&bufferLock);
+    publishImageSnapshot(cycle_counter, input_time);
+    pthread_mutex_unlock(&bufferLock);
     //pthread_t persistentThread;
     //pthread_create(&persistentThread, NULL, persistentStorage, NULL);
 
@@ -246,47 +417,186 @@ int main(int argc,char **argv)
     }
 #endif
 
+	//periodic tasks compiled with iec2c -O t run on threads of their own
+	startTasks();
+
+	//program groups compiled with iec2c -O g run in parallel on all cores
+	startProgramGroups();
+
 	//gets the starting point for the clock
 	printf("Getting current time\n");
 	struct timespec timer_start;
 	clock_gettime(CLOCK_MONOTONIC, &timer_start);
+	struct timespec clock_start = timer_start;
+	struct timespec phase_start, phase_end;
+	struct scan_record record;
+	unsigned long discarded_writes = 0; //protocol writes dropped during the current watchdog fault
 
 	//======================================================
 	//                    MAIN LOOP
 	//======================================================
 	while(run_openplc)
 	{
+		clock_gettime(CLOCK_MONOTONIC, &phase_start);
+		record.wake_jitter_ns = (uint32_t)timespec_diff_ns(&phase_start, &timer_start);
+
 		//make sure the buffer pointers are correct and
 		//attached to the user variables
 		glueVars();
+
+		//after a watchdog fault the program is no longer executed and
+		//the outputs are held in a safe state until the fault is reset
+		if (watchdog_fault)
+		{
+			pthread_mutex_lock(&bufferLock); //lock mutex
+
+			//writes from the protocol servers are dropped, so that stale
+			//setpoints are not applied all at once when the fault is reset
+			int discarded = discardImageWrites();
+			if (discarded > 0 && discarded_writes == 0)
+			{
+				sprintf(log_msg, "Watchdog: discarding writes from the protocol servers until the fault is reset\n");
+				logMessage(LOG_WARNING, LOG_SCAN, log_msg);
+			}
+			discarded_writes += discarded;
+
+			serviceDebugRequests(cycle_counter);
+			disableOutputs();
+			disableOutputs_MB();
+			updateCustomOut();
+			clock_gettime(CLOCK_REALTIME, &input_time);
+			publishImageSnapshot(cycle_counter, input_time);
+			pthread_mutex_unlock(&bufferLock); //unlock mutex
+			updateBuffersOut();
+
+			//the PLC clock keeps running while the fault is latched
+			if (task_count > 0)
+			{
+				syncPlcTime(&clock_start);
+				holdTaskDeadlines();
+				sleep_until_next_scan(&timer_start, common_ticktime__);
+			}
+			else
+			{
+				updateTime();
+				unsigned long held = sleep_until_next_scan(&timer_start, common_ticktime__);
+				for (unsigned long i = 0; i < held; i++)
+				{
+					updateTime();
+				}
+			}
+			continue;
+		}
+
+		if (discarded_writes > 0)
+		{
+			sprintf(log_msg, "Watchdog: %lu writes from the protocol servers were discarded during the fault\n", discarded_writes);
+			logMessage(LOG_WARNING, LOG_SCAN, log_msg);
+			discarded_writes = 0;
+		}
         
 		updateBuffersIn(); //read input image
+		clock_gettime(CLOCK_REALTIME, &input_time);
+		clock_gettime(CLOCK_MONOTONIC, &phase_end);
+		record.phase_ns[SCAN_PHASE_INPUT] = (uint32_t)timespec_diff_ns(&phase_end, &phase_start);
+		phase_start = phase_end;
 
 		pthread_mutex_lock(&bufferLock); //lock mutex
 		updateCustomIn();
         updateBuffersIn_MB(); //update input image table with data from slave devices
+		applyImageWrites(); //apply the writes queued by the protocol servers
+		clock_gettime(CLOCK_MONOTONIC, &phase_end);
+		record.phase_ns[SCAN_PHASE_MB_INPUT] = (uint32_t)timespec_diff_ns(&phase_end, &phase_start);
+		phase_start = phase_end;
+
         handleSpecialFunctions();
-		config_run__(__tick++); // execute plc program logic
+
+		//with periodic tasks there is no common tick. The tasks that are due
+		//are released with the inputs just read, and the programs not bound
+		//to a task only run when their own deadline is due
+		bool run_programs = true;
+		unsigned long dropped = 0;
+		if (task_count > 0)
+		{
+			run_programs = releaseDueTasks(&dropped);
+			notifyEventTasks();
+			__tick += dropped;
+			scan_dropped += dropped;
+		}
+
+		if (run_programs)
+		{
+			if (group_workers > 0) runProgramGroups(__tick++); // execute plc program logic on all cores
+			else config_run__(__tick++); // execute plc program logic
+		}
+		serviceDebugRequests(cycle_counter); //read and force variables for the debugger
+		clock_gettime(CLOCK_MONOTONIC, &phase_end);
+		record.phase_ns[SCAN_PHASE_PROGRAM] = (uint32_t)timespec_diff_ns(&phase_end, &phase_start);
+		phase_start = phase_end;
+
 		updateCustomOut();
         updateBuffersOut_MB(); //update slave devices with data from the output image table
+		publishImageSnapshot(cycle_counter, input_time); //share the new image with the protocol servers
+		checkpointPersistentStorage();
 		pthread_mutex_unlock(&bufferLock); //unlock mutex
 
 		updateBuffersOut(); //write output image
         
-		updateTime();
+		if (task_count > 0) syncPlcTime(&clock_start);
+		else updateTime();
+		clock_gettime(CLOCK_MONOTONIC, &phase_end);
+		record.phase_ns[SCAN_PHASE_OUTPUT] = (uint32_t)timespec_diff_ns(&phase_end, &phase_start);
+
+		//with periodic tasks the next scan happens when a task or the
+		//unbound programs are due, or when a task finishes
+		if (task_count > 0)
+		{
+			struct timespec wake;
+			waitNextTaskEvent(&wake);
+			int64_t slack = timespec_diff_ns(&wake, &phase_end);
+			record.overrun = (dropped > 0);
+			record.phase_ns[SCAN_PHASE_SLACK] = slack > 0 ? (uint32_t)slack : 0;
+			recordScanCycle(&record);
+			timer_start = wake;
+			continue;
+		}
+
+		//time left until the next deadline. A negative slack means that this
+		//cycle took longer than the task period
+		struct timespec deadline = timer_start;
+		deadline.tv_nsec += common_ticktime__;
+		while (deadline.tv_nsec >= 1000*1000*1000)
+		{
+			deadline.tv_nsec -= 1000*1000*1000;
+			deadline.tv_sec++;
+		}
+		int64_t slack = timespec_diff_ns(&deadline, &phase_end);
+		record.overrun = (slack < 0);
+		record.phase_ns[SCAN_PHASE_SLACK] = record.overrun ? 0 : (uint32_t)slack;
+		recordScanCycle(&record);
 
-		sleep_until(&timer_start, common_ticktime__);
+		//keep the PLC clock and task ticks in step with the cycles that
+		//were dropped by the overrun policy
+		dropped = sleep_until_next_scan(&timer_start, common_ticktime__);
+		for (unsigned long i = 0; i < dropped; i++)
+		{
+			updateTime();
+		}
+		__tick += dropped;
 	}
     
     //======================================================
 	//             SHUTTING DOWN OPENPLC RUNTIME
 	//======================================================
     pthread_join(interactive_thread, NULL);
+    stopTasks();
+    stopProgramGroups();
     printf("Disabling outputs\n");
     disableOutputs();
     updateCustomOut();
     updateBuffersOut();
 	finalizeHardware();
     printf("Shutting down OpenPLC Runtime...\n");
+    finalizeLogging();
     exit(0);
 }
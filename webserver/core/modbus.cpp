@@ -27,12 +27,13 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <string.h>
 
 #include "ladder.h"
 
 #define MAX_DISCRETE_INPUT              8192
 #define MAX_COILS                       8192
-#define MAX_HOLD_REGS                   8192
+#define MAX_HOLD_REGS                   65536 //whole Modbus address space
 #define MAX_INP_REGS                    1024
 
 #define MIN_16B_RANGE                   1024
@@ -42,6 +43,10 @@
 #define MIN_64B_RANGE                   4096
 #define MAX_64B_RANGE                   8191
 
+#define MAX_MB_MAP_ENTRIES              256
+#define MAX_MB_REGIONS                  1024
+#define MB_NO_REGION                    0xffff
+
 #define MB_FC_NONE                      0
 #define MB_FC_READ_COILS                1
 #define MB_FC_READ_INPUTS               2
@@ -51,8 +56,17 @@
 #define MB_FC_WRITE_REGISTER            6
 #define MB_FC_WRITE_MULTIPLE_COILS      15
 #define MB_FC_WRITE_MULTIPLE_REGISTERS  16
+#define MB_FC_MASK_WRITE_REGISTER       22
+#define MB_FC_READ_WRITE_MULTIPLE_REGISTERS 23
 #define MB_FC_ERROR                     255
 
+#define MAX_MB_WRITES                   256
+#define MAX_MB_RW_READ_REGS             125 //FC23 quantity limits from the spec
+#define MAX_MB_RW_WRITE_REGS            121
+
+#define MB_WORD_ORDER_MSW               0 //most significant word first
+#define MB_WORD_ORDER_LSW               1 //least significant word first
+
 #define ERR_NONE                        0
 #define ERR_ILLEGAL_FUNCTION            1
 #define ERR_ILLEGAL_DATA_ADDRESS        2
@@ -69,12 +83,44 @@
 #define lowByte(w) ((unsigned char) ((w) & 0xff))
 #define highByte(w) ((unsigned char) ((w) >> 8))
 
-IEC_BOOL mb_discrete_input[MAX_DISCRETE_INPUT];
-IEC_BOOL mb_coils[MAX_COILS];
-IEC_UINT mb_input_regs[MAX_INP_REGS];
-IEC_UINT mb_holding_regs[MAX_HOLD_REGS];
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define bigEndian16(x) __builtin_bswap16(x)
+#define bigEndian32(x) __builtin_bswap32(x)
+#define bigEndian64(x) __builtin_bswap64(x)
+#else
+#define bigEndian16(x) (x)
+#define bigEndian32(x) (x)
+#define bigEndian64(x) (x)
+#endif
+
+
+//Run of holding registers backed by consecutive values of the same area
+struct mb_region
+{
+	int start;              //first register of the region
+	int length;             //number of registers
+	uint8_t area;           //IMAGE_* area backing the region
+	uint8_t width;          //registers per value: 1, 2 or 4
+	uint8_t word_order;     //MB_WORD_ORDER_*
+	int index;              //value of the area mapped to the first register
+};
+
+//Holding register address map. It is built by mapUnusedIO() so that requests
+//can be served as copies of whole regions instead of checking every register.
+//Registers that are not mapped belong to MB_NO_REGION
+struct mb_address_map
+{
+	int num_regions;
+	struct mb_region regions[MAX_MB_REGIONS];
+	uint16_t region_of[MAX_HOLD_REGS]; //region of each register
+};
 
-int MessageLength;
+//The map is rebuilt on the copy not in use and then switched, so that the
+//servers never see a half built map
+struct mb_address_map mb_address_maps[2];
+struct mb_address_map *mb_address_map = NULL;
+
+thread_local int MessageLength;
 
 
 
@@ -90,8 +136,220 @@ int word(unsigned char byte1, unsigned char byte2)
 }
 
 //-----------------------------------------------------------------------------
-// This function sets the internal NULL OpenPLC buffers to point to valid
-// positions on the Modbus buffer
+// Swaps the order of the 16-bit words of a value, so that it can be sent least
+// significant word first with a single byte swap
+//-----------------------------------------------------------------------------
+static inline uint32_t swapWords32(uint32_t value)
+{
+	return (value << 16) | (value >> 16);
+}
+
+static inline uint64_t swapWords64(uint64_t value)
+{
+	value = ((value & 0x0000ffff0000ffffULL) << 16) | ((value >> 16) & 0x0000ffff0000ffffULL);
+	return (value << 32) | (value >> 32);
+}
+
+//-----------------------------------------------------------------------------
+// Adds a run of registers to the address map being built. The run is joined
+// to the last region if it continues it
+//-----------------------------------------------------------------------------
+void addRegion(struct mb_address_map *map, int start, int length, uint8_t area, uint8_t width, uint8_t word_order, int index)
+{
+	if (map->num_regions > 0)
+	{
+		struct mb_region *last = &map->regions[map->num_regions - 1];
+		if (last->area == area && last->width == width && last->word_order == word_order &&
+			last->start + last->length == start && last->index + last->length / width == index)
+		{
+			last->length += length;
+			return;
+		}
+	}
+
+	struct mb_region *region = &map->regions[map->num_regions++];
+	region->start = start;
+	region->length = length;
+	region->area = area;
+	region->width = width;
+	region->word_order = word_order;
+	region->index = index;
+}
+
+//-----------------------------------------------------------------------------
+// Parses a located variable of a register map entry (like %MD10) and sets the
+// area, width and first index of the entry. Returns false if the variable
+// can't be mapped to holding registers
+//-----------------------------------------------------------------------------
+bool parseMapLocation(char *location, struct mb_region *entry)
+{
+	if (location[0] != '%' || location[3] < '0' || location[3] > '9') return false;
+
+	if (location[1] == 'Q' && location[2] == 'W')
+	{
+		entry->area = IMAGE_INT_OUTPUT;
+		entry->width = 1;
+	}
+	else if (location[1] == 'M' && location[2] == 'W')
+	{
+		entry->area = IMAGE_INT_MEMORY;
+		entry->width = 1;
+	}
+	else if (location[1] == 'M' && location[2] == 'D')
+	{
+		entry->area = IMAGE_DINT_MEMORY;
+		entry->width = 2;
+	}
+	else if (location[1] == 'M' && location[2] == 'L')
+	{
+		entry->area = IMAGE_LINT_MEMORY;
+		entry->width = 4;
+	}
+	else
+	{
+		return false;
+	}
+
+	entry->index = atoi(&location[3]);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Reads the holding register map entries from modbus_map.cfg. Returns the
+// number of entries read. default_layout is cleared if the file disables the
+// default layout
+//-----------------------------------------------------------------------------
+int parseMapConfig(struct mb_region *entries, int max_entries, bool *default_layout)
+{
+	int num_entries = 0;
+	unsigned char log_msg[1000];
+	char line[1024];
+
+	FILE *cfgfile = fopen("modbus_map.cfg", "r");
+	if (cfgfile == NULL) return num_entries;
+
+	while (fgets(line, sizeof(line), cfgfile) != NULL)
+	{
+		char key[64], value[1000];
+		if (sscanf(line, " %63[A-Za-z_] = %999[^\r\n]", key, value) != 2) continue;
+
+		if (!strcmp(key, "default_layout"))
+		{
+			*default_layout = strncmp(value, "False", 5) != 0;
+		}
+		else if (!strcmp(key, "holding_registers"))
+		{
+			struct mb_region entry;
+			char location[32], word_order[8] = "MSW";
+			int count;
+
+			if (sscanf(value, "%d , %31[%A-Z0-9] , %d , %7[A-Z]", &entry.start, location, &count, word_order) < 3 ||
+				!parseMapLocation(location, &entry) || count <= 0 || entry.start < 0 ||
+				entry.index + count > BUFFER_SIZE || entry.start + count * entry.width > MAX_HOLD_REGS ||
+				(strcmp(word_order, "MSW") && strcmp(word_order, "LSW")))
+			{
+				snprintf((char *)log_msg, sizeof(log_msg), "Invalid holding register map entry on modbus_map.cfg: %.900s", line);
+				log(log_msg);
+				continue;
+			}
+			if (num_entries == max_entries)
+			{
+				snprintf((char *)log_msg, sizeof(log_msg), "Too many entries on modbus_map.cfg. Ignoring: %.900s", line);
+				log(log_msg);
+				continue;
+			}
+
+			entry.length = count * entry.width;
+			entry.word_order = strcmp(word_order, "LSW") ? MB_WORD_ORDER_MSW : MB_WORD_ORDER_LSW;
+			entries[num_entries++] = entry;
+		}
+	}
+
+	fclose(cfgfile);
+	return num_entries;
+}
+
+//-----------------------------------------------------------------------------
+// Builds the holding register address map. The default layout puts %QW at 0,
+// %MW at 1024, %MD at 2048 and %ML at 4096. Entries from modbus_map.cfg are
+// laid over it, so that a client can have any located variable at the address
+// and word order it wants. Values partially covered by a later entry are
+// dropped, so a region always holds whole values. 32 and 64-bit memory that
+// is not used by the program is still backed by its place on the I/O image,
+// so each memory area is a single region
+//-----------------------------------------------------------------------------
+void buildAddressMap()
+{
+	static struct mb_region entries[MAX_MB_MAP_ENTRIES];
+	static uint16_t owner[MAX_HOLD_REGS]; //entry of each register
+
+	struct mb_address_map *map = (mb_address_map == &mb_address_maps[0]) ? &mb_address_maps[1] : &mb_address_maps[0];
+	map->num_regions = 0;
+
+	//the default layout goes first, so that the configured entries are laid over it
+	struct mb_region defaults[] = {
+		{0, MIN_16B_RANGE, IMAGE_INT_OUTPUT, 1, MB_WORD_ORDER_MSW, 0},
+		{MIN_16B_RANGE, MAX_16B_RANGE - MIN_16B_RANGE + 1, IMAGE_INT_MEMORY, 1, MB_WORD_ORDER_MSW, 0},
+		{MIN_32B_RANGE, MAX_32B_RANGE - MIN_32B_RANGE + 1, IMAGE_DINT_MEMORY, 2, MB_WORD_ORDER_MSW, 0},
+		{MIN_64B_RANGE, MAX_64B_RANGE - MIN_64B_RANGE + 1, IMAGE_LINT_MEMORY, 4, MB_WORD_ORDER_MSW, 0}};
+	int num_defaults = sizeof(defaults) / sizeof(defaults[0]);
+	memcpy(entries, defaults, sizeof(defaults));
+
+	bool default_layout = true;
+	int num_entries = num_defaults + parseMapConfig(&entries[num_defaults], MAX_MB_MAP_ENTRIES - num_defaults, &default_layout);
+	int first_entry = default_layout ? 0 : num_defaults;
+
+	for (int i = 0; i < MAX_HOLD_REGS; i++) owner[i] = MB_NO_REGION;
+	for (int e = first_entry; e < num_entries; e++)
+	{
+		for (int i = 0; i < entries[e].length; i++) owner[entries[e].start + i] = e;
+	}
+
+	//drop the values that were cut by the entries laid over them
+	for (int e = first_entry; e < num_entries; e++)
+	{
+		int width = entries[e].width;
+		for (int v = entries[e].start; v < entries[e].start + entries[e].length; v += width)
+		{
+			bool whole = true;
+			for (int i = 0; i < width; i++) whole = whole && owner[v + i] == e;
+			if (whole) continue;
+			for (int i = 0; i < width; i++)
+			{
+				if (owner[v + i] == e) owner[v + i] = MB_NO_REGION;
+			}
+		}
+	}
+
+	//every entry adds at most two boundaries, so the runs always fit on
+	//MAX_MB_REGIONS
+	int position = 0;
+	while (position < MAX_HOLD_REGS)
+	{
+		int e = owner[position];
+		int length = 1;
+		while (position + length < MAX_HOLD_REGS && owner[position + length] == e) length++;
+
+		if (e != MB_NO_REGION)
+		{
+			struct mb_region *entry = &entries[e];
+			addRegion(map, position, length, entry->area, entry->width, entry->word_order,
+					  entry->index + (position - entry->start) / entry->width);
+		}
+		for (int i = 0; i < length; i++)
+		{
+			map->region_of[position + i] = (e == MB_NO_REGION) ? MB_NO_REGION : map->num_regions - 1;
+		}
+		position += length;
+	}
+
+	__atomic_store_n(&mb_address_map, map, __ATOMIC_RELEASE);
+}
+
+//-----------------------------------------------------------------------------
+// This function sets the internal NULL OpenPLC buffers to point to their
+// positions on the I/O image, so that unused addresses can still be accessed
+// through Modbus
 //-----------------------------------------------------------------------------
 void mapUnusedIO()
 {
@@ -99,17 +357,17 @@ void mapUnusedIO()
 
 	for(int i = 0; i < MAX_DISCRETE_INPUT; i++)
 	{
-		if (bool_input[i/8][i%8] == NULL) bool_input[i/8][i%8] = &mb_discrete_input[i];
+		if (bool_input[i/8][i%8] == NULL) bool_input[i/8][i%8] = &bool_input_image[i/8][i%8];
 	}
 
 	for(int i = 0; i < MAX_COILS; i++)
 	{
-		if (bool_output[i/8][i%8] == NULL) bool_output[i/8][i%8] = &mb_coils[i];
+		if (bool_output[i/8][i%8] == NULL) bool_output[i/8][i%8] = &bool_output_image[i/8][i%8];
 	}
 
 	for (int i = 0; i < MAX_INP_REGS; i++)
 	{
-		if (int_input[i] == NULL) int_input[i] = &mb_input_regs[i];
+		if (int_input[i] == NULL) int_input[i] = &int_input_image[i];
 	}
 
 	for (int i = 0; i <= MAX_16B_RANGE; i++)
@@ -118,7 +376,7 @@ void mapUnusedIO()
         {
             if (int_output[i] == NULL)
             {
-                int_output[i] = &mb_holding_regs[i];
+                int_output[i] = &int_output_image[i];
             }
         }
 
@@ -126,11 +384,13 @@ void mapUnusedIO()
         {
 			if (int_memory[i - MIN_16B_RANGE] == NULL)
             {
-                int_memory[i - MIN_16B_RANGE] = &mb_holding_regs[i];
+                int_memory[i - MIN_16B_RANGE] = &int_memory_image[i - MIN_16B_RANGE];
             }
         }
 	}
 
+	buildAddressMap();
+
 	pthread_mutex_unlock(&bufferLock);
 }
 
@@ -146,6 +406,160 @@ void ModbusError(unsigned char *buffer, int mb_error)
 	MessageLength = 9;
 }
 
+//-----------------------------------------------------------------------------
+// Returns the position in bits of a register inside the value that holds it
+//-----------------------------------------------------------------------------
+static inline int registerShift(struct mb_region *region, int offset)
+{
+	int word = offset % region->width;
+	return (region->word_order == MB_WORD_ORDER_MSW ? region->width - 1 - word : word) * 16;
+}
+
+//-----------------------------------------------------------------------------
+// Stores a single register of a region to a Modbus message. Used for values
+// cut by the edges of a request
+//-----------------------------------------------------------------------------
+static inline void storeRegister(unsigned char *data, struct mb_region *region, void *values, int offset)
+{
+	int width = region->width;
+	uint64_t value;
+	if (width == 1) value = ((uint16_t *)values)[offset];
+	else if (width == 2) value = ((uint32_t *)values)[offset / 2];
+	else value = ((uint64_t *)values)[offset / 4];
+
+	int shift = registerShift(region, offset);
+	data[0] = highByte((uint16_t)(value >> shift));
+	data[1] = lowByte((uint16_t)(value >> shift));
+}
+
+//-----------------------------------------------------------------------------
+// Copies count holding registers starting at position to a Modbus message.
+// Each region is copied as a whole: values that fit entirely on the request
+// are stored with a single byte swap, and only values cut by the edges of
+// the request are copied one register at a time. Returns false if any of the
+// registers is not mapped
+//-----------------------------------------------------------------------------
+bool readHoldingRegisters(struct mb_address_map *map, struct image_snapshot *snapshot, int position, int count, unsigned char *data)
+{
+	while (count > 0)
+	{
+		if (map->region_of[position] == MB_NO_REGION) return false;
+		struct mb_region *region = &map->regions[map->region_of[position]];
+		int width = region->width;
+		int width_shift = width >> 1; //widths are 1, 2 or 4
+		int offset = position - region->start;
+		int end = region->length;
+		if (end - offset > count) end = offset + count;
+
+		void *values;
+		switch (region->area)
+		{
+			case IMAGE_INT_OUTPUT:  values = &snapshot->int_output[region->index]; break;
+			case IMAGE_INT_MEMORY:  values = &snapshot->int_memory[region->index]; break;
+			case IMAGE_DINT_MEMORY: values = &snapshot->dint_memory[region->index]; break;
+			default:                values = &snapshot->lint_memory[region->index]; break;
+		}
+
+		position += end - offset;
+		count -= end - offset;
+		bool lsw = (region->word_order == MB_WORD_ORDER_LSW);
+
+		//value cut by the start of the request
+		for (; offset < end && (offset & (width - 1)) != 0; offset++, data += 2) storeRegister(data, region, values, offset);
+
+		//whole values
+		int first = offset >> width_shift;
+		int whole = (end - offset) >> width_shift;
+		if (width == 1)
+		{
+			for (int i = 0; i < whole; i++)
+			{
+				uint16_t value = bigEndian16(((uint16_t *)values)[first + i]);
+				memcpy(&data[i * 2], &value, 2);
+			}
+		}
+		else if (width == 2)
+		{
+			for (int i = 0; i < whole; i++)
+			{
+				uint32_t value = ((uint32_t *)values)[first + i];
+				value = bigEndian32(lsw ? swapWords32(value) : value);
+				memcpy(&data[i * 4], &value, 4);
+			}
+		}
+		else
+		{
+			for (int i = 0; i < whole; i++)
+			{
+				uint64_t value = ((uint64_t *)values)[first + i];
+				value = bigEndian64(lsw ? swapWords64(value) : value);
+				memcpy(&data[i * 8], &value, 8);
+			}
+		}
+		offset += whole * width;
+		data += whole * width * 2;
+
+		//value cut by the end of the request
+		for (; offset < end; offset++, data += 2) storeRegister(data, region, values, offset);
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Converts a write of count holding registers starting at position to image
+// writes. Registers of the same 32 or 64-bit value are joined on a single
+// write. Returns the number of image writes, or -1 if any of the registers is
+// not mapped
+//-----------------------------------------------------------------------------
+int writeHoldingRegisters(struct mb_address_map *map, int position, int count, unsigned char *data, struct image_write *writes)
+{
+	int num_writes = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		if (map->region_of[position + i] == MB_NO_REGION) return -1;
+		struct mb_region *region = &map->regions[map->region_of[position + i]];
+		int offset = position + i - region->start;
+		uint16_t value = word(data[i * 2], data[i * 2 + 1]);
+		int index = region->index + offset / region->width;
+		int shift = registerShift(region, offset);
+		if (num_writes == 0 || writes[num_writes - 1].area != region->area || writes[num_writes - 1].index != index)
+		{
+			writes[num_writes].area = region->area;
+			writes[num_writes].index = index;
+			writes[num_writes].mask = 0;
+			writes[num_writes].value = 0;
+			num_writes++;
+		}
+		writes[num_writes - 1].mask |= (uint64_t)0xffff << shift;
+		writes[num_writes - 1].value |= (uint64_t)value << shift;
+	}
+
+	return num_writes;
+}
+
+//-----------------------------------------------------------------------------
+// Converts a mask write of the holding register at position to an image
+// write. Only the bits cleared on and_mask are written, so the main loop
+// applies it against the current value of the register. Returns false if the
+// register is not mapped
+//-----------------------------------------------------------------------------
+bool maskWriteHoldingRegister(struct mb_address_map *map, int position, uint16_t and_mask, uint16_t or_mask, struct image_write *write)
+{
+	if (map->region_of[position] == MB_NO_REGION) return false;
+	struct mb_region *region = &map->regions[map->region_of[position]];
+	int offset = position - region->start;
+	int shift = registerShift(region, offset);
+
+	write->area = region->area;
+	write->index = region->index + offset / region->width;
+	write->mask = (uint64_t)(uint16_t)~and_mask << shift;
+	write->value = (uint64_t)or_mask << shift;
+
+	return true;
+}
+
 //-----------------------------------------------------------------------------
 // Implementation of Modbus/TCP Read Coils
 //-----------------------------------------------------------------------------
@@ -178,7 +592,7 @@ void ReadCoils(unsigned char *buffer, int bufferSize)
 	buffer[5] = lowByte(ByteDataLength + 3); //Number of bytes after this one
 	buffer[8] = ByteDataLength;     //Number of bytes of data
 
-	pthread_mutex_lock(&bufferLock);
+	struct image_snapshot *snapshot = acquireImageSnapshot();
 	for(int i = 0; i < ByteDataLength ; i++)
 	{
 		for(int j = 0; j < 8; j++)
@@ -186,14 +600,7 @@ void ReadCoils(unsigned char *buffer, int bufferSize)
 			int position = Start + i * 8 + j;
 			if (position < MAX_COILS)
 			{
-				if (bool_output[position/8][position%8] != NULL)
-				{
-					bitWrite(buffer[9 + i], j, *bool_output[position/8][position%8]);
-				}
-				else
-				{
-					bitWrite(buffer[9 + i], j, 0);
-				}
+				bitWrite(buffer[9 + i], j, snapshot->bool_output[position/8][position%8]);
 			}
 			else //invalid address
 			{
@@ -201,7 +608,7 @@ void ReadCoils(unsigned char *buffer, int bufferSize)
 			}
 		}
 	}
-	pthread_mutex_unlock(&bufferLock);
+	releaseImageSnapshot(snapshot);
 
 	if (mb_error != ERR_NONE)
 	{
@@ -245,7 +652,7 @@ void ReadDiscreteInputs(unsigned char *buffer, int bufferSize)
 	buffer[5] = lowByte(ByteDataLength + 3); //Number of bytes after this one
 	buffer[8] = ByteDataLength;     //Number of bytes of data
 
-	pthread_mutex_lock(&bufferLock);
+	struct image_snapshot *snapshot = acquireImageSnapshot();
 	for(int i = 0; i < ByteDataLength ; i++)
 	{
 		for(int j = 0; j < 8; j++)
@@ -253,14 +660,7 @@ void ReadDiscreteInputs(unsigned char *buffer, int bufferSize)
 			int position = Start + i * 8 + j;
 			if (position < MAX_DISCRETE_INPUT)
 			{
-				if (bool_input[position/8][position%8] != NULL)
-				{
-					bitWrite(buffer[9 + i], j, *bool_input[position/8][position%8]);
-				}
-				else
-				{
-					bitWrite(buffer[9 + i], j, 0);
-				}
+				bitWrite(buffer[9 + i], j, snapshot->bool_input[position/8][position%8]);
 			}
 			else //invalid address
 			{
@@ -268,7 +668,7 @@ void ReadDiscreteInputs(unsigned char *buffer, int bufferSize)
 			}
 		}
 	}
-	pthread_mutex_unlock(&bufferLock);
+	releaseImageSnapshot(snapshot);
 
 	if (mb_error != ERR_NONE)
 	{
@@ -311,105 +711,21 @@ void ReadHoldingRegisters(unsigned char *buffer, int bufferSize)
 	buffer[5] = lowByte(ByteDataLength + 3); //Number of bytes after this one
 	buffer[8] = ByteDataLength;     //Number of bytes of data
 
-	pthread_mutex_lock(&bufferLock);
-	for(int i = 0; i < WordDataLength; i++)
+	struct mb_address_map *map = __atomic_load_n(&mb_address_map, __ATOMIC_ACQUIRE);
+	if (Start + WordDataLength > MAX_HOLD_REGS)
 	{
-		int position = Start + i;
-		if (position <= MIN_16B_RANGE)
-		{
-			if (int_output[position] != NULL)
-			{
-				buffer[ 9 + i * 2] = highByte(*int_output[position]);
-				buffer[10 + i * 2] = lowByte(*int_output[position]);
-			}
-			else
-			{
-				buffer[ 9 + i * 2] = 0;
-				buffer[10 + i * 2] = 0;
-			}
-		}
-		//accessing memory
-		//16-bit registers
-		else if (position >= MIN_16B_RANGE && position <= MAX_16B_RANGE)
-		{
-			if (int_memory[position - MIN_16B_RANGE] != NULL)
-			{
-				buffer[ 9 + i * 2] = highByte(*int_memory[position - MIN_16B_RANGE]);
-				buffer[10 + i * 2] = lowByte(*int_memory[position - MIN_16B_RANGE]);
-			}
-			else
-			{
-				buffer[ 9 + i * 2] = 0;
-				buffer[10 + i * 2] = 0;
-			}
-		}
-		//32-bit registers
-		else if (position >= MIN_32B_RANGE && position <= MAX_32B_RANGE)
-		{
-			if (dint_memory[(position - MIN_32B_RANGE)/2] != NULL)
-			{
-				if ((position - MIN_32B_RANGE) % 2 == 0) //first word
-				{
-					uint16_t tempValue = (uint16_t)(*dint_memory[(position - MIN_32B_RANGE)/2] >> 16);
-					buffer[ 9 + i * 2] = highByte(tempValue);
-					buffer[10 + i * 2] = lowByte(tempValue);
-				}
-				else //second word
-				{
-					uint16_t tempValue = (uint16_t)(*dint_memory[(position - MIN_32B_RANGE)/2] & 0xffff);
-					buffer[ 9 + i * 2] = highByte(tempValue);
-					buffer[10 + i * 2] = lowByte(tempValue);
-				}
-			}
-			else
-			{
-				buffer[ 9 + i * 2] = mb_holding_regs[position];
-				buffer[10 + i * 2] = mb_holding_regs[position];
-			}
-		}
-		//64-bit registers
-		else if (position >= MIN_64B_RANGE && position <= MAX_64B_RANGE)
-		{
-			if (lint_memory[(position - MIN_64B_RANGE)/4] != NULL)
-			{
-				if ((position - MIN_64B_RANGE) % 4 == 0) //first word
-				{
-					uint16_t tempValue = (uint16_t)(*lint_memory[(position - MIN_64B_RANGE)/4] >> 48);
-					buffer[ 9 + i * 2] = highByte(tempValue);
-					buffer[10 + i * 2] = lowByte(tempValue);
-				}
-				else if ((position - MIN_64B_RANGE) % 4 == 1)//second word
-				{
-					uint16_t tempValue = (uint16_t)((*lint_memory[(position - MIN_64B_RANGE)/4] >> 32) & 0xffff);
-					buffer[ 9 + i * 2] = highByte(tempValue);
-					buffer[10 + i * 2] = lowByte(tempValue);
-				}
-				else if ((position - MIN_64B_RANGE) % 4 == 2)//third word
-				{
-					uint16_t tempValue = (uint16_t)((*lint_memory[(position - MIN_64B_RANGE)/4] >> 16) & 0xffff);
-					buffer[ 9 + i * 2] = highByte(tempValue);
-					buffer[10 + i * 2] = lowByte(tempValue);
-				}
-				else if ((position - MIN_64B_RANGE) % 4 == 3)//fourth word
-				{
-					uint16_t tempValue = (uint16_t)(*lint_memory[(position - MIN_64B_RANGE)/4] & 0xffff);
-					buffer[ 9 + i * 2] = highByte(tempValue);
-					buffer[10 + i * 2] = lowByte(tempValue);
-				}
-			}
-			else
-			{
-				buffer[ 9 + i * 2] = mb_holding_regs[position];
-				buffer[10 + i * 2] = mb_holding_regs[position];
-			}
-		}
-		//invalid address
-		else
-		{
-			mb_error = ERR_ILLEGAL_DATA_ADDRESS;
-		}
+		mb_error = ERR_ILLEGAL_DATA_ADDRESS;
+	}
+	else if (map == NULL) //the buffers are not mapped yet
+	{
+		mb_error = ERR_SLAVE_DEVICE_BUSY;
+	}
+	else
+	{
+		struct image_snapshot *snapshot = acquireImageSnapshot();
+		if (!readHoldingRegisters(map, snapshot, Start, WordDataLength, &buffer[9])) mb_error = ERR_ILLEGAL_DATA_ADDRESS;
+		releaseImageSnapshot(snapshot);
 	}
-	pthread_mutex_unlock(&bufferLock);
 
 	if (mb_error != ERR_NONE)
 	{
@@ -452,29 +768,21 @@ void ReadInputRegisters(unsigned char *buffer, int bufferSize)
 	buffer[5] = lowByte(ByteDataLength + 3); //Number of bytes after this one
 	buffer[8] = ByteDataLength;     //Number of bytes of data
 
-	pthread_mutex_lock(&bufferLock);
+	struct image_snapshot *snapshot = acquireImageSnapshot();
 	for(int i = 0; i < WordDataLength; i++)
 	{
 		int position = Start + i;
 		if (position < MAX_INP_REGS)
 		{
-			if (int_input[position] != NULL)
-			{
-				buffer[ 9 + i * 2] = highByte(*int_input[position]);
-				buffer[10 + i * 2] = lowByte(*int_input[position]);
-			}
-			else
-			{
-				buffer[ 9 + i * 2] = 0;
-				buffer[10 + i * 2] = 0;
-			}
+			buffer[ 9 + i * 2] = highByte(snapshot->int_input[position]);
+			buffer[10 + i * 2] = lowByte(snapshot->int_input[position]);
 		}
 		else //invalid address
 		{
 			mb_error = ERR_ILLEGAL_DATA_ADDRESS;
 		}
 	}
-	pthread_mutex_unlock(&bufferLock);
+	releaseImageSnapshot(snapshot);
 
 	if (mb_error != ERR_NONE)
 	{
@@ -515,12 +823,12 @@ void WriteCoil(unsigned char *buffer, int bufferSize)
 			value = 0;
 		}
 
-		pthread_mutex_lock(&bufferLock);
-		if (bool_output[Start/8][Start%8] != NULL)
-		{
-			*bool_output[Start/8][Start%8] = value;
-		}
-		pthread_mutex_unlock(&bufferLock);
+		struct image_write write;
+		write.area = IMAGE_BOOL_OUTPUT;
+		write.index = Start/8;
+		write.mask = 1 << (Start%8);
+		write.value = value << (Start%8);
+		if (!queueImageWrites(&write, 1)) mb_error = ERR_SLAVE_DEVICE_BUSY;
 	}
 
 	else //invalid address
@@ -556,86 +864,19 @@ void WriteRegister(unsigned char *buffer, int bufferSize)
 	}
 
 	Start = word(buffer[8],buffer[9]);
+	struct mb_address_map *map = __atomic_load_n(&mb_address_map, __ATOMIC_ACQUIRE);
 
-	pthread_mutex_lock(&bufferLock);
-	//analog outputs
-	if (Start <= MIN_16B_RANGE)
-	{
-		if (int_output[Start] != NULL)
-		{
-			*int_output[Start] = word(buffer[10],buffer[11]);
-		}
-	}
-	//accessing memory
-	//16-bit registers
-	else if (Start >= MIN_16B_RANGE && Start <= MAX_16B_RANGE)
-	{
-		if (int_memory[Start - MIN_16B_RANGE] != NULL)
-		{
-			*int_memory[Start - MIN_16B_RANGE] = word(buffer[10],buffer[11]);
-		}
-	}
-	//32-bit registers
-	else if (Start >= MIN_32B_RANGE && Start <= MAX_32B_RANGE)
-	{
-		if (dint_memory[(Start - MIN_32B_RANGE)/2] != NULL)
-		{
-			uint32_t tempValue = (uint32_t)word(buffer[10],buffer[11]);
-
-			if ((Start - MIN_32B_RANGE) % 2 == 0) //first word
-			{
-				*dint_memory[(Start - MIN_32B_RANGE) / 2] = *dint_memory[(Start - MIN_32B_RANGE) / 2] & 0x0000ffff;
-				*dint_memory[(Start - MIN_32B_RANGE) / 2] = *dint_memory[(Start - MIN_32B_RANGE) / 2] | (tempValue << 16);
-			}
-			else //second word
-			{
-				*dint_memory[(Start - MIN_32B_RANGE) / 2] = *dint_memory[(Start - MIN_32B_RANGE) / 2] & 0xffff0000;
-				*dint_memory[(Start - MIN_32B_RANGE) / 2] = *dint_memory[(Start - MIN_32B_RANGE) / 2] | tempValue;
-			}
-		}
-		else
-		{
-			mb_holding_regs[Start] = word(buffer[10],buffer[11]);
-		}
-	}
-	//64-bit registers
-	else if (Start >= MIN_64B_RANGE && Start <= MAX_64B_RANGE)
+	if (map == NULL) //the buffers are not mapped yet
 	{
-		if (lint_memory[(Start - MIN_64B_RANGE)/4] != NULL)
-		{
-			uint64_t tempValue = (uint64_t)word(buffer[10],buffer[11]);
-
-			if ((Start - MIN_64B_RANGE) % 4 == 0) //first word
-			{
-				*lint_memory[(Start - MIN_64B_RANGE) / 4] = *lint_memory[(Start - MIN_64B_RANGE) / 4] & 0x0000ffffffffffff;
-				*lint_memory[(Start - MIN_64B_RANGE) / 4] = *lint_memory[(Start - MIN_64B_RANGE) / 4] | (tempValue << 48);
-			}
-			else if ((Start - MIN_64B_RANGE) % 4 == 1) //second word
-			{
-				*lint_memory[(Start - MIN_64B_RANGE) / 4] = *lint_memory[(Start - MIN_64B_RANGE) / 4] & 0xffff0000ffffffff;
-				*lint_memory[(Start - MIN_64B_RANGE) / 4] = *lint_memory[(Start - MIN_64B_RANGE) / 4] | (tempValue << 32);
-			}
-			else if ((Start - MIN_64B_RANGE) % 4 == 2) //third word
-			{
-				*lint_memory[(Start - MIN_64B_RANGE) / 4] = *lint_memory[(Start - MIN_64B_RANGE) / 4] & 0xffffffff0000ffff;
-				*lint_memory[(Start - MIN_64B_RANGE) / 4] = *lint_memory[(Start - MIN_64B_RANGE) / 4] | (tempValue << 16);
-			}
-			else if ((Start - MIN_64B_RANGE) % 4 == 3) //fourth word
-			{
-				*lint_memory[(Start - MIN_64B_RANGE) / 4] = *lint_memory[(Start - MIN_64B_RANGE) / 4] & 0xffffffffffff0000;
-				*lint_memory[(Start - MIN_64B_RANGE) / 4] = *lint_memory[(Start - MIN_64B_RANGE) / 4] | tempValue;
-			}
-		}
-		else
-		{
-			mb_holding_regs[Start] = word(buffer[10],buffer[11]);
-		}
+		mb_error = ERR_SLAVE_DEVICE_BUSY;
 	}
-	else //invalid address
+	else
 	{
-		mb_error = ERR_ILLEGAL_DATA_ADDRESS;
+		struct image_write write;
+		int num_writes = writeHoldingRegisters(map, Start, 1, &buffer[10], &write);
+		if (num_writes < 0) mb_error = ERR_ILLEGAL_DATA_ADDRESS; //invalid address
+		else if (!queueImageWrites(&write, num_writes)) mb_error = ERR_SLAVE_DEVICE_BUSY;
 	}
-	pthread_mutex_unlock(&bufferLock);
 
 	if (mb_error != ERR_NONE)
 	{
@@ -656,6 +897,8 @@ void WriteMultipleCoils(unsigned char *buffer, int bufferSize)
 {
 	int Start, ByteDataLength, CoilDataLength;
 	int mb_error = ERR_NONE;
+	struct image_write writes[MAX_MB_WRITES];
+	int num_writes = 0;
 
 	//this request must have at least 12 bytes. If it doesn't, it's a corrupted message
 	if (bufferSize < 12)
@@ -680,7 +923,7 @@ void WriteMultipleCoils(unsigned char *buffer, int bufferSize)
 	buffer[4] = 0;
 	buffer[5] = 6; //Number of bytes after this one.
 
-	pthread_mutex_lock(&bufferLock);
+	//group the coils in writes of 8 booleans each
 	for(int i = 0; i < ByteDataLength ; i++)
 	{
 		for(int j = 0; j < 8; j++)
@@ -688,7 +931,16 @@ void WriteMultipleCoils(unsigned char *buffer, int bufferSize)
 			int position = Start + i * 8 + j;
 			if (position < MAX_COILS)
 			{
-				if (bool_output[position/8][position%8] != NULL) *bool_output[position/8][position%8] = bitRead(buffer[13 + i], j);
+				if (num_writes == 0 || writes[num_writes - 1].index != position/8)
+				{
+					writes[num_writes].area = IMAGE_BOOL_OUTPUT;
+					writes[num_writes].index = position/8;
+					writes[num_writes].mask = 0;
+					writes[num_writes].value = 0;
+					num_writes++;
+				}
+				writes[num_writes - 1].mask |= 1 << (position%8);
+				writes[num_writes - 1].value |= bitRead(buffer[13 + i], j) << (position%8);
 			}
 			else //invalid address
 			{
@@ -696,7 +948,11 @@ void WriteMultipleCoils(unsigned char *buffer, int bufferSize)
 			}
 		}
 	}
-	pthread_mutex_unlock(&bufferLock);
+
+	if (mb_error == ERR_NONE && !queueImageWrites(writes, num_writes))
+	{
+		mb_error = ERR_SLAVE_DEVICE_BUSY;
+	}
 
 	if (mb_error != ERR_NONE)
 	{
@@ -715,6 +971,8 @@ void WriteMultipleRegisters(unsigned char *buffer, int bufferSize)
 {
 	int Start, WordDataLength, ByteDataLength;
 	int mb_error = ERR_NONE;
+	struct image_write writes[MAX_MB_WRITES];
+	int num_writes = 0;
 
 	//this request must have at least 12 bytes. If it doesn't, it's a corrupted message
 	if (bufferSize < 12)
@@ -728,7 +986,7 @@ void WriteMultipleRegisters(unsigned char *buffer, int bufferSize)
 	ByteDataLength = WordDataLength * 2;
 
 	//this request must have all the bytes it wants to write. If it doesn't, it's a corrupted message
-	if ( (bufferSize < (13 + ByteDataLength)) || (buffer[12] != ByteDataLength) )
+	if ( (bufferSize < (13 + ByteDataLength)) || (buffer[12] != ByteDataLength) || (WordDataLength > MAX_MB_WRITES) )
 	{
 		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
 		return;
@@ -738,83 +996,25 @@ void WriteMultipleRegisters(unsigned char *buffer, int bufferSize)
 	buffer[4] = 0;
 	buffer[5] = 6; //Number of bytes after this one.
 
-	pthread_mutex_lock(&bufferLock);
-	for(int i = 0; i < WordDataLength; i++)
+	struct mb_address_map *map = __atomic_load_n(&mb_address_map, __ATOMIC_ACQUIRE);
+	if (Start + WordDataLength > MAX_HOLD_REGS) //invalid address
 	{
-		int position = Start + i;
-		//analog outputs
-		if (position <= MIN_16B_RANGE)
-		{
-			if (int_output[position] != NULL) *int_output[position] =  word(buffer[13 + i * 2], buffer[14 + i * 2]);
-		}
-		//accessing memory
-		//16-bit registers
-		else if (position >= MIN_16B_RANGE && position <= MAX_16B_RANGE)
-		{
-			if (int_memory[position - MIN_16B_RANGE] != NULL) *int_memory[position - MIN_16B_RANGE] = word(buffer[13 + i * 2], buffer[14 + i * 2]);
-		}
-		//32-bit registers
-		else if (position >= MIN_32B_RANGE && position <= MAX_32B_RANGE)
-		{
-			if (dint_memory[(Start - MIN_32B_RANGE)/2] != NULL)
-			{
-				uint32_t tempValue = (uint32_t)word(buffer[13 + i * 2], buffer[14 + i * 2]);
-
-				if ((position - MIN_32B_RANGE) % 2 == 0) //first word
-				{
-					*dint_memory[(position - MIN_32B_RANGE) / 2] = *dint_memory[(position - MIN_32B_RANGE) / 2] & 0x0000ffff;
-					*dint_memory[(position - MIN_32B_RANGE) / 2] = *dint_memory[(position - MIN_32B_RANGE) / 2] | (tempValue << 16);
-				}
-				else //second word
-				{
-					*dint_memory[(position - MIN_32B_RANGE) / 2] = *dint_memory[(position - MIN_32B_RANGE) / 2] & 0xffff0000;
-					*dint_memory[(position - MIN_32B_RANGE) / 2] = *dint_memory[(position - MIN_32B_RANGE) / 2] | tempValue;
-				}
-			}
-			else
-			{
-				mb_holding_regs[position] = word(buffer[13 + i * 2], buffer[14 + i * 2]);
-			}
-		}
-		//64-bit registers
-		else if (position >= MIN_64B_RANGE && position <= MAX_64B_RANGE)
-		{
-			if (lint_memory[(position - MIN_64B_RANGE)/4] != NULL)
-			{
-				uint64_t tempValue = (uint64_t)word(buffer[13 + i * 2], buffer[14 + i * 2]);
+		mb_error = ERR_ILLEGAL_DATA_ADDRESS;
+	}
+	else if (map == NULL) //the buffers are not mapped yet
+	{
+		mb_error = ERR_SLAVE_DEVICE_BUSY;
+	}
+	else
+	{
+		num_writes = writeHoldingRegisters(map, Start, WordDataLength, &buffer[13], writes);
+		if (num_writes < 0) mb_error = ERR_ILLEGAL_DATA_ADDRESS;
+	}
 
-				if ((position - MIN_64B_RANGE) % 4 == 0) //first word
-				{
-					*lint_memory[(position - MIN_64B_RANGE) / 4] = *lint_memory[(position - MIN_64B_RANGE) / 4] & 0x0000ffffffffffff;
-					*lint_memory[(position - MIN_64B_RANGE) / 4] = *lint_memory[(position - MIN_64B_RANGE) / 4] | (tempValue << 48);
-				}
-				else if ((Start - MIN_64B_RANGE) % 4 == 1) //second word
-				{
-					*lint_memory[(position - MIN_64B_RANGE) / 4] = *lint_memory[(position - MIN_64B_RANGE) / 4] & 0xffff0000ffffffff;
-					*lint_memory[(position - MIN_64B_RANGE) / 4] = *lint_memory[(position - MIN_64B_RANGE) / 4] | (tempValue << 32);
-				}
-				else if ((Start - MIN_64B_RANGE) % 4 == 2) //third word
-				{
-					*lint_memory[(position - MIN_64B_RANGE) / 4] = *lint_memory[(position - MIN_64B_RANGE) / 4] & 0xffffffff0000ffff;
-					*lint_memory[(position - MIN_64B_RANGE) / 4] = *lint_memory[(position - MIN_64B_RANGE) / 4] | (tempValue << 16);
-				}
-				else if ((Start - MIN_64B_RANGE) % 4 == 3) //fourth word
-				{
-					*lint_memory[(position - MIN_64B_RANGE) / 4] = *lint_memory[(position - MIN_64B_RANGE) / 4] & 0xffffffffffff0000;
-					*lint_memory[(position - MIN_64B_RANGE) / 4] = *lint_memory[(position - MIN_64B_RANGE) / 4] | tempValue;
-				}
-			}
-			else
-			{
-				mb_holding_regs[Start] = word(buffer[10],buffer[11]);
-			}
-		}
-		else //invalid address
-		{
-			mb_error = ERR_ILLEGAL_DATA_ADDRESS;
-		}
+	if (mb_error == ERR_NONE && !queueImageWrites(writes, num_writes))
+	{
+		mb_error = ERR_SLAVE_DEVICE_BUSY;
 	}
-	pthread_mutex_unlock(&bufferLock);
 
 	if (mb_error != ERR_NONE)
 	{
@@ -826,6 +1026,147 @@ void WriteMultipleRegisters(unsigned char *buffer, int bufferSize)
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Implementation of Modbus/TCP Mask Write Register
+//-----------------------------------------------------------------------------
+void MaskWriteRegister(unsigned char *buffer, int bufferSize)
+{
+	int Start;
+	int mb_error = ERR_NONE;
+
+	//this request must have at least 14 bytes. If it doesn't, it's a corrupted message
+	if (bufferSize < 14)
+	{
+		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
+		return;
+	}
+
+	Start = word(buffer[8], buffer[9]);
+	struct mb_address_map *map = __atomic_load_n(&mb_address_map, __ATOMIC_ACQUIRE);
+
+	if (map == NULL) //the buffers are not mapped yet
+	{
+		mb_error = ERR_SLAVE_DEVICE_BUSY;
+	}
+	else
+	{
+		struct image_write write;
+		if (!maskWriteHoldingRegister(map, Start, word(buffer[10], buffer[11]), word(buffer[12], buffer[13]), &write))
+			mb_error = ERR_ILLEGAL_DATA_ADDRESS; //invalid address
+		else if (!queueImageWrites(&write, 1))
+			mb_error = ERR_SLAVE_DEVICE_BUSY;
+	}
+
+	if (mb_error != ERR_NONE)
+	{
+		ModbusError(buffer, mb_error);
+	}
+	else
+	{
+		buffer[4] = 0;
+		buffer[5] = 8; //Number of bytes after this one.
+		MessageLength = 14;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Implementation of Modbus/TCP Read/Write Multiple Registers. The writes are
+// queued as a single batch, so they are applied on the same cycle. Since they
+// only reach the image at the start of the next cycle, the registers that
+// were written are returned with the written values, as if the write had
+// been done before the read
+//-----------------------------------------------------------------------------
+void ReadWriteMultipleRegisters(unsigned char *buffer, int bufferSize)
+{
+	int ReadStart, ReadDataLength, WriteStart, WriteDataLength, ByteDataLength;
+	int mb_error = ERR_NONE;
+	struct image_write writes[MAX_MB_WRITES];
+	unsigned char write_data[MAX_MB_WRITES * 2];
+	int num_writes = 0;
+
+	//this request must have at least 17 bytes. If it doesn't, it's a corrupted message
+	if (bufferSize < 17)
+	{
+		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
+		return;
+	}
+
+	ReadStart = word(buffer[8], buffer[9]);
+	ReadDataLength = word(buffer[10], buffer[11]);
+	WriteStart = word(buffer[12], buffer[13]);
+	WriteDataLength = word(buffer[14], buffer[15]);
+	ByteDataLength = ReadDataLength * 2;
+
+	//quantities must be within the limits of the spec and the byte count must match the write quantity
+	if ( (ReadDataLength < 1) || (ReadDataLength > MAX_MB_RW_READ_REGS) ||
+	     (WriteDataLength < 1) || (WriteDataLength > MAX_MB_RW_WRITE_REGS) || (buffer[16] != WriteDataLength * 2) )
+	{
+		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
+		return;
+	}
+
+	//this request must have all the bytes it wants to write. If it doesn't, it's a corrupted message
+	if (bufferSize < (17 + WriteDataLength * 2))
+	{
+		ModbusError(buffer, ERR_ILLEGAL_DATA_VALUE);
+		return;
+	}
+
+	//the response overwrites the values to be written
+	memcpy(write_data, &buffer[17], WriteDataLength * 2);
+
+	//preparing response
+	buffer[4] = highByte(ByteDataLength + 3);
+	buffer[5] = lowByte(ByteDataLength + 3); //Number of bytes after this one
+	buffer[8] = ByteDataLength;     //Number of bytes of data
+
+	struct mb_address_map *map = __atomic_load_n(&mb_address_map, __ATOMIC_ACQUIRE);
+	if (ReadStart + ReadDataLength > MAX_HOLD_REGS || WriteStart + WriteDataLength > MAX_HOLD_REGS) //invalid address
+	{
+		mb_error = ERR_ILLEGAL_DATA_ADDRESS;
+	}
+	else if (map == NULL) //the buffers are not mapped yet
+	{
+		mb_error = ERR_SLAVE_DEVICE_BUSY;
+	}
+	else
+	{
+		num_writes = writeHoldingRegisters(map, WriteStart, WriteDataLength, write_data, writes);
+		if (num_writes < 0) mb_error = ERR_ILLEGAL_DATA_ADDRESS;
+	}
+
+	if (mb_error == ERR_NONE)
+	{
+		struct image_snapshot *snapshot = acquireImageSnapshot();
+		if (!readHoldingRegisters(map, snapshot, ReadStart, ReadDataLength, &buffer[9])) mb_error = ERR_ILLEGAL_DATA_ADDRESS;
+		releaseImageSnapshot(snapshot);
+	}
+
+	if (mb_error == ERR_NONE && !queueImageWrites(writes, num_writes))
+	{
+		mb_error = ERR_SLAVE_DEVICE_BUSY;
+	}
+
+	if (mb_error != ERR_NONE)
+	{
+		ModbusError(buffer, mb_error);
+	}
+	else
+	{
+		//registers both written and read return the written values
+		for (int i = 0; i < WriteDataLength; i++)
+		{
+			int position = WriteStart + i - ReadStart;
+			if (position >= 0 && position < ReadDataLength)
+			{
+				buffer[ 9 + position * 2] = write_data[i * 2];
+				buffer[10 + position * 2] = write_data[i * 2 + 1];
+			}
+		}
+		MessageLength = ByteDataLength + 9;
+	}
+}
+
 //-----------------------------------------------------------------------------
 // This function must parse and process the client request and write back the
 // response for it. The return value is the size of the response message in
@@ -889,6 +1230,18 @@ int processModbusMessage(unsigned char *buffer, int bufferSize)
 		WriteMultipleRegisters(buffer, bufferSize);
 	}
 
+	//****************** Mask Write Register ******************
+	else if(buffer[7] == MB_FC_MASK_WRITE_REGISTER)
+	{
+		MaskWriteRegister(buffer, bufferSize);
+	}
+
+	//*************** Read/Write Multiple Registers ***************
+	else if(buffer[7] == MB_FC_READ_WRITE_MULTIPLE_REGISTERS)
+	{
+		ReadWriteMultipleRegisters(buffer, bufferSize);
+	}
+
 	//****************** Function Code Error ******************
 	else
 	{
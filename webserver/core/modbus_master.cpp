@@ -41,14 +41,34 @@
 
 #define MB_TCP                1
 #define MB_RTU                2
-#define MAX_MB_IO            400
+#define MB_IO_OFFSET         100 //first position of the I/O image used by the slave devices
+#define MAX_MB_BOOL          ((BUFFER_SIZE - MB_IO_OFFSET) * 8)
+#define MAX_MB_INT           (BUFFER_SIZE - MB_IO_OFFSET)
+#define MAX_RECONNECT_DELAY  30000 //maximum time in ms between reconnection attempts
+#define MB_WRITE_GAP         4 //unchanged registers that can be written to join two changed spans
+
+#define MB_FC_NONE                      0
+#define MB_FC_READ_INPUTS               2
+#define MB_FC_READ_HOLDING_REGISTERS    3
+#define MB_FC_READ_INPUT_REGISTERS      4
+#define MB_FC_WRITE_COIL                5
+#define MB_FC_WRITE_REGISTER            6
+#define MB_FC_WRITE_MULTIPLE_COILS      15
+#define MB_FC_WRITE_MULTIPLE_REGISTERS  16
+#define MB_FC_WRITE_READ_REGISTERS      23
 
 using namespace std;
 
-uint8_t bool_input_buf[MAX_MB_IO];
-uint8_t bool_output_buf[MAX_MB_IO];
-uint16_t int_input_buf[MAX_MB_IO];
-uint16_t int_output_buf[MAX_MB_IO];
+//Buffers are sized from mbconfig.cfg. Devices are mapped to them in the
+//order they are declared, so each buffer is a single contiguous span
+uint8_t *bool_input_buf;
+uint8_t *bool_output_buf;
+uint16_t *int_input_buf;
+uint16_t *int_output_buf;
+int num_bool_inputs = 0;
+int num_bool_outputs = 0;
+int num_int_inputs = 0;
+int num_int_outputs = 0;
 
 pthread_mutex_t ioLock;
 
@@ -58,6 +78,37 @@ struct MB_address
     uint16_t num_regs;
 };
 
+//Range of slave addresses that maps to a range of the I/O buffers
+struct MB_segment
+{
+    uint16_t start_address;
+    uint16_t num_regs;
+    uint16_t buffer_index;
+    int32_t deadband; //writes only. Points with a negative deadband are written on every poll
+    bool is_signed; //registers hold INT values. The deadband is compared as int16_t
+};
+
+//A single transaction sent to a slave on every poll. Each request carries
+//one or more segments. On FC23 requests the write half has its own segments
+struct MB_request
+{
+    uint8_t function;
+    uint16_t start_address;
+    uint16_t num_regs;
+    int first_segment;
+    int num_segments;
+
+    uint16_t write_start_address;
+    uint16_t write_num_regs;
+    int first_write_segment;
+    int num_write_segments;
+
+    //Last values written to the slave. Only points that changed since then
+    //are written again
+    uint16_t *shadow;
+    bool shadow_valid;
+};
+
 struct MB_device
 {
     modbus_t *mb_ctx;
@@ -72,6 +123,35 @@ struct MB_device
     int rtu_tx_pause;
     uint8_t dev_id;
     bool isConnected;
+    bool read_write_multiple; //slave supports FC23
+
+    //Report by exception. Outputs are only written when they change
+    bool write_on_change;
+    uint16_t write_deadband;
+    bool write_signed; //outputs are INT, not UINT
+    uint32_t write_refresh_period; //outputs are all written again at this rate. 0 disables it
+
+    //Scheduling. Devices with the same bus are polled by the same thread
+    int bus;
+    uint16_t polling_period;
+    uint32_t reconnect_delay;
+    uint64_t next_poll;
+
+    //Devices on the same slave and with the same polling period are polled
+    //together by the first of them, which holds the requests for all
+    int poll_group;
+    struct MB_request *requests;
+    int num_requests;
+    struct MB_segment *segments;
+    int num_segments;
+    uint32_t refresh_period;
+    uint64_t next_refresh;
+
+    //Position of the device's points on the I/O buffers
+    uint16_t bool_input_index;
+    uint16_t bool_output_index;
+    uint16_t int_input_index;
+    uint16_t int_output_index;
 
     struct MB_address discrete_inputs;
     struct MB_address coils;
@@ -84,6 +164,7 @@ struct MB_device *mb_devices;
 uint8_t num_devices;
 uint16_t polling_period = 100;
 uint16_t timeout = 1000;
+uint16_t max_read_gap = 8; //unused registers that can be read to merge two ranges
 
 //-----------------------------------------------------------------------------
 // Finds the data between the separators on the line provided
@@ -182,6 +263,12 @@ void parseConfig()
                     getData(line_str, temp_buffer, '"', '"');
                     timeout = atoi(temp_buffer);
                 }
+                else if (!strncmp(line_str, "Max_Read_Gap", 12))
+                {
+                    char temp_buffer[10];
+                    getData(line_str, temp_buffer, '"', '"');
+                    max_read_gap = atoi(temp_buffer);
+                }
 
                 else if (!strncmp(line_str, "device", 6))
                 {
@@ -243,12 +330,48 @@ void parseConfig()
                         getData(line_str, temp_buffer, '"', '"');
                         mb_devices[deviceNumber].rtu_stop_bit = atoi(temp_buffer);
                     }
+                    else if (!strncmp(functionType, "Polling_Period", 14))
+                    {
+                        char temp_buffer[10];
+                        getData(line_str, temp_buffer, '"', '"');
+                        mb_devices[deviceNumber].polling_period = atoi(temp_buffer);
+                    }
                     else if (!strncmp(functionType, "RTU_TX_Pause", 12))
                     {
                         char temp_buffer[10];
                         getData(line_str, temp_buffer, '"', '"');
                         mb_devices[deviceNumber].rtu_tx_pause = atoi(temp_buffer);
                     }
+                    else if (!strncmp(functionType, "Write_On_Change", 15))
+                    {
+                        char temp_buffer[10];
+                        getData(line_str, temp_buffer, '"', '"');
+                        mb_devices[deviceNumber].write_on_change = !strncmp(temp_buffer, "true", 4);
+                    }
+                    else if (!strncmp(functionType, "Write_Deadband", 14))
+                    {
+                        char temp_buffer[10];
+                        getData(line_str, temp_buffer, '"', '"');
+                        mb_devices[deviceNumber].write_deadband = atoi(temp_buffer);
+                    }
+                    else if (!strncmp(functionType, "Write_Signed", 12))
+                    {
+                        char temp_buffer[10];
+                        getData(line_str, temp_buffer, '"', '"');
+                        mb_devices[deviceNumber].write_signed = !strncmp(temp_buffer, "true", 4);
+                    }
+                    else if (!strncmp(functionType, "Write_Refresh_Period", 20))
+                    {
+                        char temp_buffer[10];
+                        getData(line_str, temp_buffer, '"', '"');
+                        mb_devices[deviceNumber].write_refresh_period = atoi(temp_buffer);
+                    }
+                    else if (!strncmp(functionType, "Read_Write_Multiple", 19))
+                    {
+                        char temp_buffer[10];
+                        getData(line_str, temp_buffer, '"', '"');
+                        mb_devices[deviceNumber].read_write_multiple = !strncmp(temp_buffer, "true", 4);
+                    }
                     else if (!strncmp(functionType, "Discrete_Inputs_Start", 21))
                     {
                         char temp_buffer[10];
@@ -348,264 +471,634 @@ void parseConfig()
 
 
 //-----------------------------------------------------------------------------
-// Thread to poll each slave device
+// Returns the value of the monotonic clock in milliseconds
 //-----------------------------------------------------------------------------
-void *querySlaveDevices(void *arg)
+uint64_t getMonotonicMs()
 {
-    while (run_openplc)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//-----------------------------------------------------------------------------
+// Increments the communication error counter (%ML1026)
+//-----------------------------------------------------------------------------
+void countCommError()
+{
+    if (special_functions[2] != NULL) __atomic_add_fetch(special_functions[2], 1, __ATOMIC_RELAXED);
+}
+
+//-----------------------------------------------------------------------------
+// Returns the name of a request, used on log messages
+//-----------------------------------------------------------------------------
+const char *requestName(uint8_t function)
+{
+    switch (function)
     {
-        unsigned char log_msg[1000];
-        
-        uint16_t bool_input_index = 0;
-        uint16_t bool_output_index = 0;
-        uint16_t int_input_index = 0;
-        uint16_t int_output_index = 0;
+        case MB_FC_READ_INPUTS:
+            return "Read Discrete Input Registers";
+        case MB_FC_READ_HOLDING_REGISTERS:
+            return "Read Holding Registers";
+        case MB_FC_READ_INPUT_REGISTERS:
+            return "Read Input Registers";
+        case MB_FC_WRITE_MULTIPLE_COILS:
+            return "Write Coils";
+        case MB_FC_WRITE_MULTIPLE_REGISTERS:
+            return "Write Holding Registers";
+        case MB_FC_WRITE_READ_REGISTERS:
+            return "Write/Read Holding Registers";
+    }
+    return "Request";
+}
 
-        for (int i = 0; i < num_devices; i++)
+//-----------------------------------------------------------------------------
+// Copies the data received for a set of segments to the I/O buffer. The
+// caller must hold ioLock
+//-----------------------------------------------------------------------------
+void scatterSegments(struct MB_segment *segments, int num_segments, uint16_t start_address,
+                     void *data, void *buffer, int point_size)
+{
+    for (int s = 0; s < num_segments; s++)
+    {
+        memcpy((uint8_t *)buffer + segments[s].buffer_index * point_size,
+               (uint8_t *)data + (segments[s].start_address - start_address) * point_size,
+               segments[s].num_regs * point_size);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Copies the data to be sent for a set of segments from the I/O buffer. The
+// caller must hold ioLock
+//-----------------------------------------------------------------------------
+void gatherSegments(struct MB_segment *segments, int num_segments, uint16_t start_address,
+                    void *data, void *buffer, int point_size)
+{
+    for (int s = 0; s < num_segments; s++)
+    {
+        memcpy((uint8_t *)data + (segments[s].start_address - start_address) * point_size,
+               (uint8_t *)buffer + segments[s].buffer_index * point_size,
+               segments[s].num_regs * point_size);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Marks the points of a write that must be sent to the slave: the ones that
+// moved more than their deadband away from the last value written, or all of
+// them if the last values written are unknown. Signed registers are compared
+// as int16_t, so -1 to 0 is a step of 1 and not of 65535. Returns the number
+// of points marked
+//-----------------------------------------------------------------------------
+int findChanges(struct MB_request *request, struct MB_segment *segments, int num_segments, uint16_t start_address,
+                void *data, int point_size, bool *changed)
+{
+    int count = 0;
+
+    for (int s = 0; s < num_segments; s++)
+    {
+        for (int j = 0; j < segments[s].num_regs; j++)
         {
-            //Check if there is a connected RTU device using the same port
-            bool found_sharing = false;
-            bool rtu_port_connected = false;
-            if (mb_devices[i].protocol == MB_RTU)
+            int offset = segments[s].start_address - start_address + j;
+            int value = (point_size == sizeof(uint8_t)) ? ((uint8_t *)data)[offset] : ((uint16_t *)data)[offset];
+            int last_value = request->shadow[offset];
+            if (point_size != sizeof(uint8_t) && segments[s].is_signed)
             {
-                for (int a = 0; a < num_devices; a++)
-                {
-                    if (a != i && !strcmp(mb_devices[i].dev_address, mb_devices[a].dev_address))
-                    {
-                        found_sharing = true;
-                        if (mb_devices[a].isConnected)
-                        {
-                            rtu_port_connected = true;
-                        }
-                    }
-                }
-                if (found_sharing)
-                {
-                    //Must reset mb context to current device's slave id
-                    modbus_set_slave(mb_devices[i].mb_ctx, mb_devices[i].dev_id);
-                }
+                value = (int16_t)value;
+                last_value = (int16_t)last_value;
             }
+            int difference = abs(value - last_value);
 
-            //Verify if device is connected
-            if (!mb_devices[i].isConnected && !rtu_port_connected)
+            changed[offset] = !request->shadow_valid || segments[s].deadband < 0 || difference > segments[s].deadband;
+            if (changed[offset]) count++;
+        }
+    }
+
+    return count;
+}
+
+//-----------------------------------------------------------------------------
+// Writes the points of a FC15 or FC16 request that changed. Changed points
+// close to each other are sent together. Single points are sent with FC5 or
+// FC6 only on devices with Write_On_Change, since slaves configured for
+// FC15/FC16 may not support the single write functions. Returns -1 on error
+//-----------------------------------------------------------------------------
+int writeChanges(struct MB_device *device, struct MB_request *request, void *data, int point_size)
+{
+    bool changed[MODBUS_MAX_WRITE_BITS];
+    int max_gap = (point_size == sizeof(uint8_t)) ? MB_WRITE_GAP * 16 : MB_WRITE_GAP;
+    uint8_t *bits = (uint8_t *)data;
+    uint16_t *registers = (uint16_t *)data;
+
+    findChanges(request, &device->segments[request->first_segment], request->num_segments, request->start_address,
+                data, point_size, changed);
+
+    int offset = 0;
+    while (offset < request->num_regs)
+    {
+        if (!changed[offset])
+        {
+            offset++;
+            continue;
+        }
+
+        int last = offset;
+        for (int next = offset + 1; next < request->num_regs && next - last <= max_gap + 1; next++)
+        {
+            if (changed[next]) last = next;
+        }
+
+        int count = last - offset + 1;
+        int address = request->start_address + offset;
+        int return_val;
+
+        //Only points of devices with Write_On_Change have a deadband
+        bool single_write = false;
+        for (int s = 0; count == 1 && s < request->num_segments; s++)
+        {
+            struct MB_segment *segment = &device->segments[request->first_segment + s];
+            if (address >= segment->start_address && address < segment->start_address + segment->num_regs)
+                single_write = (segment->deadband >= 0);
+        }
+        if (point_size == sizeof(uint8_t))
+        {
+            if (single_write) return_val = modbus_write_bit(device->mb_ctx, address, bits[offset]);
+            else return_val = modbus_write_bits(device->mb_ctx, address, count, &bits[offset]);
+        }
+        else
+        {
+            if (single_write) return_val = modbus_write_register(device->mb_ctx, address, registers[offset]);
+            else return_val = modbus_write_registers(device->mb_ctx, address, count, &registers[offset]);
+        }
+        if (return_val == -1) return -1;
+
+        for (int j = offset; j <= last; j++)
+        {
+            request->shadow[j] = (point_size == sizeof(uint8_t)) ? bits[j] : registers[j];
+        }
+        offset = last + 1;
+    }
+
+    request->shadow_valid = true;
+    return request->num_regs;
+}
+
+//-----------------------------------------------------------------------------
+// Sends a single request to the slave and moves its data to or from the I/O
+// buffers. Returns -1 on error
+//-----------------------------------------------------------------------------
+int sendRequest(struct MB_device *device, struct MB_request *request)
+{
+    uint8_t bits[MODBUS_MAX_READ_BITS];
+    uint16_t registers[MODBUS_MAX_READ_REGISTERS];
+    uint16_t write_registers[MODBUS_MAX_WRITE_REGISTERS];
+    bool changed[MODBUS_MAX_WRITE_REGISTERS];
+    struct MB_segment *segments = &device->segments[request->first_segment];
+    struct MB_segment *write_segments = &device->segments[request->first_write_segment];
+    int return_val = -1;
+
+    switch (request->function)
+    {
+        case MB_FC_READ_INPUTS:
+            return_val = modbus_read_input_bits(device->mb_ctx, request->start_address, request->num_regs, bits);
+            if (return_val != -1)
             {
-                sprintf(log_msg, "Device %s is disconnected. Attempting to reconnect...\n", mb_devices[i].dev_name);
-                log(log_msg);
-                if (modbus_connect(mb_devices[i].mb_ctx) == -1)
-                {
+                pthread_mutex_lock(&ioLock);
+                scatterSegments(segments, request->num_segments, request->start_address, bits, bool_input_buf, sizeof(uint8_t));
+                pthread_mutex_unlock(&ioLock);
+            }
+            break;
 
-                    sprintf(log_msg, "Connection failed on MB device %s: %s\n", mb_devices[i].dev_name, modbus_strerror(errno));
-                    log(log_msg);
-                    
-                    if (special_functions[2] != NULL) *special_functions[2]++;
-                    
-                    // Because this device is not connected, we skip those input registers
-                    bool_input_index += (mb_devices[i].discrete_inputs.num_regs);
-                    int_input_index += (mb_devices[i].input_registers.num_regs);
-                    int_input_index += (mb_devices[i].holding_read_registers.num_regs);
-                    bool_output_index += (mb_devices[i].coils.num_regs);
-                    int_output_index += (mb_devices[i].holding_registers.num_regs);
-                }
-                else
+        case MB_FC_WRITE_MULTIPLE_COILS:
+            pthread_mutex_lock(&ioLock);
+            gatherSegments(segments, request->num_segments, request->start_address, bits, bool_output_buf, sizeof(uint8_t));
+            pthread_mutex_unlock(&ioLock);
+            return_val = writeChanges(device, request, bits, sizeof(uint8_t));
+            break;
+
+        case MB_FC_READ_INPUT_REGISTERS:
+            return_val = modbus_read_input_registers(device->mb_ctx, request->start_address, request->num_regs, registers);
+            if (return_val != -1)
+            {
+                pthread_mutex_lock(&ioLock);
+                scatterSegments(segments, request->num_segments, request->start_address, registers, int_input_buf, sizeof(uint16_t));
+                pthread_mutex_unlock(&ioLock);
+            }
+            break;
+
+        case MB_FC_READ_HOLDING_REGISTERS:
+            return_val = modbus_read_registers(device->mb_ctx, request->start_address, request->num_regs, registers);
+            if (return_val != -1)
+            {
+                pthread_mutex_lock(&ioLock);
+                scatterSegments(segments, request->num_segments, request->start_address, registers, int_input_buf, sizeof(uint16_t));
+                pthread_mutex_unlock(&ioLock);
+            }
+            break;
+
+        case MB_FC_WRITE_MULTIPLE_REGISTERS:
+            pthread_mutex_lock(&ioLock);
+            gatherSegments(segments, request->num_segments, request->start_address, registers, int_output_buf, sizeof(uint16_t));
+            pthread_mutex_unlock(&ioLock);
+            return_val = writeChanges(device, request, registers, sizeof(uint16_t));
+            break;
+
+        case MB_FC_WRITE_READ_REGISTERS:
+            pthread_mutex_lock(&ioLock);
+            gatherSegments(write_segments, request->num_write_segments, request->write_start_address, write_registers, int_output_buf, sizeof(uint16_t));
+            pthread_mutex_unlock(&ioLock);
+
+            //Only the span that changed is written. If nothing changed this
+            //is just a read
+            if (findChanges(request, write_segments, request->num_write_segments, request->write_start_address,
+                            write_registers, sizeof(uint16_t), changed) == 0)
+            {
+                return_val = modbus_read_registers(device->mb_ctx, request->start_address, request->num_regs, registers);
+            }
+            else
+            {
+                int first = 0, last = request->write_num_regs - 1;
+                while (!changed[first]) first++;
+                while (!changed[last]) last--;
+
+                return_val = modbus_write_and_read_registers(device->mb_ctx, request->write_start_address + first, last - first + 1, &write_registers[first],
+                                                             request->start_address, request->num_regs, registers);
+                if (return_val != -1)
                 {
-                    sprintf(log_msg, "Connected to MB device %s\n", mb_devices[i].dev_name);
-                    log(log_msg);
-                    mb_devices[i].isConnected = true;
+                    for (int j = first; j <= last; j++) request->shadow[j] = write_registers[j];
                 }
             }
-            if (mb_devices[i].isConnected || rtu_port_connected)
+
+            if (return_val != -1)
             {
+                request->shadow_valid = true;
+                pthread_mutex_lock(&ioLock);
+                scatterSegments(segments, request->num_segments, request->start_address, registers, int_input_buf, sizeof(uint16_t));
+                pthread_mutex_unlock(&ioLock);
+            }
+            break;
+    }
+
+    return return_val;
+}
 
-                struct timespec ts;
-                ts.tv_sec = 0;
-                if (mb_devices[i].protocol == MB_RTU)
+//-----------------------------------------------------------------------------
+// Forgets the last values written to the slave, so that all outputs are
+// written on the next poll
+//-----------------------------------------------------------------------------
+void invalidateShadows(struct MB_device *device)
+{
+    for (int r = 0; r < device->num_requests; r++)
+    {
+        device->requests[r].shadow_valid = false;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Polls a group of devices on the same slave: reads their inputs and writes
+// their outputs. Returns false if the slave could not be reached, or if none
+// of the requests sent to an RTU slave succeeded
+//-----------------------------------------------------------------------------
+bool pollDevice(int i)
+{
+    unsigned char log_msg[1000];
+    struct MB_device *device = &mb_devices[i];
+
+    //The connection state is kept by the first device on the bus, as all
+    //devices on the bus share the same context
+    struct MB_device *port = &mb_devices[device->bus];
+
+    //Must reset mb context to current device's slave id in case it is shared
+    modbus_set_slave(device->mb_ctx, device->dev_id);
+
+    //Verify if device is connected
+    if (!port->isConnected)
+    {
+        sprintf(log_msg, "Device %s is disconnected. Attempting to reconnect...\n", device->dev_name);
+        log(log_msg);
+        if (modbus_connect(device->mb_ctx) == -1)
+        {
+            sprintf(log_msg, "Connection failed on MB device %s: %s\n", device->dev_name, modbus_strerror(errno));
+            log(log_msg);
+            countCommError();
+            return false;
+        }
+
+        sprintf(log_msg, "Connected to MB device %s\n", device->dev_name);
+        log(log_msg);
+        port->isConnected = true;
+        invalidateShadows(device);
+    }
+
+    //Periodic full refresh of the outputs
+    if (device->refresh_period != 0 && getMonotonicMs() >= device->next_refresh)
+    {
+        invalidateShadows(device);
+        device->next_refresh = getMonotonicMs() + device->refresh_period;
+    }
+
+    struct timespec ts;
+    ts.tv_sec = 0;
+    if (device->protocol == MB_RTU)
+    {
+        ts.tv_nsec = (1000*1000*1000*28)/device->rtu_baud;
+    }
+    else
+    {
+        ts.tv_nsec = 0;
+    }
+
+    int failures = 0;
+    for (int r = 0; r < device->num_requests; r++)
+    {
+        sleepms(device->rtu_tx_pause);
+        nanosleep(&ts, NULL);
+
+        if (sendRequest(device, &device->requests[r]) == -1)
+        {
+            sprintf(log_msg, "Modbus %s failed on MB device %s: %s\n", requestName(device->requests[r].function), device->dev_name, modbus_strerror(errno));
+            log(log_msg);
+            countCommError();
+            failures++;
+
+            //The slave may have lost its outputs, so write all of them on the
+            //next poll
+            invalidateShadows(device);
+
+            //TCP devices are disconnected when a transaction fails
+            if (device->protocol != MB_RTU)
+            {
+                modbus_close(device->mb_ctx);
+                port->isConnected = false;
+                return false;
+            }
+        }
+    }
+
+    //RTU slaves have no connection to lose. One that doesn't answer any
+    //request is retried with the same backoff as a TCP slave
+    return (device->num_requests == 0 || failures < device->num_requests);
+}
+
+//-----------------------------------------------------------------------------
+// Thread to poll the slave devices of a bus. Every TCP device is a bus of its
+// own, while RTU devices sharing the same port are polled one after the other
+// by the same thread. Each device is polled at its own rate, and devices that
+// can't be reached are retried with an exponential backoff
+//-----------------------------------------------------------------------------
+void *querySlaveDevices(void *arg)
+{
+    int bus = (int)(intptr_t)arg;
+
+    while (run_openplc)
+    {
+        uint64_t now = getMonotonicMs();
+        uint64_t next_wakeup = now + 100;
+
+        for (int i = 0; i < num_devices; i++)
+        {
+            if (mb_devices[i].bus != bus || mb_devices[i].poll_group != i) continue;
+
+            if (mb_devices[i].next_poll <= now)
+            {
+                if (pollDevice(i))
                 {
-                    ts.tv_nsec = (1000*1000*1000*28)/mb_devices[i].rtu_baud;
+                    mb_devices[i].reconnect_delay = mb_devices[i].polling_period;
+                    mb_devices[i].next_poll += mb_devices[i].polling_period;
                 }
                 else
                 {
-                    ts.tv_nsec = 0;                    
+                    mb_devices[i].next_poll = now + mb_devices[i].reconnect_delay;
+                    mb_devices[i].reconnect_delay *= 2;
+                    if (mb_devices[i].reconnect_delay > MAX_RECONNECT_DELAY) mb_devices[i].reconnect_delay = MAX_RECONNECT_DELAY;
                 }
 
-                //Read discrete inputs
-                if (mb_devices[i].discrete_inputs.num_regs != 0)
-                {
-                    sleepms(mb_devices[i].rtu_tx_pause);
-                    uint8_t *tempBuff;
-                    tempBuff = (uint8_t *)malloc(mb_devices[i].discrete_inputs.num_regs);
-                    nanosleep(&ts, NULL); 
-                    int return_val = modbus_read_input_bits(mb_devices[i].mb_ctx, mb_devices[i].discrete_inputs.start_address,
-                                                            mb_devices[i].discrete_inputs.num_regs, tempBuff);
-                    if (return_val == -1)
-                    {
-                        if (mb_devices[i].protocol != MB_RTU)
-                        {
-                            modbus_close(mb_devices[i].mb_ctx);
-                            mb_devices[i].isConnected = false;
-                        }
-                        
-                        sprintf(log_msg, "Modbus Read Discrete Input Registers failed on MB device %s: %s\n", mb_devices[i].dev_name, modbus_strerror(errno));
-                        log(log_msg);
-                        bool_input_index += (mb_devices[i].discrete_inputs.num_regs);
-                        if (special_functions[2] != NULL) *special_functions[2]++;
-                    }
-                    else
-                    {
-                        pthread_mutex_lock(&ioLock);
-                        for (int j = 0; j < return_val; j++)
-                        {
-                            bool_input_buf[bool_input_index] = tempBuff[j];
-                            bool_input_index++;
-                        }
-                        pthread_mutex_unlock(&ioLock);
-                    }
+                //don't try to catch up with polls missed while the bus was busy
+                now = getMonotonicMs();
+                if (mb_devices[i].next_poll < now) mb_devices[i].next_poll = now;
+            }
 
-                    free(tempBuff);
-                }
+            if (mb_devices[i].next_poll < next_wakeup) next_wakeup = mb_devices[i].next_poll;
+        }
 
-                //Write coils
-                if (mb_devices[i].coils.num_regs != 0)
-                {
-                    sleepms(mb_devices[i].rtu_tx_pause);
-                    uint8_t *tempBuff;
-                    tempBuff = (uint8_t *)malloc(mb_devices[i].coils.num_regs);
+        if (next_wakeup > now) sleepms(next_wakeup - now);
+    }
+}
 
-                    pthread_mutex_lock(&ioLock);
-                    for (int j = 0; j < mb_devices[i].coils.num_regs; j++)
-                    {
-                        tempBuff[j] = bool_output_buf[bool_output_index];
-                        bool_output_index++;
-                    }
-                    pthread_mutex_unlock(&ioLock);
+//-----------------------------------------------------------------------------
+// Reserves space for a range of points on a Modbus master buffer. Ranges that
+// don't fit on the I/O image are truncated. Returns the position of the range
+// on the buffer
+//-----------------------------------------------------------------------------
+uint16_t mapRange(struct MB_address *range, int *buffer_size, int max_size, char *dev_name)
+{
+    uint16_t index = *buffer_size;
 
-                    nanosleep(&ts, NULL); 
-                    int return_val = modbus_write_bits(mb_devices[i].mb_ctx, mb_devices[i].coils.start_address, mb_devices[i].coils.num_regs, tempBuff);
-                    if (return_val == -1)
-                    {
-                        if (mb_devices[i].protocol != MB_RTU)
-                        {
-                            modbus_close(mb_devices[i].mb_ctx);
-                            mb_devices[i].isConnected = false;
-                        }
-
-                        sprintf(log_msg, "Modbus Write Coils failed on MB device %s: %s\n", mb_devices[i].dev_name, modbus_strerror(errno));
-                        log(log_msg);
-                        if (special_functions[2] != NULL) *special_functions[2]++;
-                    }
-                    
-                    free(tempBuff);
-                }
+    if (*buffer_size + range->num_regs > max_size)
+    {
+        unsigned char log_msg[1000];
+        sprintf(log_msg, "Warning: MB device %s has more points than the I/O image can hold. Range truncated\n", dev_name);
+        log(log_msg);
+        range->num_regs = max_size - *buffer_size;
+    }
+    *buffer_size += range->num_regs;
 
-                //Read input registers
-                if (mb_devices[i].input_registers.num_regs != 0)
-                {
-                    sleepms(mb_devices[i].rtu_tx_pause);
-                    uint16_t *tempBuff;
-                    tempBuff = (uint16_t *)malloc(2*mb_devices[i].input_registers.num_regs);
-                    nanosleep(&ts, NULL); 
-                    int return_val = modbus_read_input_registers(    mb_devices[i].mb_ctx, mb_devices[i].input_registers.start_address,
-                                                                    mb_devices[i].input_registers.num_regs, tempBuff);
-                    if (return_val == -1)
-                    {
-                        if (mb_devices[i].protocol != MB_RTU)
-                        {
-                            modbus_close(mb_devices[i].mb_ctx);
-                            mb_devices[i].isConnected = false;
-                        }
-                        
-                        sprintf(log_msg, "Modbus Read Input Registers failed on MB device %s: %s\n", mb_devices[i].dev_name, modbus_strerror(errno));
-                        log(log_msg);
-                        int_input_index += (mb_devices[i].input_registers.num_regs);
-                        if (special_functions[2] != NULL) *special_functions[2]++;
-                    }
-                    else
-                    {
-                        pthread_mutex_lock(&ioLock);
-                        for (int j = 0; j < return_val; j++)
-                        {
-                            int_input_buf[int_input_index] = tempBuff[j];
-                            int_input_index++;
-                        }
-                        pthread_mutex_unlock(&ioLock);
-                    }
+    return index;
+}
 
-                    free(tempBuff);
-                }
+//-----------------------------------------------------------------------------
+// Sorts segments by address
+//-----------------------------------------------------------------------------
+int compareSegments(const void *a, const void *b)
+{
+    return (int)((struct MB_segment *)a)->start_address - (int)((struct MB_segment *)b)->start_address;
+}
 
-                //Read holding registers
-                if (mb_devices[i].holding_read_registers.num_regs != 0)
-                {
-                    sleepms(mb_devices[i].rtu_tx_pause);
-                    uint16_t *tempBuff;
-                    tempBuff = (uint16_t *)malloc(2*mb_devices[i].holding_read_registers.num_regs);
-                    nanosleep(&ts, NULL); 
-                    int return_val = modbus_read_registers(mb_devices[i].mb_ctx, mb_devices[i].holding_read_registers.start_address,
-                                                           mb_devices[i].holding_read_registers.num_regs, tempBuff);
-                    if (return_val == -1)
-                    {
-                        if (mb_devices[i].protocol != MB_RTU)
-                        {
-                            modbus_close(mb_devices[i].mb_ctx);
-                            mb_devices[i].isConnected = false;
-                        }
-                        sprintf(log_msg, "Modbus Read Holding Registers failed on MB device %s: %s\n", mb_devices[i].dev_name, modbus_strerror(errno));
-                        log(log_msg);
-                        int_input_index += (mb_devices[i].holding_read_registers.num_regs);
-                        if (special_functions[2] != NULL) *special_functions[2]++;
-                    }
-                    else
-                    {
-                        pthread_mutex_lock(&ioLock);
-                        for (int j = 0; j < return_val; j++)
-                        {
-                            int_input_buf[int_input_index] = tempBuff[j];
-                            int_input_index++;
-                        }
-                        pthread_mutex_unlock(&ioLock);
-                    }
+//-----------------------------------------------------------------------------
+// Adds the requests needed to transfer a set of ranges to the device. Ranges
+// bigger than max_size are split, and then ranges up to max_gap addresses
+// apart are merged into as few requests as possible. Writes are only merged
+// when the ranges are adjacent, so that no address outside of them is written
+//-----------------------------------------------------------------------------
+void planRequests(struct MB_device *device, uint8_t function, struct MB_segment *ranges, int num_ranges, int max_size, int max_gap)
+{
+    bool is_write = (function == MB_FC_WRITE_MULTIPLE_COILS || function == MB_FC_WRITE_MULTIPLE_REGISTERS);
+    int first = device->num_segments;
 
-                    free(tempBuff);
-                }
+    for (int r = 0; r < num_ranges; r++)
+    {
+        for (int offset = 0; offset < ranges[r].num_regs; offset += max_size)
+        {
+            int size = ranges[r].num_regs - offset;
+            if (size > max_size) size = max_size;
 
-                //Write holding registers
-                if (mb_devices[i].holding_registers.num_regs != 0)
-                {
-                    sleepms(mb_devices[i].rtu_tx_pause);
-                    uint16_t *tempBuff;
-                    tempBuff = (uint16_t *)malloc(2*mb_devices[i].holding_registers.num_regs);
+            device->segments = (struct MB_segment *)realloc(device->segments, (device->num_segments + 1) * sizeof(struct MB_segment));
+            struct MB_segment *segment = &device->segments[device->num_segments++];
+            segment->start_address = ranges[r].start_address + offset;
+            segment->num_regs = size;
+            segment->buffer_index = ranges[r].buffer_index + offset;
+            segment->deadband = ranges[r].deadband;
+            segment->is_signed = ranges[r].is_signed;
+        }
+    }
+    qsort(&device->segments[first], device->num_segments - first, sizeof(struct MB_segment), compareSegments);
 
-                    pthread_mutex_lock(&ioLock);
-                    for (int j = 0; j < mb_devices[i].holding_registers.num_regs; j++)
-                    {
-                        tempBuff[j] = int_output_buf[int_output_index];
-                        int_output_index++;
-                    }
-                    pthread_mutex_unlock(&ioLock);
+    struct MB_request *request = NULL;
+    for (int s = first; s < device->num_segments; s++)
+    {
+        struct MB_segment *segment = &device->segments[s];
+        int segment_end = segment->start_address + segment->num_regs;
 
-                    nanosleep(&ts, NULL); 
-                    int return_val = modbus_write_registers(mb_devices[i].mb_ctx, mb_devices[i].holding_registers.start_address,
-                                                            mb_devices[i].holding_registers.num_regs, tempBuff);
-                    if (return_val == -1)
-                    {
-                        if (mb_devices[i].protocol != MB_RTU)
-                        {
-                            modbus_close(mb_devices[i].mb_ctx);
-                            mb_devices[i].isConnected = false;
-                        }
-                        
-                        sprintf(log_msg, "Modbus Write Holding Registers failed on MB device %s: %s\n", mb_devices[i].dev_name, modbus_strerror(errno));
-                        log(log_msg);
-                        if (special_functions[2] != NULL) *special_functions[2]++;
-                    }
-                    
-                    free(tempBuff);
-                }
+        if (request != NULL)
+        {
+            int request_end = request->start_address + request->num_regs;
+            int new_end = (segment_end > request_end) ? segment_end : request_end;
+            bool close_enough = is_write ? (segment->start_address == request_end) : (segment->start_address <= request_end + max_gap);
+
+            if (close_enough && new_end - request->start_address <= max_size)
+            {
+                request->num_regs = new_end - request->start_address;
+                request->num_segments++;
+                continue;
             }
         }
-        sleepms(polling_period);
+
+        device->requests = (struct MB_request *)realloc(device->requests, (device->num_requests + 1) * sizeof(struct MB_request));
+        request = &device->requests[device->num_requests++];
+        memset(request, 0, sizeof(struct MB_request));
+        request->function = function;
+        request->start_address = segment->start_address;
+        request->num_regs = segment->num_regs;
+        request->first_segment = s;
+        request->num_segments = 1;
+        if (is_write) request->shadow = (uint16_t *)calloc(max_size, sizeof(uint16_t));
     }
 }
 
+//-----------------------------------------------------------------------------
+// Joins holding register writes with holding register reads into FC23
+// requests, so that each pair takes a single round trip
+//-----------------------------------------------------------------------------
+void pairRequests(struct MB_device *device)
+{
+    int w = 0;
+    for (int r = 0; r < device->num_requests; r++)
+    {
+        struct MB_request *read = &device->requests[r];
+        if (read->function != MB_FC_READ_HOLDING_REGISTERS) continue;
+
+        while (w < device->num_requests && device->requests[w].function != MB_FC_WRITE_MULTIPLE_REGISTERS) w++;
+        if (w == device->num_requests) break;
+
+        struct MB_request *write = &device->requests[w];
+        read->function = MB_FC_WRITE_READ_REGISTERS;
+        read->write_start_address = write->start_address;
+        read->write_num_regs = write->num_regs;
+        read->first_write_segment = write->first_segment;
+        read->num_write_segments = write->num_segments;
+        read->shadow = write->shadow;
+        write->function = MB_FC_NONE;
+    }
+
+    int count = 0;
+    for (int r = 0; r < device->num_requests; r++)
+    {
+        if (device->requests[r].function != MB_FC_NONE) device->requests[count++] = device->requests[r];
+    }
+    device->num_requests = count;
+}
+
+//-----------------------------------------------------------------------------
+// Builds the list of requests for a poll group out of the ranges of all its
+// devices. Requests are sent in the same order the ranges of a single device
+// used to be: discrete inputs, coils, input registers and holding registers
+//-----------------------------------------------------------------------------
+void planPollGroup(int leader)
+{
+    struct MB_device *device = &mb_devices[leader];
+    struct MB_segment *ranges = (struct MB_segment *)calloc(num_devices, sizeof(struct MB_segment));
+    bool read_write_multiple = false;
+    int num_ranges;
+
+    for (int i = 0; i < num_devices; i++)
+    {
+        if (mb_devices[i].poll_group != leader) continue;
+        if (mb_devices[i].read_write_multiple) read_write_multiple = true;
+
+        //The group is refreshed at the fastest rate asked by its devices
+        uint32_t refresh_period = mb_devices[i].write_refresh_period;
+        if (mb_devices[i].write_on_change && refresh_period != 0 && (device->refresh_period == 0 || refresh_period < device->refresh_period))
+            device->refresh_period = refresh_period;
+    }
+
+    //Discrete inputs
+    num_ranges = 0;
+    for (int i = 0; i < num_devices; i++)
+    {
+        if (mb_devices[i].poll_group != leader || mb_devices[i].discrete_inputs.num_regs == 0) continue;
+        ranges[num_ranges].start_address = mb_devices[i].discrete_inputs.start_address;
+        ranges[num_ranges].num_regs = mb_devices[i].discrete_inputs.num_regs;
+        ranges[num_ranges].buffer_index = mb_devices[i].bool_input_index;
+        num_ranges++;
+    }
+    planRequests(device, MB_FC_READ_INPUTS, ranges, num_ranges, MODBUS_MAX_READ_BITS, max_read_gap * 16);
+
+    //Coils
+    num_ranges = 0;
+    for (int i = 0; i < num_devices; i++)
+    {
+        if (mb_devices[i].poll_group != leader || mb_devices[i].coils.num_regs == 0) continue;
+        ranges[num_ranges].start_address = mb_devices[i].coils.start_address;
+        ranges[num_ranges].num_regs = mb_devices[i].coils.num_regs;
+        ranges[num_ranges].buffer_index = mb_devices[i].bool_output_index;
+        ranges[num_ranges].deadband = mb_devices[i].write_on_change ? 0 : -1;
+        ranges[num_ranges].is_signed = false;
+        num_ranges++;
+    }
+    planRequests(device, MB_FC_WRITE_MULTIPLE_COILS, ranges, num_ranges, MODBUS_MAX_WRITE_BITS, 0);
+
+    //Input registers
+    num_ranges = 0;
+    for (int i = 0; i < num_devices; i++)
+    {
+        if (mb_devices[i].poll_group != leader || mb_devices[i].input_registers.num_regs == 0) continue;
+        ranges[num_ranges].start_address = mb_devices[i].input_registers.start_address;
+        ranges[num_ranges].num_regs = mb_devices[i].input_registers.num_regs;
+        ranges[num_ranges].buffer_index = mb_devices[i].int_input_index;
+        num_ranges++;
+    }
+    planRequests(device, MB_FC_READ_INPUT_REGISTERS, ranges, num_ranges, MODBUS_MAX_READ_REGISTERS, max_read_gap);
+
+    //Holding registers (read). They are stored right after the input registers
+    num_ranges = 0;
+    for (int i = 0; i < num_devices; i++)
+    {
+        if (mb_devices[i].poll_group != leader || mb_devices[i].holding_read_registers.num_regs == 0) continue;
+        ranges[num_ranges].start_address = mb_devices[i].holding_read_registers.start_address;
+        ranges[num_ranges].num_regs = mb_devices[i].holding_read_registers.num_regs;
+        ranges[num_ranges].buffer_index = mb_devices[i].int_input_index + mb_devices[i].input_registers.num_regs;
+        num_ranges++;
+    }
+    planRequests(device, MB_FC_READ_HOLDING_REGISTERS, ranges, num_ranges, MODBUS_MAX_READ_REGISTERS, max_read_gap);
+
+    //Holding registers (write)
+    num_ranges = 0;
+    for (int i = 0; i < num_devices; i++)
+    {
+        if (mb_devices[i].poll_group != leader || mb_devices[i].holding_registers.num_regs == 0) continue;
+        ranges[num_ranges].start_address = mb_devices[i].holding_registers.start_address;
+        ranges[num_ranges].num_regs = mb_devices[i].holding_registers.num_regs;
+        ranges[num_ranges].buffer_index = mb_devices[i].int_output_index;
+        ranges[num_ranges].deadband = mb_devices[i].write_on_change ? mb_devices[i].write_deadband : -1;
+        ranges[num_ranges].is_signed = mb_devices[i].write_signed;
+        num_ranges++;
+    }
+    planRequests(device, MB_FC_WRITE_MULTIPLE_REGISTERS, ranges, num_ranges,
+                 read_write_multiple ? MODBUS_MAX_WR_WRITE_REGISTERS : MODBUS_MAX_WRITE_REGISTERS, 0);
+
+    if (read_write_multiple) pairRequests(device);
+
+    free(ranges);
+}
+
 //-----------------------------------------------------------------------------
 // This function is called by the main OpenPLC routine when it is initializing.
 // Modbus master initialization procedures are here.
@@ -616,9 +1109,39 @@ void initializeMB()
 
     for (int i = 0; i < num_devices; i++)
     {
+        //Devices are mapped to the I/O buffers in the order they are declared
+        mb_devices[i].bool_input_index = mapRange(&mb_devices[i].discrete_inputs, &num_bool_inputs, MAX_MB_BOOL, mb_devices[i].dev_name);
+        mb_devices[i].bool_output_index = mapRange(&mb_devices[i].coils, &num_bool_outputs, MAX_MB_BOOL, mb_devices[i].dev_name);
+        mb_devices[i].int_input_index = mapRange(&mb_devices[i].input_registers, &num_int_inputs, MAX_MB_INT, mb_devices[i].dev_name);
+        mapRange(&mb_devices[i].holding_read_registers, &num_int_inputs, MAX_MB_INT, mb_devices[i].dev_name);
+        mb_devices[i].int_output_index = mapRange(&mb_devices[i].holding_registers, &num_int_outputs, MAX_MB_INT, mb_devices[i].dev_name);
+
+        if (mb_devices[i].polling_period == 0) mb_devices[i].polling_period = polling_period;
+        mb_devices[i].reconnect_delay = mb_devices[i].polling_period;
+        mb_devices[i].bus = i;
+
         if (mb_devices[i].protocol == MB_TCP)
         {
-            mb_devices[i].mb_ctx = modbus_new_tcp(mb_devices[i].dev_address, mb_devices[i].ip_port);
+            //Devices on the same server share the connection
+            int share_index = -1;
+            for (int a = 0; a < i; a++)
+            {
+                if (mb_devices[a].protocol == MB_TCP && mb_devices[i].ip_port == mb_devices[a].ip_port &&
+                    strcmp(mb_devices[i].dev_address, mb_devices[a].dev_address) == 0)
+                {
+                    share_index = a;
+                    break;
+                }
+            }
+            if (share_index != -1)
+            {
+                mb_devices[i].mb_ctx = mb_devices[share_index].mb_ctx;
+                mb_devices[i].bus = mb_devices[share_index].bus;
+            }
+            else
+            {
+                mb_devices[i].mb_ctx = modbus_new_tcp(mb_devices[i].dev_address, mb_devices[i].ip_port);
+            }
         }
         else if (mb_devices[i].protocol == MB_RTU)
         {
@@ -642,6 +1165,7 @@ void initializeMB()
                     log(log_msg);
                 }
                 mb_devices[i].mb_ctx = mb_devices[share_index].mb_ctx;
+                mb_devices[i].bus = mb_devices[share_index].bus;
             }
             else
             {
@@ -662,14 +1186,42 @@ void initializeMB()
         modbus_set_response_timeout(mb_devices[i].mb_ctx, to_sec, to_usec);
         
     }
+
+    //Ranges of devices on the same slave and with the same polling period
+    //are merged into as few requests as possible
+    for (int i = 0; i < num_devices; i++)
+    {
+        mb_devices[i].poll_group = i;
+        for (int a = 0; a < i; a++)
+        {
+            if (mb_devices[a].bus == mb_devices[i].bus && mb_devices[a].dev_id == mb_devices[i].dev_id &&
+                mb_devices[a].polling_period == mb_devices[i].polling_period)
+            {
+                mb_devices[i].poll_group = mb_devices[a].poll_group;
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < num_devices; i++)
+    {
+        if (mb_devices[i].poll_group == i) planPollGroup(i);
+    }
     
+    bool_input_buf = (uint8_t *)calloc(num_bool_inputs + 1, sizeof(uint8_t));
+    bool_output_buf = (uint8_t *)calloc(num_bool_outputs + 1, sizeof(uint8_t));
+    int_input_buf = (uint16_t *)calloc(num_int_inputs + 1, sizeof(uint16_t));
+    int_output_buf = (uint16_t *)calloc(num_int_outputs + 1, sizeof(uint16_t));
+
     //Initialize comm error counter
     if (special_functions[2] != NULL) *special_functions[2] = 0;
     
-    if (num_devices > 0)
+    //One polling thread per bus
+    for (int i = 0; i < num_devices; i++)
     {
+        if (mb_devices[i].bus != i) continue;
+
         pthread_t thread;
-        int ret = pthread_create(&thread, NULL, querySlaveDevices, NULL);
+        int ret = pthread_create(&thread, NULL, querySlaveDevices, (void *)(intptr_t)i);
         if (ret==0) 
         {
             pthread_detach(thread);
@@ -685,11 +1237,8 @@ void updateBuffersIn_MB()
 {
     pthread_mutex_lock(&ioLock);
 
-    for (int i = 0; i < MAX_MB_IO; i++)
-    {
-        if (bool_input[100+(i/8)][i%8] != NULL) *bool_input[100+(i/8)][i%8] = bool_input_buf[i];
-        if (int_input[100+i] != NULL) *int_input[100+i] = int_input_buf[i];
-    }
+    memcpy(&bool_input_image[MB_IO_OFFSET][0], bool_input_buf, num_bool_inputs);
+    memcpy(&int_input_image[MB_IO_OFFSET], int_input_buf, num_int_inputs * sizeof(uint16_t));
 
     pthread_mutex_unlock(&ioLock);
 }
@@ -703,11 +1252,23 @@ void updateBuffersOut_MB()
 {
     pthread_mutex_lock(&ioLock);
 
-    for (int i = 0; i < MAX_MB_IO; i++)
-    {
-        if (bool_output[100+(i/8)][i%8] != NULL) bool_output_buf[i] = *bool_output[100+(i/8)][i%8];
-        if (int_output[100+i] != NULL) int_output_buf[i] = *int_output[100+i];
-    }
+    memcpy(bool_output_buf, &bool_output_image[MB_IO_OFFSET][0], num_bool_outputs);
+    memcpy(int_output_buf, &int_output_image[MB_IO_OFFSET], num_int_outputs * sizeof(uint16_t));
+
+    pthread_mutex_unlock(&ioLock);
+}
+
+//-----------------------------------------------------------------------------
+// This function is called by the main OpenPLC routine while the watchdog
+// fault is latched. It sets the outputs of the slave devices to their safe
+// state, which is then written by the polling threads
+//-----------------------------------------------------------------------------
+void disableOutputs_MB()
+{
+    pthread_mutex_lock(&ioLock);
+
+    memset(bool_output_buf, 0, num_bool_outputs);
+    memset(int_output_buf, 0, num_int_outputs * sizeof(uint16_t));
 
     pthread_mutex_unlock(&ioLock);
 }
@@ -0,0 +1,249 @@
+//-----------------------------------------------------------------------------
+// Copyright 2026 agent
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file implements the variable monitor used by the web interface. The
+// monitor keeps a list of located variables and returns all their values,
+// taken from the same process image snapshot, in a single binary response:
+//
+//   uint32  size of the rest of the response
+//   uint64  scan cycle of the snapshot
+//   values  one per monitored variable, in the order they were added, with
+//           1 byte for %IX, %QX, %IB and %QB, 2 bytes for %IW, %QW and %MW,
+//           4 bytes for %MD and 8 bytes for %ML
+//
+// All fields are in the byte order of the host running the runtime. Each
+// connection to the interactive server has a list of its own, so clients
+// don't change each other's lists or wait for each other's changes.
+// agent, Oct 2026
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "ladder.h"
+
+#define MONITOR_WAIT_TIMEOUT    1000 //ms
+
+#define MONITOR_BOOL_INPUT      0
+#define MONITOR_BOOL_OUTPUT     1
+#define MONITOR_BYTE_INPUT      2
+#define MONITOR_BYTE_OUTPUT     3
+#define MONITOR_INT_INPUT       4
+#define MONITOR_INT_OUTPUT      5
+#define MONITOR_INT_MEMORY      6
+#define MONITOR_DINT_MEMORY     7
+#define MONITOR_LINT_MEMORY     8
+
+struct monitor_point
+{
+    uint8_t area;
+    uint8_t size;
+    uint8_t bit;
+    uint16_t index;
+};
+
+struct monitor_list
+{
+    struct monitor_point points[MONITOR_MAX_POINTS];
+    int count;
+
+    //Values sent on the last response, used to detect changes
+    unsigned char values[MONITOR_MAX_POINTS * 8];
+    uint64_t cycle;
+};
+
+//-----------------------------------------------------------------------------
+// Creates an empty monitor list for a connection. Returns NULL if there is
+// no memory for it
+//-----------------------------------------------------------------------------
+struct monitor_list *createMonitorList()
+{
+    return (struct monitor_list *)calloc(1, sizeof(struct monitor_list));
+}
+
+//-----------------------------------------------------------------------------
+// Frees a list created with createMonitorList(). NULL is ignored
+//-----------------------------------------------------------------------------
+void deleteMonitorList(struct monitor_list *monitor)
+{
+    free(monitor);
+}
+
+//-----------------------------------------------------------------------------
+// Parses a located variable such as %IX0.1, %QW3 or %MD10. Returns a pointer
+// to the first character after the location, or NULL if it is not valid
+//-----------------------------------------------------------------------------
+char *parseMonitorLocation(char *text, struct monitor_point *point)
+{
+    if (text[0] != '%' || text[1] == '\0') return NULL;
+
+    char area = toupper(text[1]);
+    char size = toupper(text[2]);
+    if (!isdigit(text[3])) return NULL;
+
+    char *end;
+    long index = strtol(text + 3, &end, 10);
+    if (index < 0 || index >= BUFFER_SIZE) return NULL;
+    point->index = index;
+    point->bit = 0;
+
+    if (size == 'X')
+    {
+        if (*end != '.' || !isdigit(end[1])) return NULL;
+        long bit = strtol(end + 1, &end, 10);
+        if (bit > 7) return NULL;
+        point->bit = bit;
+    }
+
+    if (area == 'I' && size == 'X') point->area = MONITOR_BOOL_INPUT;
+    else if (area == 'Q' && size == 'X') point->area = MONITOR_BOOL_OUTPUT;
+    else if (area == 'I' && size == 'B') point->area = MONITOR_BYTE_INPUT;
+    else if (area == 'Q' && size == 'B') point->area = MONITOR_BYTE_OUTPUT;
+    else if (area == 'I' && size == 'W') point->area = MONITOR_INT_INPUT;
+    else if (area == 'Q' && size == 'W') point->area = MONITOR_INT_OUTPUT;
+    else if (area == 'M' && size == 'W') point->area = MONITOR_INT_MEMORY;
+    else if (area == 'M' && size == 'D') point->area = MONITOR_DINT_MEMORY;
+    else if (area == 'M' && size == 'L') point->area = MONITOR_LINT_MEMORY;
+    else return NULL;
+
+    if (size == 'X' || size == 'B') point->size = 1;
+    else if (size == 'W') point->size = 2;
+    else if (size == 'D') point->size = 4;
+    else point->size = 8;
+
+    return end;
+}
+
+//-----------------------------------------------------------------------------
+// Adds a comma separated list of located variables, terminated by ')' or the
+// end of the string, to the monitor list. Either all variables are added or,
+// if any of them is invalid or the list is full, none is
+//-----------------------------------------------------------------------------
+bool addMonitorPoints(struct monitor_list *monitor, char *list)
+{
+    struct monitor_point points[MONITOR_MAX_POINTS];
+    int count = 0;
+
+    char *p = list;
+    while (true)
+    {
+        while (isspace(*p)) p++;
+        if (*p == ')' || *p == '\0') break;
+        if (count == MONITOR_MAX_POINTS) return false;
+
+        p = parseMonitorLocation(p, &points[count]);
+        if (p == NULL) return false;
+        count++;
+
+        while (isspace(*p)) p++;
+        if (*p == ',') p++;
+        else if (*p != ')' && *p != '\0') return false;
+    }
+
+    if (monitor->count + count > MONITOR_MAX_POINTS) return false;
+
+    memcpy(&monitor->points[monitor->count], points, count * sizeof(struct monitor_point));
+    monitor->count += count;
+    monitor->cycle = 0;
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Removes all variables from the monitor list
+//-----------------------------------------------------------------------------
+void clearMonitorPoints(struct monitor_list *monitor)
+{
+    monitor->count = 0;
+    monitor->cycle = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Copies the values of the monitored variables from a snapshot. Returns the
+// number of bytes written
+//-----------------------------------------------------------------------------
+int copyMonitorValues(struct monitor_list *monitor, struct image_snapshot *snapshot, unsigned char *values)
+{
+    int size = 0;
+    for (int i = 0; i < monitor->count; i++)
+    {
+        struct monitor_point *point = &monitor->points[i];
+        void *value;
+        switch (point->area)
+        {
+            case MONITOR_BOOL_INPUT:  value = &snapshot->bool_input[point->index][point->bit]; break;
+            case MONITOR_BOOL_OUTPUT: value = &snapshot->bool_output[point->index][point->bit]; break;
+            case MONITOR_BYTE_INPUT:  value = &snapshot->byte_input[point->index]; break;
+            case MONITOR_BYTE_OUTPUT: value = &snapshot->byte_output[point->index]; break;
+            case MONITOR_INT_INPUT:   value = &snapshot->int_input[point->index]; break;
+            case MONITOR_INT_OUTPUT:  value = &snapshot->int_output[point->index]; break;
+            case MONITOR_INT_MEMORY:  value = &snapshot->int_memory[point->index]; break;
+            case MONITOR_DINT_MEMORY: value = &snapshot->dint_memory[point->index]; break;
+            default:                  value = &snapshot->lint_memory[point->index]; break;
+        }
+        memcpy(values + size, value, point->size);
+        size += point->size;
+    }
+
+    return size;
+}
+
+//-----------------------------------------------------------------------------
+// Writes the values of all variables of the monitor list on buffer, in the
+// format described at the top of this file, and returns the size of the
+// response. If last_cycle is the cycle of the previous response on this
+// list, the call waits for up to MONITOR_WAIT_TIMEOUT until any of the values
+// changes, so that clients can subscribe to changes instead of polling.
+// buffer must be at least MONITOR_RESPONSE_SIZE bytes long
+//-----------------------------------------------------------------------------
+int readMonitorPoints(struct monitor_list *monitor, uint64_t last_cycle, unsigned char *buffer)
+{
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned char *values = buffer + sizeof(uint32_t) + sizeof(uint64_t);
+    uint32_t size;
+    uint64_t cycle;
+
+    bool wait = (last_cycle != 0 && last_cycle == monitor->cycle);
+    while (true)
+    {
+        struct image_snapshot *snapshot = acquireImageSnapshot();
+        size = copyMonitorValues(monitor, snapshot, values);
+        cycle = snapshot->cycle;
+        releaseImageSnapshot(snapshot);
+
+        if (!wait || memcmp(values, monitor->values, size) != 0) break;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int elapsed_ms = (int)(timespec_diff_ns(&now, &start) / 1000000);
+        if (elapsed_ms >= MONITOR_WAIT_TIMEOUT) break;
+        waitImageSnapshot(cycle, MONITOR_WAIT_TIMEOUT - elapsed_ms);
+    }
+
+    memcpy(monitor->values, values, size);
+    monitor->cycle = cycle;
+
+    uint32_t response_size = size + sizeof(cycle);
+    memcpy(buffer, &response_size, sizeof(response_size));
+    memcpy(buffer + sizeof(response_size), &cycle, sizeof(cycle));
+
+    return sizeof(response_size) + response_size;
+}
@@ -55,6 +55,10 @@
 #define PCCC_FN_INT						0x07
 #define PCCC_FN_FLOAT					0x08
 
+/*------------Status codes (STS) for PCCC replies--------------*/
+#define PCCC_STS_SUCCESS				0x00
+#define PCCC_STS_CANNOT_BUFFER			0x90 //Remote node cannot buffer command
+
 /*----------------Define functions for bit/byte operations-------------------*/
 #define bitRead(value, bit) (((value) >> (bit)) & 0x01)
 #define bitSet(value, bit) ((value) |= (1UL << (bit)))
@@ -112,11 +116,11 @@ uint16_t Protected_Logical_Read_Reply(pccc_header, unsigned char *buffer, int bu
 uint16_t Protected_Logical_Write_Reply(pccc_header, unsigned char *buffer, int buffer_size);
 
 void Pccc_ReadCoils(unsigned char *buffer, int buffer_size);
-void Pccc_WriteCoil(unsigned char *buffer, int buffer_size);
+unsigned char Pccc_WriteCoil(unsigned char *buffer, int buffer_size);
 void Pccc_ReadDiscreteInputs(unsigned char *buffer, int buffer_size);
 void Pccc_ReadHoldingRegisters(unsigned char *buffer, int buffer_size);
 //void Pccc_ReadInputRegisters(unsigned char *buffer, int buffer_size);
-void Pccc_WriteRegister(unsigned char *buffer, int buffer_size);
+unsigned char Pccc_WriteRegister(unsigned char *buffer, int buffer_size);
 
 int word_pccc(unsigned char byte1, unsigned char byte2);
 int an_word_pccc(unsigned char byte1, unsigned char byte2);
@@ -254,13 +258,13 @@ uint16_t Protected_Logical_Write_Reply(pccc_header header,unsigned char *buffer,
 	//****************** Write Coil **********************//
 	if(buffer[6] == PCCC_FN_OUTPUT && buffer[7] == PCCC_OUTPUT_LOGICAL_SLOT)// Done/Tested
 	{
-		Pccc_WriteCoil(buffer, buffer_size);
+		buffer[1] = Pccc_WriteCoil(buffer, buffer_size);
 	}
 
 	//****************** Write Register ******************//
 	else if((buffer[6] == PCCC_FN_FLOAT || buffer[6] == PCCC_FN_INT) && (buffer[7] == PCCC_INTEGER || buffer[7] == PCCC_FLOATING_POINT))//Done/Tested
 	{
-		Pccc_WriteRegister(buffer, buffer_size);
+		buffer[1] = Pccc_WriteRegister(buffer, buffer_size);
 	}
 
 	//****************** Function Code Error ******************/
@@ -309,7 +313,7 @@ void Pccc_ReadCoils(unsigned char *buffer, int buffer_size) //Working QX Read
 	Start = word_pccc(buffer[8],buffer[9]); //Start based on the Element and Subelemnt values in the Command Packet
 	Mask = log2( word_pccc(buffer[10],buffer[11]) ); //Save the byte size or byte data length to the variable from the command packet
 	ByteDataLength = buffer[5];
-	pthread_mutex_lock(&bufferLock);
+	struct image_snapshot *snapshot = acquireImageSnapshot();
 	
 	/*----Reading the values from the PLC bool_output buffer and writing to the PCCC buffer based on position----*/
 	for (int i = 0; i < ByteDataLength; i++)
@@ -319,14 +323,7 @@ void Pccc_ReadCoils(unsigned char *buffer, int buffer_size) //Working QX Read
 			int position = Start + i * 8 + j;
 			if (position < MAX_COILS)
 			{
-				if(bool_output[position/8][position%8] != NULL)
-				{
-					bitWrite(buffer[4+i], j, *bool_output[position/8][position%8]);
-				}
-				else
-				{
-					bitWrite(buffer[4+i],j,0);
-				}
+				bitWrite(buffer[4+i], j, snapshot->bool_output[position/8][position%8]);
 			}
 			else
 			{
@@ -334,7 +331,7 @@ void Pccc_ReadCoils(unsigned char *buffer, int buffer_size) //Working QX Read
 			}
 		}
 	}
-	pthread_mutex_unlock(&bufferLock);
+	releaseImageSnapshot(snapshot);
 	
 	/*Left in for future error handling setup*/
 	/*if (pccc_error != ERR_NONE)
@@ -358,7 +355,7 @@ void Pccc_ReadDiscreteInputs(unsigned char *buffer, int buffer_size) //Working I
 	
 	Start = word_pccc(buffer[8],buffer[9]);//Start based on the Element and Subelemnt values in the Command Packet
 	ByteDataLength = buffer[5];//Save the byte size or byte data length to the variable from the command packet
-	pthread_mutex_lock(&bufferLock);
+	struct image_snapshot *snapshot = acquireImageSnapshot();
 	
 	/*--------Reading the values from the PLC bool_input buffer and writing to the PCCC buffer based on position--------*/
 	for (int i = 0; i < ByteDataLength; i++)
@@ -368,14 +365,7 @@ void Pccc_ReadDiscreteInputs(unsigned char *buffer, int buffer_size) //Working I
 			int position = Start + i * 8 + j;
 			if (position < MAX_DISCRETE_INPUT)
 			{
-				if(bool_input[position/8][position%8] != NULL)
-				{
-					bitWrite(buffer[4+i], j, *bool_input[position/8][position%8]);
-				}
-				else
-				{
-					bitWrite(buffer[4+i],j,0);
-				}
+				bitWrite(buffer[4+i], j, snapshot->bool_input[position/8][position%8]);
 			}
 			else
 			{
@@ -383,7 +373,7 @@ void Pccc_ReadDiscreteInputs(unsigned char *buffer, int buffer_size) //Working I
 			}
 		}
 	}
-	pthread_mutex_unlock(&bufferLock);
+	releaseImageSnapshot(snapshot);
 	
 	/*Left in for future error handling setup*/
 	/*if (mb_error != ERR_NONE)
@@ -419,46 +409,30 @@ void Pccc_ReadHoldingRegisters(unsigned char *buffer, int buffer_size) // QW Rea
 		//return;
 	}*/
 
-	pthread_mutex_lock(&bufferLock);
+	struct image_snapshot *snapshot = acquireImageSnapshot();
 	/*--------Reading the values from the PLC int_output, int_memory, and dint_memory buffer and writing to the PCCC buffer based on position--------*/
 	for(int i = 0; i < WordDataLength; i++)
 	{
 		int position = Start + i;
 		//int an_position = an_Start + i;
-		if ((position <= MIN_16B_RANGE) && (Temp_FileN == PCCC_FN_INT && Temp_FileT == PCCC_INTEGER))
+		if ((position < MIN_16B_RANGE) && (Temp_FileN == PCCC_FN_INT && Temp_FileT == PCCC_INTEGER))
 		{
-			if (int_output[position] != NULL)
-			{
-				buffer[ 4 + position * 2] = lowByte(*int_output[position]);
-				buffer[5 + position * 2] = highByte(*int_output[position]);
-			}
-			else
-			{
-				buffer[ 4 + position * 2] = 0;
-				buffer[5 + position * 2] = 0;
-			}
+			buffer[ 4 + position * 2] = lowByte(snapshot->int_output[position]);
+			buffer[5 + position * 2] = highByte(snapshot->int_output[position]);
 		}
 		//accessing memory
 		//16-bit registers
 		else if ((position >= MIN_16B_RANGE && position <= MAX_16B_RANGE) && (Temp_FileN == PCCC_FN_INT && Temp_FileT == PCCC_INTEGER))
 		{
-			if (int_memory[position - MIN_16B_RANGE] != NULL)
-			{
-				buffer[ 4 + position * 2] = lowByte(*int_memory[position - MIN_16B_RANGE]);
-				buffer[5 + position * 2] = highByte(*int_memory[position - MIN_16B_RANGE]);
-			}
-			else
-			{
-				buffer[ 4 + position * 2] = 0;
-				buffer[5 + position * 2] = 0;
-			}
+			buffer[ 4 + position * 2] = lowByte(snapshot->int_memory[position - MIN_16B_RANGE]);
+			buffer[5 + position * 2] = highByte(snapshot->int_memory[position - MIN_16B_RANGE]);
 		}
 		
 		//32-bit registers
 		else if (Temp_FileN == PCCC_FN_FLOAT && Temp_FileT == PCCC_FLOATING_POINT && (position % 2 == 0))
 		{
 			position = position/2;
-			uint32_t tempValue = *dint_memory[position];
+			uint32_t tempValue = snapshot->dint_memory[position];
 			
 			buffer[4+(4*position)] = tempValue;
 			buffer[5+(4*position)] = tempValue >> 8;
@@ -473,14 +447,14 @@ void Pccc_ReadHoldingRegisters(unsigned char *buffer, int buffer_size) // QW Rea
 		}
 
 	}
-	pthread_mutex_unlock(&bufferLock);
+	releaseImageSnapshot(snapshot);
 
 }
 
 //-----------------------------------------------------------------------------
-// Implementation of PCCC Write Coil
+// Implementation of PCCC Write Coil. Returns the status code for the reply
 //-----------------------------------------------------------------------------
- void Pccc_WriteCoil(unsigned char *buffer, int buffer_size) //QX Write NEEDS WRITE MULTIPLE
+ unsigned char Pccc_WriteCoil(unsigned char *buffer, int buffer_size) //QX Write NEEDS WRITE MULTIPLE
  {
 	int Start, Mask;
 	int mask_offset = 0;
@@ -514,23 +488,30 @@ void Pccc_ReadHoldingRegisters(unsigned char *buffer, int buffer_size) // QW Rea
 		{
 			value = 0; 
 		}
-		pthread_mutex_lock(&bufferLock);
-		if(bool_output[Start][Mask] != NULL)
+		struct image_write write;
+		write.area = IMAGE_BOOL_OUTPUT;
+		write.index = Start;
+		write.mask = 1 << Mask;
+		write.value = value << Mask;
+		if (!queueImageWrites(&write, 1))
 		{
-			*bool_output[Start][Mask] = value;
+			return PCCC_STS_CANNOT_BUFFER;
 		}
-		pthread_mutex_unlock(&bufferLock);
 	}
 	
+	return PCCC_STS_SUCCESS;
 }
 
 
 //-----------------------------------------------------------------------------
-// Implementation of PCCC Write Holding Register
+// Implementation of PCCC Write Holding Register. Returns the status code for
+// the reply
 //-----------------------------------------------------------------------------
-void Pccc_WriteRegister(unsigned char *buffer, int buffer_size) // QW Write
+unsigned char Pccc_WriteRegister(unsigned char *buffer, int buffer_size) // QW Write
 {
 	int Start, WordDataLength, ByteDataLength;
+	struct image_write writes[128];
+	int num_writes = 0;
 
 	Start = word_pccc(buffer[8],buffer[9]);//Start based on the Element and Subelemnt values in the Command Packet
 	int an_Start = an_word_pccc(buffer[8],buffer[9]);//Different Start method for INTs based on the Element and Subelemnt values in the Command Packet
@@ -539,22 +520,28 @@ void Pccc_WriteRegister(unsigned char *buffer, int buffer_size) // QW Write
 	unsigned int Temp_FileT = buffer[7];//Value will be changed potentially during this process, save the File Type Value from command packet
 	unsigned int Temp_FileN = buffer[6];//Value will be changed potentially during this process, save the File Number Value from command packet
 
-	pthread_mutex_lock(&bufferLock);
-	
 	/*--------Determines if the values inside the PCCC data has data. Writes that value to the appropriate PLC Buffer based on the contents of the data in PCCC Buffer-------*/
 	for(int i = 0; i < WordDataLength; i++)
 	{
 		int position = Start + i;
 		//analog outputs
-		if ((position <= MIN_16B_RANGE) && (Temp_FileN == PCCC_FN_INT && (Temp_FileT == PCCC_INTEGER)))
+		if ((position < MIN_16B_RANGE) && (Temp_FileN == PCCC_FN_INT && (Temp_FileT == PCCC_INTEGER)))
 		{
-			if (int_output[position] != NULL) *int_output[position] =  an_word_pccc(buffer[10 + i], buffer[11 + i]);//look at this closer
+			writes[num_writes].area = IMAGE_INT_OUTPUT;
+			writes[num_writes].index = position;
+			writes[num_writes].mask = 0xffff;
+			writes[num_writes].value = (uint16_t)an_word_pccc(buffer[10 + i], buffer[11 + i]);//look at this closer
+			num_writes++;
 		}
 		//accessing memory
 		//16-bit registers
 		else if ((position >= MIN_16B_RANGE && position <= MAX_16B_RANGE) && (Temp_FileN == PCCC_FN_OUTPUT && (Temp_FileT == PCCC_INTEGER)))
 		{
-			if (int_memory[position - MIN_16B_RANGE] != NULL) *int_memory[position - MIN_16B_RANGE] = an_word_pccc(buffer[10 + i], buffer[11 + i]);//look at this closer
+			writes[num_writes].area = IMAGE_INT_MEMORY;
+			writes[num_writes].index = position - MIN_16B_RANGE;
+			writes[num_writes].mask = 0xffff;
+			writes[num_writes].value = (uint16_t)an_word_pccc(buffer[10 + i], buffer[11 + i]);//look at this closer
+			num_writes++;
 		}
 		//32-bit registers
 		if (Temp_FileN == PCCC_FN_FLOAT && (Temp_FileT == PCCC_FLOATING_POINT))
@@ -563,7 +550,11 @@ void Pccc_WriteRegister(unsigned char *buffer, int buffer_size) // QW Write
 			{
 				uint32_t tempValue = buffer[10 + i] | buffer[11 + i] << 8 | buffer[12 + i] << 16 | buffer[13 + i] <<24;//look at this closer
 				
-				*dint_memory[position] = tempValue;
+				writes[num_writes].area = IMAGE_DINT_MEMORY;
+				writes[num_writes].index = position;
+				writes[num_writes].mask = 0xffffffff;
+				writes[num_writes].value = tempValue;
+				num_writes++;
 				
 				i += 4;
 			}
@@ -572,8 +563,12 @@ void Pccc_WriteRegister(unsigned char *buffer, int buffer_size) // QW Write
 				pccc_holding_regs[position] = an_word_pccc(buffer[10 + i], buffer[11 + i]);//look at this closer might need to copy from temp
 			}
 		}
-	
-	pthread_mutex_unlock(&bufferLock);
+	}
 
+	if (!queueImageWrites(writes, num_writes))
+	{
+		return PCCC_STS_CANNOT_BUFFER;
 	}
+
+	return PCCC_STS_SUCCESS;
 }
\ No newline at end of file
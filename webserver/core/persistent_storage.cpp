@@ -18,116 +18,811 @@
 //
 // This file is responsible for the persistent storage on the OpenPLC
 // Thiago Alves, Jun 2019
+//
+// The retain data (%MW, %MD and %ML memory followed by the program variables
+// declared as RETAIN) is saved on persistent.file as a checkpoint followed
+// by a journal. Each time the data changes, only the pages that changed are
+// appended to the journal, followed by a commit record. Every record has a
+// checksum, so a transaction cut by a power loss is simply ignored when the
+// file is read back. When the journal grows too big, a new checkpoint is
+// written to a temporary file and renamed over persistent.file.
+//
+// Optionally (start_pstorage_mapped) the memory image is mapped to
+// persistent.mmap, so that %MW, %MD and %ML live directly on the file. The
+// retained program variables are stored on the file after the image. In this
+// mode the scan loop picks the end of a cycle to checkpoint the data and the
+// persistent storage thread flushes it to disk with msync. No data is copied
+// or compared, but there is no journal: a power loss during the flush can
+// leave the file with values from different cycles. The file is only mapped
+// while the mapped mode runs. At boot its contents are just read back, and
+// the journal mode removes it once its own checkpoint is on disk. If the
+// file cannot be mapped, the thread falls back to the journal.
 //-----------------------------------------------------------------------------
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <time.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "ladder.h"
 
+#define PSTORAGE_FILE           "persistent.file"
+#define PSTORAGE_TMP_FILE       "persistent.file.tmp"
+#define PSTORAGE_MAGIC          0x53504c4f
+#define PSTORAGE_RECORD_MAGIC   0x52504c4f
+#define PSTORAGE_VERSION        1
+#define PSTORAGE_PAGE_SIZE      512
+#define PSTORAGE_COMMIT         0xffffffff //page of commit records
+#define PSTORAGE_MAX_JOURNAL    (64 * 1024) //journal size that triggers a new checkpoint
+#define PSTORAGE_MAP_FILE       "persistent.mmap"
+#define PSTORAGE_MAP_TMP_FILE   "persistent.mmap.tmp"
+#define PSTORAGE_MAP_MAGIC      0x4d504c4f
+
+//Located memory saved at the start of the retain data
+#define PSTORAGE_AREAS_SIZE     (BUFFER_SIZE * (sizeof(IEC_UINT) + sizeof(IEC_DINT) + sizeof(IEC_LINT)))
+
+struct pstorage_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t data_size;     //bytes of retain data after the header
+    uint32_t layout;        //checksum of the sizes of the retained variables
+    uint64_t sequence;      //last transaction included on the checkpoint
+    uint32_t data_crc;
+    uint32_t header_crc;    //checksum of the fields above
+};
+
+struct pstorage_record
+{
+    uint32_t magic;
+    uint32_t page;          //page of the retain data or PSTORAGE_COMMIT
+    uint64_t sequence;      //transaction the record belongs to
+    uint32_t length;        //bytes of data after the record
+    uint32_t crc;           //checksum of the fields above and the data
+};
+
+//Header of the retained variables on persistent.mmap. It is stored right
+//after the memory image
+struct pstorage_map_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t layout;            //checksum of the sizes of the retained variables
+    uint32_t variables_size;
+};
+
+//Journal record as it is written to the file
+struct pstorage_entry
+{
+    struct pstorage_record record;
+    unsigned char data[PSTORAGE_PAGE_SIZE];
+};
+
+//Program variables declared as RETAIN. They are registered by the program
+//initialization code through the __INIT_VAR and __INIT_GLOBAL macros
+struct retain_variable
+{
+    void *address;
+    uint32_t size;
+};
+
+struct retain_variable *retain_variables = NULL;
+int num_retain_variables = 0;
+uint32_t retain_variables_size = 0;
+
 uint8_t pstorage_read = false;
+uint64_t pstorage_sequence = 0; //last transaction written to the file
+
+//Memory mapped mode
+bool pstorage_use_map = false;  //set by start_pstorage_mapped()
+bool pstorage_mapped = false;   //the memory image lives on persistent.mmap
+unsigned char *pstorage_map_variables = NULL; //retained variables area of the file
+size_t pstorage_map_variables_size = 0;
+struct timespec pstorage_next_checkpoint;
+bool pstorage_checkpoint_pending = false;
+pthread_mutex_t checkpointLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t checkpointCond = PTHREAD_COND_INITIALIZER;
 
 //-----------------------------------------------------------------------------
-// Main function for the thread. Should create a buffer for the persistent
-// data, compare it with the actual data and write back to the persistent
-// file if the data has changed
+// Adds a program variable to the retain data. Called by the program
+// initialization code for every variable declared as RETAIN
 //-----------------------------------------------------------------------------
-void startPstorage()
+void registerRetainVariable(void *address, unsigned int size)
 {
-    //We can only start persistent storage after the persistent.file was read
-    while (pstorage_read == false)
-        sleepms(100);
-    
-    unsigned char log_msg[1000];
-    IEC_UINT persistentBuffer[BUFFER_SIZE];
+    if ((num_retain_variables & 63) == 0)
+    {
+        struct retain_variable *variables = (struct retain_variable *)realloc(retain_variables,
+                                            (num_retain_variables + 64) * sizeof(struct retain_variable));
+        if (variables == NULL) return;
+        retain_variables = variables;
+    }
+
+    retain_variables[num_retain_variables].address = address;
+    retain_variables[num_retain_variables].size = size;
+    num_retain_variables++;
+    retain_variables_size += size;
+}
+
+//-----------------------------------------------------------------------------
+// CRC-32 (IEEE 802.3) of a block of data. Start with crc = 0
+//-----------------------------------------------------------------------------
+uint32_t pstorageChecksum(uint32_t crc, const void *data, size_t length)
+{
+    static uint32_t table[256];
+    if (table[1] == 0)
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int j = 0; j < 8; j++) c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+
+    const unsigned char *bytes = (const unsigned char *)data;
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+//-----------------------------------------------------------------------------
+// Returns a checksum of the sizes of the retained variables, so that data
+// saved by a different program is not restored into the wrong variables
+//-----------------------------------------------------------------------------
+uint32_t retainLayout()
+{
+    uint32_t layout = pstorageChecksum(0, &retain_variables_size, sizeof(retain_variables_size));
+    for (int i = 0; i < num_retain_variables; i++)
+    {
+        layout = pstorageChecksum(layout, &retain_variables[i].size, sizeof(retain_variables[i].size));
+    }
+    return layout;
+}
+
+//-----------------------------------------------------------------------------
+// Copies the current retain data to buffer. Located memory comes from the
+// last published snapshot. Retained program variables are copied while
+// holding bufferLock, so that all of them come from the same scan
+//-----------------------------------------------------------------------------
+void gatherRetainData(unsigned char *buffer)
+{
+    struct image_snapshot *snapshot = acquireImageSnapshot();
+    memcpy(buffer, snapshot->int_memory, sizeof(snapshot->int_memory));
+    buffer += sizeof(snapshot->int_memory);
+    memcpy(buffer, snapshot->dint_memory, sizeof(snapshot->dint_memory));
+    buffer += sizeof(snapshot->dint_memory);
+    memcpy(buffer, snapshot->lint_memory, sizeof(snapshot->lint_memory));
+    buffer += sizeof(snapshot->lint_memory);
+    releaseImageSnapshot(snapshot);
+
+    if (num_retain_variables == 0) return;
+
+    pthread_mutex_lock(&bufferLock);
+    for (int i = 0; i < num_retain_variables; i++)
+    {
+        memcpy(buffer, retain_variables[i].address, retain_variables[i].size);
+        buffer += retain_variables[i].size;
+    }
+    pthread_mutex_unlock(&bufferLock);
+}
+
+//-----------------------------------------------------------------------------
+// Copies size bytes of retain data read from the file to the OpenPLC
+// buffers and to the retained program variables. Parts of the retain data
+// that are not covered by size keep their current values
+//-----------------------------------------------------------------------------
+void restoreRetainData(unsigned char *buffer, uint32_t size)
+{
+    IEC_UINT int_values[BUFFER_SIZE];
+    IEC_DINT dint_values[BUFFER_SIZE];
+    IEC_LINT lint_values[BUFFER_SIZE];
+    memcpy(int_values, buffer, sizeof(int_values));
+    buffer += sizeof(int_values);
+    if (size >= PSTORAGE_AREAS_SIZE)
+    {
+        memcpy(dint_values, buffer, sizeof(dint_values));
+        buffer += sizeof(dint_values);
+        memcpy(lint_values, buffer, sizeof(lint_values));
+        buffer += sizeof(lint_values);
+    }
 
-    //Read initial buffers into persistent struct
     pthread_mutex_lock(&bufferLock); //lock mutex
     for (int i = 0; i < BUFFER_SIZE; i++)
     {
-        if (int_memory[i] != NULL) persistentBuffer[i] = *int_memory[i];
+        if (int_memory[i] != NULL) *int_memory[i] = int_values[i];
+    }
+
+    if (size >= PSTORAGE_AREAS_SIZE)
+    {
+        for (int i = 0; i < BUFFER_SIZE; i++)
+        {
+            if (dint_memory[i] != NULL) *dint_memory[i] = dint_values[i];
+            else dint_memory_image[i] = dint_values[i];
+            if (lint_memory[i] != NULL) *lint_memory[i] = lint_values[i];
+            else lint_memory_image[i] = lint_values[i];
+        }
+    }
+
+    if (size == PSTORAGE_AREAS_SIZE + retain_variables_size)
+    {
+        for (int i = 0; i < num_retain_variables; i++)
+        {
+            memcpy(retain_variables[i].address, buffer, retain_variables[i].size);
+            buffer += retain_variables[i].size;
+        }
     }
     pthread_mutex_unlock(&bufferLock); //unlock mutex
-    
-    //Perform the first write
-    if (access("persistent.file", F_OK) == -1) 
+}
+
+//-----------------------------------------------------------------------------
+// Writes a whole buffer to a file descriptor. Returns false on errors
+//-----------------------------------------------------------------------------
+bool writeAll(int fd, const void *data, size_t length)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    while (length > 0)
     {
-        sprintf(log_msg, "Creating Persistent Storage file\n");
-        log(log_msg);
+        ssize_t written = write(fd, bytes, length);
+        if (written <= 0) return false;
+        bytes += written;
+        length -= written;
     }
-    
-    FILE *ps = fopen("persistent.file", "w"); //if file already exists, it will be overwritten
-    if (ps == NULL)
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Writes a new checkpoint with all the retain data. The checkpoint is written
+// to a temporary file that replaces persistent.file only after it is on
+// disk, so the old file is kept if the write is interrupted. Returns the
+// file opened for appending the journal, or -1 on errors
+//-----------------------------------------------------------------------------
+int writeCheckpoint(unsigned char *data, uint32_t size, uint64_t sequence)
+{
+    unsigned char log_msg[1000];
+
+    struct pstorage_header header;
+    header.magic = PSTORAGE_MAGIC;
+    header.version = PSTORAGE_VERSION;
+    header.data_size = size;
+    header.layout = retainLayout();
+    header.sequence = sequence;
+    header.data_crc = pstorageChecksum(0, data, size);
+    header.header_crc = pstorageChecksum(0, &header, offsetof(struct pstorage_header, header_crc));
+
+    int fd = open(PSTORAGE_TMP_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
     {
         sprintf(log_msg, "Persistent Storage: Error creating persistent memory file!\n");
         log(log_msg);
-        return 0;
+        return -1;
     }
 
-    if (fwrite(persistentBuffer, sizeof(IEC_INT), BUFFER_SIZE, ps) < BUFFER_SIZE)
+    if (!writeAll(fd, &header, sizeof(header)) || !writeAll(fd, data, size) || fsync(fd) != 0)
     {
         sprintf(log_msg, "Persistent Storage: Error writing to persistent memory file!\n");
         log(log_msg);
-        return 0;
+        close(fd);
+        return -1;
     }
-    fclose(ps);
-    
-    //Run the main thread
-    while (run_pstorage)
+    close(fd);
+
+    if (rename(PSTORAGE_TMP_FILE, PSTORAGE_FILE) != 0)
     {
-        
-        //Verify if persistent buffer is outdated
-        bool bufferOutdated = false;
-        pthread_mutex_lock(&bufferLock); //lock mutex
-        for (int i = 0; i < BUFFER_SIZE; i++)
+        sprintf(log_msg, "Persistent Storage: Error replacing persistent memory file!\n");
+        log(log_msg);
+        return -1;
+    }
+
+    //make sure the rename itself is on disk
+    int dir = open(".", O_RDONLY);
+    if (dir >= 0)
+    {
+        fsync(dir);
+        close(dir);
+    }
+
+    return open(PSTORAGE_FILE, O_WRONLY | O_APPEND);
+}
+
+//-----------------------------------------------------------------------------
+// Appends the pages of data that are different from saved to the journal,
+// followed by a commit record. Returns the number of bytes appended, or -1
+// on errors
+//-----------------------------------------------------------------------------
+int writeTransaction(int fd, unsigned char *data, unsigned char *saved, uint32_t size, uint64_t sequence)
+{
+    struct pstorage_entry entry;
+    struct pstorage_record *record = &entry.record;
+    int appended = 0;
+
+    for (uint32_t offset = 0; offset < size; offset += PSTORAGE_PAGE_SIZE)
+    {
+        uint32_t length = (size - offset < PSTORAGE_PAGE_SIZE) ? size - offset : PSTORAGE_PAGE_SIZE;
+        if (memcmp(&data[offset], &saved[offset], length) == 0) continue;
+
+        record->magic = PSTORAGE_RECORD_MAGIC;
+        record->page = offset / PSTORAGE_PAGE_SIZE;
+        record->sequence = sequence;
+        record->length = length;
+        record->crc = 0;
+        memcpy(entry.data, &data[offset], length);
+        record->crc = pstorageChecksum(0, &entry, sizeof(struct pstorage_record) + length);
+
+        if (!writeAll(fd, &entry, sizeof(struct pstorage_record) + length)) return -1;
+        appended += sizeof(struct pstorage_record) + length;
+    }
+
+    if (appended == 0) return 0;
+
+    record->magic = PSTORAGE_RECORD_MAGIC;
+    record->page = PSTORAGE_COMMIT;
+    record->sequence = sequence;
+    record->length = 0;
+    record->crc = 0;
+    record->crc = pstorageChecksum(0, record, sizeof(struct pstorage_record));
+    if (!writeAll(fd, record, sizeof(struct pstorage_record)) || fdatasync(fd) != 0) return -1;
+
+    return appended + sizeof(struct pstorage_record);
+}
+
+//-----------------------------------------------------------------------------
+// Returns the size of the retained variables area of persistent.mmap. It
+// takes whole pages, so that it can be mapped on its own
+//-----------------------------------------------------------------------------
+size_t mapVariablesSize()
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t size = sizeof(struct pstorage_map_header) + retain_variables_size;
+    return (size + page_size - 1) / page_size * page_size;
+}
+
+//-----------------------------------------------------------------------------
+// Maps an open persistent.mmap over the memory image, which takes the
+// contents of the file, and maps the retained variables area that follows
+// it. Must be called while holding bufferLock. Returns false on errors
+//-----------------------------------------------------------------------------
+bool mapPersistentFile(int fd)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size <= 0 || sizeof(retain_image) % page_size != 0 || (uintptr_t)&retain_image % page_size != 0)
+        return false;
+
+    void *variables = mmap(NULL, pstorage_map_variables_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, sizeof(retain_image));
+    if (variables == MAP_FAILED) return false;
+
+    if (mmap(&retain_image, sizeof(retain_image), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(variables, pstorage_map_variables_size);
+        return false;
+    }
+
+    pstorage_map_variables = (unsigned char *)variables;
+    pstorage_mapped = true;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Gives the memory image its own memory back, with the current values, and
+// unmaps persistent.mmap. Returns false if the image could not be remapped,
+// in which case it stays on the file
+//-----------------------------------------------------------------------------
+bool unmapPersistentFile()
+{
+    unsigned char *values = (unsigned char *)malloc(sizeof(retain_image));
+    if (values == NULL) return false;
+
+    pthread_mutex_lock(&bufferLock);
+    memcpy(values, &retain_image, sizeof(retain_image));
+    bool unmapped = (mmap(&retain_image, sizeof(retain_image), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED);
+    if (unmapped)
+    {
+        memcpy(&retain_image, values, sizeof(retain_image));
+        munmap(pstorage_map_variables, pstorage_map_variables_size);
+        pstorage_map_variables = NULL;
+        pstorage_mapped = false;
+    }
+    pthread_mutex_unlock(&bufferLock);
+    free(values);
+
+    return unmapped;
+}
+
+//-----------------------------------------------------------------------------
+// Copies the retained program variables to persistent.mmap. Must be called
+// while holding bufferLock
+//-----------------------------------------------------------------------------
+void storeMappedVariables()
+{
+    unsigned char *buffer = pstorage_map_variables + sizeof(struct pstorage_map_header);
+    for (int i = 0; i < num_retain_variables; i++)
+    {
+        memcpy(buffer, retain_variables[i].address, retain_variables[i].size);
+        buffer += retain_variables[i].size;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Writes the header of the retained variables area of persistent.mmap
+//-----------------------------------------------------------------------------
+void storeMappedHeader()
+{
+    struct pstorage_map_header *header = (struct pstorage_map_header *)pstorage_map_variables;
+    header->magic = PSTORAGE_MAP_MAGIC;
+    header->version = PSTORAGE_VERSION;
+    header->layout = retainLayout();
+    header->variables_size = retain_variables_size;
+}
+
+//-----------------------------------------------------------------------------
+// Creates persistent.mmap with the current retain data and maps it. Returns
+// false on errors
+//-----------------------------------------------------------------------------
+bool createPersistentMap()
+{
+    unsigned char log_msg[1000];
+
+    pstorage_map_variables_size = mapVariablesSize();
+    int fd = open(PSTORAGE_MAP_TMP_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(retain_image) + pstorage_map_variables_size) != 0)
+    {
+        sprintf(log_msg, "Persistent Storage: Error creating persistent memory map!\n");
+        log(log_msg);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    //The image is copied to the file and mapped while the scan is stopped,
+    //so that no change is lost in between
+    pthread_mutex_lock(&bufferLock);
+    bool mapped = (pwrite(fd, &retain_image, sizeof(retain_image), 0) == sizeof(retain_image) && mapPersistentFile(fd));
+    if (mapped)
+    {
+        storeMappedHeader();
+        storeMappedVariables();
+    }
+    pthread_mutex_unlock(&bufferLock);
+
+    if (!mapped || fsync(fd) != 0 || rename(PSTORAGE_MAP_TMP_FILE, PSTORAGE_MAP_FILE) != 0)
+    {
+        sprintf(log_msg, "Persistent Storage: Error creating persistent memory map!\n");
+        log(log_msg);
+    }
+    if (!mapped) unlink(PSTORAGE_MAP_TMP_FILE);
+    close(fd); //the mapping keeps the file open
+
+    return mapped;
+}
+
+//-----------------------------------------------------------------------------
+// Reads persistent.mmap, if it exists, into the memory image and restores the
+// retained program variables from it. The file is not mapped here: that is
+// only done when the mapped mode is started. Returns false if the file was
+// not read
+//-----------------------------------------------------------------------------
+bool readPersistentMap()
+{
+    unsigned char log_msg[1000];
+    int fd = open(PSTORAGE_MAP_FILE, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct pstorage_map_header header;
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < (off_t)(sizeof(retain_image) + sizeof(header)) ||
+        pread(fd, &header, sizeof(header), sizeof(retain_image)) != sizeof(header) ||
+        header.magic != PSTORAGE_MAP_MAGIC || header.version != PSTORAGE_VERSION)
+    {
+        sprintf(log_msg, "Persistent Storage: Error while trying to read persistent.mmap!\n");
+        log(log_msg);
+        close(fd);
+        return false;
+    }
+
+    //Retained variables are only restored if they still have the same sizes
+    bool restore_variables = (header.layout == retainLayout() && header.variables_size == retain_variables_size &&
+                              file_stat.st_size >= (off_t)(sizeof(retain_image) + sizeof(header) + retain_variables_size));
+    struct retain_image *image = (struct retain_image *)malloc(sizeof(retain_image));
+    unsigned char *variables = (unsigned char *)malloc(retain_variables_size + 1);
+    bool read = (image != NULL && variables != NULL &&
+                 pread(fd, image, sizeof(retain_image), 0) == sizeof(retain_image) &&
+                 (!restore_variables || pread(fd, variables, retain_variables_size, sizeof(retain_image) + sizeof(header)) == retain_variables_size));
+    close(fd);
+
+    if (read)
+    {
+        sprintf(log_msg, "Persistent Storage: Reading persistent.mmap into local buffers\n");
+        log(log_msg);
+
+        pthread_mutex_lock(&bufferLock);
+        memcpy(&retain_image, image, sizeof(retain_image));
+        unsigned char *buffer = variables;
+        for (int i = 0; restore_variables && i < num_retain_variables; i++)
         {
-            if (int_memory[i] != NULL)
-            {
-                if (persistentBuffer[i] != *int_memory[i])
-                {
-                    persistentBuffer[i] = *int_memory[i];
-                    bufferOutdated = true;
-                }
-            }
+            memcpy(retain_variables[i].address, buffer, retain_variables[i].size);
+            buffer += retain_variables[i].size;
+        }
+        pthread_mutex_unlock(&bufferLock);
+
+        if (!restore_variables && num_retain_variables > 0)
+        {
+            sprintf(log_msg, "Persistent Storage: Retained variables changed. Restoring only located memory\n");
+            log(log_msg);
+        }
+    }
+    else
+    {
+        sprintf(log_msg, "Persistent Storage: Error while trying to read persistent.mmap!\n");
+        log(log_msg);
+    }
+    free(image);
+    free(variables);
+
+    return read;
+}
+
+//-----------------------------------------------------------------------------
+// Called by the main loop at the end of every cycle while it holds
+// bufferLock. When the memory image is mapped and a checkpoint is due, the
+// retained variables are stored on the file and the persistent storage
+// thread is woken up to flush the file to disk. This way checkpoints always
+// start on the boundary of a cycle
+//-----------------------------------------------------------------------------
+void checkpointPersistentStorage()
+{
+    if (!pstorage_mapped || !run_pstorage) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec < pstorage_next_checkpoint.tv_sec ||
+        (now.tv_sec == pstorage_next_checkpoint.tv_sec && now.tv_nsec < pstorage_next_checkpoint.tv_nsec))
+        return;
+
+    pstorage_next_checkpoint = now;
+    pstorage_next_checkpoint.tv_sec += pstorage_polling;
+
+    storeMappedVariables();
+    pthread_mutex_lock(&checkpointLock);
+    pstorage_checkpoint_pending = true;
+    pthread_cond_signal(&checkpointCond);
+    pthread_mutex_unlock(&checkpointLock);
+}
+
+//-----------------------------------------------------------------------------
+// Flushes persistent.mmap to disk every time the main loop asks for a
+// checkpoint, until the thread is stopped or switched back to the journal
+//-----------------------------------------------------------------------------
+void runMappedPstorage()
+{
+    while (run_pstorage && pstorage_use_map)
+    {
+        pthread_mutex_lock(&checkpointLock);
+        if (!pstorage_checkpoint_pending)
+        {
+            //wake up every second to check if the thread was stopped
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&checkpointCond, &checkpointLock, &deadline);
         }
-        pthread_mutex_unlock(&bufferLock); //unlock mutex
+        bool checkpoint = pstorage_checkpoint_pending;
+        pstorage_checkpoint_pending = false;
+        pthread_mutex_unlock(&checkpointLock);
 
-        //If buffer is outdated, write the changes back to the file
-        if (bufferOutdated)
+        if (checkpoint)
         {
-            FILE *fd = fopen("persistent.file", "w"); //if file already exists, it will be overwritten
-            if (fd == NULL)
+            msync(&retain_image, sizeof(retain_image), MS_SYNC);
+            msync(pstorage_map_variables, pstorage_map_variables_size, MS_SYNC);
+        }
+    }
+
+    msync(&retain_image, sizeof(retain_image), MS_SYNC);
+    msync(pstorage_map_variables, pstorage_map_variables_size, MS_SYNC);
+}
+
+//-----------------------------------------------------------------------------
+// Saves the retain data on persistent.file until the thread is stopped or
+// switched to the mapped mode. Should create a buffer for the persistent
+// data, compare it with the actual data and write the pages that changed to
+// the persistent file
+//-----------------------------------------------------------------------------
+void runJournalPstorage()
+{
+    unsigned char log_msg[1000];
+
+    uint32_t size = PSTORAGE_AREAS_SIZE + retain_variables_size;
+    unsigned char *saved = (unsigned char *)malloc(size);
+    unsigned char *current = (unsigned char *)malloc(size);
+    if (saved == NULL || current == NULL)
+    {
+        sprintf(log_msg, "Persistent Storage: Error allocating persistent memory buffers!\n");
+        log(log_msg);
+        free(saved);
+        free(current);
+        run_pstorage = 0;
+        return;
+    }
+
+    if (access(PSTORAGE_FILE, F_OK) == -1)
+    {
+        sprintf(log_msg, "Creating Persistent Storage file\n");
+        log(log_msg);
+    }
+
+    //Start with a checkpoint of the current data, so that the journal
+    //always belongs to the current program. Once it is on disk, an old
+    //persistent.mmap would only hide it on the next boot
+    gatherRetainData(saved);
+    int fd = writeCheckpoint(saved, size, ++pstorage_sequence);
+    if (fd >= 0) unlink(PSTORAGE_MAP_FILE);
+    int journal_size = 0;
+
+    while (run_pstorage && !pstorage_use_map)
+    {
+        sleepms(pstorage_polling*1000);
+
+        //Only the pages that changed are written. If the journal is too big
+        //or the last write failed, the whole data goes to a new checkpoint
+        gatherRetainData(current);
+        if (memcmp(current, saved, size) == 0) continue;
+
+        pstorage_sequence++;
+        int appended = -1;
+        if (fd >= 0 && journal_size < PSTORAGE_MAX_JOURNAL)
+            appended = writeTransaction(fd, current, saved, size, pstorage_sequence);
+
+        if (appended >= 0)
+        {
+            journal_size += appended;
+        }
+        else
+        {
+            if (fd >= 0) close(fd);
+            fd = writeCheckpoint(current, size, pstorage_sequence);
+            journal_size = 0;
+        }
+
+        if (fd >= 0) memcpy(saved, current, size);
+    }
+
+    if (fd >= 0) close(fd);
+    free(saved);
+    free(current);
+}
+
+//-----------------------------------------------------------------------------
+// Main function for the thread. Runs the journal or the mapped mode, as set
+// by the last start_pstorage or start_pstorage_mapped command, until the
+// thread is stopped. The memory image is unmapped from persistent.mmap when
+// the mapped mode ends
+//-----------------------------------------------------------------------------
+void startPstorage()
+{
+    //We can only start persistent storage after the persistent.file was read
+    while (pstorage_read == false)
+        sleepms(100);
+
+    unsigned char log_msg[1000];
+
+    while (run_pstorage)
+    {
+        if (pstorage_use_map && !pstorage_mapped)
+        {
+            sprintf(log_msg, "Creating Persistent Storage memory map\n");
+            log(log_msg);
+            if (!createPersistentMap())
             {
-                sprintf(log_msg, "Persistent Storage: Error creating persistent memory file!\n");
+                sprintf(log_msg, "Persistent Storage: Memory map not available. Using persistent.file instead\n");
                 log(log_msg);
-                return 0;
+                pstorage_use_map = false;
             }
+        }
 
-            if (fwrite(persistentBuffer, sizeof(IEC_INT), BUFFER_SIZE, fd) < BUFFER_SIZE)
+        if (pstorage_mapped)
+        {
+            runMappedPstorage();
+            if (!unmapPersistentFile())
             {
-                sprintf(log_msg, "Persistent Storage: Error writing to persistent memory file!\n");
+                //the image is still on the file, so keep flushing it
+                sprintf(log_msg, "Persistent Storage: Error unmapping persistent.mmap!\n");
                 log(log_msg);
-                return 0;
+                pstorage_use_map = true;
             }
-            fclose(fd);
         }
+        else
+        {
+            runJournalPstorage();
+        }
+    }
+}
 
-        sleepms(pstorage_polling*1000);
+//-----------------------------------------------------------------------------
+// Reads the checkpoint and the complete transactions of the journal from an
+// open persistent.file into data. Returns false if the file is not valid
+//-----------------------------------------------------------------------------
+bool readPersistentFile(FILE *fd, struct pstorage_header *header, unsigned char **data)
+{
+    if (fread(header, sizeof(*header), 1, fd) < 1 || header->magic != PSTORAGE_MAGIC ||
+        header->version != PSTORAGE_VERSION || header->data_size < PSTORAGE_AREAS_SIZE ||
+        header->header_crc != pstorageChecksum(0, header, offsetof(struct pstorage_header, header_crc)))
+        return false;
+
+    unsigned char *restored = (unsigned char *)malloc(header->data_size);
+    unsigned char *pending = (unsigned char *)malloc(header->data_size);
+    struct pstorage_entry entry;
+    struct pstorage_record *record = &entry.record;
+    if (restored == NULL || pending == NULL ||
+        fread(restored, 1, header->data_size, fd) < header->data_size ||
+        header->data_crc != pstorageChecksum(0, restored, header->data_size))
+    {
+        free(restored);
+        free(pending);
+        return false;
+    }
+
+    //Replay the journal. Pages are collected on pending and only become part
+    //of the restored data when the commit record of their transaction is
+    //found. Reading stops on the first record that is incomplete or corrupted
+    uint64_t transaction = header->sequence;
+    memcpy(pending, restored, header->data_size);
+    while (fread(record, sizeof(*record), 1, fd) == 1)
+    {
+        uint32_t crc = record->crc;
+        uint32_t page = record->page;
+        uint32_t length = record->length;
+        if (record->magic != PSTORAGE_RECORD_MAGIC || record->sequence <= header->sequence || length > PSTORAGE_PAGE_SIZE ||
+            (page != PSTORAGE_COMMIT && (uint64_t)page * PSTORAGE_PAGE_SIZE + length > header->data_size))
+            break;
+        if (length > 0 && fread(entry.data, 1, length, fd) < length) break;
+        record->crc = 0;
+        if (crc != pstorageChecksum(0, &entry, sizeof(*record) + length)) break;
+
+        //a new transaction discards the pages of an unfinished one
+        if (record->sequence != transaction)
+        {
+            memcpy(pending, restored, header->data_size);
+            transaction = record->sequence;
+        }
+
+        if (page == PSTORAGE_COMMIT)
+        {
+            memcpy(restored, pending, header->data_size);
+            header->sequence = transaction;
+        }
+        else
+        {
+            memcpy(&pending[page * PSTORAGE_PAGE_SIZE], entry.data, length);
+        }
     }
+
+    free(pending);
+    *data = restored;
+    return true;
 }
 
 //-----------------------------------------------------------------------------
-// This function reads the contents from persistent.file into OpenPLC internal
-// buffers. Must be called when OpenPLC is initializing. If persistent storage
+// This function reads the contents from persistent.mmap or persistent.file
+// into OpenPLC internal buffers. Must be called when OpenPLC is initializing. If persistent storage
 // is disabled, the persistent.file will not be found and the function will
 // exit gracefully.
 //-----------------------------------------------------------------------------
 int readPersistentStorage()
 {
     unsigned char log_msg[1000];
-    FILE *fd = fopen("persistent.file", "r");
+
+    //a memory map takes the place of persistent.file
+    if (readPersistentMap())
+    {
+        pstorage_read = true;
+        return 0;
+    }
+
+    FILE *fd = fopen(PSTORAGE_FILE, "r");
     if (fd == NULL)
     {
         sprintf(log_msg, "Warning: Persistent Storage file not found\n");
@@ -136,26 +831,52 @@ int readPersistentStorage()
         return 0;
     }
 
-    IEC_INT persistentBuffer[BUFFER_SIZE];
+    struct pstorage_header header;
+    unsigned char *data = NULL;
+    if (!readPersistentFile(fd, &header, &data))
+    {
+        //files written by older versions have only the %MW values
+        IEC_UINT legacyBuffer[BUFFER_SIZE];
+        fseek(fd, 0, SEEK_END);
+        if (ftell(fd) == sizeof(legacyBuffer))
+        {
+            data = (unsigned char *)malloc(sizeof(legacyBuffer));
+            fseek(fd, 0, SEEK_SET);
+            if (data != NULL && fread(data, sizeof(legacyBuffer), 1, fd) < 1)
+            {
+                free(data);
+                data = NULL;
+            }
+            header.data_size = sizeof(legacyBuffer);
+            header.layout = retainLayout();
+            header.sequence = 0;
+        }
+    }
+    fclose(fd);
 
-    if (fread(persistentBuffer, sizeof(IEC_INT), BUFFER_SIZE, fd) < BUFFER_SIZE)
+    if (data == NULL)
     {
         sprintf(log_msg, "Persistent Storage: Error while trying to read persistent.file!\n");
         log(log_msg);
         pstorage_read = true;
         return 0;
     }
-    fclose(fd);
-    
+
     sprintf(log_msg, "Persistent Storage: Reading persistent.file into local buffers\n");
     log(log_msg);
-    
-    pthread_mutex_lock(&bufferLock); //lock mutex
-    for (int i = 0; i < BUFFER_SIZE; i++)
+
+    //Retained variables are only restored if they still have the same sizes
+    uint32_t size = header.data_size;
+    if (size > PSTORAGE_AREAS_SIZE && (size != PSTORAGE_AREAS_SIZE + retain_variables_size || header.layout != retainLayout()))
     {
-        if (int_memory[i] != NULL) *int_memory[i] = persistentBuffer[i];
+        sprintf(log_msg, "Persistent Storage: Retained variables changed. Restoring only located memory\n");
+        log(log_msg);
+        size = PSTORAGE_AREAS_SIZE;
     }
-    pthread_mutex_unlock(&bufferLock); //unlock mutex
-    
+    restoreRetainData(data, size);
+    free(data);
+
+    pstorage_sequence = header.sequence;
     pstorage_read = true;
+    return 0;
 }
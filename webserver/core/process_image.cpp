@@ -0,0 +1,320 @@
+//-----------------------------------------------------------------------------
+// Copyright 2026 agent
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file decouples the protocol servers from the PLC scan. At the end of
+// every cycle the main loop publishes a snapshot of the I/O image that the
+// servers can read without taking bufferLock. Writes coming from the servers
+// are stored on a queue and applied by the main loop at the start of the
+// next cycle.
+// agent, Oct 2026
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ladder.h"
+
+#define IMAGE_SNAPSHOTS         3
+#define WRITE_QUEUE_SIZE        4096 //must be a power of two
+
+struct image_snapshot image_snapshots[IMAGE_SNAPSHOTS];
+int published_snapshot = 0;
+int snapshot_readers[IMAGE_SNAPSHOTS];
+uint64_t published_cycle = 0;
+
+//Threads waiting for the end of the next scan
+pthread_mutex_t snapshotLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t snapshotCond;
+int snapshot_waiters = 0;
+
+struct write_slot
+{
+    uint64_t sequence;
+    struct image_write write;
+};
+
+struct write_slot write_queue[WRITE_QUEUE_SIZE];
+uint64_t write_queue_head = 0; //only touched by the main loop
+uint64_t write_queue_tail = 0;
+
+//-----------------------------------------------------------------------------
+// Initializes the write queue. Must be called before any protocol server is
+// started
+//-----------------------------------------------------------------------------
+void initializeProcessImage()
+{
+    for (uint64_t i = 0; i < WRITE_QUEUE_SIZE; i++)
+    {
+        write_queue[i].sequence = i;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&snapshotCond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+//-----------------------------------------------------------------------------
+// Copies the current values of the I/O image into a free snapshot and makes
+// it the one returned to the readers. Called by the main loop at the end of
+// each cycle while it holds bufferLock. If every other snapshot is still in
+// use by a reader, publishing is skipped for this cycle. Threads blocked on
+// waitImageSnapshot() are woken up once the snapshot is published.
+//-----------------------------------------------------------------------------
+void publishImageSnapshot(uint64_t cycle, struct timespec scan_time)
+{
+    int current = __atomic_load_n(&published_snapshot, __ATOMIC_SEQ_CST);
+    int target = -1;
+    for (int i = 0; i < IMAGE_SNAPSHOTS; i++)
+    {
+        if (i != current && __atomic_load_n(&snapshot_readers[i], __ATOMIC_SEQ_CST) == 0)
+        {
+            target = i;
+            break;
+        }
+    }
+    if (target < 0) return;
+
+    struct image_snapshot *snapshot = &image_snapshots[target];
+    memcpy(snapshot->bool_input, bool_input_image, sizeof(bool_input_image));
+    memcpy(snapshot->bool_output, bool_output_image, sizeof(bool_output_image));
+    memcpy(snapshot->byte_input, byte_input_image, sizeof(byte_input_image));
+    memcpy(snapshot->byte_output, byte_output_image, sizeof(byte_output_image));
+    memcpy(snapshot->int_input, int_input_image, sizeof(int_input_image));
+    memcpy(snapshot->int_output, int_output_image, sizeof(int_output_image));
+    memcpy(snapshot->int_memory, int_memory_image, sizeof(int_memory_image));
+    memcpy(snapshot->dint_memory, dint_memory_image, sizeof(dint_memory_image));
+    memcpy(snapshot->lint_memory, lint_memory_image, sizeof(lint_memory_image));
+    snapshot->cycle = cycle;
+    snapshot->time = scan_time;
+
+    __atomic_store_n(&published_snapshot, target, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&published_cycle, cycle, __ATOMIC_SEQ_CST);
+
+    //only take the lock if someone is waiting, so that the scan doesn't
+    //pay for it otherwise
+    if (__atomic_load_n(&snapshot_waiters, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&snapshotLock);
+        pthread_cond_broadcast(&snapshotCond);
+        pthread_mutex_unlock(&snapshotLock);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Returns the last published snapshot of the I/O image. The snapshot is
+// guaranteed not to change until it is given back with
+// releaseImageSnapshot(). Never blocks.
+//-----------------------------------------------------------------------------
+struct image_snapshot *acquireImageSnapshot()
+{
+    while (true)
+    {
+        int index = __atomic_load_n(&published_snapshot, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&snapshot_readers[index], 1, __ATOMIC_SEQ_CST);
+
+        //make sure the main loop didn't start reusing this snapshot
+        //before we registered as a reader
+        if (__atomic_load_n(&published_snapshot, __ATOMIC_SEQ_CST) == index)
+            return &image_snapshots[index];
+
+        __atomic_sub_fetch(&snapshot_readers[index], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Gives back a snapshot obtained with acquireImageSnapshot()
+//-----------------------------------------------------------------------------
+void releaseImageSnapshot(struct image_snapshot *snapshot)
+{
+    int index = snapshot - image_snapshots;
+    __atomic_sub_fetch(&snapshot_readers[index], 1, __ATOMIC_SEQ_CST);
+}
+
+//-----------------------------------------------------------------------------
+// Blocks until a snapshot of a cycle after the one given is published, or
+// until timeout_ms elapses. Returns false on timeout
+//-----------------------------------------------------------------------------
+bool waitImageSnapshot(uint64_t cycle, int timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_nsec -= 1000000000;
+        deadline.tv_sec++;
+    }
+
+    bool published = true;
+    pthread_mutex_lock(&snapshotLock);
+    __atomic_add_fetch(&snapshot_waiters, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&published_cycle, __ATOMIC_SEQ_CST) <= cycle)
+    {
+        if (pthread_cond_timedwait(&snapshotCond, &snapshotLock, &deadline) == ETIMEDOUT)
+        {
+            published = false;
+            break;
+        }
+    }
+    __atomic_sub_fetch(&snapshot_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&snapshotLock);
+
+    return published;
+}
+
+//-----------------------------------------------------------------------------
+// Queues a batch of writes to the I/O image. All writes in the batch are
+// applied on the same cycle. Returns false if the queue doesn't have room
+// for the whole batch.
+//-----------------------------------------------------------------------------
+bool queueImageWrites(struct image_write *writes, int count)
+{
+    if (count <= 0) return true;
+    if (count > WRITE_QUEUE_SIZE) return false;
+
+    //reserve a contiguous range of slots. The main loop frees slots in
+    //order, so if the last slot of the range is free all of them are
+    uint64_t position = __atomic_load_n(&write_queue_tail, __ATOMIC_RELAXED);
+    while (true)
+    {
+        uint64_t last = position + count - 1;
+        uint64_t sequence = __atomic_load_n(&write_queue[last & (WRITE_QUEUE_SIZE - 1)].sequence, __ATOMIC_ACQUIRE);
+        if (sequence < last) return false; //queue is full
+
+        if (sequence == last && __atomic_compare_exchange_n(&write_queue_tail, &position, position + count, false,
+                                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+
+        if (sequence > last) position = __atomic_load_n(&write_queue_tail, __ATOMIC_RELAXED);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        struct write_slot *slot = &write_queue[(position + i) & (WRITE_QUEUE_SIZE - 1)];
+        slot->write = writes[i];
+        slot->write.end_of_batch = (i == count - 1);
+        __atomic_store_n(&slot->sequence, position + i + 1, __ATOMIC_RELEASE);
+    }
+
+    //the write may be the data source of an event task. Periodic tasks
+    //pick it up on their next scan
+    if (event_task_count > 0) requestScan();
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Applies a single write to the I/O image. 32 and 64-bit memory not used by
+// the program is written to its place on the image, so that it can still be
+// used through the protocol servers
+//-----------------------------------------------------------------------------
+void applyImageWrite(struct image_write *write)
+{
+    int index = write->index;
+    if (index >= BUFFER_SIZE) return;
+
+    switch (write->area)
+    {
+        case IMAGE_BOOL_OUTPUT:
+            for (int j = 0; j < 8; j++)
+            {
+                if ((write->mask >> j) & 1 && bool_output[index][j] != NULL)
+                    *bool_output[index][j] = (write->value >> j) & 1;
+            }
+            break;
+        case IMAGE_INT_OUTPUT:
+            if (int_output[index] != NULL)
+                *int_output[index] = (*int_output[index] & ~write->mask) | (write->value & write->mask);
+            break;
+        case IMAGE_INT_MEMORY:
+            if (int_memory[index] != NULL)
+                *int_memory[index] = (*int_memory[index] & ~write->mask) | (write->value & write->mask);
+            break;
+        case IMAGE_DINT_MEMORY:
+        {
+            IEC_DINT *value = (dint_memory[index] != NULL) ? dint_memory[index] : &dint_memory_image[index];
+            *value = (*value & ~write->mask) | (write->value & write->mask);
+            break;
+        }
+        case IMAGE_LINT_MEMORY:
+        {
+            IEC_LINT *value = (lint_memory[index] != NULL) ? lint_memory[index] : &lint_memory_image[index];
+            *value = (*value & ~write->mask) | (write->value & write->mask);
+            break;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Takes all complete batches off the write queue, applying them to the I/O
+// image if apply is set. Returns the number of writes taken
+//-----------------------------------------------------------------------------
+static int takeImageWrites(bool apply)
+{
+    int taken = 0;
+    uint64_t head = write_queue_head;
+    uint64_t position = head;
+
+    while (true)
+    {
+        struct write_slot *slot = &write_queue[position & (WRITE_QUEUE_SIZE - 1)];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != position + 1) break;
+
+        if (slot->write.end_of_batch)
+        {
+            //batch is complete. Apply it and hand the slots back
+            for (uint64_t p = head; p <= position; p++)
+            {
+                struct write_slot *batch_slot = &write_queue[p & (WRITE_QUEUE_SIZE - 1)];
+                if (apply) applyImageWrite(&batch_slot->write);
+                taken++;
+                __atomic_store_n(&batch_slot->sequence, p + WRITE_QUEUE_SIZE, __ATOMIC_RELEASE);
+            }
+            head = position + 1;
+        }
+        position++;
+    }
+
+    write_queue_head = head;
+    return taken;
+}
+
+//-----------------------------------------------------------------------------
+// Applies all complete batches waiting on the write queue. Called by the main
+// loop at the start of each cycle while it holds bufferLock.
+//-----------------------------------------------------------------------------
+void applyImageWrites()
+{
+    takeImageWrites(true);
+}
+
+//-----------------------------------------------------------------------------
+// Drops all complete batches waiting on the write queue without applying
+// them. Called by the main loop instead of applyImageWrites() while the
+// watchdog fault is latched. Returns the number of writes dropped
+//-----------------------------------------------------------------------------
+int discardImageWrites()
+{
+    return takeImageWrites(false);
+}
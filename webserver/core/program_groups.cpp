@@ -0,0 +1,240 @@
+//-----------------------------------------------------------------------------
+// Copyright 2026 agent
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file runs the programs of the PLC on all cores. When the program is
+// compiled with iec2c -O g, the programs of each resource are split into
+// groups that share no variables, listed on config_groups__. The groups of a
+// resource then run in parallel on a pool of worker threads. The main loop
+// runs its own share of the groups and waits on a barrier for the workers,
+// so the outputs are only sent once every group has finished.
+//
+// Workers are pinned to the cores the kernel keeps isolated (isolcpus), or
+// to the cores after the first one if there are none, and run at the
+// priority of the main loop.
+// agent, Oct 2026
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "iec_types.h"
+#include "accessor.h"
+#include "ladder.h"
+
+#define MAX_GROUP_WORKERS       16
+#define GROUP_RT_PRIORITY       30 //same as the main loop
+
+//Defined on the configuration by iec2c -O g. NULL for programs compiled
+//without that option
+extern __IEC_RESOURCE_GROUPS_t config_groups__[] __attribute__((weak));
+
+struct group_worker
+{
+    int share; //the worker runs the groups share, share + group_workers + 1, ...
+    int cpu;
+    pthread_t thread;
+};
+
+struct group_worker group_worker_list[MAX_GROUP_WORKERS];
+int group_workers = 0;
+bool run_groups = false;
+
+//Groups being run, set by the main loop before the workers are released.
+//The barriers order these with the runs of the workers
+__IEC_PROGRAM_GROUP_t *current_groups;
+int current_group_count;
+unsigned long current_tick;
+pthread_barrier_t groups_start;
+pthread_barrier_t groups_done;
+
+//-----------------------------------------------------------------------------
+// Reads the list of isolated cores. Returns the number of cores found
+//-----------------------------------------------------------------------------
+int getIsolatedCpus(int *cpus, int max_cpus)
+{
+    int count = 0;
+    FILE *isolated = fopen("/sys/devices/system/cpu/isolated", "r");
+    if (isolated == NULL) return 0;
+
+    //the list looks like 2-3,6
+    int first, last;
+    while (count < max_cpus && fscanf(isolated, "%d", &first) == 1)
+    {
+        last = first;
+        int c = fgetc(isolated);
+        if (c == '-')
+        {
+            if (fscanf(isolated, "%d", &last) != 1) break;
+            c = fgetc(isolated);
+        }
+        for (int cpu = first; cpu <= last && count < max_cpus; cpu++) cpus[count++] = cpu;
+        if (c != ',') break;
+    }
+    fclose(isolated);
+
+    return count;
+}
+
+//-----------------------------------------------------------------------------
+// Runs one share of the groups of a resource
+//-----------------------------------------------------------------------------
+void runGroupShare(int share, __IEC_PROGRAM_GROUP_t *groups, int count, unsigned long tick)
+{
+    for (int i = share; i < count; i += group_workers + 1)
+    {
+        groups[i].run(tick);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Thread that runs a share of the program groups on every scan
+//-----------------------------------------------------------------------------
+void *groupWorker(void *arg)
+{
+    struct group_worker *worker = (struct group_worker *)arg;
+    unsigned char log_msg[1000];
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(worker->cpu, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))
+    {
+        sprintf(log_msg, "WARNING: Failed to pin program worker to core %d\n", worker->cpu);
+        logMessage(LOG_WARNING, LOG_SCAN, log_msg);
+    }
+
+    struct sched_param sp;
+    sp.sched_priority = GROUP_RT_PRIORITY;
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp))
+    {
+        sprintf(log_msg, "WARNING: Failed to set program worker to real-time priority\n");
+        logMessage(LOG_WARNING, LOG_SCAN, log_msg);
+    }
+
+    while (true)
+    {
+        pthread_barrier_wait(&groups_start);
+        if (!run_groups) break;
+        runGroupShare(worker->share, current_groups, current_group_count, current_tick);
+        pthread_barrier_wait(&groups_done);
+    }
+
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Starts the workers that run the program groups in parallel. Nothing is
+// started if the program has no groups or if there is a single core
+//-----------------------------------------------------------------------------
+void startProgramGroups()
+{
+    if (config_groups__ == NULL) return;
+
+    unsigned char log_msg[1000];
+    int max_groups = 0;
+    for (int r = 0; config_groups__[r].name != NULL; r++)
+    {
+        int count = 0;
+        while (config_groups__[r].groups[count].run != NULL)
+        {
+            sprintf(log_msg, "Resource %s, group %d: %s\n", config_groups__[r].name, count,
+                    config_groups__[r].groups[count].programs);
+            log(log_msg);
+            count++;
+        }
+        if (count > max_groups) max_groups = count;
+    }
+
+    int cpus[MAX_GROUP_WORKERS];
+    int cpu_count = getIsolatedCpus(cpus, MAX_GROUP_WORKERS);
+    if (cpu_count == 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int cpu = 1; cpu < online && cpu_count < MAX_GROUP_WORKERS; cpu++) cpus[cpu_count++] = cpu;
+    }
+
+    group_workers = max_groups - 1;
+    if (group_workers > cpu_count) group_workers = cpu_count;
+    if (group_workers <= 0)
+    {
+        group_workers = 0;
+        return;
+    }
+
+    pthread_barrier_init(&groups_start, NULL, group_workers + 1);
+    pthread_barrier_init(&groups_done, NULL, group_workers + 1);
+    run_groups = true;
+    for (int i = 0; i < group_workers; i++)
+    {
+        group_worker_list[i].share = i + 1;
+        group_worker_list[i].cpu = cpus[i];
+        pthread_create(&group_worker_list[i].thread, NULL, groupWorker, &group_worker_list[i]);
+    }
+
+    sprintf(log_msg, "Running %d program groups on %d cores\n", max_groups, group_workers + 1);
+    log(log_msg);
+}
+
+//-----------------------------------------------------------------------------
+// Stops the workers of the program groups
+//-----------------------------------------------------------------------------
+void stopProgramGroups()
+{
+    if (group_workers == 0) return;
+
+    run_groups = false;
+    pthread_barrier_wait(&groups_start);
+    for (int i = 0; i < group_workers; i++)
+    {
+        pthread_join(group_worker_list[i].thread, NULL);
+    }
+    group_workers = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Runs the programs of every resource, with the groups of each resource in
+// parallel. Replaces config_run__() in the main loop when there are workers
+//-----------------------------------------------------------------------------
+void runProgramGroups(unsigned long tick)
+{
+    for (int r = 0; config_groups__[r].name != NULL; r++)
+    {
+        __IEC_PROGRAM_GROUP_t *groups = config_groups__[r].groups;
+        int count = 0;
+        while (groups[count].run != NULL) count++;
+        config_groups__[r].schedule(tick);
+
+        //a resource with a single group is not worth waking up the workers
+        if (count < 2)
+        {
+            if (count == 1) groups[0].run(tick);
+            continue;
+        }
+
+        current_groups = groups;
+        current_group_count = count;
+        current_tick = tick;
+        pthread_barrier_wait(&groups_start);
+        runGroupShare(0, groups, count, tick);
+        pthread_barrier_wait(&groups_done);
+    }
+}
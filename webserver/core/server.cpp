@@ -29,6 +29,10 @@
 #include <string.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #include "ladder.h"
 
@@ -36,6 +40,45 @@
 #define MAX_OUTPUT 16
 #define MAX_MODBUS 100
 #define NET_BUFFER_SIZE 10000
+#define TX_BUFFER_SIZE  (4 * NET_BUFFER_SIZE)
+
+#define MBAP_HEADER_SIZE    6
+#define MAX_MBAP_LENGTH     254 //unit identifier + PDU
+#define ENIP_HEADER_SIZE    24
+
+#define MAX_SERVER_EVENTS       64
+#define SERVER_POLL_TIMEOUT     100 //time in ms the workers wait before checking if the server was stopped
+
+int server_workers = 1;
+int server_max_connections = 64;
+
+struct server_connection
+{
+    int fd;
+    int protocol_type;
+    int worker_id;
+    char address[INET_ADDRSTRLEN];
+    uint16_t port;
+    time_t connected_at;
+    uint64_t requests;
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    uint64_t errors;
+
+    //bytes received that don't make a complete request yet
+    unsigned char rx_buffer[NET_BUFFER_SIZE];
+    int rx_size;
+
+    //responses waiting to be sent
+    unsigned char tx_buffer[TX_BUFFER_SIZE];
+    int tx_offset;
+    int tx_size;
+};
+
+//Open connections of all servers. The lock protects the table, the stats of
+//each connection are only written by the worker that owns it
+struct server_connection *server_connections[MAX_SERVER_CONNECTIONS];
+pthread_mutex_t connectionsLock = PTHREAD_MUTEX_INITIALIZER;
 
 
 //-----------------------------------------------------------------------------
@@ -120,14 +163,470 @@ int createSocket(uint16_t port)
         return -1;
     }
     
-    // we accept max 5 pending connections
-    listen(socket_fd,5);
+    listen(socket_fd,SOMAXCONN);
     sprintf(log_msg, "Server: Listening on port %d\n", port);
     log(log_msg);
 
     return socket_fd;
 }
 
+//-----------------------------------------------------------------------------
+// Adds a connection to the table of open connections. Returns false if the
+// server has already reached its connection limit
+//-----------------------------------------------------------------------------
+bool registerConnection(struct server_connection *connection)
+{
+    int free_slot = -1;
+    int count = 0;
+
+    pthread_mutex_lock(&connectionsLock);
+    for (int i = 0; i < MAX_SERVER_CONNECTIONS; i++)
+    {
+        if (server_connections[i] == NULL)
+        {
+            if (free_slot < 0) free_slot = i;
+        }
+        else if (server_connections[i]->protocol_type == connection->protocol_type)
+        {
+            count++;
+        }
+    }
+
+    if (free_slot < 0 || count >= server_max_connections)
+    {
+        pthread_mutex_unlock(&connectionsLock);
+        return false;
+    }
+
+    server_connections[free_slot] = connection;
+    pthread_mutex_unlock(&connectionsLock);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Removes a connection from the table of open connections
+//-----------------------------------------------------------------------------
+void unregisterConnection(struct server_connection *connection)
+{
+    pthread_mutex_lock(&connectionsLock);
+    for (int i = 0; i < MAX_SERVER_CONNECTIONS; i++)
+    {
+        if (server_connections[i] == connection)
+        {
+            server_connections[i] = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&connectionsLock);
+}
+
+//-----------------------------------------------------------------------------
+// Writes the stats of all open connections to the buffer. Returns the number
+// of characters written
+//-----------------------------------------------------------------------------
+int getServerStats(char *buffer, int buffer_size)
+{
+    time_t now;
+    time(&now);
+
+    int len = snprintf(buffer, buffer_size, "workers: %d\nmax_connections: %d\n", server_workers, server_max_connections);
+
+    pthread_mutex_lock(&connectionsLock);
+    for (int i = 0; i < MAX_SERVER_CONNECTIONS && len < buffer_size; i++)
+    {
+        struct server_connection *connection = server_connections[i];
+        if (connection == NULL) continue;
+
+        len += snprintf(buffer + len, buffer_size - len, "%s %s:%d fd=%d uptime=%lds requests=%llu rx=%llu tx=%llu errors=%llu\n",
+                        connection->protocol_type == MODBUS_PROTOCOL ? "modbus" : "enip",
+                        connection->address, connection->port, connection->fd, (long)(now - connection->connected_at),
+                        (unsigned long long)connection->requests, (unsigned long long)connection->bytes_received,
+                        (unsigned long long)connection->bytes_sent, (unsigned long long)connection->errors);
+    }
+    pthread_mutex_unlock(&connectionsLock);
+
+    return len < buffer_size ? len : buffer_size - 1;
+}
+
+//-----------------------------------------------------------------------------
+// Process client's request. The response is written back on the same buffer.
+// Returns the size of the response
+//-----------------------------------------------------------------------------
+int processMessage(unsigned char *buffer, int bufferSize, int protocol_type)
+{
+    if (protocol_type == MODBUS_PROTOCOL)
+    {
+        return processModbusMessage(buffer, bufferSize);
+    }
+    else if (protocol_type == ENIP_PROTOCOL)
+    {
+        return processEnipMessage(buffer, bufferSize);
+    }
+
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+// Finds the size of the first request on a stream of bytes received from a
+// client. Returns 0 if the request is not complete yet, or -1 if the stream
+// doesn't carry a valid request
+//-----------------------------------------------------------------------------
+int getFrameSize(unsigned char *buffer, int bufferSize, int protocol_type)
+{
+    if (protocol_type == MODBUS_PROTOCOL)
+    {
+        if (bufferSize < MBAP_HEADER_SIZE) return 0;
+
+        int length = (buffer[4] << 8) | buffer[5];
+        if (length < 2 || length > MAX_MBAP_LENGTH) return -1;
+
+        return (bufferSize >= MBAP_HEADER_SIZE + length) ? MBAP_HEADER_SIZE + length : 0;
+    }
+    else if (protocol_type == ENIP_PROTOCOL)
+    {
+        if (bufferSize < ENIP_HEADER_SIZE) return 0;
+
+        //ENIP length is little endian
+        int length = buffer[2] | (buffer[3] << 8);
+        if (ENIP_HEADER_SIZE + length > NET_BUFFER_SIZE) return -1;
+
+        return (bufferSize >= ENIP_HEADER_SIZE + length) ? ENIP_HEADER_SIZE + length : 0;
+    }
+
+    return -1;
+}
+
+#ifdef __linux__
+
+struct server_worker
+{
+    int id;
+    int epoll_fd;
+    int socket_fd;
+    int protocol_type;
+    bool *run_server;
+    pthread_t thread;
+};
+
+//-----------------------------------------------------------------------------
+// Closes a client connection and releases its resources
+//-----------------------------------------------------------------------------
+void closeConnection(struct server_worker *worker, struct server_connection *connection)
+{
+    unsigned char log_msg[1000];
+
+    sprintf(log_msg, "Server: closing connection from %s:%d (ID: %d)\n", connection->address, connection->port, connection->fd);
+    log(log_msg);
+
+    unregisterConnection(connection);
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    free(connection);
+}
+
+//-----------------------------------------------------------------------------
+// Accepts all pending clients and adds them to the worker's epoll set
+//-----------------------------------------------------------------------------
+void acceptClients(struct server_worker *worker)
+{
+    unsigned char log_msg[1000];
+
+    while (true)
+    {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_fd = accept4(worker->socket_fd, (struct sockaddr *)&client_addr, &client_len, SOCK_NONBLOCK);
+        if (client_fd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                sprintf(log_msg, "Server: Error accepting client! => %s\n", strerror(errno));
+                log(log_msg);
+            }
+            return;
+        }
+
+        struct server_connection *connection = (struct server_connection *)calloc(1, sizeof(struct server_connection));
+        if (connection == NULL)
+        {
+            close(client_fd);
+            continue;
+        }
+        connection->fd = client_fd;
+        connection->protocol_type = worker->protocol_type;
+        connection->worker_id = worker->id;
+        inet_ntop(AF_INET, &client_addr.sin_addr, connection->address, sizeof(connection->address));
+        connection->port = ntohs(client_addr.sin_port);
+        time(&connection->connected_at);
+
+        if (!registerConnection(connection))
+        {
+            sprintf(log_msg, "Server: connection limit reached. Rejecting client %s:%d\n", connection->address, connection->port);
+            log(log_msg);
+            close(client_fd);
+            free(connection);
+            continue;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = connection;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) < 0)
+        {
+            unregisterConnection(connection);
+            close(client_fd);
+            free(connection);
+            continue;
+        }
+
+        sprintf(log_msg, "Server: Client accepted! %s:%d assigned to worker %d (ID: %d)\n", connection->address, connection->port, worker->id, client_fd);
+        log(log_msg);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Sends as much as possible of the pending response. Returns false if the
+// connection must be closed
+//-----------------------------------------------------------------------------
+bool flushConnection(struct server_worker *worker, struct server_connection *connection)
+{
+    while (connection->tx_offset < connection->tx_size)
+    {
+        int n = write(connection->fd, connection->tx_buffer + connection->tx_offset, connection->tx_size - connection->tx_offset);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+
+            //socket is full. Stop reading requests until the client
+            //catches up with the responses
+            struct epoll_event event;
+            event.events = EPOLLOUT | EPOLLRDHUP;
+            event.data.ptr = connection;
+            epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+            return true;
+        }
+        connection->tx_offset += n;
+        connection->bytes_sent += n;
+    }
+
+    connection->tx_offset = 0;
+    connection->tx_size = 0;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Processes every complete request waiting on the receive buffer. Responses
+// are appended to the transmit buffer so that they all go out in a single
+// write. Returns false if the connection must be closed
+//-----------------------------------------------------------------------------
+bool processRequests(struct server_connection *connection)
+{
+    int offset = 0;
+
+    //the handlers write the response over the request, so each request is
+    //moved to the end of the transmit buffer before being processed
+    while (connection->tx_size + NET_BUFFER_SIZE <= TX_BUFFER_SIZE)
+    {
+        int frameSize = getFrameSize(connection->rx_buffer + offset, connection->rx_size - offset, connection->protocol_type);
+        if (frameSize < 0) return false;
+        if (frameSize == 0) break;
+
+        unsigned char *message = connection->tx_buffer + connection->tx_size;
+        memcpy(message, connection->rx_buffer + offset, frameSize);
+        offset += frameSize;
+
+        int messageSize = processMessage(message, frameSize, connection->protocol_type);
+        if (messageSize <= 0 || messageSize > NET_BUFFER_SIZE)
+        {
+            connection->errors++;
+            continue;
+        }
+        connection->requests++;
+        connection->tx_size += messageSize;
+    }
+
+    if (offset > 0)
+    {
+        memmove(connection->rx_buffer, connection->rx_buffer + offset, connection->rx_size - offset);
+        connection->rx_size -= offset;
+    }
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Answers the requests waiting on the receive buffer until all of them are
+// processed or the client stops accepting responses. Returns false if the
+// connection must be closed
+//-----------------------------------------------------------------------------
+bool serviceConnection(struct server_worker *worker, struct server_connection *connection)
+{
+    while (true)
+    {
+        int pending = connection->rx_size;
+        if (!processRequests(connection))
+        {
+            unsigned char log_msg[1000];
+            sprintf(log_msg, "Server: invalid request framing from %s:%d (ID: %d)\n", connection->address, connection->port, connection->fd);
+            log(log_msg);
+            return false;
+        }
+        if (!flushConnection(worker, connection)) return false;
+        if (connection->tx_size > 0 || connection->rx_size == pending) return true;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Handles an event on a client connection. Returns false if the connection
+// must be closed
+//-----------------------------------------------------------------------------
+bool handleConnectionEvent(struct server_worker *worker, struct server_connection *connection, uint32_t events)
+{
+    if (events & EPOLLERR) return false;
+
+    if (events & EPOLLOUT)
+    {
+        if (!flushConnection(worker, connection)) return false;
+        if (connection->tx_size > 0) return true;
+
+        //requests that didn't fit on the transmit buffer are still waiting
+        if (!serviceConnection(worker, connection)) return false;
+        if (connection->tx_size > 0) return true;
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = connection;
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP))
+    {
+        int n = read(connection->fd, connection->rx_buffer + connection->rx_size, NET_BUFFER_SIZE - connection->rx_size);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return true;
+        if (n <= 0) return false;
+        connection->bytes_received += n;
+        connection->rx_size += n;
+
+        return serviceConnection(worker, connection);
+    }
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Event loop of a server worker. Every worker waits for new clients on the
+// shared listening socket and serves the connections it has accepted
+//-----------------------------------------------------------------------------
+void *serverWorker(void *arg)
+{
+    struct server_worker *worker = (struct server_worker *)arg;
+    struct epoll_event events[MAX_SERVER_EVENTS];
+
+    while (*worker->run_server)
+    {
+        int n = epoll_wait(worker->epoll_fd, events, MAX_SERVER_EVENTS, SERVER_POLL_TIMEOUT);
+        for (int i = 0; i < n; i++)
+        {
+            struct server_connection *connection = (struct server_connection *)events[i].data.ptr;
+            if (connection == NULL)
+            {
+                acceptClients(worker);
+            }
+            else if (!handleConnectionEvent(worker, connection, events[i].events))
+            {
+                closeConnection(worker, connection);
+            }
+        }
+    }
+
+    //close all connections owned by this worker
+    while (true)
+    {
+        struct server_connection *connection = NULL;
+        pthread_mutex_lock(&connectionsLock);
+        for (int i = 0; i < MAX_SERVER_CONNECTIONS && connection == NULL; i++)
+        {
+            if (server_connections[i] != NULL && server_connections[i]->protocol_type == worker->protocol_type &&
+                server_connections[i]->worker_id == worker->id)
+            {
+                connection = server_connections[i];
+            }
+        }
+        pthread_mutex_unlock(&connectionsLock);
+
+        if (connection == NULL) break;
+        closeConnection(worker, connection);
+    }
+
+    close(worker->epoll_fd);
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Function to start the server. It receives the port number as argument and
+// runs the event loop of the server workers until the server is stopped
+//-----------------------------------------------------------------------------
+void startServer(uint16_t port, int protocol_type)
+{
+    unsigned char log_msg[1000];
+    struct server_worker workers[MAX_SERVER_WORKERS];
+    bool *run_server;
+    int num_workers = server_workers;
+
+    if (num_workers < 1) num_workers = 1;
+    if (num_workers > MAX_SERVER_WORKERS) num_workers = MAX_SERVER_WORKERS;
+
+    if (protocol_type == MODBUS_PROTOCOL)
+        run_server = &run_modbus;
+    else if (protocol_type == ENIP_PROTOCOL)
+        run_server = &run_enip;
+
+    int socket_fd = createSocket(port);
+    if (socket_fd < 0) return;
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        workers[i].id = i;
+        workers[i].socket_fd = socket_fd;
+        workers[i].protocol_type = protocol_type;
+        workers[i].run_server = run_server;
+        workers[i].epoll_fd = epoll_create1(0);
+
+        //only one worker is woken up for each new client
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = NULL;
+        if (workers[i].epoll_fd < 0 || epoll_ctl(workers[i].epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) < 0)
+        {
+            sprintf(log_msg, "Server: error creating event loop => %s\n", strerror(errno));
+            log(log_msg);
+            num_workers = i;
+            break;
+        }
+    }
+
+    sprintf(log_msg, "Server: started %d worker(s) for up to %d connections\n", num_workers, server_max_connections);
+    log(log_msg);
+
+    //the first worker runs on this thread
+    for (int i = 1; i < num_workers; i++)
+    {
+        pthread_create(&workers[i].thread, NULL, serverWorker, &workers[i]);
+    }
+    if (num_workers > 0) serverWorker(&workers[0]);
+    for (int i = 1; i < num_workers; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    close(socket_fd);
+    sprintf(log_msg, "Terminating Server thread\r\n");
+    log(log_msg);
+}
+
+#else
+
 //-----------------------------------------------------------------------------
 // Blocking call. Wait here for the client to connect. Returns the file
 // descriptor to communicate with the client.
@@ -175,23 +674,6 @@ int listenToClient(int client_fd, unsigned char *buffer)
     return n;
 }
 
-//-----------------------------------------------------------------------------
-// Process client's request
-//-----------------------------------------------------------------------------
-void processMessage(unsigned char *buffer, int bufferSize, int client_fd, int protocol_type)
-{
-    if (protocol_type == MODBUS_PROTOCOL)
-    {
-        int messageSize = processModbusMessage(buffer, bufferSize);
-        write(client_fd, buffer, messageSize);
-    }
-    else if (protocol_type == ENIP_PROTOCOL)
-    {
-        int messageSize = processEnipMessage(buffer, bufferSize);
-        write(client_fd, buffer, messageSize);
-    }
-}
-
 //-----------------------------------------------------------------------------
 // Thread to handle requests for each connected client
 //-----------------------------------------------------------------------------
@@ -235,7 +717,8 @@ void *handleConnections(void *arguments)
             break;
         }
 
-        processMessage(buffer, messageSize, client_fd, protocol_type);
+        messageSize = processMessage(buffer, messageSize, protocol_type);
+        if (messageSize > 0) write(client_fd, buffer, messageSize);
     }
     //printf("Debug: Closing client socket and calling pthread_exit in server.cpp\n");
     close(client_fd);
@@ -294,4 +777,6 @@ void startServer(uint16_t port, int protocol_type)
     close(client_fd);
     sprintf(log_msg, "Terminating Server thread\r\n");
     log(log_msg);
-}
\ No newline at end of file
+}
+
+#endif
@@ -0,0 +1,679 @@
+//-----------------------------------------------------------------------------
+// Copyright 2026 agent
+// This file is part of the OpenPLC Software Stack.
+//
+// OpenPLC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// OpenPLC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with OpenPLC.  If not, see <http://www.gnu.org/licenses/>.
+//------
+//
+// This file implements the scheduler for periodic tasks. When the program is
+// compiled with iec2c -O t, each periodic task of the configuration gets its
+// own functions, listed on config_tasks__. Every task then runs on a thread
+// of its own, with a SCHED_FIFO priority taken from the IEC PRIORITY (0 is
+// the most urgent), so a slow task can't delay a fast one.
+//
+// SINGLE tasks are event tasks. Their thread runs above the main loop and is
+// woken up after every scan to sample the task's data source, and it runs the
+// task's programs as soon as it rises. Hardware layers and protocol servers
+// call requestScan() when an input changes, so an event only waits for one
+// I/O scan instead of a whole tick.
+//
+// Periodic tasks are not run on a common tick. The scheduler keeps the deadline of
+// each task on a min-heap, and the main loop sleeps until the earliest one,
+// scans the I/O and releases the tasks that are due. It also scans the I/O
+// when a task finishes, so that its outputs are sent right away, and at
+// least every SCAN_IDLE_PERIOD to service the protocol servers. Programs that
+// are not bound to a periodic task keep running every common tick: they have
+// their own entry on the heap, and only run on the scans where it is due.
+//
+// A task that is still running when it is due again skips that activation.
+// With the watchdog overrun policy, a task or the unbound programs falling
+// overrun_limit activations behind raise the watchdog fault. Tasks don't run
+// and don't write their outputs back while the fault is latched.
+//
+// Each task works on a private copy of the image. The located variables of
+// its programs are bound to the copy when the programs are initialized.
+// Before each run the copy is refreshed from the shared image, and after the
+// run the outputs and memory values changed by the task are written back.
+// bufferLock is only held for these copies, so the programs see the same
+// inputs for the whole run without holding the lock while they execute.
+// Only located variables go through the task images: VAR_GLOBALs and
+// function block instances used by programs of different tasks are shared
+// with no locking, so a program must not rely on a value written by another
+// task while it runs.
+// agent, Oct 2026
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+
+#include "iec_types.h"
+#include "accessor.h"
+#include "ladder.h"
+
+#define MAX_TASKS               32
+#define TASK_RT_PRIORITY        29 //priority of IEC PRIORITY 0. The main loop runs at 30
+#define EVENT_RT_PRIORITY       40 //priority of event tasks with IEC PRIORITY 0
+#define SCAN_IDLE_PERIOD        100000000 //ns. Longest time without an I/O scan
+#define MAIN_PROGRAMS           MAX_TASKS //heap entry of the programs not bound to a task
+
+//Defined on the configuration by iec2c -O t. NULL for programs compiled
+//without that option
+extern __IEC_TASK_t *config_tasks__[] __attribute__((weak));
+
+struct task_state
+{
+    __IEC_TASK_t *task;
+    struct task_image *image;
+    struct task_image *start; //outputs and memory as they were before the run
+    pthread_t thread;
+    sem_t release; //posted by the main loop when the task is due
+    bool running;
+    bool pending; //event tasks only. Set while the task has a trigger check to do
+    struct timespec deadline;
+    unsigned long tick;
+    unsigned long release_tick; //tick of the activation being run
+    uint64_t runs;
+    uint64_t overruns;
+    uint32_t late; //activations skipped in a row
+    uint32_t last_ns;
+    uint32_t max_ns;
+};
+
+struct task_state task_states[MAX_TASKS + 1];
+int task_count = 0;
+int event_task_count = 0;
+bool run_tasks = false;
+
+//Min-heap of the tasks, ordered by their next deadline. Only touched by the
+//main loop
+int deadline_heap[MAX_TASKS + 1];
+int deadline_heap_size = 0;
+
+//Signals the main loop that the I/O must be scanned right away, because a
+//task finished or an input changed
+pthread_mutex_t taskEventLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t taskEvent;
+bool scan_requested = false;
+
+//Number of positions of each area that hold located variables. Only these
+//are copied to and from the task images
+struct image_extent
+{
+    int bool_input;
+    int bool_output;
+    int byte_input;
+    int byte_output;
+    int int_input;
+    int int_output;
+    int int_memory;
+    int dint_memory;
+    int lint_memory;
+    int special_functions;
+};
+
+struct image_extent used_image;
+
+//-----------------------------------------------------------------------------
+// Helper function - Adds a number of nanoseconds to a timestamp
+//-----------------------------------------------------------------------------
+void timespec_add_ns(struct timespec *ts, uint64_t ns)
+{
+    ts->tv_sec += ns / (1000*1000*1000);
+    ts->tv_nsec += ns % (1000*1000*1000);
+    if (ts->tv_nsec >= 1000*1000*1000)
+    {
+        ts->tv_nsec -= 1000*1000*1000;
+        ts->tv_sec++;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Helper function - Tells if the deadline of task a comes before the one of
+// task b
+//-----------------------------------------------------------------------------
+bool deadlineBefore(int a, int b)
+{
+    return timespec_diff_ns(&task_states[a].deadline, &task_states[b].deadline) < 0;
+}
+
+//-----------------------------------------------------------------------------
+// Adds a task to the deadline heap
+//-----------------------------------------------------------------------------
+void pushDeadline(int task)
+{
+    int i = deadline_heap_size++;
+    while (i > 0 && deadlineBefore(task, deadline_heap[(i - 1) / 2]))
+    {
+        deadline_heap[i] = deadline_heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    deadline_heap[i] = task;
+}
+
+//-----------------------------------------------------------------------------
+// Removes the task with the earliest deadline from the heap and returns it
+//-----------------------------------------------------------------------------
+int popDeadline()
+{
+    int top = deadline_heap[0];
+    int last = deadline_heap[--deadline_heap_size];
+
+    int i = 0;
+    while (2 * i + 1 < deadline_heap_size)
+    {
+        int child = 2 * i + 1;
+        if (child + 1 < deadline_heap_size && deadlineBefore(deadline_heap[child + 1], deadline_heap[child])) child++;
+        if (!deadlineBefore(deadline_heap[child], last)) break;
+        deadline_heap[i] = deadline_heap[child];
+        i = child;
+    }
+    deadline_heap[i] = last;
+
+    return top;
+}
+
+//-----------------------------------------------------------------------------
+// Finds out how much of each area of the image is used by located variables.
+// Must be called after glueVars()
+//-----------------------------------------------------------------------------
+void findUsedImage()
+{
+    memset(&used_image, 0, sizeof(used_image));
+    for (int i = 0; i < BUFFER_SIZE; i++)
+    {
+        for (int j = 0; j < 8; j++)
+        {
+            if (bool_input[i][j] != NULL) used_image.bool_input = i + 1;
+            if (bool_output[i][j] != NULL) used_image.bool_output = i + 1;
+        }
+        if (byte_input[i] != NULL) used_image.byte_input = i + 1;
+        if (byte_output[i] != NULL) used_image.byte_output = i + 1;
+        if (int_input[i] != NULL) used_image.int_input = i + 1;
+        if (int_output[i] != NULL) used_image.int_output = i + 1;
+        if (int_memory[i] != NULL) used_image.int_memory = i + 1;
+        if (dint_memory[i] != NULL) used_image.dint_memory = i + 1;
+        if (lint_memory[i] != NULL) used_image.lint_memory = i + 1;
+        if (special_functions[i] != NULL) used_image.special_functions = i + 1;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Copies the shared image to the image of a task. Must be called with
+// bufferLock held
+//-----------------------------------------------------------------------------
+void copyTaskImageIn(struct task_state *state)
+{
+    struct task_image *image = state->image;
+    struct task_image *start = state->start;
+
+    memcpy(image->bool_input, bool_input_image, used_image.bool_input * sizeof(image->bool_input[0]));
+    memcpy(image->byte_input, byte_input_image, used_image.byte_input * sizeof(IEC_BYTE));
+    memcpy(image->int_input, int_input_image, used_image.int_input * sizeof(IEC_UINT));
+    memcpy(image->special_functions, special_functions_image, used_image.special_functions * sizeof(IEC_LINT));
+
+    //outputs and memory can be read by the programs too. A copy of them is
+    //kept to find out which values the task changes
+    memcpy(image->bool_output, bool_output_image, used_image.bool_output * sizeof(image->bool_output[0]));
+    memcpy(image->byte_output, byte_output_image, used_image.byte_output * sizeof(IEC_BYTE));
+    memcpy(image->int_output, int_output_image, used_image.int_output * sizeof(IEC_UINT));
+    memcpy(image->int_memory, int_memory_image, used_image.int_memory * sizeof(IEC_UINT));
+    memcpy(image->dint_memory, dint_memory_image, used_image.dint_memory * sizeof(IEC_DINT));
+    memcpy(image->lint_memory, lint_memory_image, used_image.lint_memory * sizeof(IEC_LINT));
+
+    memcpy(start->bool_output, image->bool_output, used_image.bool_output * sizeof(image->bool_output[0]));
+    memcpy(start->byte_output, image->byte_output, used_image.byte_output * sizeof(IEC_BYTE));
+    memcpy(start->int_output, image->int_output, used_image.int_output * sizeof(IEC_UINT));
+    memcpy(start->int_memory, image->int_memory, used_image.int_memory * sizeof(IEC_UINT));
+    memcpy(start->dint_memory, image->dint_memory, used_image.dint_memory * sizeof(IEC_DINT));
+    memcpy(start->lint_memory, image->lint_memory, used_image.lint_memory * sizeof(IEC_LINT));
+}
+
+//-----------------------------------------------------------------------------
+// Writes the values of an area that were changed by a task to the shared
+// image. Values are compared whole, so that a value is never written in part
+//-----------------------------------------------------------------------------
+void writeBackArea(void *shared, void *image, void *start, int count, int size)
+{
+    unsigned char *to = (unsigned char *)shared;
+    unsigned char *after = (unsigned char *)image;
+    unsigned char *before = (unsigned char *)start;
+
+    for (int i = 0; i < count * size; i += size)
+    {
+        if (memcmp(after + i, before + i, size) != 0) memcpy(to + i, after + i, size);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Writes the outputs and memory values changed by a task to the shared image,
+// leaving the values written by other tasks in the meantime untouched. Must
+// be called with bufferLock held
+//-----------------------------------------------------------------------------
+void writeTaskImageBack(struct task_state *state)
+{
+    struct task_image *image = state->image;
+    struct task_image *start = state->start;
+
+    writeBackArea(bool_output_image, image->bool_output, start->bool_output, used_image.bool_output * 8, sizeof(IEC_BOOL));
+    writeBackArea(byte_output_image, image->byte_output, start->byte_output, used_image.byte_output, sizeof(IEC_BYTE));
+    writeBackArea(int_output_image, image->int_output, start->int_output, used_image.int_output, sizeof(IEC_UINT));
+    writeBackArea(int_memory_image, image->int_memory, start->int_memory, used_image.int_memory, sizeof(IEC_UINT));
+    writeBackArea(dint_memory_image, image->dint_memory, start->dint_memory, used_image.dint_memory, sizeof(IEC_DINT));
+    writeBackArea(lint_memory_image, image->lint_memory, start->lint_memory, used_image.lint_memory, sizeof(IEC_LINT));
+}
+
+//-----------------------------------------------------------------------------
+// Returns the address on the shared image of a location on the image of a
+// task, or the location itself if it is not on a task image. The debugger
+// reads the located variables of task programs from the shared image, as
+// their task may be running
+//-----------------------------------------------------------------------------
+void *sharedImageLocation(void *location)
+{
+    unsigned char *address = (unsigned char *)location;
+    for (int i = 0; i < task_count; i++)
+    {
+        struct task_image *image = task_states[i].image;
+        if (address < (unsigned char *)image || address >= (unsigned char *)(image + 1)) continue;
+
+        struct
+        {
+            void *copy;
+            void *shared;
+            size_t size;
+        } areas[] = {
+            {image->bool_input, bool_input_image, sizeof(image->bool_input)},
+            {image->bool_output, bool_output_image, sizeof(image->bool_output)},
+            {image->byte_input, byte_input_image, sizeof(image->byte_input)},
+            {image->byte_output, byte_output_image, sizeof(image->byte_output)},
+            {image->int_input, int_input_image, sizeof(image->int_input)},
+            {image->int_output, int_output_image, sizeof(image->int_output)},
+            {image->int_memory, int_memory_image, sizeof(image->int_memory)},
+            {image->dint_memory, dint_memory_image, sizeof(image->dint_memory)},
+            {image->lint_memory, lint_memory_image, sizeof(image->lint_memory)},
+            {image->special_functions, special_functions_image, sizeof(image->special_functions)},
+        };
+        for (unsigned int j = 0; j < sizeof(areas) / sizeof(areas[0]); j++)
+        {
+            unsigned char *copy = (unsigned char *)areas[j].copy;
+            if (address >= copy && address < copy + areas[j].size)
+                return (unsigned char *)areas[j].shared + (address - copy);
+        }
+    }
+
+    return location;
+}
+
+//-----------------------------------------------------------------------------
+// Thread that runs a task each time the main loop releases it
+//-----------------------------------------------------------------------------
+void *taskThread(void *arg)
+{
+    struct task_state *state = (struct task_state *)arg;
+    __IEC_TASK_t *task = state->task;
+
+    struct sched_param sp;
+    if (task->trigger != NULL)
+    {
+        sp.sched_priority = EVENT_RT_PRIORITY - task->priority;
+        if (sp.sched_priority < 31) sp.sched_priority = 31; //always above the main loop
+    }
+    else
+    {
+        sp.sched_priority = TASK_RT_PRIORITY - task->priority;
+        if (sp.sched_priority < 1) sp.sched_priority = 1;
+    }
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp))
+    {
+        unsigned char log_msg[1000];
+        sprintf(log_msg, "WARNING: Failed to set task %s to real-time priority\n", task->name);
+        logMessage(LOG_WARNING, LOG_SCAN, log_msg);
+    }
+
+    struct timespec run_start, run_end;
+    while (true)
+    {
+        sem_wait(&state->release);
+        if (!__atomic_load_n(&run_tasks, __ATOMIC_RELAXED)) break;
+
+        //the programs are not executed while the watchdog fault is latched
+        if (watchdog_fault)
+        {
+            __atomic_store_n(&state->pending, false, __ATOMIC_RELEASE);
+            __atomic_store_n(&state->running, false, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &run_start);
+        pthread_mutex_lock(&bufferLock);
+        if (task->trigger != NULL)
+        {
+            //event tasks only run when their data source rose
+            __atomic_store_n(&state->pending, false, __ATOMIC_RELEASE);
+            if (!task->trigger())
+            {
+                pthread_mutex_unlock(&bufferLock);
+                continue;
+            }
+            state->release_tick = state->tick++;
+        }
+        copyTaskImageIn(state);
+        pthread_mutex_unlock(&bufferLock);
+
+        task->run(state->release_tick);
+
+        //a task that was late enough to raise the watchdog fault must not
+        //overwrite the safe outputs
+        pthread_mutex_lock(&bufferLock);
+        if (!watchdog_fault) writeTaskImageBack(state);
+        pthread_mutex_unlock(&bufferLock);
+        clock_gettime(CLOCK_MONOTONIC, &run_end);
+
+        state->last_ns = (uint32_t)timespec_diff_ns(&run_end, &run_start);
+        if (state->last_ns > state->max_ns) state->max_ns = state->last_ns;
+        state->runs++;
+        __atomic_store_n(&state->running, false, __ATOMIC_RELEASE);
+
+        //send the outputs of the task right away
+        requestScan();
+    }
+
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Initializes the programs of the periodic tasks, each one bound to the
+// image of its task. Must be called after config_init__() and glueVars(), and
+// before the persistent storage is read, so that retained values are not
+// overwritten by the initial values
+//-----------------------------------------------------------------------------
+void initializeTasks()
+{
+    if (config_tasks__ == NULL) return;
+
+    unsigned char log_msg[1000];
+    findUsedImage();
+
+    for (int i = 0; config_tasks__[i] != NULL; i++)
+    {
+        for (__IEC_TASK_t *task = config_tasks__[i]; task->name != NULL; task++)
+        {
+            if (task_count == MAX_TASKS)
+            {
+                sprintf(log_msg, "Too many periodic tasks. Task %s will not run\n", task->name);
+                logMessage(LOG_ERROR, LOG_SCAN, log_msg);
+                continue;
+            }
+
+            struct task_state *state = &task_states[task_count++];
+            state->task = task;
+            state->image = (struct task_image *)calloc(1, sizeof(struct task_image));
+            state->start = (struct task_image *)calloc(1, sizeof(struct task_image));
+
+            //located variables that have initial values are written to the
+            //task image while the programs are initialized
+            copyTaskImageIn(state);
+            bindLocatedVars(state->image);
+            task->init();
+            writeTaskImageBack(state);
+
+            if (task->trigger != NULL)
+            {
+                event_task_count++;
+                sprintf(log_msg, "Task %s runs on events with priority %d\n", task->name, task->priority);
+            }
+            else
+            {
+                sprintf(log_msg, "Task %s runs every %llu us with priority %d\n", task->name,
+                        task->interval / 1000, task->priority);
+            }
+            log(log_msg);
+        }
+    }
+
+    bindLocatedVars(NULL);
+}
+
+//-----------------------------------------------------------------------------
+// Starts a thread for each task. All periodic tasks and the programs not
+// bound to a task are due on the first scan
+//-----------------------------------------------------------------------------
+void startTasks()
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&taskEvent, &attr);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    run_tasks = true;
+    for (int i = 0; i < task_count; i++)
+    {
+        sem_init(&task_states[i].release, 0, 0);
+        if (task_states[i].task->trigger == NULL)
+        {
+            task_states[i].deadline = now;
+            pushDeadline(i);
+        }
+        pthread_create(&task_states[i].thread, NULL, taskThread, &task_states[i]);
+    }
+
+    if (task_count > 0)
+    {
+        task_states[MAIN_PROGRAMS].deadline = now;
+        pushDeadline(MAIN_PROGRAMS);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Stops the threads of the tasks
+//-----------------------------------------------------------------------------
+void stopTasks()
+{
+    __atomic_store_n(&run_tasks, false, __ATOMIC_RELAXED);
+    for (int i = 0; i < task_count; i++)
+    {
+        sem_post(&task_states[i].release);
+        pthread_join(task_states[i].thread, NULL);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Counts an activation that a task, or the unbound programs, could not run.
+// With the watchdog policy, overrun_limit of them in a row raise the fault
+//-----------------------------------------------------------------------------
+void countLateActivations(const char *name, struct task_state *state, uint64_t late)
+{
+    state->overruns += late;
+    state->late += late;
+    if (overrun_policy == OVERRUN_WATCHDOG && state->late >= overrun_limit && !watchdog_fault)
+    {
+        unsigned char log_msg[1000];
+        sprintf(log_msg, "Watchdog: %s is %u cycles late. Disabling outputs!\n", name, state->late);
+        logMessage(LOG_ERROR, LOG_SCAN, log_msg);
+        watchdog_fault = true;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Releases the tasks whose deadline has passed and schedules their next
+// activation. A task that is still running when it is due again, or whose
+// deadlines were missed by the main loop, skips those activations, and they
+// are counted as overruns. Called by the main loop after the I/O scan, while
+// it holds bufferLock. Returns true if the programs not bound to a task are
+// due, and sets dropped to the number of their cycles that were missed
+//-----------------------------------------------------------------------------
+bool releaseDueTasks(unsigned long *dropped)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    bool programs_due = false;
+    *dropped = 0;
+
+    while (deadline_heap_size > 0 && timespec_diff_ns(&now, &task_states[deadline_heap[0]].deadline) >= 0)
+    {
+        int index = popDeadline();
+        struct task_state *state = &task_states[index];
+        bool main_programs = (index == MAIN_PROGRAMS);
+        unsigned long long interval = main_programs ? common_ticktime__ : state->task->interval;
+        const char *name = main_programs ? "the main program" : state->task->name;
+
+        if (main_programs)
+        {
+            programs_due = true;
+            state->late = 0;
+        }
+        else if (__atomic_load_n(&state->running, __ATOMIC_ACQUIRE))
+        {
+            countLateActivations(name, state, 1);
+        }
+        else
+        {
+            state->late = 0;
+            state->running = true;
+            state->release_tick = state->tick;
+            sem_post(&state->release);
+        }
+
+        timespec_add_ns(&state->deadline, interval);
+        state->tick++;
+        int64_t lag = timespec_diff_ns(&now, &state->deadline);
+        if (lag >= 0)
+        {
+            uint64_t missed = lag / interval + 1;
+            timespec_add_ns(&state->deadline, missed * interval);
+            state->tick += missed;
+            countLateActivations(name, state, missed);
+            if (main_programs) *dropped = missed;
+        }
+        pushDeadline(index);
+    }
+
+    return programs_due;
+}
+
+//-----------------------------------------------------------------------------
+// Moves the deadlines that have passed to now, so that the activations that
+// were held back by the watchdog fault are not counted as late once it is
+// reset. Called by the main loop while the fault is latched
+//-----------------------------------------------------------------------------
+void holdTaskDeadlines()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    //the entries moved keep the heap order, as they were all earlier than
+    //the ones left untouched
+    for (int i = 0; i < deadline_heap_size; i++)
+    {
+        struct task_state *state = &task_states[deadline_heap[i]];
+        if (timespec_diff_ns(&now, &state->deadline) > 0) state->deadline = now;
+        state->late = 0;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Wakes up the event tasks to check if their data source rose. Called by the
+// main loop after the I/O scan
+//-----------------------------------------------------------------------------
+void notifyEventTasks()
+{
+    for (int i = 0; i < task_count; i++)
+    {
+        struct task_state *state = &task_states[i];
+        if (state->task->trigger != NULL && !__atomic_exchange_n(&state->pending, true, __ATOMIC_ACQ_REL))
+        {
+            sem_post(&state->release);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Makes the main loop scan the I/O right away instead of waiting for the
+// next task to be due. Hardware layers should call it when an input changes,
+// so that event tasks can react to it
+//-----------------------------------------------------------------------------
+void requestScan()
+{
+    //a burst of requests is served by a single scan
+    if (task_count == 0 || __atomic_load_n(&scan_requested, __ATOMIC_RELAXED)) return;
+
+    pthread_mutex_lock(&taskEventLock);
+    scan_requested = true;
+    pthread_cond_signal(&taskEvent);
+    pthread_mutex_unlock(&taskEventLock);
+}
+
+//-----------------------------------------------------------------------------
+// Sleeps until the next task is due or a scan is requested, but no longer than
+// SCAN_IDLE_PERIOD. wake is set to the time the main loop was meant to wake
+// up, so that the wake up jitter can be measured
+//-----------------------------------------------------------------------------
+void waitNextTaskEvent(struct timespec *wake)
+{
+    clock_gettime(CLOCK_MONOTONIC, wake);
+    struct timespec idle = *wake;
+    timespec_add_ns(&idle, SCAN_IDLE_PERIOD);
+    *wake = idle;
+    if (deadline_heap_size > 0 && timespec_diff_ns(&task_states[deadline_heap[0]].deadline, &idle) < 0)
+    {
+        *wake = task_states[deadline_heap[0]].deadline;
+    }
+
+    pthread_mutex_lock(&taskEventLock);
+    while (!scan_requested)
+    {
+        if (pthread_cond_timedwait(&taskEvent, &taskEventLock, wake) == ETIMEDOUT) break;
+    }
+    if (scan_requested)
+    {
+        //woken up ahead of time on purpose
+        clock_gettime(CLOCK_MONOTONIC, wake);
+        scan_requested = false;
+    }
+    pthread_mutex_unlock(&taskEventLock);
+}
+
+//-----------------------------------------------------------------------------
+// Formats the timing of each periodic task. Returns the number of characters
+// written to the buffer
+//-----------------------------------------------------------------------------
+int getTaskStats(char *buffer, int buffer_size)
+{
+    int len = snprintf(buffer, buffer_size, "tasks: %d\n", task_count);
+    for (int i = 0; i < task_count && len < buffer_size; i++)
+    {
+        struct task_state *state = &task_states[i];
+        if (state->task->trigger != NULL)
+            len += snprintf(buffer + len, buffer_size - len, "%s: event", state->task->name);
+        else
+            len += snprintf(buffer + len, buffer_size - len, "%s: interval_us=%llu", state->task->name,
+                            state->task->interval / 1000);
+        if (len >= buffer_size) break;
+        len += snprintf(buffer + len, buffer_size - len,
+                        " priority=%d runs=%llu overruns=%llu last_us=%u max_us=%u\n", state->task->priority,
+                        (unsigned long long)state->runs, (unsigned long long)state->overruns,
+                        state->last_ns / 1000, state->max_ns / 1000);
+    }
+
+    return len < buffer_size ? len : buffer_size - 1;
+}
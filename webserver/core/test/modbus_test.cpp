@@ -0,0 +1,228 @@
+// Catch2 will provide a main() function
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+// The Modbus slave is a single CPP file, so it is included directly to reach
+// its internals. It runs against the real process image (snapshots and write
+// queue). The I/O buffers normally defined by the generated glueVars.cpp and
+// the few symbols taken from the rest of the runtime are defined below.
+#include "../modbus.cpp"
+
+IEC_BOOL *bool_input[BUFFER_SIZE][8];
+IEC_BOOL *bool_output[BUFFER_SIZE][8];
+IEC_BYTE *byte_input[BUFFER_SIZE];
+IEC_BYTE *byte_output[BUFFER_SIZE];
+IEC_UINT *int_input[BUFFER_SIZE];
+IEC_UINT *int_output[BUFFER_SIZE];
+IEC_UINT *int_memory[BUFFER_SIZE];
+IEC_DINT *dint_memory[BUFFER_SIZE];
+IEC_LINT *lint_memory[BUFFER_SIZE];
+IEC_BOOL bool_input_image[BUFFER_SIZE][8];
+IEC_BOOL bool_output_image[BUFFER_SIZE][8];
+IEC_BYTE byte_input_image[BUFFER_SIZE];
+IEC_BYTE byte_output_image[BUFFER_SIZE];
+IEC_UINT int_input_image[BUFFER_SIZE];
+IEC_UINT int_output_image[BUFFER_SIZE];
+struct retain_image retain_image;
+pthread_mutex_t bufferLock = PTHREAD_MUTEX_INITIALIZER;
+int event_task_count = 0;
+
+void requestScan() {}
+void log(unsigned char *logmsg) {}
+
+static uint64_t cycle = 0;
+
+// Clears the image, maps it to the default register layout and publishes it
+static void startImage()
+{
+    static bool initialized = false;
+    if (!initialized)
+    {
+        initializeProcessImage();
+        mapUnusedIO();
+        initialized = true;
+    }
+
+    applyImageWrites(); // drop whatever a previous test left queued
+    memset(int_output_image, 0, sizeof(int_output_image));
+    memset(&retain_image, 0, sizeof(retain_image));
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    publishImageSnapshot(++cycle, now);
+}
+
+// What the main loop does between two requests: apply the queued writes at
+// the start of the cycle and publish the image at the end of it
+static void runCycle()
+{
+    pthread_mutex_lock(&bufferLock);
+    applyImageWrites();
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    publishImageSnapshot(++cycle, now);
+    pthread_mutex_unlock(&bufferLock);
+}
+
+// Builds a FC22 request for the register at address
+static int maskWriteRequest(unsigned char *buffer, int address, uint16_t and_mask, uint16_t or_mask)
+{
+    unsigned char request[] = { 0, 1, 0, 0, 0, 8, 1, MB_FC_MASK_WRITE_REGISTER,
+                                highByte(address), lowByte(address),
+                                highByte(and_mask), lowByte(and_mask), highByte(or_mask), lowByte(or_mask) };
+    memcpy(buffer, request, sizeof(request));
+    return sizeof(request);
+}
+
+// Builds a FC23 request reading read_qty registers at read_address and
+// writing write_qty registers at write_address, with byte_count as the
+// declared byte count. The values written are taken from values, if given
+static int readWriteRequest(unsigned char *buffer, int read_address, int read_qty, int write_address, int write_qty,
+                            int byte_count, const uint16_t *values = NULL)
+{
+    unsigned char header[] = { 0, 1, 0, 0, 0, 0, 1, MB_FC_READ_WRITE_MULTIPLE_REGISTERS,
+                               highByte(read_address), lowByte(read_address), highByte(read_qty), lowByte(read_qty),
+                               highByte(write_address), lowByte(write_address), highByte(write_qty), lowByte(write_qty),
+                               (unsigned char)byte_count };
+    memcpy(buffer, header, sizeof(header));
+    memset(&buffer[17], 0, byte_count);
+    for (int i = 0; values != NULL && i < write_qty; i++)
+    {
+        buffer[17 + i * 2] = highByte(values[i]);
+        buffer[18 + i * 2] = lowByte(values[i]);
+    }
+    return 17 + byte_count;
+}
+
+static uint16_t responseRegister(unsigned char *buffer, int i)
+{
+    return word(buffer[9 + i * 2], buffer[10 + i * 2]);
+}
+
+SCENARIO("Mask Write Register", "[modbus]") {
+    GIVEN("A holding register mapped to %QW5") {
+        unsigned char buffer[260]; // largest Modbus/TCP frame
+        startImage();
+        int_output_image[5] = 0x12F0;
+        runCycle();
+
+        WHEN("A mask write is applied") {
+            int size = maskWriteRequest(buffer, 5, 0xF00F, 0x0A5A);
+            REQUIRE(processModbusMessage(buffer, size) == 14);
+            REQUIRE(buffer[7] == MB_FC_MASK_WRITE_REGISTER);
+
+            // Queued until the start of the next cycle
+            REQUIRE(int_output_image[5] == 0x12F0);
+            runCycle();
+            // (current & and) | (or & ~and)
+            REQUIRE(int_output_image[5] == ((0x12F0 & 0xF00F) | (0x0A5A & ~0xF00F)));
+        }
+
+        WHEN("Two mask writes on different bits are queued on the same cycle") {
+            int size = maskWriteRequest(buffer, 5, 0xFFFE, 0x0001);
+            REQUIRE(processModbusMessage(buffer, size) == 14);
+            size = maskWriteRequest(buffer, 5, 0x7FFF, 0x0000);
+            REQUIRE(processModbusMessage(buffer, size) == 14);
+            runCycle();
+            // Neither write undoes the other
+            REQUIRE(int_output_image[5] == 0x12F1);
+        }
+
+        WHEN("The register is not mapped") {
+            int size = maskWriteRequest(buffer, MAX_64B_RANGE + 1, 0xFFFE, 0x0001);
+            processModbusMessage(buffer, size);
+            REQUIRE(buffer[7] == (0x80 | MB_FC_MASK_WRITE_REGISTER));
+            REQUIRE(buffer[8] == ERR_ILLEGAL_DATA_ADDRESS);
+        }
+    }
+}
+
+SCENARIO("Read/Write Multiple Registers", "[modbus]") {
+    GIVEN("Holding registers mapped to %QW10 to %QW14") {
+        unsigned char buffer[260]; // largest Modbus/TCP frame
+        startImage();
+        for (int i = 10; i <= 14; i++) int_output_image[i] = 100 + i;
+        runCycle();
+
+        WHEN("The written registers overlap the ones read") {
+            const uint16_t values[] = { 7, 8, 9 };
+            int size = readWriteRequest(buffer, 10, 4, 12, 3, 6, values);
+            REQUIRE(processModbusMessage(buffer, size) == 9 + 8);
+            REQUIRE(buffer[7] == MB_FC_READ_WRITE_MULTIPLE_REGISTERS);
+            REQUIRE(buffer[8] == 8);
+
+            // The registers both written and read return the written values
+            REQUIRE(responseRegister(buffer, 0) == 110);
+            REQUIRE(responseRegister(buffer, 1) == 111);
+            REQUIRE(responseRegister(buffer, 2) == 7);
+            REQUIRE(responseRegister(buffer, 3) == 8);
+
+            // All writes land on the same cycle
+            runCycle();
+            REQUIRE(int_output_image[11] == 111);
+            REQUIRE(int_output_image[12] == 7);
+            REQUIRE(int_output_image[13] == 8);
+            REQUIRE(int_output_image[14] == 9);
+        }
+
+        WHEN("The read is not mapped") {
+            int size = readWriteRequest(buffer, MAX_64B_RANGE + 1, 1, 10, 1, 2);
+            processModbusMessage(buffer, size);
+            REQUIRE(buffer[7] == (0x80 | MB_FC_READ_WRITE_MULTIPLE_REGISTERS));
+            REQUIRE(buffer[8] == ERR_ILLEGAL_DATA_ADDRESS);
+        }
+
+        WHEN("The write is not mapped") {
+            int size = readWriteRequest(buffer, 10, 1, MAX_64B_RANGE, 2, 4);
+            processModbusMessage(buffer, size);
+            REQUIRE(buffer[8] == ERR_ILLEGAL_DATA_ADDRESS);
+            // Nothing of the rejected request is written
+            runCycle();
+            REQUIRE(retain_image.lint_memory[(MAX_64B_RANGE - MIN_64B_RANGE) / 4] == 0);
+        }
+    }
+}
+
+SCENARIO("Read/Write Multiple Registers limits", "[modbus]") {
+    GIVEN("The default address map") {
+        unsigned char buffer[260]; // largest Modbus/TCP frame
+        int size;
+        startImage();
+
+        WHEN("Quantities are at the limits") {
+            size = readWriteRequest(buffer, 0, 125, 200, 121, 242);
+            REQUIRE(processModbusMessage(buffer, size) == 9 + 250);
+            REQUIRE(buffer[7] == MB_FC_READ_WRITE_MULTIPLE_REGISTERS);
+            REQUIRE(buffer[8] == 250);
+        }
+
+        WHEN("Read quantity is 0") {
+            size = readWriteRequest(buffer, 0, 0, 0, 1, 2);
+            processModbusMessage(buffer, size);
+            REQUIRE(buffer[8] == ERR_ILLEGAL_DATA_VALUE);
+        }
+
+        WHEN("Read quantity is 126") {
+            size = readWriteRequest(buffer, 0, 126, 0, 1, 2);
+            processModbusMessage(buffer, size);
+            REQUIRE(buffer[8] == ERR_ILLEGAL_DATA_VALUE);
+        }
+
+        WHEN("Write quantity is 0") {
+            size = readWriteRequest(buffer, 0, 1, 0, 0, 0);
+            processModbusMessage(buffer, size);
+            REQUIRE(buffer[8] == ERR_ILLEGAL_DATA_VALUE);
+        }
+
+        WHEN("Write quantity is 122") {
+            size = readWriteRequest(buffer, 0, 1, 0, 122, 244);
+            processModbusMessage(buffer, size);
+            REQUIRE(buffer[8] == ERR_ILLEGAL_DATA_VALUE);
+        }
+
+        WHEN("Byte count doesn't match the write quantity") {
+            size = readWriteRequest(buffer, 0, 1, 0, 2, 2);
+            processModbusMessage(buffer, size);
+            REQUIRE(buffer[8] == ERR_ILLEGAL_DATA_VALUE);
+        }
+    }
+}
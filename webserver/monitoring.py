@@ -1,8 +1,7 @@
-# import time
+import time
+import socket
 import threading
-from struct import pack, unpack
-#from pymodbus.client.asynchronous import ModbusTcpClient
-from pymodbus.client.sync import ModbusTcpClient
+from struct import unpack, error as struct_error
 
 
 class debug_var():
@@ -14,8 +13,10 @@ class debug_var():
 
 
 debug_vars = []
+# Variables accepted by the runtime's monitor, in the order of its replies
+monitored_vars = []
 monitor_active = False
-mb_client = None
+monitor_thread = None
 
 
 def parse_st(st_file):
@@ -53,111 +54,171 @@ def cleanup():
     del debug_vars[:]
 
 
-def modbus_monitor():
-    global mb_client
+def monitor_connect():
+    # The runtime keeps a monitor list per connection, so the variables are
+    # registered and read on the same connection
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.settimeout(5)
+    try:
+        s.connect(('localhost', 43628))
+    except socket.error:
+        s.close()
+        raise
+    return s
+
+
+def runtime_command(s, command):
+    s.send(command.encode() + b'\n')
+    reply = b''
+    while not reply.endswith(b'\n'):
+        chunk = s.recv(1000)
+        if not chunk:
+            raise IOError('Connection closed by the runtime')
+        reply += chunk
+    return reply
+
+
+def location_size(location):
+    if location.find('X') == 2 or location.find('B') == 2:
+        return 1
+    if location.find('W') == 2:
+        return 2
+    if location.find('D') == 2:
+        return 4
+    return 8
+
+
+def add_monitor_points(s, batch):
+    # The runtime adds either all locations of a batch or none of them. A
+    # rejected batch is retried one location at a time, so that a single
+    # bad location doesn't hide the others
+    result = runtime_command(s, 'monitor_add(' + ','.join(d.location for d in batch) + ')')
+    if not result.startswith(b'Error'):
+        monitored_vars.extend(batch)
+    elif len(batch) > 1:
+        for debug_data in batch:
+            add_monitor_points(s, [debug_data])
+    else:
+        print('Monitor rejected location: ' + batch[0].location)
+
+
+def register_monitor_points(s):
+    # The runtime reads commands of up to 1024 bytes, so the locations are
+    # sent in batches
+    del monitored_vars[:]
+    runtime_command(s, 'monitor_clear()')
+    batch = []
     for debug_data in debug_vars:
-        if (debug_data.location.find('IX')) > 0:
-            # Reading Input Status
-            mb_address = debug_data.location.split('%IX')[1].split('.')
-            result = mb_client.read_discrete_inputs(
-                int(mb_address[0])*8 + int(mb_address[1]), 1)
-            debug_data.value = result.bits[0]
-
-        elif (debug_data.location.find('QX')) > 0:
-            # Reading Coils
-            mb_address = debug_data.location.split('%QX')[1].split('.')
-            if len(mb_address) < 2:
-                result = mb_client.read_coils(int(mb_address[0])*8, 1)
-            else:
-                result = mb_client.read_coils(
-                    int(mb_address[0])*8 + int(mb_address[1]), 1)
-            debug_data.value = result.bits[0]
-
-        elif (debug_data.location.find('IW')) > 0:
-            # Reading Input Registers
-            mb_address = debug_data.location.split('%IW')[1]
-            result = mb_client.read_input_registers(int(mb_address), 1)
-            debug_data.value = result.registers[0]
-
-        elif (debug_data.location.find('QW')) > 0:
-            # Reading Holding Registers
-            mb_address = debug_data.location.split('%QW')[1]
-            result = mb_client.read_holding_registers(int(mb_address), 1)
-            debug_data.value = result.registers[0]
-
-        elif (debug_data.location.find('MW')) > 0:
-            # Reading Word Memory
-            mb_address = debug_data.location.split('%MW')[1]
-            result = mb_client.read_holding_registers(
-                int(mb_address) + 1024, 1)
-            debug_data.value = result.registers[0]
-
-        elif (debug_data.location.find('MD')) > 0:
-            # Reading Double Memory
-            mb_address = debug_data.location.split('%MD')[1]
-            result = mb_client.read_holding_registers(
-                (int(mb_address)*2) + 2048, 2)
-            if debug_data.type in ["SINT", "INT", "DINT"]:
-                # signed integer
-                float_pack = pack(
-                    '>HH', result.registers[0], result.registers[1])
-                debug_data.value = unpack('>i', float_pack)[0]
-
-            if debug_data.type in ["USINT", "UINT", "UDINT"]:
-                # unsigned integer
-                float_pack = pack(
-                    '>HH', result.registers[0], result.registers[1])
-                debug_data.value = unpack('>I', float_pack)[0]
-
-            if debug_data.type == 'REAL':
-                # 32-bit float
-                float_pack = pack(
-                    '>HH', result.registers[0], result.registers[1])
-                debug_data.value = unpack('>f', float_pack)[0]
-
-        elif (debug_data.location.find('ML')) > 0:
-            # Reading Long Memory
-            mb_address = debug_data.location.split('%ML')[1]
-            result = mb_client.read_holding_registers(
-                (int(mb_address)*4) + 4096, 4)
-
-            if debug_data.type in ["SINT", "INT", "DINT", "LINT"]:
-                # signed integer
-                float_pack = pack(
-                    '>HHHH', result.registers[0], result.registers[1], result.registers[2], result.registers[3])
-                debug_data.value = unpack('>q', float_pack)[0]
-
-            if debug_data.type in ["USINT", "UINT", "UDINT", "ULINT"]:
-                # unsigned integer
-                float_pack = pack(
-                    '>HHHH', result.registers[0], result.registers[1], result.registers[2], result.registers[3])
-                debug_data.value = unpack('>Q', float_pack)[0]
-
-            if (debug_data.type == 'REAL') or (debug_data.type == 'LREAL'):
-                # 64-bit float
-                float_pack = pack(
-                    '>HHHH', result.registers[0], result.registers[1], result.registers[2], result.registers[3])
-                debug_data.value = unpack('>d', float_pack)[0]
-
-    if monitor_active:
-        threading.Timer(0.5, modbus_monitor).start()
+        batch.append(debug_data)
+        if len(batch) == 50:
+            add_monitor_points(s, batch)
+            batch = []
+    if batch:
+        add_monitor_points(s, batch)
+
+
+def read_monitor_points(s, last_cycle):
+    # Returns as soon as any value changes since last_cycle, or after 1s
+    s.send(('monitor_read(' + str(last_cycle) + ')\n').encode())
+    data = b''
+    while len(data) < 4 or len(data) < 4 + unpack('=I', data[:4])[0]:
+        chunk = s.recv(16384)
+        if not chunk:
+            raise IOError('Monitor response truncated')
+        data += chunk
+
+    try:
+        cycle = unpack('=Q', data[4:12])[0]
+        offset = 12
+        for debug_data in monitored_vars:
+            size = location_size(debug_data.location)
+            raw = data[offset:offset + size]
+            offset += size
+            decode_monitor_value(debug_data, size, raw)
+    except struct_error:
+        # the reply doesn't match the monitored variables, e.g. the runtime
+        # was restarted. The caller registers them again
+        raise IOError('Monitor response does not match the monitored variables')
+
+    return cycle
+
+
+def decode_monitor_value(debug_data, size, raw):
+    if size == 1:
+        debug_data.value = unpack('=B', raw)[0]
+    elif size == 2:
+        debug_data.value = unpack('=H', raw)[0]
+    elif size == 4:
+        if debug_data.type == 'REAL':
+            debug_data.value = unpack('=f', raw)[0]
+        elif debug_data.type in ["USINT", "UINT", "UDINT"]:
+            debug_data.value = unpack('=I', raw)[0]
+        else:
+            debug_data.value = unpack('=i', raw)[0]
+    else:
+        if (debug_data.type == 'REAL') or (debug_data.type == 'LREAL'):
+            debug_data.value = unpack('=d', raw)[0]
+        elif debug_data.type in ["USINT", "UINT", "UDINT", "ULINT"]:
+            debug_data.value = unpack('=Q', raw)[0]
+        else:
+            debug_data.value = unpack('=q', raw)[0]
+
+
+def runtime_monitor(s, last_cycle):
+    # Subscribes to changes on the monitored variables. Each read blocks on
+    # the runtime until a value changes, so there is no polling interval.
+    # The thread ends once the monitor is stopped or replaced by a new one.
+    # After an error the connection is opened again, which starts a new
+    # list on the runtime
+    while monitor_active and monitor_thread is threading.current_thread():
+        try:
+            if s is None:
+                s = monitor_connect()
+                last_cycle = 0
+            if last_cycle == 0:
+                register_monitor_points(s)
+            last_cycle = read_monitor_points(s, last_cycle)
+        except (socket.error, IOError):
+            print("Error connecting to OpenPLC runtime")
+            if s is not None:
+                s.close()
+                s = None
+            last_cycle = 0
+            time.sleep(1)
+
+    if s is not None:
+        s.close()
 
 
 def start_monitor(modbus_port_cfg):
+    # modbus_port_cfg is kept for compatibility. The values are read from
+    # the runtime's interactive server, not from the Modbus slave
     global monitor_active
-    global mb_client
+    global monitor_thread
 
     if not monitor_active:
         monitor_active = True
-        mb_client = ModbusTcpClient('127.0.0.1', port=modbus_port_cfg)
 
-        modbus_monitor()
+        # First read is done right away, so that the page has values to show
+        last_cycle = 0
+        s = None
+        try:
+            s = monitor_connect()
+            register_monitor_points(s)
+            last_cycle = read_monitor_points(s, 0)
+        except (socket.error, IOError):
+            print("Error connecting to OpenPLC runtime")
+            if s is not None:
+                s.close()
+                s = None
+
+        monitor_thread = threading.Thread(target=runtime_monitor, args=(s, last_cycle))
+        monitor_thread.daemon = True
+        monitor_thread.start()
 
 
 def stop_monitor():
     global monitor_active
-    global mb_client
 
     if monitor_active:
         monitor_active = False
-        mb_client.close()
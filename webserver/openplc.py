@@ -103,7 +103,7 @@ class runtime:
             except socket.error as serr:
                 print(("Failed to stop the runtime. Error: " + str(serr)))
 
-    def compile_program(self, st_file):
+    def compile_program(self, st_file, compiler_options=''):
         if self.status() == "Running":
             self.stop_runtime()
 
@@ -111,7 +111,7 @@ class runtime:
         global compilation_status_str
         global compilation_object
         compilation_status_str = ""
-        a = subprocess.Popen(['./scripts/compile_program.sh', str(st_file)],
+        a = subprocess.Popen(['./scripts/compile_program.sh', str(st_file), str(compiler_options)],
                              stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
         compilation_object = NonBlockingStreamReader(a.stdout)
 
@@ -223,6 +223,17 @@ class runtime:
             except:
                 print("Error connecting to OpenPLC runtime")
 
+    def start_pstorage_mapped(self, poll_rate):
+        if (self.status() == "Running"):
+            try:
+                s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+                s.connect(('localhost', 43628))
+                s.send(b'start_pstorage_mapped(' + str(poll_rate).encode('utf-8') + b')\n')
+                data = s.recv(1000)
+                s.close()
+            except:
+                print("Error connecting to OpenPLC runtime")
+
     def stop_pstorage(self):
         if (self.status() == "Running"):
             try:
@@ -240,7 +251,14 @@ class runtime:
                 s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
                 s.connect(('localhost', 43628))
                 s.send(b'runtime_logs()\n')
-                data = s.recv(1000000)
+                # the logs are sent in chunks, and the runtime closes its side
+                # of the connection after the last one
+                data = b''
+                while True:
+                    chunk = s.recv(16384)
+                    if not chunk:
+                        break
+                    data += chunk
                 s.close()
                 return data
             except:
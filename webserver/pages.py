@@ -1177,8 +1177,16 @@ settings_tail = """
             var enip_text = document.getElementById('enip_server_port');
             var pstorage_checkbox = document.getElementById('pstorage_thread');
             var pstorage_text = document.getElementById('pstorage_thread_poll');
+            var pstorage_mapped_checkbox = document.getElementById('pstorage_mapped');
+            var pstorage_mapped_text = document.getElementById('pstorage_mapped_text');
             var auto_run_checkbox = document.getElementById('auto_run');
             var auto_run_text = document.getElementById('auto_run_text');
+            var compile_tasks_checkbox = document.getElementById('compile_tasks');
+            var compile_tasks_text = document.getElementById('compile_tasks_text');
+            var compile_groups_checkbox = document.getElementById('compile_groups');
+            var compile_groups_text = document.getElementById('compile_groups_text');
+            var compile_direct_checkbox = document.getElementById('compile_direct');
+            var compile_direct_text = document.getElementById('compile_direct_text');
             
             if (modbus_checkbox.checked == true)
             {
@@ -1210,10 +1218,21 @@ settings_tail = """
             if (pstorage_checkbox.checked == true)
             {
                 pstorage_text.disabled = false;
+                pstorage_mapped_checkbox.disabled = false;
             }
             else
             {
                 pstorage_text.disabled = true;
+                pstorage_mapped_checkbox.disabled = true;
+            }
+            
+            if (pstorage_mapped_checkbox.checked == true)
+            {
+                pstorage_mapped_text.value = 'true';
+            }
+            else
+            {
+                pstorage_mapped_text.value = 'false';
             }
             
             if (auto_run_checkbox.checked == true)
@@ -1224,6 +1243,10 @@ settings_tail = """
             {
                 auto_run_text.value = 'false';
             }
+            
+            compile_tasks_text.value = compile_tasks_checkbox.checked ? 'true' : 'false';
+            compile_groups_text.value = compile_groups_checkbox.checked ? 'true' : 'false';
+            compile_direct_text.value = compile_direct_checkbox.checked ? 'true' : 'false';
         }
 
         document.getElementById('modbus_server').onchange = function()
@@ -1246,11 +1269,31 @@ settings_tail = """
             setupCheckboxes();
         }
         
+        document.getElementById('pstorage_mapped').onchange = function()
+        {
+            setupCheckboxes();
+        }
+        
         document.getElementById('auto_run').onchange = function()
         {
             setupCheckboxes();
         }
         
+        document.getElementById('compile_tasks').onchange = function()
+        {
+            setupCheckboxes();
+        }
+        
+        document.getElementById('compile_groups').onchange = function()
+        {
+            setupCheckboxes();
+        }
+        
+        document.getElementById('compile_direct').onchange = function()
+        {
+            setupCheckboxes();
+        }
+        
         function validateForm()
         {
             var modbus_checkbox = document.forms["uploadForm"]["modbus_server"].checked;
@@ -4,6 +4,12 @@ if [ $# -eq 0 ]; then
     exit 1
 fi
 
+#optional iec2c output options, separated by commas (e.g. t,g)
+IEC2C_OPTIONS=""
+if [ -n "$2" ]; then
+    IEC2C_OPTIONS="-O $2"
+fi
+
 #move into the scripts folder if you're not there already
 cd scripts &>/dev/null
 
@@ -17,7 +23,7 @@ cd ..
 echo "Optimizing ST program..."
 ./st_optimizer ./st_files/"$1" ./st_files/"$1"
 echo "Generating C files..."
-./iec2c -f -l -p -r -R -a ./st_files/"$1"
+./iec2c -f -l -p -r -R -a $IEC2C_OPTIONS ./st_files/"$1"
 if [ $? -ne 0 ]; then
     echo "Error generating C files"
     echo "Compilation finished with errors!"
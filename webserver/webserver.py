@@ -219,6 +219,11 @@ def configure_runtime():
             #cur.close()
             #conn.close()
 
+            pstorage_mapped = False
+            for row in rows:
+                if row[0] == "Pstorage_mapped" and row[1] == "true":
+                    pstorage_mapped = True
+
             for row in rows:
                 if row[0] == "Modbus_port":
                     if row[1] != "disabled":
@@ -242,7 +247,10 @@ def configure_runtime():
                         print("Disabling EtherNet/IP")
                         openplc_runtime.stop_enip()
                 elif row[0] == "Pstorage_polling":
-                    if row[1] != "disabled":
+                    if row[1] != "disabled" and pstorage_mapped:
+                        print("Enabling mapped Persistent Storage with checkpoints every " + str(int(row[1])) + " seconds")
+                        openplc_runtime.start_pstorage_mapped(int(row[1]))
+                    elif row[1] != "disabled":
                         print("Enabling Persistent Storage with polling rate of " + str(int(row[1])) + " seconds")
                         openplc_runtime.start_pstorage(int(row[1]))
                     else:
@@ -258,6 +266,8 @@ def configure_runtime():
 def delete_persistent_file():
     if os.path.isfile("persistent.file"):
         os.remove("persistent.file")
+    if os.path.isfile("persistent.mmap"):
+        os.remove("persistent.mmap")
     print("persistent.file removed!")
 
 
@@ -1084,6 +1094,7 @@ def compile_program():
         st_file = flask.request.args.get('file')
 
         #load information about the program being compiled into the openplc_runtime object
+        compiler_options = []
         database = "openplc.db"
         conn = create_connection(database)
         if not conn is None:
@@ -1094,6 +1105,17 @@ def compile_program():
                 openplc_runtime.project_name = str(row[1])
                 openplc_runtime.project_description = str(row[2])
                 openplc_runtime.project_file = str(row[3])
+
+                #iec2c output options selected on the settings page
+                cur.execute("SELECT * FROM Settings")
+                rows = cur.fetchall()
+                for row in rows:
+                    if row[0] == "Compile_tasks" and row[1] == "true":
+                        compiler_options.append('t')
+                    elif row[0] == "Compile_groups" and row[1] == "true":
+                        compiler_options.append('g')
+                    elif row[0] == "Compile_direct" and row[1] == "true":
+                        compiler_options.append('d')
                 cur.close()
                 conn.close()
             except Error as e:
@@ -1102,7 +1124,7 @@ def compile_program():
             print("error connecting to the database")
 
         delete_persistent_file()
-        openplc_runtime.compile_program(st_file)
+        openplc_runtime.compile_program(st_file, ','.join(compiler_options))
 
         return draw_compiling_page()
 
@@ -2285,6 +2307,10 @@ def settings():
                         <label class="container">
                             <b>Enable Modbus Server</b>"""
 
+            pstorage_mapped = 'false'
+            compile_tasks = 'false'
+            compile_groups = 'false'
+            compile_direct = 'false'
             database = "openplc.db"
             conn = create_connection(database)
             if not conn is None:
@@ -2304,12 +2330,20 @@ def settings():
                             enip_port = str(row[1])
                         elif row[0] == "Pstorage_polling":
                             pstorage_poll = str(row[1])
+                        elif row[0] == "Pstorage_mapped":
+                            pstorage_mapped = str(row[1])
                         elif row[0] == "Start_run_mode":
                             start_run = str(row[1])
                         elif row[0] == "Slave_polling":
                             slave_polling = str(row[1])
                         elif row[0] == "Slave_timeout":
                             slave_timeout = str(row[1])
+                        elif row[0] == "Compile_tasks":
+                            compile_tasks = str(row[1])
+                        elif row[0] == "Compile_groups":
+                            compile_groups = str(row[1])
+                        elif row[0] == "Compile_direct":
+                            compile_direct = str(row[1])
 
                     if modbus_port == 'disabled':
                         return_str += """
@@ -2392,6 +2426,25 @@ def settings():
                         <label for='pstorage_thread_poll'><b>Persistent Storage polling rate</b></label>
                         <input type='text' id='pstorage_thread_poll' name='pstorage_thread_poll' value='""" + pstorage_poll + "'>"
 
+                    return_str += """
+                        <br>
+                        <br>
+                        <label class="container">
+                            <b>Map retentive memory to disk (persistent.mmap)</b>"""
+
+                    if pstorage_mapped == 'true':
+                        return_str += """
+                            <input id="pstorage_mapped" type="checkbox" checked>
+                            <span class="checkmark"></span>
+                        </label>
+                        <input type='hidden' value='true' id='pstorage_mapped_text' name='pstorage_mapped_text'/>"""
+                    else:
+                        return_str += """
+                            <input id="pstorage_mapped" type="checkbox">
+                            <span class="checkmark"></span>
+                        </label>
+                        <input type='hidden' value='false' id='pstorage_mapped_text' name='pstorage_mapped_text'/>"""
+
                     return_str += """
                         <br>
                         <br>
@@ -2412,6 +2465,63 @@ def settings():
                         </label>
                         <input type='hidden' value='true' id='auto_run_text' name='auto_run_text'/>"""
 
+                    return_str += """
+                        <br>
+                        <h2>Compiler</h2>
+                        <label class="container">
+                            <b>Run each task at its own rate and priority</b>"""
+
+                    if compile_tasks == 'true':
+                        return_str += """
+                            <input id="compile_tasks" type="checkbox" checked>
+                            <span class="checkmark"></span>
+                        </label>
+                        <input type='hidden' value='true' id='compile_tasks_text' name='compile_tasks_text'/>"""
+                    else:
+                        return_str += """
+                            <input id="compile_tasks" type="checkbox">
+                            <span class="checkmark"></span>
+                        </label>
+                        <input type='hidden' value='false' id='compile_tasks_text' name='compile_tasks_text'/>"""
+
+                    return_str += """
+                        <p style='font-size:14px; color:#555; margin:0px 0px 0px 35px'>Tasks run on threads of their own. Globals and function block instances used by programs of different tasks are not protected against concurrent access.</p>
+                        <br>
+                        <label class="container">
+                            <b>Run independent programs in parallel</b>"""
+
+                    if compile_groups == 'true':
+                        return_str += """
+                            <input id="compile_groups" type="checkbox" checked>
+                            <span class="checkmark"></span>
+                        </label>
+                        <input type='hidden' value='true' id='compile_groups_text' name='compile_groups_text'/>"""
+                    else:
+                        return_str += """
+                            <input id="compile_groups" type="checkbox">
+                            <span class="checkmark"></span>
+                        </label>
+                        <input type='hidden' value='false' id='compile_groups_text' name='compile_groups_text'/>"""
+
+                    return_str += """
+                        <br>
+                        <br>
+                        <label class="container">
+                            <b>Access variables directly (disables forcing)</b>"""
+
+                    if compile_direct == 'true':
+                        return_str += """
+                            <input id="compile_direct" type="checkbox" checked>
+                            <span class="checkmark"></span>
+                        </label>
+                        <input type='hidden' value='true' id='compile_direct_text' name='compile_direct_text'/>"""
+                    else:
+                        return_str += """
+                            <input id="compile_direct" type="checkbox">
+                            <span class="checkmark"></span>
+                        </label>
+                        <input type='hidden' value='false' id='compile_direct_text' name='compile_direct_text'/>"""
+
                     return_str += """
                         <br>
                         <h2>Slave Devices</h2>
@@ -2439,9 +2549,13 @@ def settings():
             dnp3_port = flask.request.form.get('dnp3_server_port')
             enip_port = flask.request.form.get('enip_server_port')
             pstorage_poll = flask.request.form.get('pstorage_thread_poll')
+            pstorage_mapped = flask.request.form.get('pstorage_mapped_text')
             start_run = flask.request.form.get('auto_run_text')
             slave_polling = flask.request.form.get('slave_polling_period')
             slave_timeout = flask.request.form.get('slave_timeout')
+            compile_tasks = flask.request.form.get('compile_tasks_text')
+            compile_groups = flask.request.form.get('compile_groups_text')
+            compile_direct = flask.request.form.get('compile_direct_text')
 
             (modbus_port, dnp3_port, enip_port, pstorage_poll, start_run, slave_polling, slave_timeout) = sanitize_input(modbus_port, dnp3_port, enip_port, pstorage_poll, start_run, slave_polling, slave_timeout)
 
@@ -2478,6 +2592,13 @@ def settings():
                         cur.execute("UPDATE Settings SET Value = ? WHERE Key = 'Pstorage_polling'", (str(pstorage_poll),))
                         conn.commit()
 
+                    if pstorage_mapped == 'true':
+                        cur.execute("INSERT OR REPLACE INTO Settings (Key, Value) VALUES ('Pstorage_mapped', 'true')")
+                        conn.commit()
+                    else:
+                        cur.execute("INSERT OR REPLACE INTO Settings (Key, Value) VALUES ('Pstorage_mapped', 'false')")
+                        conn.commit()
+
                     if start_run:
                         cur.execute("UPDATE Settings SET Value = 'true' WHERE Key = 'Start_run_mode'")
                         conn.commit()
@@ -2491,6 +2612,12 @@ def settings():
                     cur.execute("UPDATE Settings SET Value = ? WHERE Key = 'Slave_timeout'", (str(slave_timeout),))
                     conn.commit()
 
+                    #compiler options take effect the next time a program is compiled
+                    cur.execute("INSERT OR REPLACE INTO Settings (Key, Value) VALUES ('Compile_tasks', ?)", ('true' if compile_tasks == 'true' else 'false',))
+                    cur.execute("INSERT OR REPLACE INTO Settings (Key, Value) VALUES ('Compile_groups', ?)", ('true' if compile_groups == 'true' else 'false',))
+                    cur.execute("INSERT OR REPLACE INTO Settings (Key, Value) VALUES ('Compile_direct', ?)", ('true' if compile_direct == 'true' else 'false',))
+                    conn.commit()
+
                     cur.close()
                     conn.close()
                     configure_runtime()